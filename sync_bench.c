@@ -0,0 +1,1204 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// End-to-end benchmark: runs syncserver and K syncclients on loopback against
+// generated trees and reports how fast changes reach every mirror.
+//
+// Each scenario starts fresh processes in its own directory, so peak RSS is
+// per scenario. Arrival times are taken with inotify on the clients' trees:
+// a file has arrived when its temp file is renamed into place, a directory
+// when it is created. Trees and contents come from a seeded generator, so a
+// run with the same options does the same work on every commit.
+
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_PORT 17600
+#define DEFAULT_TIMEOUT 120             // seconds per scenario
+#define MAX_CLIENTS 64
+#define SMALL_FILES 2000
+#define SMALL_DIRS 20
+#define SMALL_MAX_SIZE 8192
+#define HUGE_FILES 3
+#define HUGE_SIZE (32L * 1024 * 1024)
+#define DEEP_CHAINS 4
+#define DEEP_DEPTH 32
+#define DEEP_FILES_PER_DIR 4
+#define CHURN_FILES 500
+#define CHURN_DIRS 10
+#define CHURN_OPS 5000
+#define WRITE_CHUNK (1024 * 1024)
+#define STARTUP_TIMEOUT 10              // seconds for processes to come up
+
+const char *server_bin = "./syncserver";
+const char *client_bin = "./syncclient";
+int port = DEFAULT_PORT;
+int client_count = DEFAULT_CLIENTS;
+int timeout_s = DEFAULT_TIMEOUT;
+double scale = 1.0;
+uint64_t seed = 1;
+const char *label = "";
+char work_root[PATH_MAX];
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static uint64_t rng_below(uint64_t n) {
+    return n ? rng_next() % n : 0;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static long scaled(long n) {
+    long v = (long)(n * scale);
+    return v < 1 ? 1 : v;
+}
+
+// Write size bytes of seeded data to path, through a temp file outside the
+// tree when staged so the server sees it appear whole
+static int write_file(const char *path, uint64_t size, const char *stage) {
+    static char chunk[WRITE_CHUNK];
+    const char *target = stage ? stage : path;
+    int fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open failed");
+        return -1;
+    }
+    uint64_t left = size;
+    while (left > 0) {
+        size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+        for (size_t i = 0; i + 8 <= n; i += 8) {
+            uint64_t r = rng_next();
+            memcpy(chunk + i, &r, 8);
+        }
+        if (write(fd, chunk, n) != (ssize_t)n) {
+            perror("write failed");
+            close(fd);
+            return -1;
+        }
+        left -= n;
+    }
+    close(fd);
+    if (stage && rename(stage, path) < 0) {
+        perror("rename failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Something the scenario created on the server, and when each client got it
+typedef struct {
+    char *path;                 // relative
+    uint64_t size;
+    bool is_dir;
+    double written;             // complete on the server's side
+} Item;
+
+// A directory of a client's tree being watched, indexed by wd
+typedef struct {
+    int client;
+    char *path;                 // relative, "" for the root
+} WatchedDir;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t arrived_cond;
+    Item *items;
+    size_t count;
+    size_t capacity;
+    size_t *slots;              // open addressing by path, index + 1
+    size_t slot_capacity;
+    double *arrived;            // count x client_count, 0 until seen
+    size_t pending;             // arrivals still expected
+    int inotify_fd;
+    WatchedDir *dirs;           // only touched by the watcher thread once it runs
+    size_t dir_capacity;
+    char client_roots[MAX_CLIENTS][PATH_MAX + 48];
+    bool overflowed;            // inotify dropped events: some arrivals came from a rescan
+    volatile bool stop;
+    pthread_t thread;
+} Tracker;
+
+Tracker tracker;
+
+static uint64_t hash_path(const char *path) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Called with tracker.lock held
+static size_t *item_slot(const char *path) {
+    size_t mask = tracker.slot_capacity - 1;
+    size_t i = hash_path(path) & mask;
+    while (tracker.slots[i] && strcmp(tracker.items[tracker.slots[i] - 1].path, path) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &tracker.slots[i];
+}
+
+// Expect path to show up in every client. Returns its index.
+static size_t track(const char *path, uint64_t size, bool is_dir) {
+    pthread_mutex_lock(&tracker.lock);
+    if (tracker.count == tracker.capacity) {
+        size_t capacity = tracker.capacity ? tracker.capacity * 2 : 1024;
+        Item *items = realloc(tracker.items, capacity * sizeof(Item));
+        double *arrived = realloc(tracker.arrived, capacity * client_count * sizeof(double));
+        if (!items || !arrived) {
+            perror("realloc failed");
+            exit(1);
+        }
+        tracker.items = items;
+        tracker.arrived = arrived;
+        tracker.capacity = capacity;
+    }
+    if ((tracker.count + 1) * 2 > tracker.slot_capacity) {
+        free(tracker.slots);
+        tracker.slot_capacity = tracker.slot_capacity ? tracker.slot_capacity * 2 : 2048;
+        tracker.slots = calloc(tracker.slot_capacity, sizeof(size_t));
+        if (!tracker.slots) {
+            perror("calloc failed");
+            exit(1);
+        }
+        for (size_t i = 0; i < tracker.count; i++) {
+            *item_slot(tracker.items[i].path) = i + 1;
+        }
+    }
+    size_t id = tracker.count++;
+    Item *item = &tracker.items[id];
+    item->path = strdup(path);
+    item->size = size;
+    item->is_dir = is_dir;
+    item->written = 0;
+    memset(&tracker.arrived[id * client_count], 0, client_count * sizeof(double));
+    *item_slot(path) = id + 1;
+    tracker.pending += client_count;
+    pthread_mutex_unlock(&tracker.lock);
+    return id;
+}
+
+static void mark_written(size_t id) {
+    pthread_mutex_lock(&tracker.lock);
+    tracker.items[id].written = now_s();
+    pthread_mutex_unlock(&tracker.lock);
+}
+
+static void note_arrival(int client, const char *path) {
+    double t = now_s();
+    pthread_mutex_lock(&tracker.lock);
+    if (tracker.slot_capacity) {
+        size_t slot = *item_slot(path);
+        if (slot && tracker.arrived[(slot - 1) * client_count + client] == 0) {
+            tracker.arrived[(slot - 1) * client_count + client] = t;
+            if (--tracker.pending == 0) {
+                pthread_cond_broadcast(&tracker.arrived_cond);
+            }
+        }
+    }
+    pthread_mutex_unlock(&tracker.lock);
+}
+
+// Wait until everything tracked so far is in every client
+static bool wait_arrivals(double deadline) {
+    bool done;
+    pthread_mutex_lock(&tracker.lock);
+    while (tracker.pending > 0 && now_s() < deadline) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&tracker.arrived_cond, &tracker.lock, &ts);
+    }
+    done = tracker.pending == 0;
+    pthread_mutex_unlock(&tracker.lock);
+    return done;
+}
+
+// Watch a directory of a client's tree and count what is already in it: the
+// client may have filled it before the watch was in place
+static void watch_client_dir(int client, const char *rel) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s%s", tracker.client_roots[client], *rel ? "/" : "", rel);
+    int wd = inotify_add_watch(tracker.inotify_fd, full, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        return;
+    }
+    if ((size_t)wd >= tracker.dir_capacity) {
+        size_t capacity = tracker.dir_capacity ? tracker.dir_capacity : 256;
+        while (capacity <= (size_t)wd) {
+            capacity *= 2;
+        }
+        WatchedDir *dirs = realloc(tracker.dirs, capacity * sizeof(WatchedDir));
+        if (!dirs) {
+            perror("realloc failed");
+            exit(1);
+        }
+        memset(dirs + tracker.dir_capacity, 0, (capacity - tracker.dir_capacity) * sizeof(WatchedDir));
+        tracker.dirs = dirs;
+        tracker.dir_capacity = capacity;
+    }
+    free(tracker.dirs[wd].path);
+    tracker.dirs[wd].client = client;
+    tracker.dirs[wd].path = strdup(rel);
+    if (*rel) {
+        note_arrival(client, rel);
+    }
+
+    DIR *dir = opendir(full);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            watch_client_dir(client, child);
+        } else {
+            note_arrival(client, child);
+        }
+    }
+    closedir(dir);
+}
+
+static void *watcher_main(void *arg) {
+    (void)arg;
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { tracker.inotify_fd, POLLIN, 0 };
+    while (!tracker.stop) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        ssize_t length = read(tracker.inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+        for (ssize_t i = 0; i < length;) {
+            struct inotify_event *event = (struct inotify_event *)&buffer[i];
+            i += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Rescan everything; arrivals found this way are late
+                tracker.overflowed = true;
+                for (int c = 0; c < client_count; c++) {
+                    watch_client_dir(c, "");
+                }
+                continue;
+            }
+            if (!event->len || event->wd < 0 || (size_t)event->wd >= tracker.dir_capacity ||
+                !tracker.dirs[event->wd].path) {
+                continue;
+            }
+            WatchedDir *dir = &tracker.dirs[event->wd];
+            char rel[PATH_MAX];
+            snprintf(rel, sizeof(rel), "%s%s%s", dir->path, *dir->path ? "/" : "", event->name);
+            if (event->mask & IN_ISDIR) {
+                watch_client_dir(dir->client, rel);
+            } else if (event->mask & IN_MOVED_TO) {
+                note_arrival(dir->client, rel);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void tracker_start(void) {
+    memset(&tracker, 0, sizeof(tracker));
+    pthread_mutex_init(&tracker.lock, NULL);
+    pthread_cond_init(&tracker.arrived_cond, NULL);
+    tracker.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (tracker.inotify_fd < 0) {
+        perror("inotify_init failed");
+        exit(1);
+    }
+}
+
+static void tracker_watch(void) {
+    for (int c = 0; c < client_count; c++) {
+        watch_client_dir(c, "");
+    }
+    if (pthread_create(&tracker.thread, NULL, watcher_main, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
+}
+
+static void tracker_stop(void) {
+    tracker.stop = true;
+    pthread_join(tracker.thread, NULL);
+    close(tracker.inotify_fd);
+    for (size_t i = 0; i < tracker.count; i++) {
+        free(tracker.items[i].path);
+    }
+    for (size_t i = 0; i < tracker.dir_capacity; i++) {
+        free(tracker.dirs[i].path);
+    }
+    free(tracker.items);
+    free(tracker.arrived);
+    free(tracker.slots);
+    free(tracker.dirs);
+    pthread_cond_destroy(&tracker.arrived_cond);
+    pthread_mutex_destroy(&tracker.lock);
+}
+
+// Processes under test
+
+static pid_t spawn(const char *cwd, const char *log_path, char *const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (chdir(cwd) < 0 || log_fd < 0) {
+            _exit(127);
+        }
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        execv(argv[0], argv);
+        perror("exec failed");
+        _exit(127);
+    }
+    return pid;
+}
+
+// User plus system CPU seconds of a live process
+static double process_cpu(pid_t pid) {
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+    // Fields after the command name, which may contain spaces
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Peak resident set size in KB
+static long process_peak_rss(pid_t pid) {
+    char path[64];
+    char line[256];
+    long kb = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+static void stop_process(pid_t pid) {
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 200; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return;
+        }
+        sleep_ms(10);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// Read the server's metrics; returns a malloc'd snapshot or NULL
+static char *read_stats(const char *sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return NULL;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return NULL;
+    }
+    size_t len = 0, capacity = 64 * 1024;
+    char *text = malloc(capacity);
+    ssize_t got;
+    while (text && (got = read(sock, text + len, capacity - len - 1)) > 0) {
+        len += got;
+        if (len + 1 == capacity) {
+            capacity *= 2;
+            char *grown = realloc(text, capacity);
+            if (!grown) {
+                free(text);
+            }
+            text = grown;
+        }
+    }
+    close(sock);
+    if (text) {
+        text[len] = '\0';
+    }
+    return text;
+}
+
+// Value of an unlabelled metric in a snapshot, -1 if absent
+static double stats_value(const char *text, const char *name) {
+    size_t len = strlen(name);
+    for (const char *line = text; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return atof(line + len + 1);
+        }
+    }
+    return -1;
+}
+
+// Workloads. Each writes into the server's tree; prepare runs before the
+// clients connect and is not measured.
+
+typedef struct {
+    const char *name;
+    void (*prepare)(const char *tree);
+    bool (*run)(const char *tree, double deadline);
+    bool tracked;               // latencies come from arrivals
+} Scenario;
+
+typedef struct {
+    const char *name;
+    bool complete;              // everything arrived before the timeout
+    bool verified;              // and every client's copy has the right shape and sizes
+    size_t items;
+    uint64_t bytes;
+    double elapsed;             // seconds from the first write until the last client caught up
+    double converge;            // seconds from the last write until then
+    bool has_latency;
+    double p50, p90, p99, max;  // seconds from written on the server to in place on a client
+    double server_cpu;
+    double client_cpu;          // all clients together
+    long server_rss_kb;
+    long client_rss_kb;         // the largest client
+    double server_bytes_sent;
+    bool overflowed;
+} Result;
+
+static double last_write;
+static uint64_t churn_ops;
+
+// Create directories one level at a time: the server only watches a new
+// directory once it has seen it created, so anything written into it before
+// then would not be noticed (as with mkdir -p)
+static bool make_level(const char *tree, char (*paths)[PATH_MAX], int count, double deadline) {
+    for (int i = 0; i < count; i++) {
+        char full[PATH_MAX * 2];
+        size_t id = track(paths[i], 0, true);
+        snprintf(full, sizeof(full), "%s/%s", tree, paths[i]);
+        if (mkdir(full, 0755) < 0) {
+            perror("mkdir failed");
+            return false;
+        }
+        mark_written(id);
+    }
+    return wait_arrivals(deadline);
+}
+
+// Many small files spread over a few directories, written in one burst
+static bool run_small(const char *tree, double deadline) {
+    char (*dirs)[PATH_MAX] = malloc(SMALL_DIRS * sizeof(*dirs));
+    for (int i = 0; i < SMALL_DIRS; i++) {
+        snprintf(dirs[i], PATH_MAX, "small%02d", i);
+    }
+    bool ok = make_level(tree, dirs, SMALL_DIRS, deadline);
+    long files = scaled(SMALL_FILES);
+    for (long i = 0; ok && i < files; i++) {
+        char rel[PATH_MAX * 2];
+        char full[PATH_MAX * 3];
+        snprintf(rel, sizeof(rel), "%s/f%05ld.dat", dirs[i % SMALL_DIRS], i);
+        snprintf(full, sizeof(full), "%s/%s", tree, rel);
+        uint64_t size = 1 + rng_below(SMALL_MAX_SIZE);
+        size_t id = track(rel, size, false);
+        if (write_file(full, size, NULL) < 0) {
+            ok = false;
+        }
+        mark_written(id);
+    }
+    last_write = now_s();
+    free(dirs);
+    return ok && wait_arrivals(deadline);
+}
+
+// A few large files, each written outside the tree and moved in once the
+// previous one has arrived everywhere: several at once would overflow the
+// server's per-client queue and turn into a rescan
+static bool run_huge(const char *tree, double deadline) {
+    long size = scaled(HUGE_SIZE);
+    for (int i = 0; i < HUGE_FILES; i++) {
+        char rel[64];
+        char full[PATH_MAX * 2];
+        char stage[PATH_MAX * 2];
+        snprintf(rel, sizeof(rel), "huge%d.bin", i);
+        snprintf(full, sizeof(full), "%s/%s", tree, rel);
+        snprintf(stage, sizeof(stage), "%s/../stage-%d", tree, i);
+        size_t id = track(rel, size, false);
+        if (write_file(full, size, stage) < 0) {
+            return false;
+        }
+        mark_written(id);
+        last_write = now_s();
+        if (!wait_arrivals(deadline)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A few long chains of nested directories with some files at every level
+static bool run_deep(const char *tree, double deadline) {
+    char (*level)[PATH_MAX] = malloc(DEEP_CHAINS * sizeof(*level));
+    long depth = scaled(DEEP_DEPTH);
+    for (int c = 0; c < DEEP_CHAINS; c++) {
+        snprintf(level[c], PATH_MAX, "deep%d", c);
+    }
+    bool ok = true;
+    for (long d = 0; ok && d < depth; d++) {
+        if (d > 0) {
+            for (int c = 0; c < DEEP_CHAINS; c++) {
+                size_t len = strlen(level[c]);
+                snprintf(level[c] + len, PATH_MAX - len, "/l%02ld", d);
+            }
+        }
+        ok = make_level(tree, level, DEEP_CHAINS, deadline);
+    }
+    // Files at every level of every chain, all in one burst
+    for (int c = 0; ok && c < DEEP_CHAINS; c++) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", level[c]);
+        for (long d = depth - 1; ok && d >= 0; d--) {
+            for (int f = 0; f < DEEP_FILES_PER_DIR; f++) {
+                char rel[PATH_MAX + 16];
+                char full[PATH_MAX * 2 + 16];
+                snprintf(rel, sizeof(rel), "%s/f%d", dir, f);
+                snprintf(full, sizeof(full), "%s/%s", tree, rel);
+                uint64_t size = 1 + rng_below(4096);
+                size_t id = track(rel, size, false);
+                ok = write_file(full, size, NULL) == 0;
+                mark_written(id);
+            }
+            char *slash = strrchr(dir, '/');
+            if (slash) {
+                *slash = '\0';
+            }
+        }
+    }
+    last_write = now_s();
+    free(level);
+    return ok && wait_arrivals(deadline);
+}
+
+// Churn: what the server's tree should look like after a storm of creates,
+// rewrites, renames and deletes. Clients are compared with it by walking.
+typedef struct {
+    char *path;
+    uint64_t size;
+    bool alive;
+} ChurnEntry;
+
+static ChurnEntry *churn;
+static size_t churn_count;
+static size_t churn_capacity;
+static char churn_dirs[CHURN_DIRS][32];
+static int churn_next_name;
+
+static void churn_add(const char *path, uint64_t size) {
+    if (churn_count == churn_capacity) {
+        churn_capacity = churn_capacity ? churn_capacity * 2 : 1024;
+        churn = realloc(churn, churn_capacity * sizeof(ChurnEntry));
+        if (!churn) {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+    churn[churn_count].path = strdup(path);
+    churn[churn_count].size = size;
+    churn[churn_count].alive = true;
+    churn_count++;
+}
+
+static ChurnEntry *churn_pick(void) {
+    for (int tries = 0; tries < 64 && churn_count; tries++) {
+        ChurnEntry *e = &churn[rng_below(churn_count)];
+        if (e->alive) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void prepare_churn(const char *tree) {
+    for (size_t i = 0; i < churn_count; i++) {
+        free(churn[i].path);
+    }
+    churn_count = 0;
+    churn_next_name = 0;
+    for (int d = 0; d < CHURN_DIRS; d++) {
+        char full[PATH_MAX];
+        snprintf(churn_dirs[d], sizeof(churn_dirs[d]), "dir%d", churn_next_name++);
+        snprintf(full, sizeof(full), "%s/%s", tree, churn_dirs[d]);
+        mkdir(full, 0755);
+    }
+    long files = scaled(CHURN_FILES);
+    for (long i = 0; i < files; i++) {
+        char rel[PATH_MAX];
+        char full[PATH_MAX * 2];
+        snprintf(rel, sizeof(rel), "%s/c%d", churn_dirs[rng_below(CHURN_DIRS)], churn_next_name++);
+        snprintf(full, sizeof(full), "%s/%s", tree, rel);
+        uint64_t size = 100 + rng_below(2000);
+        if (write_file(full, size, NULL) == 0) {
+            churn_add(rel, size);
+        }
+    }
+}
+
+// Number of entries below root, -1 if a temp file is still there
+static long count_tree(const char *root) {
+    DIR *dir = opendir(root);
+    if (!dir) {
+        return -1;
+    }
+    long count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count >= 0) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (strstr(entry->d_name, ".sync-tmp")) {
+            count = -1;
+            break;
+        }
+        count++;
+        if (entry->d_type == DT_DIR) {
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", root, entry->d_name);
+            long n = count_tree(sub);
+            count = n < 0 ? -1 : count + n;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+static bool churn_matches(const char *root) {
+    long expected = CHURN_DIRS;
+    for (size_t i = 0; i < churn_count; i++) {
+        if (!churn[i].alive) {
+            continue;
+        }
+        expected++;
+        char full[PATH_MAX * 2];
+        struct stat st;
+        snprintf(full, sizeof(full), "%s/%s", root, churn[i].path);
+        if (stat(full, &st) < 0 || (uint64_t)st.st_size != churn[i].size) {
+            return false;
+        }
+    }
+    return count_tree(root) == expected;
+}
+
+static bool run_churn(const char *tree, double deadline) {
+    long ops = scaled(CHURN_OPS);
+    char full[PATH_MAX * 2];
+    char to[PATH_MAX * 2];
+    for (long op = 0; op < ops; op++) {
+        int kind = rng_below(100);
+        ChurnEntry *e = churn_pick();
+        if (kind < 30 || !e) {
+            char rel[PATH_MAX];
+            snprintf(rel, sizeof(rel), "%s/c%d", churn_dirs[rng_below(CHURN_DIRS)], churn_next_name++);
+            snprintf(full, sizeof(full), "%s/%s", tree, rel);
+            uint64_t size = 100 + rng_below(2000);
+            if (write_file(full, size, NULL) == 0) {
+                churn_add(rel, size);
+            }
+        } else if (kind < 55) {
+            snprintf(full, sizeof(full), "%s/%s", tree, e->path);
+            if (unlink(full) == 0) {
+                e->alive = false;
+            }
+        } else if (kind < 80) {
+            char rel[PATH_MAX];
+            snprintf(rel, sizeof(rel), "%s/c%d", churn_dirs[rng_below(CHURN_DIRS)], churn_next_name++);
+            snprintf(full, sizeof(full), "%s/%s", tree, e->path);
+            snprintf(to, sizeof(to), "%s/%s", tree, rel);
+            if (rename(full, to) == 0) {
+                free(e->path);
+                e->path = strdup(rel);
+            }
+        } else if (kind < 95) {
+            snprintf(full, sizeof(full), "%s/%s", tree, e->path);
+            e->size = 100 + rng_below(2000);
+            write_file(full, e->size, NULL);
+        } else {
+            // Rename a whole directory and everything known to be in it
+            int d = rng_below(CHURN_DIRS);
+            char renamed[32];
+            snprintf(renamed, sizeof(renamed), "dir%d", churn_next_name++);
+            snprintf(full, sizeof(full), "%s/%s", tree, churn_dirs[d]);
+            snprintf(to, sizeof(to), "%s/%s", tree, renamed);
+            if (rename(full, to) < 0) {
+                continue;
+            }
+            size_t old_len = strlen(churn_dirs[d]);
+            for (size_t i = 0; i < churn_count; i++) {
+                if (strncmp(churn[i].path, churn_dirs[d], old_len) == 0 && churn[i].path[old_len] == '/') {
+                    char rel[PATH_MAX];
+                    snprintf(rel, sizeof(rel), "%s%s", renamed, churn[i].path + old_len);
+                    free(churn[i].path);
+                    churn[i].path = strdup(rel);
+                }
+            }
+            snprintf(churn_dirs[d], sizeof(churn_dirs[d]), "%s", renamed);
+        }
+    }
+    churn_ops = ops;
+    last_write = now_s();
+
+    // Poll until every client matches
+    for (int c = 0; c < client_count; c++) {
+        while (!churn_matches(tracker.client_roots[c])) {
+            if (now_s() > deadline) {
+                return false;
+            }
+            sleep_ms(10);
+        }
+    }
+    return true;
+}
+
+static const Scenario scenarios[] = {
+    { "small", NULL, run_small, true },
+    { "huge", NULL, run_huge, true },
+    { "deep", NULL, run_deep, true },
+    { "churn", prepare_churn, run_churn, false },
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Every tracked item is in every client with the size it was written with
+static bool verify_items(void) {
+    for (size_t i = 0; i < tracker.count; i++) {
+        Item *item = &tracker.items[i];
+        for (int c = 0; c < client_count; c++) {
+            char full[PATH_MAX * 2];
+            struct stat st;
+            snprintf(full, sizeof(full), "%s/%s", tracker.client_roots[c], item->path);
+            if (stat(full, &st) < 0 || (item->is_dir ? !S_ISDIR(st.st_mode) : (uint64_t)st.st_size != item->size)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void summarise_arrivals(Result *r, double started) {
+    size_t n = tracker.count * client_count;
+    double *latencies = malloc((n ? n : 1) * sizeof(double));
+    size_t got = 0;
+    double last = started;
+    for (size_t i = 0; i < tracker.count; i++) {
+        r->bytes += tracker.items[i].size;
+        for (int c = 0; c < client_count; c++) {
+            double t = tracker.arrived[i * client_count + c];
+            if (t == 0) {
+                continue;
+            }
+            double latency = t - tracker.items[i].written;
+            latencies[got++] = latency > 0 ? latency : 0;
+            if (t > last) {
+                last = t;
+            }
+        }
+    }
+    r->items = tracker.count;
+    r->elapsed = last - started;
+    r->converge = last > last_write ? last - last_write : 0;
+    if (got) {
+        qsort(latencies, got, sizeof(double), compare_doubles);
+        r->has_latency = true;
+        r->p50 = latencies[(got - 1) * 50 / 100];
+        r->p90 = latencies[(got - 1) * 90 / 100];
+        r->p99 = latencies[(got - 1) * 99 / 100];
+        r->max = latencies[got - 1];
+    }
+    free(latencies);
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror(path);
+        exit(1);
+    }
+}
+
+static bool run_scenario(const Scenario *sc, Result *r) {
+    char dir[PATH_MAX + 16];
+    char tree[PATH_MAX + 32];
+    char sock_path[PATH_MAX + 32];
+    char log_path[PATH_MAX + 64];
+    char port_arg[16];
+    char clients_arg[16];
+    pid_t clients[MAX_CLIENTS];
+
+    memset(r, 0, sizeof(*r));
+    r->name = sc->name;
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    snprintf(dir, sizeof(dir), "%s/%s", work_root, sc->name);
+    snprintf(tree, sizeof(tree), "%s/server", dir);
+    snprintf(sock_path, sizeof(sock_path), "%s/server.sock", dir);
+    make_dir(dir);
+    make_dir(tree);
+    tracker_start();
+    for (int c = 0; c < client_count; c++) {
+        char client_dir[PATH_MAX + 40];
+        char ignore_path[PATH_MAX + 64];
+        snprintf(client_dir, sizeof(client_dir), "%s/client%d", dir, c);
+        make_dir(client_dir);
+        snprintf(tracker.client_roots[c], sizeof(tracker.client_roots[c]), "%s/tree", client_dir);
+        make_dir(tracker.client_roots[c]);
+        // The client reads its ignore list from its working directory
+        snprintf(ignore_path, sizeof(ignore_path), "%s/ignore_list.txt", client_dir);
+        FILE *ignore = fopen(ignore_path, "w");
+        if (ignore) {
+            fclose(ignore);
+        }
+    }
+    if (sc->prepare) {
+        sc->prepare(tree);
+    }
+
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(clients_arg, sizeof(clients_arg), "%d", client_count);
+    snprintf(log_path, sizeof(log_path), "%s/server.log", dir);
+    char *server_argv[] = { (char *)server_bin, "-l", "quiet", "-m", sock_path, tree, port_arg, clients_arg, NULL };
+    pid_t server = spawn(dir, log_path, server_argv);
+
+    // Up once its stats socket answers
+    char *stats = NULL;
+    double deadline = now_s() + STARTUP_TIMEOUT;
+    while (!(stats = read_stats(sock_path)) && now_s() < deadline) {
+        sleep_ms(20);
+    }
+    free(stats);
+
+    tracker_watch();
+    for (int c = 0; c < client_count; c++) {
+        char client_dir[PATH_MAX + 40];
+        snprintf(client_dir, sizeof(client_dir), "%s/client%d", dir, c);
+        snprintf(log_path, sizeof(log_path), "%s/client.log", client_dir);
+        char *client_argv[] = { (char *)client_bin, "-l", "quiet", "127.0.0.1", port_arg, tracker.client_roots[c], NULL };
+        clients[c] = spawn(client_dir, log_path, client_argv);
+    }
+    bool connected = false;
+    while (!connected && now_s() < deadline) {
+        stats = read_stats(sock_path);
+        connected = stats && stats_value(stats, "sync_clients") == client_count;
+        free(stats);
+        if (!connected) {
+            sleep_ms(20);
+        }
+    }
+    if (connected && sc->prepare) {
+        // The prepared tree reaches clients through the initial manifest diff
+        for (int c = 0; c < client_count && connected; c++) {
+            while (!(connected = churn_matches(tracker.client_roots[c])) && now_s() < deadline) {
+                sleep_ms(20);
+            }
+        }
+    }
+
+    if (connected) {
+        double server_cpu = process_cpu(server);
+        double client_cpu = 0;
+        for (int c = 0; c < client_count; c++) {
+            client_cpu -= process_cpu(clients[c]);
+        }
+        double started = now_s();
+        last_write = started;
+        r->complete = sc->run(tree, started + timeout_s);
+        double finished = now_s();
+
+        r->server_cpu = process_cpu(server) - server_cpu;
+        for (int c = 0; c < client_count; c++) {
+            client_cpu += process_cpu(clients[c]);
+            long rss = process_peak_rss(clients[c]);
+            if (rss > r->client_rss_kb) {
+                r->client_rss_kb = rss;
+            }
+        }
+        r->client_cpu = client_cpu;
+        r->server_rss_kb = process_peak_rss(server);
+        stats = read_stats(sock_path);
+        r->server_bytes_sent = stats ? stats_value(stats, "sync_bytes_sent_total") : -1;
+        free(stats);
+
+        if (sc->tracked) {
+            summarise_arrivals(r, started);
+            r->verified = r->complete && verify_items();
+        } else {
+            r->items = churn_ops;
+            r->elapsed = finished - started;
+            r->converge = finished - last_write;
+            r->verified = r->complete;
+        }
+    } else {
+        fprintf(stderr, "%s: clients did not connect, see %s\n", sc->name, dir);
+    }
+
+    for (int c = 0; c < client_count; c++) {
+        stop_process(clients[c]);
+    }
+    stop_process(server);
+    r->overflowed = tracker.overflowed;
+    tracker_stop();
+    return connected;
+}
+
+static void print_result(const Result *r) {
+    if (r->has_latency) {
+        printf("%-6s %7zu %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f %9.1f %8.2f %8.2f %7ld %7ld %s\n", r->name, r->items,
+               r->bytes / 1e6, r->p50 * 1e3, r->p90 * 1e3, r->p99 * 1e3, r->max * 1e3,
+               r->elapsed > 0 ? r->bytes * (double)client_count / 1e6 / r->elapsed : 0,
+               r->elapsed > 0 ? r->items * (double)client_count / r->elapsed : 0,
+               r->server_cpu, r->client_cpu, r->server_rss_kb / 1024, r->client_rss_kb / 1024,
+               !r->complete ? "TIMEOUT" : !r->verified ? "MISMATCH" : "ok");
+    } else {
+        printf("%-6s %7zu %8s %8s %8s %8s %8.1f %9s %9.1f %8.2f %8.2f %7ld %7ld %s\n", r->name, r->items,
+               "-", "-", "-", "-", r->converge * 1e3, "-",
+               r->elapsed > 0 ? r->items / r->elapsed : 0,
+               r->server_cpu, r->client_cpu, r->server_rss_kb / 1024, r->client_rss_kb / 1024,
+               !r->complete ? "TIMEOUT" : "ok");
+    }
+    fflush(stdout);
+}
+
+static void write_json(FILE *out, const Result *results, int count) {
+    time_t t = time(NULL);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    fprintf(out, "{\n  \"label\": \"");
+    for (const char *p = label; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*p >= 0x20) {
+            fputc(*p, out);
+        }
+    }
+    fprintf(out, "\",\n  \"time\": \"%s\",\n  \"clients\": %d,\n  \"seed\": %llu,\n  \"scale\": %g,\n",
+            when, client_count, (unsigned long long)seed, scale);
+    fprintf(out, "  \"scenarios\": [\n");
+    for (int i = 0; i < count; i++) {
+        const Result *r = &results[i];
+        fprintf(out, "    {\n      \"name\": \"%s\",\n      \"complete\": %s,\n      \"verified\": %s,\n",
+                r->name, r->complete ? "true" : "false", r->verified ? "true" : "false");
+        fprintf(out, "      \"items\": %zu,\n      \"bytes\": %llu,\n      \"elapsed_s\": %.6f,\n"
+                "      \"converge_s\": %.6f,\n",
+                r->items, (unsigned long long)r->bytes, r->elapsed, r->converge);
+        if (r->has_latency) {
+            fprintf(out, "      \"latency_s\": { \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f },\n",
+                    r->p50, r->p90, r->p99, r->max);
+            fprintf(out, "      \"throughput_mb_s\": %.3f,\n      \"items_per_s\": %.1f,\n",
+                    r->elapsed > 0 ? r->bytes * (double)client_count / 1e6 / r->elapsed : 0,
+                    r->elapsed > 0 ? r->items * (double)client_count / r->elapsed : 0);
+        } else {
+            fprintf(out, "      \"latency_s\": null,\n      \"throughput_mb_s\": null,\n"
+                    "      \"items_per_s\": %.1f,\n", r->elapsed > 0 ? r->items / r->elapsed : 0);
+        }
+        fprintf(out, "      \"server\": { \"cpu_s\": %.3f, \"peak_rss_kb\": %ld, \"bytes_sent\": %.0f },\n",
+                r->server_cpu, r->server_rss_kb, r->server_bytes_sent);
+        fprintf(out, "      \"clients\": { \"cpu_s\": %.3f, \"peak_rss_kb\": %ld },\n",
+                r->client_cpu, r->client_rss_kb);
+        fprintf(out, "      \"inotify_overflow\": %s\n    }%s\n", r->overflowed ? "true" : "false",
+                i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-k clients] [-w small,huge,deep,churn] [-f scale] [-r seed] [-T timeout_s]\n"
+           "          [-S syncserver] [-C syncclient] [-p port] [-d work_dir] [-t label] [-o results.json]\n", prog);
+    printf("  -k  number of clients (default %d)\n", DEFAULT_CLIENTS);
+    printf("  -w  scenarios to run (default all)\n");
+    printf("  -f  multiply file counts and sizes by this (default 1)\n");
+    printf("  -o  write results as JSON here (default: standard output after the table)\n");
+    printf("  -t  label stored with the results, e.g. the commit being measured\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *which = "small,huge,deep,churn";
+    const char *json_path = NULL;
+    const char *work_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:w:f:r:T:S:C:p:d:t:o:")) != -1) {
+        switch (opt) {
+        case 'k':
+            client_count = atoi(optarg);
+            if (client_count < 1 || client_count > MAX_CLIENTS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            which = optarg;
+            break;
+        case 'f':
+            scale = atof(optarg);
+            if (scale <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            timeout_s = atoi(optarg);
+            break;
+        case 'S':
+            server_bin = optarg;
+            break;
+        case 'C':
+            client_bin = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'd':
+            work_dir = optarg;
+            break;
+        case 't':
+            label = optarg;
+            break;
+        case 'o':
+            json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+    // The processes are started from scenario directories
+    static char server_path[PATH_MAX], client_path[PATH_MAX];
+    if (!realpath(server_bin, server_path) || !realpath(client_bin, client_path)) {
+        fprintf(stderr, "Cannot find %s and %s (use -S and -C)\n", server_bin, client_bin);
+        return 1;
+    }
+    server_bin = server_path;
+    client_bin = client_path;
+
+    if (work_dir) {
+        make_dir(work_dir);
+        if (!realpath(work_dir, work_root)) {
+            perror("realpath failed");
+            return 1;
+        }
+    } else {
+        snprintf(work_root, sizeof(work_root), "/tmp/syncbench.XXXXXX");
+        if (!mkdtemp(work_root)) {
+            perror("mkdtemp failed");
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%d clients, scale %g, seed %llu, work dir %s\n", client_count, scale, (unsigned long long)seed, work_root);
+    printf("%-6s %7s %8s %8s %8s %8s %8s %9s %9s %8s %8s %7s %7s\n", "", "items", "MB", "p50 ms", "p90 ms",
+           "p99 ms", "max ms", "MB/s", "items/s", "srv cpu", "cli cpu", "srv MB", "cli MB");
+    Result results[sizeof(scenarios) / sizeof(scenarios[0])];
+    int count = 0;
+    bool failed = false;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        // Match whole names in the comma-separated list
+        const char *p = which;
+        size_t len = strlen(scenarios[i].name);
+        bool wanted = false;
+        while (p && *p) {
+            if (strncmp(p, scenarios[i].name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+                wanted = true;
+                break;
+            }
+            p = strchr(p, ',');
+            p = p ? p + 1 : NULL;
+        }
+        if (!wanted) {
+            continue;
+        }
+        Result *r = &results[count++];
+        if (!run_scenario(&scenarios[i], r) || !r->complete || !r->verified) {
+            failed = true;
+        }
+        print_result(r);
+    }
+
+    FILE *out = json_path ? fopen(json_path, "w") : stdout;
+    if (!out) {
+        perror("Cannot write results");
+        return 1;
+    }
+    write_json(out, results, count);
+    if (json_path) {
+        fclose(out);
+    }
+    return failed ? 2 : 0;
+}
@@ -1,34 +1,517 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <zlib.h>
+#include <pthread.h>
 
+#include "sync_protocol.h"
+#include "sync_hash.h"
+#include "sync_metrics.h"
+#include "sync_walk.h"
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (64 * 1024)
+#define MIN_BLOCK_SIZE 2048
+#define MAX_BLOCK_SIZE (128 * 1024)
+#define TMP_SUFFIX SYNC_TEMP_SUFFIX
+#define MAX_IGNORE_LIST_LEN (64 * 1024) // largest HELLO the server accepts
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+#define WRITE_BUFFER_ALIGN 4096
+#define MAX_WORKERS 64
+#define MAX_QUEUED_BYTES (64 * 1024 * 1024)
+#define PENDING_DIR_SLOTS 4096
+#define MAX_SEQ_MARKS 1024
+#define MAX_LATENCY_MARKS 64
+#define STALE_BUCKETS 1024
+#define MAX_RECONNECT_DELAY 30
+#define STATE_SAVE_INTERVAL 1           // seconds
+
+// Include a content hash for every file in the manifest (-H)
+bool manifest_hashes = false;
+
+// Ask the server to compress file contents (-z)
+bool offer_compression = false;
+
+// What to fsync once a received file is complete (-f)
+enum {
+    FSYNC_NONE,     // rely on the rename alone: no torn files, but a power
+                    // loss can leave recent files empty
+    FSYNC_FILE,     // fsync the data before the rename
+    FSYNC_DIR       // and the directory after it, so the rename is durable
+};
+int fsync_policy = FSYNC_NONE;
+
+// Threads applying received operations and walking the mirror for the
+// manifest (-j), 0 for one per CPU
+int worker_count = 0;
+
+// Keep the position in the server's journal and unfinished transfers in this
+// file, so a restarted client only fetches what changed (-s)
+const char *state_file = NULL;
+
+// Connect again when the connection drops, resuming where it stopped (-r)
+bool reconnect = false;
+
+// Relay (-R): a syncserver serving this mirror on relay_port to at most
+// relay_max_clients (0 for no limit). relay_fd is the pipe on which it is
+// told the origin of each batch applied here, see sync_protocol.h.
+int relay_port = 0;
+int relay_max_clients = 0;
+int relay_fd = -1;
+pid_t relay_pid = -1;
+static volatile sig_atomic_t relay_exited = 0;
+
+// Where this mirror stands in the server's change journal
+typedef struct {
+    uint64_t journal_id;            // from the server's HELLO, 0 if unknown
+    uint64_t seq;                   // every change up to this one is applied
+    bool valid;
+    uint64_t ignore_hash;           // ignore list it was reached with
+} ResumePoint;
+
+ResumePoint resume_point;
+
+// Set by SIGINT/SIGTERM; the connection is shut down so the state is saved
+static volatile sig_atomic_t stop_requested = 0;
+static volatile int active_sock = -1;
+
+// Counters served on the stats socket (-m). The receive thread and the
+// workers update them with relaxed atomics.
+typedef struct {
+    uint64_t connections;
+    uint64_t frames[SYNC_OP_MAX];   // received, by opcode
+    uint64_t bytes_received;
+    uint64_t files_received;
+    uint64_t transfers_incomplete;
+    uint64_t deltas_applied;
+    uint64_t deltas_failed;
+    uint64_t appends_applied;
+    uint64_t chunks_received;
+    uint64_t chunks_failed;         // did not match their hash
+    uint64_t queued_steps;          // waiting for a worker
+    uint64_t queued_bytes;
+    SyncHistogram apply_latency;    // server event to applied, from CHECKPOINT stamps
+    SyncHistogram origin_latency;   // the same from the origin server, across relays
+    uint64_t relays;                // between the origin and here, last stamped batch
+} ClientMetrics;
+
+static ClientMetrics metrics;
+static const char *stats_path = NULL;
+
+// Frames sent back to the server come from several threads
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A FILE being received into a temp file next to its final path
+typedef struct {
+    int fd;                         // temp file, -1 if none
+    bool failed;                    // write error; payload is still consumed
+    uint64_t size;                  // announced size
+    uint64_t received;
+    off_t offset;                   // bytes of buf already written out
+    char *buf;                      // WRITE_BUFFER_SIZE, page aligned
+    size_t buf_len;
+    bool resumed;                   // appending to a partial copy
+    uint64_t seq;
+    char path[PATH_MAX];            // relative path
+    char tmp_path[PATH_MAX];
+} FileWriter;
+
+// A file being rebuilt from DELTA_* frames
+typedef struct {
+    bool active;
+    bool failed;
+    int basis_fd;                   // our current copy, source of DELTA_COPY blocks
+    int tmp_fd;
+    uint32_t block_size;
+    uint64_t size;
+    uint64_t written;
+    SyncHash hash;
+    char path[PATH_MAX];            // relative path
+    char tmp_path[PATH_MAX];
+} DeltaState;
+
+// A file announced by an empty CHUNK whose chunks are still to come
+typedef struct Announced {
+    struct Announced *next;
+    uint64_t size;
+    uint64_t start;                 // offset of its first chunk
+    char path[];
+} Announced;
+
+// State carried across frames while decoding the server's stream
+typedef struct {
+    int sock;
+    const char *sync_dir;
+    FileWriter file;
+    char rename_to[PATH_MAX];       // payload of RENAME: the new path
+    size_t rename_len;
+    uint8_t control[64];            // payload of small control frames
+    size_t control_len;
+    DeltaState delta;
+    int append_fd;                  // file an APPEND is written into, -1 if none
+    bool append_failed;             // our copy is shorter than its offset
+    uint64_t append_at;             // where its next byte goes
+    Announced *announced;           // files being sent in chunks on this worker
+    Announced *assembling;          // the one whose chunks are arriving, if any
+    FileWriter chunked;             // its temp file
+    char chunk_path[PATH_MAX];      // path of the CHUNK being received
+    bool chunk_writing;             // its bytes go to chunked
+    SyncHash chunk_hash;            // of its bytes so far
+    char *chunk_packed;             // its bytes as sent, with SYNC_FLAG_ZLIB
+    size_t chunk_packed_len;
+    size_t chunk_packed_cap;
+    bool inflating;                 // receiving a compressed FILE
+    bool inflate_failed;
+    z_stream zs;
+    uint64_t file_size;             // announced size of the compressed FILE
+    char file_path[PATH_MAX];       // its relative path; FILE_DATA has none
+    uint64_t zlib_in;               // compressed bytes received
+    uint64_t zlib_out;              // bytes they inflated to
+    double inflate_cpu;             // seconds of CPU spent inflating
+    char scratch[BUFFER_SIZE];      // inflate output, DELTA_COPY reads
+} SyncState;
+
+// The receive thread only decodes frames and replays the decoder callbacks
+// to the worker that owns each path, so operations on one path are applied
+// in order while different paths proceed in parallel.
+enum {
+    STEP_FRAME,                     // data: path
+    STEP_PAYLOAD,                   // data: the next piece of payload
+    STEP_FRAME_END,                 // data: path
+    STEP_ABORT,                     // drop an open delta or compressed file
+    STEP_FILES                      // data: BUNDLE entries of files this worker owns
+};
+
+typedef struct Step {
+    struct Step *next;
+    int kind;
+    SyncFrameHeader hdr;
+    uint64_t order;                 // position in the stream across all workers
+    int wait_worker;                // -1, or a worker that must reach wait_order
+    uint64_t wait_order;            // before this step may be applied
+    size_t len;
+    char data[];
+} Step;
+
+typedef struct {
+    pthread_t thread;
+    Step *head;
+    Step *tail;
+    pthread_cond_t ready;
+    uint64_t done_order;            // order of the last step applied
+    SyncState state;
+} Worker;
+
+// A CHECKPOINT, or the first frame of a later change, seen in the stream:
+// change seq is complete once every step posted before it has been applied.
+typedef struct {
+    uint64_t order;
+    uint64_t seq;
+} SeqMark;
+
+// A CHECKPOINT stamped with the time the server saw the first event of the
+// batch it ends, and the origin server if that is further up; the batch is
+// applied once every step before order is.
+typedef struct {
+    uint64_t order;
+    uint64_t event_ns;
+    uint64_t origin_ns;             // 0 if unknown
+    uint8_t relays;
+} LatencyMark;
+
+// Entries of a BUNDLE for one worker, collected before they are posted as a
+// single step
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} FileBatch;
+
+// A DIR_CREATE still queued on a worker; operations inside that directory
+// that land on other workers wait for it.
+typedef struct {
+    uint64_t path_hash;
+    int worker;
+    uint64_t order;
+} PendingDir;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t progress;        // a step was applied
+    int waiting;                    // threads waiting on progress
+    Worker *workers;
+    int worker_count;
+    uint64_t next_order;
+    size_t queued_steps;
+    size_t queued_bytes;
+    bool stopping;
+    PendingDir dirs[PENDING_DIR_SLOTS];
+    int route;                      // worker for the frame being decoded, -1
+                                    // to apply it on the receive thread
+    int stream_worker;              // worker with an open delta or compressed
+                                    // file, -1 if none
+    SyncState *inline_state;        // used for frames applied on the receive thread
+    SeqMark marks[MAX_SEQ_MARKS];   // not yet known to be applied, oldest first
+    int mark_first;
+    int mark_count;
+    uint64_t group_seq;             // change the latest frames belong to
+    bool synced;                    // the manifest diff or replay has completed
+    LatencyMark latency[MAX_LATENCY_MARKS]; // batches not yet applied, oldest first
+    int latency_first;
+    int latency_count;
+    char *bundle;                   // BUNDLE payload being received
+    size_t bundle_len;
+    size_t bundle_cap;
+    char *bundle_raw;               // the payload inflated, if it was compressed
+    size_t bundle_raw_cap;
+    FileBatch *batches;             // per worker, while a BUNDLE is split up
+} Pipeline;
+
+static Pipeline pipeline;
 
 void sync_files(int sock, const char *sync_dir);
-void send_ignore_list(int sock);
-void receive_file(int sock, const char *sync_dir, const char *relative_path, size_t file_size);
+void init_state(SyncState *state, int sock, const char *sync_dir);
+void finish_state(SyncState *state);
+uint64_t send_ignore_list(int sock);
+void begin_receive_file(SyncState *state, const char *relative_path, uint64_t file_size, bool resume);
+void receive_file_data(SyncState *state, const char *data, size_t len);
+void end_receive_file(SyncState *state, const char *relative_path, uint64_t file_size);
+void receive_bundled_files(SyncState *state, const char *data, size_t len);
+void abort_receive_file(SyncState *state);
+void send_signature(SyncState *state, const char *relative_path, uint64_t seq);
+void begin_delta(SyncState *state, const char *relative_path);
+void apply_delta_copy(SyncState *state);
+void apply_delta_data(SyncState *state, const char *data, size_t len);
+void end_delta(SyncState *state, const char *relative_path, uint64_t seq);
+void abort_delta(SyncState *state);
+void begin_append(SyncState *state, const char *relative_path);
+void append_data(SyncState *state, const char *data, size_t len);
+void end_append(SyncState *state, const char *relative_path, uint64_t seq);
+void chunk_data(SyncState *state, const SyncFrameHeader *hdr, const char *data, size_t len);
+void end_chunk(SyncState *state, const SyncFrameHeader *hdr, const char *relative_path);
+void end_chunks(SyncState *state, const char *relative_path);
+void end_all_chunks(const char *relative_path);
+void send_manifest(int sock, const char *sync_dir);
+void apply_attr(SyncState *state, const char *full_path);
+void apply_rename(SyncState *state, const char *relative_path);
+void begin_inflate(SyncState *state);
+void inflate_file_data(SyncState *state, const char *data, size_t len);
+void end_inflate(SyncState *state, bool complete);
+int remove_tree(const char *path);
+void stale_add(const char *relative_path);
+void stale_done(const char *relative_path);
+void stale_forget(const char *relative_path, bool subtree);
+void stale_move(const char *from, const char *to);
+void stale_clear(void);
+void keep_partial(FileWriter *file);
+bool is_partial(const char *relative_path);
+void claim_partial(const char *relative_path);
+void send_partials(int sock, const char *sync_dir);
+void send_resume(int sock);
+void sync_completed(const char *sync_dir);
+void load_state(void);
+void save_state(void);
+void start_stats_server(const char *path);
+static uint64_t hash_path(const char *path, size_t len);
+static void reset_marks(void);
+static double cpu_seconds(void);
+static void note_applied(void);
+static bool path_within(const char *path, const char *dir, size_t dir_len);
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <server_ip> <port> <sync_directory>\n", argv[0]);
+static void usage(const char *prog) {
+    printf("Usage: %s [-H] [-z] [-f none|file|dir] [-j threads] [-s state_file] [-r] [-m stats_socket]\n"
+           "          [-R port[:max_clients]] [-l quiet|info|debug] <server_ip> <port> <sync_directory>\n", prog);
+    printf("  -H  include content hashes in the manifest sent on connect\n");
+    printf("  -z  ask the server to compress file contents\n");
+    printf("  -f  fsync received files before renaming them into place (file),\n");
+    printf("      and their directory afterwards (dir); default none\n");
+    printf("  -j  number of threads applying changes and scanning the mirror (default: one per CPU)\n");
+    printf("  -s  remember the sync position here, so a restart only fetches what changed\n");
+    printf("  -r  reconnect when the connection drops\n");
+    printf("  -m  serve counters and latency histograms on this Unix socket\n");
+    printf("  -R  relay: serve the mirror to further clients on this port, with the\n");
+    printf("      syncserver found next to this program\n");
+    printf("  -l  how much to log: quiet, info (default) or debug for every file;\n");
+    printf("      SIGUSR1 switches to debug while running, SIGUSR2 back\n");
+    exit(1);
+}
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+    if (active_sock >= 0) {
+        shutdown(active_sock, SHUT_RDWR);
+    }
+}
+
+// A relay without its server is no relay: stop, so whoever runs it notices
+static void relay_child_exited(int sig) {
+    int status;
+    if (relay_pid > 0 && waitpid(relay_pid, &status, WNOHANG) == relay_pid) {
+        relay_exited = 1;
+        request_stop(sig);
+    }
+}
+
+// Run syncserver on the mirror for downstream clients (-R). It is looked for
+// next to this program, then on PATH, and reads the origins of the batches
+// applied here from relay_fd. It dies with this process.
+static void start_relay(const char *sync_dir, const char *log_name) {
+    char server_path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", server_path, sizeof(server_path) - 1);
+    char *slash = len > 0 ? memrchr(server_path, '/', len) : NULL;
+    if (slash && (size_t)(slash - server_path) + sizeof("/syncserver") <= sizeof(server_path)) {
+        strcpy(slash, "/syncserver");
+    }
+    if (!slash || access(server_path, X_OK) < 0) {
+        strcpy(server_path, "syncserver");
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe failed");
         exit(1);
     }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = relay_child_exited;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    char *server_ip = argv[1];
-    int port = atoi(argv[2]);
-    char *sync_dir = argv[3];
+    fflush(stdout);
+    relay_pid = fork();
+    if (relay_pid < 0) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (relay_pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        fcntl(fds[0], F_SETFD, 0);
+        char fd_arg[16], port_arg[16], max_arg[16];
+        snprintf(fd_arg, sizeof(fd_arg), "%d", fds[0]);
+        snprintf(port_arg, sizeof(port_arg), "%d", relay_port);
+        snprintf(max_arg, sizeof(max_arg), "%d", relay_max_clients);
+        execlp(server_path, server_path, "-u", fd_arg, "-l", log_name, sync_dir, port_arg, max_arg, (char *)NULL);
+        perror("Cannot run syncserver for the relay");
+        _exit(127);
+    }
+    close(fds[0]);
+    relay_fd = fds[1];
+    fcntl(relay_fd, F_SETFL, O_NONBLOCK);
+    log_info("Relaying %s on port %d with %s (pid %d)\n", sync_dir, relay_port, server_path, (int)relay_pid);
+}
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
+static void stop_relay(void) {
+    if (relay_exited) {
+        fprintf(stderr, "Relay server exited\n");
         exit(1);
     }
+    kill(relay_pid, SIGTERM);
+    waitpid(relay_pid, NULL, 0);
+}
+
+// One connection: pick up where the last one stopped if the server still can,
+// otherwise describe what we already have so it only sends the differences
+static void run_session(int sock, const char *sync_dir) {
+    uint64_t ignore_hash = send_ignore_list(sock);
+    send_partials(sock, sync_dir);
+    if (resume_point.valid && resume_point.ignore_hash == ignore_hash) {
+        send_resume(sock);
+    } else {
+        // A different ignore list changes what the mirror should hold
+        resume_point.valid = false;
+        stale_clear();
+        send_manifest(sock, sync_dir);
+    }
+    resume_point.ignore_hash = ignore_hash;
+
+    // Start syncing files
+    sync_files(sock, sync_dir);
+    save_state();
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int log_level = SYNC_LOG_INFO;
+    const char *log_name = "info";
+    while ((opt = getopt(argc, argv, "Hzf:j:s:rm:R:l:")) != -1) {
+        switch (opt) {
+        case 'H':
+            manifest_hashes = true;
+            break;
+        case 'z':
+            offer_compression = true;
+            break;
+        case 'f':
+            if (strcmp(optarg, "none") == 0) {
+                fsync_policy = FSYNC_NONE;
+            } else if (strcmp(optarg, "file") == 0) {
+                fsync_policy = FSYNC_FILE;
+            } else if (strcmp(optarg, "dir") == 0) {
+                fsync_policy = FSYNC_DIR;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'j':
+            worker_count = atoi(optarg);
+            if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            state_file = optarg;
+            break;
+        case 'r':
+            reconnect = true;
+            break;
+        case 'm':
+            stats_path = optarg;
+            break;
+        case 'R': {
+            char *end;
+            relay_port = strtol(optarg, &end, 10);
+            if (*end == ':') {
+                relay_max_clients = strtol(end + 1, &end, 10);
+            }
+            if (*end || relay_port <= 0 || relay_port > 65535 || relay_max_clients < 0) {
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'l':
+            log_level = sync_parse_log_level(optarg);
+            if (log_level < 0) {
+                usage(argv[0]);
+            }
+            log_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+    }
+
+    char *server_ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    char *sync_dir = argv[optind + 2];
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -39,170 +522,2452 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection to server failed");
-        exit(1);
+    load_state();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sync_log_init(log_level);
+    if (stats_path) {
+        start_stats_server(stats_path);
+    }
+    if (relay_port) {
+        start_relay(sync_dir, log_name);
     }
 
-    printf("Connected to server at %s:%d\n", server_ip, port);
+    int delay = 1;
+    while (!stop_requested) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            perror("Socket creation failed");
+            exit(1);
+        }
+        if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Connection to server failed");
+            close(sock);
+            if (!reconnect) {
+                exit(1);
+            }
+        } else {
+            log_info("Connected to server at %s:%d\n", server_ip, port);
+            sync_counter_add(&metrics.connections, 1);
+            active_sock = sock;
+            run_session(sock, sync_dir);
+            active_sock = -1;
+            close(sock);
+            delay = 1;
+            if (!reconnect) {
+                break;
+            }
+        }
+        if (stop_requested) {
+            break;
+        }
+        log_info("Reconnecting in %d s\n", delay);
+        sleep(delay);
+        delay = delay * 2 > MAX_RECONNECT_DELAY ? MAX_RECONNECT_DELAY : delay * 2;
+    }
+    if (stats_path) {
+        unlink(stats_path);
+    }
+    if (relay_pid > 0) {
+        stop_relay();
+    }
+    return 0;
+}
+
+static int send_all(int sock, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send failed");
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
 
-    // Send ignore list to server
-    send_ignore_list(sock);
+// Send a frame header and path; the caller sends payload_len bytes after it
+static int send_frame_header(int sock, uint8_t opcode, uint8_t flags, const char *path, uint64_t payload_len, uint64_t seq) {
+    uint8_t header[SYNC_HEADER_LEN];
+    size_t path_len = path ? strlen(path) : 0;
+    SyncFrameHeader hdr = { opcode, flags, (uint16_t)path_len, payload_len, seq };
+    sync_encode_header(header, &hdr);
+    if (send_all(sock, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    return path_len ? send_all(sock, path, path_len) : 0;
+}
 
-    // Start syncing files
-    sync_files(sock, sync_dir);
+// Returns a hash of the list sent, to tell whether a saved position applies.
+// Without a readable ignore_list.txt nothing is ignored: the HELLO is still
+// sent, as the server expects it before the manifest.
+uint64_t send_ignore_list(int sock) {
+    static char ignore_list[MAX_IGNORE_LIST_LEN];
+    size_t list_len = 0;
+    FILE *file = fopen("ignore_list.txt", "r");
+    if (!file) {
+        perror("Failed to open ignore_list.txt, ignoring nothing");
+    } else {
+        log_info("Opened ignore_list.txt\n");
+        // The whole file is sent: rules may be separated by commas or newlines
+        list_len = fread(ignore_list, 1, sizeof(ignore_list), file);
+        if (ferror(file)) {
+            perror("Failed to read ignore_list.txt, ignoring nothing");
+            list_len = 0;
+        } else if (list_len == sizeof(ignore_list) && fgetc(file) != EOF) {
+            log_info("ignore_list.txt is longer than %d bytes, truncating\n", MAX_IGNORE_LIST_LEN);
+            while (list_len > 0 && ignore_list[list_len - 1] != '\n') {
+                list_len--;
+            }
+        }
+        fclose(file);
+    }
+
+    // HELLO frame: the ignore list is the payload
+    uint8_t flags = SYNC_FLAG_BUNDLE | SYNC_FLAG_APPEND | SYNC_FLAG_CHUNKS | (offer_compression ? SYNC_FLAG_ZLIB : 0);
+    send_frame_header(sock, SYNC_OP_HELLO, flags, NULL, list_len, 0);
+    send_all(sock, ignore_list, list_len);
+    log_info("Sent ignore list to server (%zu bytes)\n", list_len);
+    return hash_path(ignore_list, list_len) | 1;
+}
 
-    close(sock);
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
     return 0;
 }
 
-void send_ignore_list(int sock) {
-    // char ignore_list[] = "c, pdf";  // Modify as needed
-    // send(sock, ignore_list, strlen(ignore_list), 0);
-    // printf("Sent ignore list to server: %s\n", ignore_list);
-    FILE *file = fopen("ignore_list.txt", "r");
-        if (!file) {
-            perror("Failed to open ignore_list.txt");
-            return;
-        } else {
-            printf("Opened ignore_list.txt\n");
+static void apply_frame(SyncState *state, const SyncFrameHeader *hdr, const char *relative_path) {
+    state->control_len = 0;
+    state->rename_len = 0;
+
+    // A delta is only ever followed by its own frames; anything else means
+    // the server abandoned it (e.g. this client was downgraded to a rescan).
+    if (state->delta.active && hdr->opcode != SYNC_OP_DELTA_COPY &&
+        hdr->opcode != SYNC_OP_DELTA_DATA && hdr->opcode != SYNC_OP_DELTA_END) {
+        abort_delta(state);
+    }
+    if (state->inflating && hdr->opcode != SYNC_OP_FILE_DATA) {
+        end_inflate(state, false);
+    }
+    state->append_failed = true;
+    if (hdr->path_len == 0) {
+        return;
+    }
+    if (!sync_path_is_safe(relative_path)) {
+        fprintf(stderr, "Ignoring unsafe path from server: %s\n", relative_path);
+        return;
+    }
+    if (state->announced && hdr->opcode != SYNC_OP_CHUNK) {
+        // The server only sends something else for it once it has stopped sending chunks
+        end_chunks(state, relative_path);
+    }
+    if (hdr->opcode == SYNC_OP_CHUNK) {
+        snprintf(state->chunk_path, sizeof(state->chunk_path), "%s", relative_path);
+        state->chunk_writing = false;
+    } else if (hdr->opcode == SYNC_OP_APPEND) {
+        begin_append(state, relative_path);
+    } else if (hdr->opcode == SYNC_OP_FILE) {
+        // A compressed FILE only carries the size; begin_inflate() preallocates
+        begin_receive_file(state, relative_path, (hdr->flags & SYNC_FLAG_ZLIB) ? 0 : hdr->payload_len,
+                           hdr->flags & SYNC_FLAG_RESUME);
+        state->file.seq = hdr->seq;
+        if (hdr->flags & SYNC_FLAG_ZLIB) {
+            snprintf(state->file_path, sizeof(state->file_path), "%s", relative_path);
         }
-    
-        char ignore_list[256];  // Adjust size as needed
-        if (!fgets(ignore_list, sizeof(ignore_list), file)) {
-            perror("Failed to read ignore_list.txt");
-            fclose(file);
-            return;
+    }
+}
+
+static void apply_payload(SyncState *state, const SyncFrameHeader *hdr, const char *data, size_t len) {
+    if (hdr->opcode == SYNC_OP_FILE && !(hdr->flags & SYNC_FLAG_ZLIB)) {
+        receive_file_data(state, data, len);
+    } else if (hdr->opcode == SYNC_OP_FILE_DATA) {
+        if (state->inflating) {
+            inflate_file_data(state, data, len);
         }
-        fclose(file);
-    
-        // Remove newline if present
-        size_t len = strlen(ignore_list);
-        if (len > 0 && (ignore_list[len - 1] == '\n' || ignore_list[len - 1] == '\r')) {
-            ignore_list[len - 1] = '\0';
+    } else if (hdr->opcode == SYNC_OP_DELTA_DATA) {
+        apply_delta_data(state, data, len);
+    } else if (hdr->opcode == SYNC_OP_APPEND) {
+        append_data(state, data, len);
+    } else if (hdr->opcode == SYNC_OP_CHUNK) {
+        chunk_data(state, hdr, data, len);
+    } else if (hdr->opcode == SYNC_OP_RENAME) {
+        if (state->rename_len + len < sizeof(state->rename_to)) {
+            memcpy(state->rename_to + state->rename_len, data, len);
+            state->rename_len += len;
         }
-        printf("Read ignore list: %s\n", ignore_list);
-        send(sock, ignore_list, strlen(ignore_list), 0);
-        printf("Sent ignore list to server: %s\n", ignore_list);
+    } else if (state->control_len + len <= sizeof(state->control)) {
+        memcpy(state->control + state->control_len, data, len);
+        state->control_len += len;
+    }
 }
 
-void sync_files(int sock, const char *sync_dir) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    char moved_from_path[PATH_MAX] = "";  // To store the old path temporarily
-
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-
-        if (strncmp(buffer, "FILE ", 5) == 0) {
-            // Expecting format: FILE <relative_path> <file_size>
-            char relative_path[PATH_MAX];
-            size_t file_size;
-            if (sscanf(buffer + 5, "%s %zu", relative_path, &file_size) == 2) {
-                receive_file(sock, sync_dir, relative_path, file_size);
-            }
-        } else if (strncmp(buffer, "DELETE ", 7) == 0) {
-            // Handle DELETE command: DELETE <relative_path>
-            char relative_path[PATH_MAX];
-            if (sscanf(buffer + 7, "%s", relative_path) == 1) {
-                char full_path[PATH_MAX];
-                snprintf(full_path, sizeof(full_path), "%s/%s", sync_dir, relative_path);
-                if (remove(full_path) == 0) {
-                    printf("Deleted: %s\n", full_path);
-                } else {
-                    perror("Failed to delete file");
-                }
-            }
-        }else if (strncmp(buffer, "DIR_CREATE ", 11) == 0) {
-            // DIR_CREATE <relative_path>
-            char relative_path[PATH_MAX];
-            if (sscanf(buffer + 11, "%s", relative_path) == 1) {
-                char full_path[PATH_MAX];
-                snprintf(full_path, sizeof(full_path), "%s/%s", sync_dir, relative_path);
-                if (mkdir(full_path, 0777) == 0) {
-                    printf("Created directory: %s\n", full_path);
-                } else {
-                    perror("Failed to create directory");
-                }
-            }
-        } else if (strncmp(buffer, "DIR_DELETE ", 11) == 0) {
-            // DIR_DELETE <relative_path>
-            char relative_path[PATH_MAX];
-            if (sscanf(buffer + 11, "%s", relative_path) == 1) {
-                char full_path[PATH_MAX];
-                snprintf(full_path, sizeof(full_path), "%s/%s", sync_dir, relative_path);
-                if (rmdir(full_path) == 0) {
-                    printf("Deleted directory: %s\n", full_path);
-                } else {
-                    perror("Failed to delete directory");
-                }
-            }
-        } else if (strncmp(buffer, "MOVED_FROM ", 11) == 0) {
-            // Store the old path temporarily
-            sscanf(buffer + 11, "%s", moved_from_path);
-            printf("Moved from: %s\n", moved_from_path);
-        } else if (strncmp(buffer, "MOVED_TO ", 9) == 0) {
-            // Handle MOVE by renaming the stored path to the new path
-            char new_relative_path[PATH_MAX];
-            printf("File will be moved from %s to %s\n", moved_from_path, buffer + 9);
-            if (sscanf(buffer + 9, "%s", new_relative_path) == 1 && moved_from_path[0] != '\0') {
-                char old_full_path[PATH_MAX], new_full_path[PATH_MAX];
-                snprintf(old_full_path, sizeof(old_full_path), "%s/%s", sync_dir, moved_from_path);
-                snprintf(new_full_path, sizeof(new_full_path), "%s/%s", sync_dir, new_relative_path);
-
-                if (rename(old_full_path, new_full_path) == 0) {
-                    printf("Moved: %s -> %s\n", old_full_path, new_full_path);
-                } else {
-                    perror("Failed to move file");
-                }
-                moved_from_path[0] = '\0';  // Reset the stored path
+static void apply_frame_end(SyncState *state, const SyncFrameHeader *hdr, const char *relative_path) {
+
+    // Delta body frames carry no path
+    if (hdr->opcode == SYNC_OP_DELTA_COPY) {
+        apply_delta_copy(state);
+        return;
+    }
+    if (hdr->opcode == SYNC_OP_DELTA_DATA) {
+        return;
+    }
+    if (hdr->opcode == SYNC_OP_FILE_DATA) {
+        if (state->inflating && (hdr->flags & SYNC_FLAG_LAST)) {
+            end_inflate(state, true);
+        }
+        return;
+    }
+    if (hdr->opcode == SYNC_OP_HELLO) {
+        if (state->control_len >= SYNC_JOURNAL_ID_LEN) {
+            // Sequence numbers of another journal (the server restarted) mean nothing
+            uint64_t journal_id = sync_get_u64(state->control);
+            if (journal_id != resume_point.journal_id) {
+                resume_point.journal_id = journal_id;
+                resume_point.valid = false;
             }
+        }
+        if (hdr->flags & SYNC_FLAG_ZLIB) {
+            log_info("Server agreed to compress file contents\n");
+        }
+        if (hdr->flags & SYNC_FLAG_BUNDLE) {
+            log_debug("Server bundles small files\n");
+        }
+        if (hdr->flags & SYNC_FLAG_APPEND) {
+            log_debug("Server sends appends to followed files\n");
+        }
+        if (hdr->flags & SYNC_FLAG_CHUNKS) {
+            log_debug("Server sends large files in chunks\n");
+        }
+        return;
+    }
+    if (hdr->opcode == SYNC_OP_MANIFEST_REQUEST) {
+        // The server dropped our backlog and needs to know where we stand;
+        // until that diff is complete we have no position to resume from
+        reset_marks();
+        end_all_chunks(NULL);
+        send_manifest(state->sock, state->sync_dir);
+        return;
+    }
+    if (!sync_path_is_safe(relative_path)) {
+        return;
+    }
+
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+
+    switch (hdr->opcode) {
+    case SYNC_OP_FILE:
+        if (hdr->flags & SYNC_FLAG_ZLIB) {
+            // Only the size so far; the contents follow as FILE_DATA
+            begin_inflate(state);
         } else {
-            printf("Server: %s\n", buffer);
+            end_receive_file(state, relative_path, hdr->payload_len);
+        }
+        break;
+    case SYNC_OP_SIG_REQUEST:
+        send_signature(state, relative_path, hdr->seq);
+        break;
+    case SYNC_OP_DELTA_BEGIN:
+        begin_delta(state, relative_path);
+        break;
+    case SYNC_OP_DELTA_END:
+        end_delta(state, relative_path, hdr->seq);
+        break;
+    case SYNC_OP_APPEND:
+        end_append(state, relative_path, hdr->seq);
+        break;
+    case SYNC_OP_CHUNK:
+        end_chunk(state, hdr, relative_path);
+        break;
+    case SYNC_OP_ATTR:
+        // Ends every FILE and delta, so a SIGNATURE for the path was answered
+        apply_attr(state, full_path);
+        stale_done(relative_path);
+        break;
+    case SYNC_OP_DELETE:
+        stale_forget(relative_path, false);
+        if (remove(full_path) == 0) {
+            log_debug("Deleted: %s\n", full_path);
+        } else if (errno != ENOENT) {
+            perror("Failed to delete file");
+        }
+        break;
+    case SYNC_OP_DIR_CREATE:
+        if (mkdir(full_path, 0777) == 0) {
+            log_debug("Created directory: %s\n", full_path);
+        } else if (errno != EEXIST) {
+            perror("Failed to create directory");
+        }
+        break;
+    case SYNC_OP_DIR_DELETE:
+        // A directory moved out of the server's tree arrives as a single
+        // delete, so remove whatever is still inside it.
+        end_all_chunks(relative_path);
+        stale_forget(relative_path, true);
+        if (remove_tree(full_path) == 0) {
+            log_debug("Deleted directory: %s\n", full_path);
+        } else if (errno != ENOENT) {
+            perror("Failed to delete directory");
         }
+        break;
+    case SYNC_OP_RENAME:
+        end_all_chunks(relative_path);
+        if (state->rename_len > 0 && state->rename_len < sizeof(state->rename_to)) {
+            state->rename_to[state->rename_len] = '\0';
+            end_all_chunks(state->rename_to);
+        }
+        apply_rename(state, relative_path);
+        break;
+    default:
+        log_info("Server: unhandled opcode %d for %s\n", hdr->opcode, relative_path);
+        break;
     }
+}
 
-    if (bytes_received == 0) {
-        printf("Server disconnected.\n");
-    } else {
-        perror("recv failed");
+static void apply_step(SyncState *state, const Step *step) {
+    switch (step->kind) {
+    case STEP_FRAME:
+        apply_frame(state, &step->hdr, step->data);
+        break;
+    case STEP_PAYLOAD:
+        apply_payload(state, &step->hdr, step->data, step->len);
+        break;
+    case STEP_FRAME_END:
+        apply_frame_end(state, &step->hdr, step->data);
+        break;
+    case STEP_ABORT:
+        if (state->delta.active) {
+            abort_delta(state);
+        }
+        if (state->inflating) {
+            end_inflate(state, false);
+        }
+        break;
+    case STEP_FILES:
+        receive_bundled_files(state, step->data, step->len);
+        break;
     }
 }
 
-void receive_file(int sock, const char *sync_dir, const char *relative_path, size_t file_size) {
-    char full_path[PATH_MAX];
-    snprintf(full_path, sizeof(full_path), "%s/%s", sync_dir, relative_path);
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    pthread_mutex_lock(&pipeline.lock);
+    for (;;) {
+        while (!worker->head && !pipeline.stopping) {
+            pthread_cond_wait(&worker->ready, &pipeline.lock);
+        }
+        Step *step = worker->head;
+        if (!step) {
+            break;
+        }
+        // Wait until a directory this step writes into has been created
+        while (step->wait_worker >= 0 && pipeline.workers[step->wait_worker].done_order < step->wait_order) {
+            pipeline.waiting++;
+            pthread_cond_wait(&pipeline.progress, &pipeline.lock);
+            pipeline.waiting--;
+        }
+        pthread_mutex_unlock(&pipeline.lock);
 
-    // Create directories if necessary
-    char dir_path[PATH_MAX];
-    strncpy(dir_path, full_path, sizeof(dir_path));
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        mkdir(dir_path, 0777); // Create the directory
+        apply_step(&worker->state, step);
+
+        pthread_mutex_lock(&pipeline.lock);
+        worker->head = step->next;
+        if (!worker->head) {
+            worker->tail = NULL;
+        }
+        worker->done_order = step->order;
+        pipeline.queued_steps--;
+        pipeline.queued_bytes -= step->len;
+        sync_counter_sub(&metrics.queued_steps, 1);
+        sync_counter_sub(&metrics.queued_bytes, step->len);
+        if (pipeline.latency_count) {
+            note_applied();
+        }
+        free(step);
+        if (pipeline.waiting) {
+            pthread_cond_broadcast(&pipeline.progress);
+        }
     }
+    pthread_mutex_unlock(&pipeline.lock);
+    return NULL;
+}
 
-    // Open file for writing
-    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) {
-        perror("File creation failed");
-        return;
+static uint64_t hash_path(const char *path, size_t len) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
     }
+    return h;
+}
 
-    char buffer[BUFFER_SIZE];
-    size_t bytes_received = 0;
-    ssize_t len;
+// Called with pipeline.lock held
+static bool step_pending(int worker, uint64_t order) {
+    return pipeline.workers[worker].done_order < order;
+}
 
-    while (bytes_received < file_size && (len = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        write(fd, buffer, len);
-        bytes_received += len;
+// The DIR_CREATE of path's parent if it is still queued on a worker other
+// than worker. Called with pipeline.lock held.
+static PendingDir *pending_parent(int worker, const char *path, size_t len) {
+    const char *slash = memrchr(path, '/', len);
+    if (!slash) {
+        return NULL;
     }
+    uint64_t parent = hash_path(path, slash - path);
+    PendingDir *dir = &pipeline.dirs[parent % PENDING_DIR_SLOTS];
+    if (dir->order && dir->path_hash == parent && dir->worker != worker && step_pending(dir->worker, dir->order)) {
+        return dir;
+    }
+    return NULL;
+}
 
-    close(fd);
+// Wait for every queued step to be applied. Directory deletes and renames
+// affect paths owned by any worker, so they are applied only after this.
+static void drain_pipeline(void) {
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.queued_steps > 0) {
+        pipeline.waiting++;
+        pthread_cond_wait(&pipeline.progress, &pipeline.lock);
+        pipeline.waiting--;
+    }
+    memset(pipeline.dirs, 0, sizeof(pipeline.dirs));
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Queue one decoder callback for a worker. Blocks while too much payload is
+// queued, which pushes back on the server through TCP.
+static void post_step(int worker_index, int kind, const SyncFrameHeader *hdr, const char *data, size_t len) {
+    Step *step = malloc(sizeof(Step) + len + 1);
+    if (!step) {
+        perror("malloc failed");
+        exit(1);
+    }
+    step->next = NULL;
+    step->kind = kind;
+    step->hdr = *hdr;
+    step->wait_worker = -1;
+    step->wait_order = 0;
+    step->len = len;
+    memcpy(step->data, data, len);
+    step->data[len] = '\0';
 
-    if (bytes_received == file_size) {
-        printf("Received file: %s (%zu bytes)\n", relative_path, file_size);
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.queued_steps > 0 && pipeline.queued_bytes + len > MAX_QUEUED_BYTES) {
+        pipeline.waiting++;
+        pthread_cond_wait(&pipeline.progress, &pipeline.lock);
+        pipeline.waiting--;
+    }
+    // The first step of a frame inside a directory whose DIR_CREATE is still
+    // queued on another worker waits for it, as does a batch of files whose
+    // first entry is in one
+    PendingDir *dir = NULL;
+    if (kind == STEP_FRAME) {
+        dir = pending_parent(worker_index, data, len);
+    } else if (kind == STEP_FILES) {
+        dir = pending_parent(worker_index, data + SYNC_BUNDLE_ENTRY_LEN, sync_get_u16((const uint8_t *)data + 1));
+    }
+    if (dir) {
+        step->wait_worker = dir->worker;
+        step->wait_order = dir->order;
+    }
+    step->order = ++pipeline.next_order;
+    Worker *worker = &pipeline.workers[worker_index];
+    if (worker->tail) {
+        worker->tail->next = step;
     } else {
-        printf("File transfer incomplete: %s\n", relative_path);
+        // Only an idle worker is waiting for this
+        worker->head = step;
+        pthread_cond_signal(&worker->ready);
+    }
+    worker->tail = step;
+    pipeline.queued_steps++;
+    pipeline.queued_bytes += len;
+    sync_counter_add(&metrics.queued_steps, 1);
+    sync_counter_add(&metrics.queued_bytes, len);
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Remember a queued DIR_CREATE, i.e. the step that was just posted
+static void note_pending_dir(int worker, const char *path) {
+    uint64_t path_hash = hash_path(path, strlen(path));
+    pthread_mutex_lock(&pipeline.lock);
+    PendingDir *dir = &pipeline.dirs[path_hash % PENDING_DIR_SLOTS];
+    bool collision = dir->order && dir->path_hash != path_hash && step_pending(dir->worker, dir->order);
+    if (!collision) {
+        dir->path_hash = path_hash;
+        dir->worker = worker;
+        dir->order = pipeline.next_order;
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+    if (collision) {
+        // Another directory still pending in this slot: rare enough to just
+        // wait for everything, after which neither needs tracking
+        drain_pipeline();
+    }
+}
+
+// Every step posted before this one has been applied. Called with pipeline.lock held.
+static uint64_t applied_order(void) {
+    uint64_t applied = pipeline.next_order;
+    for (int i = 0; i < pipeline.worker_count; i++) {
+        Worker *worker = &pipeline.workers[i];
+        if (worker->head && worker->head->order - 1 < applied) {
+            applied = worker->head->order - 1;
+        }
+    }
+    return applied;
+}
+
+// Change seq is complete once what has been posted so far is applied
+static void push_mark(uint64_t seq) {
+    pthread_mutex_lock(&pipeline.lock);
+    if (pipeline.mark_count == MAX_SEQ_MARKS) {
+        // Far behind: a later mark covers this one anyway
+        pipeline.mark_first = (pipeline.mark_first + 1) % MAX_SEQ_MARKS;
+        pipeline.mark_count--;
+    }
+    SeqMark *mark = &pipeline.marks[(pipeline.mark_first + pipeline.mark_count) % MAX_SEQ_MARKS];
+    mark->order = pipeline.next_order;
+    mark->seq = seq;
+    pipeline.mark_count++;
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Move the resume point past every change the workers have finished applying
+static void update_resume_point(void) {
+    pthread_mutex_lock(&pipeline.lock);
+    uint64_t applied = applied_order();
+    while (pipeline.mark_count > 0 && pipeline.marks[pipeline.mark_first].order <= applied) {
+        resume_point.seq = pipeline.marks[pipeline.mark_first].seq;
+        resume_point.valid = true;
+        pipeline.mark_first = (pipeline.mark_first + 1) % MAX_SEQ_MARKS;
+        pipeline.mark_count--;
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Record how long ago the server saw the events of every batch that is now
+// applied, and pass the origin on to the relay's server. Both clocks are
+// wall clocks, so this is only as good as their synchronisation. Called with
+// pipeline.lock held.
+static void note_applied(void) {
+    uint64_t applied = applied_order();
+    uint64_t now = 0;
+    while (pipeline.latency_count > 0 && pipeline.latency[pipeline.latency_first].order <= applied) {
+        LatencyMark *mark = &pipeline.latency[pipeline.latency_first];
+        if (!now) {
+            now = realtime_ns();
+        }
+        sync_hist_observe(&metrics.apply_latency, now > mark->event_ns ? (now - mark->event_ns) / 1000 : 0);
+        if (mark->origin_ns) {
+            sync_hist_observe(&metrics.origin_latency, now > mark->origin_ns ? (now - mark->origin_ns) / 1000 : 0);
+            __atomic_store_n(&metrics.relays, mark->relays, __ATOMIC_RELAXED);
+            if (relay_fd >= 0) {
+                // Dropped if the server is that far behind; it only loses the stamp
+                uint8_t record[SYNC_RELAY_RECORD_LEN];
+                sync_put_u64(record, mark->origin_ns);
+                record[8] = mark->relays;
+                if (write(relay_fd, record, sizeof(record)) < 0 && errno != EAGAIN) {
+                    perror("Relay pipe write failed");
+                }
+            }
+        }
+        pipeline.latency_first = (pipeline.latency_first + 1) % MAX_LATENCY_MARKS;
+        pipeline.latency_count--;
+    }
+}
+
+// A batch ending with a stamped CHECKPOINT is applied once what has been
+// posted so far is
+static void push_latency_mark(uint64_t event_ns, uint64_t origin_ns, uint8_t relays) {
+    pthread_mutex_lock(&pipeline.lock);
+    if (pipeline.latency_count == MAX_LATENCY_MARKS) {
+        // Far behind: the oldest batch goes unmeasured
+        pipeline.latency_first = (pipeline.latency_first + 1) % MAX_LATENCY_MARKS;
+        pipeline.latency_count--;
+    }
+    LatencyMark *mark = &pipeline.latency[(pipeline.latency_first + pipeline.latency_count) % MAX_LATENCY_MARKS];
+    mark->order = pipeline.next_order;
+    mark->event_ns = event_ns;
+    mark->origin_ns = origin_ns;
+    mark->relays = relays;
+    pipeline.latency_count++;
+    note_applied();
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Forget the position until the next manifest diff or replay completes
+static void reset_marks(void) {
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.mark_count = 0;
+    pipeline.group_seq = 0;
+    pipeline.synced = false;
+    resume_point.valid = false;
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// The server has sent everything up to hdr->seq. The first CHECKPOINT of a
+// connection ends the manifest diff or replay, which is only complete once
+// applied; after that it is enough to remember where it was.
+static void note_checkpoint(const SyncFrameHeader *hdr) {
+    if (!pipeline.synced) {
+        drain_pipeline();
+        sync_completed(pipeline.inline_state->sync_dir);
+        pipeline.synced = true;
+    }
+    if (hdr->seq > pipeline.group_seq) {
+        pipeline.group_seq = hdr->seq;
+    }
+    push_mark(hdr->seq);
+}
+
+// A BUNDLE is received whole on the receive thread and then split up
+static int begin_bundle(const SyncFrameHeader *hdr) {
+    if (hdr->payload_len > SYNC_BUNDLE_MAX) {
+        fprintf(stderr, "Rejecting bundle of %llu bytes\n", (unsigned long long)hdr->payload_len);
+        return -1;
+    }
+    if (hdr->payload_len > pipeline.bundle_cap) {
+        free(pipeline.bundle);
+        pipeline.bundle = malloc(hdr->payload_len);
+        if (!pipeline.bundle) {
+            perror("malloc failed");
+            exit(1);
+        }
+        pipeline.bundle_cap = hdr->payload_len;
+    }
+    pipeline.bundle_len = 0;
+    return 0;
+}
+
+// Post the files collected for each worker. A change whose entries were held
+// back in the batches is only complete once they are posted.
+static void post_batches(const SyncFrameHeader *hdr, bool *mark_pending, uint64_t mark_seq) {
+    for (int i = 0; i < pipeline.worker_count; i++) {
+        FileBatch *batch = &pipeline.batches[i];
+        if (batch->len) {
+            post_step(i, STEP_FILES, hdr, batch->data, batch->len);
+            batch->len = 0;
+        }
+    }
+    if (*mark_pending) {
+        push_mark(mark_seq);
+        *mark_pending = false;
+    }
+}
+
+static bool batch_append(FileBatch *batch, const char *entry, size_t len) {
+    if (batch->len + len > batch->cap) {
+        size_t cap = batch->cap ? batch->cap : 64 * 1024;
+        while (cap < batch->len + len) {
+            cap *= 2;
+        }
+        char *data = realloc(batch->data, cap);
+        if (!data) {
+            return false;
+        }
+        batch->data = data;
+        batch->cap = cap;
+    }
+    memcpy(batch->data + batch->len, entry, len);
+    batch->len += len;
+    return true;
+}
+
+// Hand the entries of a complete BUNDLE to the workers that own their
+// paths: each worker gets its files as one step, and a directory is posted
+// like a DIR_CREATE frame after the files before it. Entries of later
+// changes move the resume point as the first frame of a change does.
+static int route_bundle(const SyncFrameHeader *hdr) {
+    const char *entries = pipeline.bundle;
+    size_t len = pipeline.bundle_len;
+    if (hdr->flags & SYNC_FLAG_ZLIB) {
+        SyncState *state = pipeline.inline_state;
+        double start = cpu_seconds();
+        uLongf raw_len = len >= 8 ? sync_get_u64((const uint8_t *)entries) : 0;
+        if (raw_len == 0 || raw_len > SYNC_BUNDLE_MAX) {
+            fprintf(stderr, "Malformed compressed bundle\n");
+            return -1;
+        }
+        if (raw_len > pipeline.bundle_raw_cap) {
+            free(pipeline.bundle_raw);
+            pipeline.bundle_raw = malloc(raw_len);
+            if (!pipeline.bundle_raw) {
+                perror("malloc failed");
+                exit(1);
+            }
+            pipeline.bundle_raw_cap = raw_len;
+        }
+        uLongf expected = raw_len;
+        if (uncompress((Bytef *)pipeline.bundle_raw, &raw_len, (const Bytef *)entries + 8, len - 8) != Z_OK ||
+            raw_len != expected) {
+            fprintf(stderr, "Malformed compressed bundle\n");
+            return -1;
+        }
+        state->zlib_in += len;
+        state->zlib_out += raw_len;
+        state->inflate_cpu += cpu_seconds() - start;
+        entries = pipeline.bundle_raw;
+        len = raw_len;
+    }
+    if (!pipeline.batches) {
+        pipeline.batches = calloc(pipeline.worker_count, sizeof(FileBatch));
+        if (!pipeline.batches) {
+            perror("calloc failed");
+            exit(1);
+        }
+    }
+
+    bool mark_pending = false;
+    uint64_t mark_seq = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        SyncBundleEntry e;
+        size_t entry_len = sync_bundle_get_entry(entries + pos, len - pos, &e);
+        if (entry_len == 0) {
+            fprintf(stderr, "Malformed bundle entry\n");
+            return -1;
+        }
+        const char *entry = entries + pos;
+        pos += entry_len;
+
+        char path[PATH_MAX];
+        memcpy(path, e.path, e.path_len);
+        path[e.path_len] = '\0';
+        if (!sync_path_is_safe(path)) {
+            fprintf(stderr, "Ignoring unsafe path from server: %s\n", path);
+            continue;
+        }
+        if (pipeline.synced && e.seq > pipeline.group_seq) {
+            mark_pending = true;
+            mark_seq = pipeline.group_seq;
+            pipeline.group_seq = e.seq;
+        }
+        int worker = hash_path(path, e.path_len) % pipeline.worker_count;
+        if (e.type == SYNC_ENTRY_DIR) {
+            post_batches(hdr, &mark_pending, mark_seq);
+            SyncFrameHeader dir_hdr = { SYNC_OP_DIR_CREATE, 0, e.path_len, 0, e.seq };
+            post_step(worker, STEP_FRAME, &dir_hdr, path, e.path_len);
+            post_step(worker, STEP_FRAME_END, &dir_hdr, path, e.path_len);
+            note_pending_dir(worker, path);
+        } else if (e.type == SYNC_ENTRY_FILE) {
+            FileBatch *batch = &pipeline.batches[worker];
+            if (batch->len) {
+                // A file whose directory another worker has yet to create
+                // starts a new step, so that step can wait for it
+                pthread_mutex_lock(&pipeline.lock);
+                bool waits = pending_parent(worker, path, e.path_len) != NULL;
+                pthread_mutex_unlock(&pipeline.lock);
+                if (waits) {
+                    post_step(worker, STEP_FILES, hdr, batch->data, batch->len);
+                    batch->len = 0;
+                }
+            }
+            if (!batch_append(batch, entry, entry_len)) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+    }
+    post_batches(hdr, &mark_pending, mark_seq);
+    return 0;
+}
+
+static int route_frame(void *ctx, const SyncFrameHeader *hdr, const char *relative_path) {
+    (void)ctx;
+    uint8_t op = hdr->opcode;
+    if (op < SYNC_OP_MAX) {
+        sync_counter_add(&metrics.frames[op], 1);
+    }
+    if (op == SYNC_OP_CHECKPOINT) {
+        note_checkpoint(hdr);
+        pipeline.route = -1;
+        pipeline.inline_state->control_len = 0;
+        return 0;
+    }
+    if (pipeline.synced && hdr->seq > pipeline.group_seq) {
+        // The first frame of a later change: the previous one was sent whole
+        push_mark(pipeline.group_seq);
+        pipeline.group_seq = hdr->seq;
+    }
+    if (op == SYNC_OP_FILE_DATA || op == SYNC_OP_DELTA_COPY || op == SYNC_OP_DELTA_DATA) {
+        // No path: these continue the delta or compressed file in progress
+        pipeline.route = pipeline.stream_worker;
+    } else if (op == SYNC_OP_HELLO || op == SYNC_OP_BUNDLE) {
+        pipeline.route = -1;
+    } else if (hdr->path_len == 0 || op == SYNC_OP_MANIFEST_REQUEST || op == SYNC_OP_DIR_DELETE ||
+               op == SYNC_OP_RENAME) {
+        pipeline.route = -2;
+    } else {
+        pipeline.route = hash_path(relative_path, hdr->path_len) % pipeline.worker_count;
+    }
+
+    // Anything but its own frames means the server abandoned an open stream
+    bool continues = op == SYNC_OP_FILE_DATA || op == SYNC_OP_DELTA_COPY || op == SYNC_OP_DELTA_DATA ||
+                     (op == SYNC_OP_DELTA_END && pipeline.route == pipeline.stream_worker);
+    if (pipeline.stream_worker >= 0 && !continues) {
+        post_step(pipeline.stream_worker, STEP_ABORT, hdr, "", 0);
+        pipeline.stream_worker = -1;
+    }
+    if (pipeline.route == -2) {
+        drain_pipeline();
+        pipeline.route = -1;
+    }
+    if (pipeline.route >= 0 && (op == SYNC_OP_DELTA_BEGIN || (op == SYNC_OP_FILE && (hdr->flags & SYNC_FLAG_ZLIB)))) {
+        pipeline.stream_worker = pipeline.route;
+    }
+    if (op == SYNC_OP_BUNDLE) {
+        return begin_bundle(hdr);
+    }
+
+    if (pipeline.route < 0) {
+        apply_frame(pipeline.inline_state, hdr, relative_path);
+    } else {
+        post_step(pipeline.route, STEP_FRAME, hdr, relative_path, hdr->path_len);
+    }
+    return 0;
+}
+
+static int route_payload(void *ctx, const SyncFrameHeader *hdr, const char *data, size_t len) {
+    (void)ctx;
+    if (hdr->opcode == SYNC_OP_BUNDLE) {
+        memcpy(pipeline.bundle + pipeline.bundle_len, data, len);
+        pipeline.bundle_len += len;
+    } else if (pipeline.route < 0) {
+        apply_payload(pipeline.inline_state, hdr, data, len);
+    } else {
+        post_step(pipeline.route, STEP_PAYLOAD, hdr, data, len);
+    }
+    return 0;
+}
+
+static int route_frame_end(void *ctx, const SyncFrameHeader *hdr, const char *relative_path) {
+    (void)ctx;
+    if (hdr->opcode == SYNC_OP_CHECKPOINT) {
+        SyncState *state = pipeline.inline_state;
+        if (state->control_len >= SYNC_CHECKPOINT_ORIGIN_LEN) {
+            push_latency_mark(sync_get_u64(state->control), sync_get_u64(state->control + 8), state->control[16]);
+        } else if (state->control_len >= SYNC_CHECKPOINT_LEN) {
+            push_latency_mark(sync_get_u64(state->control), 0, 0);
+        }
+        return 0;
+    }
+    if (hdr->opcode == SYNC_OP_BUNDLE) {
+        return route_bundle(hdr);
+    }
+    if (pipeline.route < 0) {
+        apply_frame_end(pipeline.inline_state, hdr, relative_path);
+        return 0;
+    }
+    post_step(pipeline.route, STEP_FRAME_END, hdr, relative_path, hdr->path_len);
+    if (hdr->opcode == SYNC_OP_DIR_CREATE) {
+        note_pending_dir(pipeline.route, relative_path);
+    }
+    if (hdr->opcode == SYNC_OP_DELTA_END ||
+        (hdr->opcode == SYNC_OP_FILE_DATA && (hdr->flags & SYNC_FLAG_LAST))) {
+        pipeline.stream_worker = -1;
+    }
+    return 0;
+}
+
+static const SyncDecoderOps decoder_ops = {
+    route_frame,
+    route_payload,
+    route_frame_end,
+};
+
+void init_state(SyncState *state, int sock, const char *sync_dir) {
+    memset(state, 0, sizeof(*state));
+    state->sock = sock;
+    state->sync_dir = sync_dir;
+    state->file.fd = -1;
+    state->chunked.fd = -1;
+    state->delta.basis_fd = -1;
+    state->delta.tmp_fd = -1;
+    state->append_fd = -1;
+}
+
+// Drop whatever was still in progress when the connection ended, except what
+// was received of a FILE: that can be continued by the next connection
+void finish_state(SyncState *state) {
+    if (state->inflating) {
+        inflateEnd(&state->zs);
+        state->inflating = false;
+        if (state->inflate_failed) {
+            abort_receive_file(state);
+        }
+    }
+    if (state->file.fd >= 0) {
+        keep_partial(&state->file);
+    }
+    if (state->assembling) {
+        keep_partial(&state->chunked);
+    }
+    while (state->announced) {
+        // Still stale; the next connection asks for them again
+        Announced *next = state->announced->next;
+        free(state->announced);
+        state->announced = next;
+    }
+    state->assembling = NULL;
+    free(state->chunked.buf);
+    free(state->chunk_packed);
+    if (state->delta.active) {
+        abort_delta(state);
+    }
+    if (state->append_fd >= 0) {
+        close(state->append_fd);
+        state->append_fd = -1;
+    }
+    free(state->file.buf);
+}
+
+void sync_files(int sock, const char *sync_dir) {
+    static char buffer[BUFFER_SIZE];
+    int bytes_received;
+    SyncDecoder decoder;
+    static SyncState inline_state;
+
+    if (worker_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+    }
+    memset(&pipeline, 0, sizeof(pipeline));
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.progress, NULL);
+    pipeline.worker_count = worker_count;
+    pipeline.stream_worker = -1;
+    pipeline.inline_state = &inline_state;
+    pipeline.workers = calloc(worker_count, sizeof(Worker));
+    if (!pipeline.workers) {
+        perror("calloc failed");
+        return;
+    }
+    init_state(&inline_state, sock, sync_dir);
+    for (int i = 0; i < worker_count; i++) {
+        Worker *worker = &pipeline.workers[i];
+        init_state(&worker->state, sock, sync_dir);
+        pthread_cond_init(&worker->ready, NULL);
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    log_info("Applying changes with %d threads\n", worker_count);
+
+    // With a state file, wake up now and then to save the position even
+    // while the server is quiet
+    if (state_file) {
+        struct timeval timeout = { STATE_SAVE_INTERVAL, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    time_t last_save = time(NULL);
+
+    sync_decoder_init(&decoder);
+    for (;;) {
+        bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
+        if (bytes_received > 0) {
+            sync_counter_add(&metrics.bytes_received, bytes_received);
+        }
+        if (bytes_received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) &&
+            !stop_requested) {
+            bytes_received = 0;
+        } else if (bytes_received <= 0) {
+            break;
+        } else if (sync_decoder_feed(&decoder, buffer, bytes_received, &decoder_ops, NULL) != 0) {
+            fprintf(stderr, "Malformed frame from server, disconnecting\n");
+            break;
+        }
+        if (state_file && time(NULL) - last_save >= STATE_SAVE_INTERVAL) {
+            update_resume_point();
+            save_state();
+            last_save = time(NULL);
+        }
+    }
+
+    // Let the workers finish what was received, then collect their totals
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.stopping = true;
+    for (int i = 0; i < worker_count; i++) {
+        pthread_cond_signal(&pipeline.workers[i].ready);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+    uint64_t zlib_in = inline_state.zlib_in;
+    uint64_t zlib_out = inline_state.zlib_out;
+    double inflate_cpu = inline_state.inflate_cpu;
+    for (int i = 0; i < worker_count; i++) {
+        Worker *worker = &pipeline.workers[i];
+        pthread_join(worker->thread, NULL);
+        finish_state(&worker->state);
+        zlib_in += worker->state.zlib_in;
+        zlib_out += worker->state.zlib_out;
+        inflate_cpu += worker->state.inflate_cpu;
+    }
+    finish_state(&inline_state);
+    update_resume_point();
+    for (int i = 0; i < worker_count; i++) {
+        pthread_cond_destroy(&pipeline.workers[i].ready);
+    }
+    free(pipeline.workers);
+    if (pipeline.batches) {
+        for (int i = 0; i < worker_count; i++) {
+            free(pipeline.batches[i].data);
+        }
+        free(pipeline.batches);
+    }
+    free(pipeline.bundle);
+    free(pipeline.bundle_raw);
+    pthread_cond_destroy(&pipeline.progress);
+    pthread_mutex_destroy(&pipeline.lock);
+
+    if (zlib_in) {
+        log_info("Compression: %llu bytes received for %llu bytes of files (ratio %.2f), %.3f s CPU inflating\n",
+               (unsigned long long)zlib_in, (unsigned long long)zlib_out,
+               (double)zlib_out / zlib_in, inflate_cpu);
+    }
+    if (bytes_received == 0) {
+        log_info("Server disconnected.\n");
+    } else if (bytes_received < 0 && !stop_requested) {
+        perror("recv failed");
+    }
+}
+
+// Received data goes to ".name.sync-tmp" in the same directory, so the final
+// rename stays on one filesystem and readers only ever see whole files.
+static void temp_path_for(const char *sync_dir, const char *relative_path, char *out, size_t out_len) {
+    const char *slash = strrchr(relative_path, '/');
+    if (slash) {
+        snprintf(out, out_len, "%s/%.*s/.%s" TMP_SUFFIX, sync_dir,
+                 (int)(slash - relative_path), relative_path, slash + 1);
+    } else {
+        snprintf(out, out_len, "%s/.%s" TMP_SUFFIX, sync_dir, relative_path);
+    }
+}
+
+// Reserve the blocks up front: the file ends up contiguous and a full disk is
+// reported before any data arrives.
+static void preallocate(FileWriter *file) {
+    if (file->fd < 0 || file->size == 0) {
+        return;
+    }
+    if (fallocate(file->fd, 0, 0, file->size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("File preallocation failed");
+        file->failed = true;
+    }
+}
+
+// Make a completed temp file durable as fsync_policy asks and move it into place
+static int commit_temp_file(int fd, const char *tmp_path, const char *full_path) {
+    if (fsync_policy != FSYNC_NONE && fsync(fd) < 0) {
+        perror("fsync failed");
+        return -1;
+    }
+    if (rename(tmp_path, full_path) < 0) {
+        perror("Failed to move file into place");
+        return -1;
+    }
+    if (fsync_policy == FSYNC_DIR) {
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), "%s", full_path);
+        char *last_slash = strrchr(dir_path, '/');
+        if (last_slash) {
+            *last_slash = '\0';
+        }
+        int dir_fd = open(last_slash ? dir_path : ".", O_RDONLY | O_DIRECTORY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    return 0;
+}
+
+// With resume the temp file left by an interrupted transfer is continued:
+// file_size is what remains after it.
+static void open_file_writer(FileWriter *file, const char *sync_dir, const char *relative_path, uint64_t file_size,
+                             bool resume) {
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", sync_dir, relative_path);
+
+    // Create directories if necessary
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", full_path);
+    char *last_slash = strrchr(dir_path, '/');
+    if (last_slash) {
+        *last_slash = '\0';
+        mkdir(dir_path, 0777); // Create the directory
+    }
+
+    if (!file->buf && posix_memalign((void **)&file->buf, WRITE_BUFFER_ALIGN, WRITE_BUFFER_SIZE) != 0) {
+        file->buf = NULL;
+    }
+    file->received = 0;
+    file->offset = 0;
+    file->buf_len = 0;
+    file->resumed = resume;
+    snprintf(file->path, sizeof(file->path), "%s", relative_path);
+    temp_path_for(sync_dir, relative_path, file->tmp_path, sizeof(file->tmp_path));
+    int flags = resume ? O_WRONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    file->fd = file->buf ? open(file->tmp_path, flags, 0666) : -1;
+    file->failed = file->fd < 0;
+    if (file->failed) {
+        perror("File creation failed");
+    } else if (resume) {
+        struct stat st;
+        file->failed = fstat(file->fd, &st) < 0;
+        file->offset = file->failed ? 0 : st.st_size;
+    }
+    file->size = file->offset + file_size;
+    preallocate(file);
+}
+
+void begin_receive_file(SyncState *state, const char *relative_path, uint64_t file_size, bool resume) {
+    open_file_writer(&state->file, state->sync_dir, relative_path, file_size, resume);
+}
+
+// Write out what has been buffered
+static void flush_file_buffer(FileWriter *file) {
+    size_t done = 0;
+    while (!file->failed && done < file->buf_len) {
+        ssize_t written = pwrite(file->fd, file->buf + done, file->buf_len - done, file->offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("File write failed");
+            file->failed = true;
+            break;
+        }
+        done += written;
+        file->offset += written;
+    }
+    file->buf_len = 0;
+}
+
+static void write_file_data(FileWriter *file, const char *data, size_t len) {
+    // Keep counting even if the file could not be opened so the payload is consumed
+    file->received += len;
+    while (!file->failed && len > 0) {
+        size_t take = WRITE_BUFFER_SIZE - file->buf_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(file->buf + file->buf_len, data, take);
+        file->buf_len += take;
+        data += take;
+        len -= take;
+        if (file->buf_len == WRITE_BUFFER_SIZE) {
+            flush_file_buffer(file);
+        }
+    }
+}
+
+void receive_file_data(SyncState *state, const char *data, size_t len) {
+    write_file_data(&state->file, data, len);
+}
+
+static void discard_file_writer(FileWriter *file) {
+    if (file->fd >= 0) {
+        close(file->fd);
+        unlink(file->tmp_path);
+        file->fd = -1;
+    }
+}
+
+void abort_receive_file(SyncState *state) {
+    discard_file_writer(&state->file);
+}
+
+void end_receive_file(SyncState *state, const char *relative_path, uint64_t file_size) {
+    FileWriter *file = &state->file;
+    flush_file_buffer(file);
+    if (file->failed || file->received != file_size) {
+        abort_receive_file(state);
+        sync_counter_add(&metrics.transfers_incomplete, 1);
+        log_info("File transfer incomplete: %s\n", relative_path);
+        if (file->resumed) {
+            // Only the rest was sent; ask for the whole file
+            send_signature(state, relative_path, file->seq);
+        }
+        return;
+    }
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+    if (commit_temp_file(file->fd, file->tmp_path, full_path) < 0) {
+        abort_receive_file(state);
+        return;
+    }
+    close(file->fd);
+    file->fd = -1;
+    sync_counter_add(&metrics.files_received, 1);
+    if (file->resumed) {
+        log_debug("Resumed file: %s (%llu bytes, %llu received)\n", relative_path,
+               (unsigned long long)file->offset, (unsigned long long)file_size);
+    } else {
+        log_debug("Received file: %s (%llu bytes)\n", relative_path, (unsigned long long)file_size);
+    }
+}
+
+// Write one file of a bundle with a single write into its temp file and move
+// it into place with its time and mode already set
+static void receive_bundled_file(SyncState *state, const char *relative_path, const SyncBundleEntry *e) {
+    char full_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (state->announced) {
+        end_chunks(state, relative_path);
+    }
+    snprintf(full_path, sizeof(full_path), "%s/%.*s", state->sync_dir, (int)e->path_len, e->path);
+    temp_path_for(state->sync_dir, relative_path, tmp_path, sizeof(tmp_path));
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        // Directory entries come first, but something local may have
+        // removed the directory since
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), "%s", full_path);
+        *strrchr(dir_path, '/') = '\0';
+        mkdir(dir_path, 0777);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = e->mtime_ns / 1000000000ULL;
+    times[1].tv_nsec = e->mtime_ns % 1000000000ULL;
+    if (fd < 0 || write_all(fd, e->data, e->size) < 0 || futimens(fd, times) < 0 ||
+        fchmod(fd, e->mode & 07777) < 0 || commit_temp_file(fd, tmp_path, full_path) < 0) {
+        perror("Failed to write bundled file");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        sync_counter_add(&metrics.transfers_incomplete, 1);
+        log_info("File transfer incomplete: %s\n", relative_path);
+        return;
+    }
+    close(fd);
+    stale_done(relative_path);
+    sync_counter_add(&metrics.files_received, 1);
+    log_debug("Received file: %s (%llu bytes)\n", relative_path, (unsigned long long)e->size);
+}
+
+// The files of a bundle that this worker owns, in order
+void receive_bundled_files(SyncState *state, const char *data, size_t len) {
+    SyncBundleEntry e;
+    size_t entry_len;
+    for (size_t pos = 0; pos < len && (entry_len = sync_bundle_get_entry(data + pos, len - pos, &e)) > 0;
+         pos += entry_len) {
+        char relative_path[PATH_MAX];
+        memcpy(relative_path, e.path, e.path_len);
+        relative_path[e.path_len] = '\0';
+        receive_bundled_file(state, relative_path, &e);
+    }
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A FILE with SYNC_FLAG_ZLIB has been opened by begin_receive_file(); its
+// payload was the real size.
+void begin_inflate(SyncState *state) {
+    state->file_size = state->control_len >= 8 ? sync_get_u64(state->control) : 0;
+    state->file.size = state->file.offset + state->file_size;
+    preallocate(&state->file);
+    memset(&state->zs, 0, sizeof(state->zs));
+    state->inflate_failed = inflateInit(&state->zs) != Z_OK;
+    if (state->inflate_failed) {
+        fprintf(stderr, "inflateInit failed\n");
+    }
+    state->inflating = true;
+}
+
+void inflate_file_data(SyncState *state, const char *data, size_t len) {
+    char *out = state->scratch;
+    state->zlib_in += len;
+    if (state->inflate_failed) {
+        return;
+    }
+    state->zs.next_in = (Bytef *)data;
+    state->zs.avail_in = len;
+    do {
+        state->zs.next_out = (Bytef *)out;
+        state->zs.avail_out = sizeof(state->scratch);
+        double start = cpu_seconds();
+        int ret = inflate(&state->zs, Z_NO_FLUSH);
+        state->inflate_cpu += cpu_seconds() - start;
+        size_t produced = sizeof(state->scratch) - state->zs.avail_out;
+        if (produced) {
+            state->zlib_out += produced;
+            receive_file_data(state, out, produced);
+        }
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Corrupt compressed data for %s\n", state->file_path);
+            state->inflate_failed = true;
+            break;
+        }
+    } while (state->zs.avail_in > 0 || state->zs.avail_out == 0);
+}
+
+void end_inflate(SyncState *state, bool complete) {
+    inflateEnd(&state->zs);
+    state->inflating = false;
+    if (!complete || state->inflate_failed) {
+        abort_receive_file(state);
+        sync_counter_add(&metrics.transfers_incomplete, 1);
+        log_info("File transfer incomplete: %s\n", state->file_path);
+        if (complete && state->file.resumed) {
+            send_signature(state, state->file_path, state->file.seq);
+        }
+        return;
+    }
+    end_receive_file(state, state->file_path, state->file_size);
+}
+
+// Block size for signatures: about the square root of the file size, as in
+// rsync, so both the signature and the per-block overhead stay small.
+static uint32_t choose_block_size(off_t size) {
+    uint32_t block_size = MIN_BLOCK_SIZE;
+    while (block_size < MAX_BLOCK_SIZE && (off_t)block_size * block_size < size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+// Reply to SIG_REQUEST with the weak and strong checksum of every full block
+// of our copy. An empty signature asks the server for the whole file.
+void send_signature(SyncState *state, const char *relative_path, uint64_t seq) {
+    // Until the reply arrives our copy is older than our position says
+    stale_add(relative_path);
+
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+
+    struct stat st;
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_lock(&send_lock);
+        send_frame_header(state->sock, SYNC_OP_SIGNATURE, 0, relative_path, 0, seq);
+        pthread_mutex_unlock(&send_lock);
+        return;
+    }
+
+    // The signature is streamed as it is computed, so no other frame may be
+    // sent until it is complete
+    pthread_mutex_lock(&send_lock);
+    uint32_t block_size = choose_block_size(st.st_size);
+    uint64_t block_count = st.st_size / block_size;
+    send_frame_header(state->sock, SYNC_OP_SIGNATURE, 0, relative_path,
+                      4 + block_count * SYNC_SIG_ENTRY_LEN, seq);
+    uint8_t size_field[4];
+    sync_put_u32(size_field, block_size);
+    send_all(state->sock, size_field, sizeof(size_field));
+
+    uint8_t *block = malloc(block_size);
+    uint8_t entries[64 * SYNC_SIG_ENTRY_LEN];
+    size_t batched = 0;
+    for (uint64_t b = 0; b < block_count; b++) {
+        ssize_t got = block ? pread(fd, block, block_size, b * block_size) : -1;
+        if (got < (ssize_t)block_size) {
+            // File shrank while reading; what's left of the signature can
+            // never match, which just turns those blocks into literals.
+            if (got < 0) {
+                got = 0;
+            }
+            if (block) {
+                memset(block + got, 0, block_size - got);
+            }
+        }
+        uint8_t *entry = entries + batched * SYNC_SIG_ENTRY_LEN;
+        if (block) {
+            sync_put_u32(entry, sync_weak_sum(block, block_size));
+            sync_hash_buffer(block, block_size, entry + 4);
+        } else {
+            memset(entry, 0, SYNC_SIG_ENTRY_LEN);
+        }
+        if (++batched == 64) {
+            send_all(state->sock, entries, batched * SYNC_SIG_ENTRY_LEN);
+            batched = 0;
+        }
+    }
+    if (batched) {
+        send_all(state->sock, entries, batched * SYNC_SIG_ENTRY_LEN);
+    }
+    pthread_mutex_unlock(&send_lock);
+    free(block);
+    close(fd);
+}
+
+void begin_delta(SyncState *state, const char *relative_path) {
+    DeltaState *delta = &state->delta;
+    if (state->control_len < 12) {
+        return;
+    }
+    delta->active = true;
+    delta->failed = false;
+    delta->size = sync_get_u64(state->control);
+    delta->block_size = sync_get_u32(state->control + 8);
+    delta->written = 0;
+    sync_hash_init(&delta->hash);
+    snprintf(delta->path, sizeof(delta->path), "%s", relative_path);
+
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+    delta->basis_fd = open(full_path, O_RDONLY);
+
+    temp_path_for(state->sync_dir, relative_path, delta->tmp_path, sizeof(delta->tmp_path));
+    delta->tmp_fd = open(delta->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (delta->tmp_fd >= 0 && delta->size > 0) {
+        fallocate(delta->tmp_fd, 0, 0, delta->size);
+    }
+    if (delta->basis_fd < 0 || delta->tmp_fd < 0) {
+        perror("Failed to start delta");
+        delta->failed = true;
+    }
+}
+
+void apply_delta_data(SyncState *state, const char *data, size_t len) {
+    DeltaState *delta = &state->delta;
+    if (!delta->active || delta->failed) {
+        return;
+    }
+    if (write_all(delta->tmp_fd, data, len) < 0) {
+        perror("Delta write failed");
+        delta->failed = true;
+        return;
+    }
+    sync_hash_update(&delta->hash, data, len);
+    delta->written += len;
+}
+
+void apply_delta_copy(SyncState *state) {
+    char *buffer = state->scratch;
+    DeltaState *delta = &state->delta;
+    if (!delta->active || delta->failed || state->control_len < 12) {
+        return;
+    }
+    off_t offset = (off_t)sync_get_u64(state->control) * delta->block_size;
+    uint64_t left = (uint64_t)sync_get_u32(state->control + 8) * delta->block_size;
+    while (left > 0) {
+        size_t want = left < sizeof(state->scratch) ? left : sizeof(state->scratch);
+        ssize_t got = pread(delta->basis_fd, buffer, want, offset);
+        if (got <= 0) {
+            delta->failed = true;
+            return;
+        }
+        apply_delta_data(state, buffer, got);
+        if (delta->failed) {
+            return;
+        }
+        offset += got;
+        left -= got;
+    }
+}
+
+void abort_delta(SyncState *state) {
+    DeltaState *delta = &state->delta;
+    if (delta->basis_fd >= 0) {
+        close(delta->basis_fd);
+    }
+    if (delta->tmp_fd >= 0) {
+        close(delta->tmp_fd);
+        unlink(delta->tmp_path);
+    }
+    delta->basis_fd = -1;
+    delta->tmp_fd = -1;
+    delta->active = false;
+}
+
+void end_delta(SyncState *state, const char *relative_path, uint64_t seq) {
+    DeltaState *delta = &state->delta;
+    if (!delta->active || strcmp(delta->path, relative_path) != 0) {
+        return;
+    }
+
+    uint8_t hash[SYNC_HASH_LEN];
+    sync_hash_final(&delta->hash, hash);
+    bool verified = !delta->failed && delta->written == delta->size &&
+                    state->control_len == SYNC_HASH_LEN && memcmp(hash, state->control, SYNC_HASH_LEN) == 0;
+
+    if (verified) {
+        struct stat st;
+        if (fstat(delta->basis_fd, &st) == 0) {
+            fchmod(delta->tmp_fd, st.st_mode & 07777);
+        }
+        char full_path[PATH_MAX];
+        snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+        if (commit_temp_file(delta->tmp_fd, delta->tmp_path, full_path) == 0) {
+            close(delta->tmp_fd);
+            delta->tmp_fd = -1;
+            sync_counter_add(&metrics.deltas_applied, 1);
+            log_debug("Updated file: %s (%llu bytes)\n", relative_path, (unsigned long long)delta->size);
+        } else {
+            verified = false;
+        }
+    }
+    abort_delta(state);
+
+    if (!verified) {
+        // Ask for the whole file instead
+        sync_counter_add(&metrics.deltas_failed, 1);
+        log_info("Delta for %s failed verification, requesting full copy\n", relative_path);
+        stale_add(relative_path);
+        pthread_mutex_lock(&send_lock);
+        send_frame_header(state->sock, SYNC_OP_SIGNATURE, 0, relative_path, 0, seq);
+        pthread_mutex_unlock(&send_lock);
+    }
+}
+
+// An APPEND: bytes added to a followed file on the server, written in place
+// at the offset that starts the payload. Other programs see the file grow
+// as it does on the server.
+void begin_append(SyncState *state, const char *relative_path) {
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+    state->append_fd = open(full_path, O_WRONLY | O_CLOEXEC);
+    state->append_failed = state->append_fd < 0;
+    state->append_at = 0;
+}
+
+void append_data(SyncState *state, const char *data, size_t len) {
+    if (state->control_len < SYNC_APPEND_HEADER_LEN) {
+        size_t take = SYNC_APPEND_HEADER_LEN - state->control_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(state->control + state->control_len, data, take);
+        state->control_len += take;
+        data += take;
+        len -= take;
+        if (state->control_len < SYNC_APPEND_HEADER_LEN) {
+            return;
+        }
+        // We may have some of the bytes already, but none may be missing before them
+        struct stat st;
+        state->append_at = sync_get_u64(state->control);
+        if (!state->append_failed && (fstat(state->append_fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+                                      (uint64_t)st.st_size < state->append_at)) {
+            state->append_failed = true;
+        }
+    }
+    while (!state->append_failed && len > 0) {
+        ssize_t written = pwrite(state->append_fd, data, len, state->append_at);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Append failed");
+            state->append_failed = true;
+            break;
+        }
+        data += written;
+        len -= written;
+        state->append_at += written;
+    }
+}
+
+void end_append(SyncState *state, const char *relative_path, uint64_t seq) {
+    if (state->append_fd >= 0) {
+        close(state->append_fd);
+        state->append_fd = -1;
+    }
+    if (state->append_failed || state->control_len < SYNC_APPEND_HEADER_LEN) {
+        // A delta against what we have brings the rest
+        log_debug("Cannot append to %s, asking for a delta\n", relative_path);
+        send_signature(state, relative_path, seq);
+        return;
+    }
+    sync_counter_add(&metrics.appends_applied, 1);
+    log_debug("Appended to %s up to byte %llu\n", relative_path, (unsigned long long)state->append_at);
+}
+
+// Chunked transfers. The empty CHUNK that announces a file is applied in
+// order with the rest of its change and leaves the path stale until its ATTR;
+// the chunks come later, between other frames, and are written to the temp
+// file in order, each checked against its hash before the next is taken.
+
+static Announced **find_announced(SyncState *state, const char *relative_path) {
+    Announced **link = &state->announced;
+    while (*link && strcmp((*link)->path, relative_path) != 0) {
+        link = &(*link)->next;
+    }
+    return *link ? link : NULL;
+}
+
+// Unless keep_stale, the ATTR that would have ended the path's stale count
+// will not come
+static void drop_announced(SyncState *state, Announced **link, bool keep_stale) {
+    Announced *a = *link;
+    if (a == state->assembling) {
+        discard_file_writer(&state->chunked);
+        state->assembling = NULL;
+    }
+    if (!keep_stale) {
+        stale_done(a->path);
+    }
+    *link = a->next;
+    free(a);
+}
+
+// The server stopped sending the chunks of relative_path and of everything
+// under it: drop what was assembled
+void end_chunks(SyncState *state, const char *relative_path) {
+    size_t len = relative_path ? strlen(relative_path) : 0;
+    Announced **link = &state->announced;
+    while (*link) {
+        if (!relative_path || path_within((*link)->path, relative_path, len)) {
+            log_debug("Chunked transfer of %s stopped\n", (*link)->path);
+            drop_announced(state, link, false);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+}
+
+// The same on every worker, for frames applied on the receive thread once
+// the workers are idle; NULL ends them all
+void end_all_chunks(const char *relative_path) {
+    for (int i = 0; i < pipeline.worker_count; i++) {
+        if (pipeline.workers[i].state.announced) {
+            end_chunks(&pipeline.workers[i].state, relative_path);
+        }
+    }
+}
+
+static void announce_chunks(SyncState *state, const char *relative_path) {
+    // A file announced again was given up on, with word to that effect
+    end_chunks(state, relative_path);
+    size_t len = strlen(relative_path);
+    Announced *a = malloc(sizeof(Announced) + len + 1);
+    if (!a) {
+        perror("Memory allocation failed");
+        return;
+    }
+    a->size = sync_get_u64(state->control);
+    a->start = sync_get_u64(state->control + 8);
+    memcpy(a->path, relative_path, len + 1);
+    a->next = state->announced;
+    state->announced = a;
+    stale_add(relative_path);
+    if (a->start > 0) {
+        claim_partial(relative_path);
+    }
+}
+
+// The chunk's header is in: check it continues the file it belongs to
+static void begin_chunk(SyncState *state, const SyncFrameHeader *hdr) {
+    uint64_t size = sync_get_u64(state->control);
+    uint64_t offset = sync_get_u64(state->control + 8);
+    uint32_t length = sync_get_u32(state->control + 16);
+    Announced **link = find_announced(state, state->chunk_path);
+    if (length == 0 || !link) {
+        return;
+    }
+    Announced *a = *link;
+    FileWriter *file = &state->chunked;
+    if (state->assembling != a) {
+        if (state->assembling) {
+            // Chunks come one file at a time; that one will not be finished
+            drop_announced(state, find_announced(state, state->assembling->path), false);
+        }
+        open_file_writer(file, state->sync_dir, a->path, a->size - a->start, a->start > 0);
+        if ((uint64_t)file->offset != a->start) {
+            file->failed = true;
+        }
+        state->assembling = a;
+    }
+    uint64_t sent_len = hdr->payload_len - SYNC_CHUNK_HEADER_LEN;
+    if (size != a->size || offset != a->start + file->received || length > SYNC_CHUNK_MAX ||
+        (hdr->flags & SYNC_FLAG_ZLIB ? sent_len > compressBound(length) : sent_len != length)) {
+        file->failed = true;
+    }
+    if (hdr->flags & SYNC_FLAG_ZLIB) {
+        if (state->chunk_packed_cap < sent_len) {
+            char *grown = realloc(state->chunk_packed, sent_len);
+            if (!grown) {
+                file->failed = true;
+                return;
+            }
+            state->chunk_packed = grown;
+            state->chunk_packed_cap = sent_len;
+        }
+        state->chunk_packed_len = 0;
+    }
+    sync_hash_init(&state->chunk_hash);
+    state->chunk_writing = !file->failed;
+}
+
+void chunk_data(SyncState *state, const SyncFrameHeader *hdr, const char *data, size_t len) {
+    if (state->control_len < SYNC_CHUNK_HEADER_LEN) {
+        size_t take = SYNC_CHUNK_HEADER_LEN - state->control_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(state->control + state->control_len, data, take);
+        state->control_len += take;
+        data += take;
+        len -= take;
+        if (state->control_len < SYNC_CHUNK_HEADER_LEN) {
+            return;
+        }
+        begin_chunk(state, hdr);
+    }
+    if (!state->chunk_writing || len == 0) {
+        return;
+    }
+    if (hdr->flags & SYNC_FLAG_ZLIB) {
+        memcpy(state->chunk_packed + state->chunk_packed_len, data, len);
+        state->chunk_packed_len += len;
+    } else {
+        sync_hash_update(&state->chunk_hash, data, len);
+        write_file_data(&state->chunked, data, len);
+    }
+}
+
+// Verify the chunk, and after the last one move the file into place, or ask
+// for it again as a delta against what we have
+void end_chunk(SyncState *state, const SyncFrameHeader *hdr, const char *relative_path) {
+    if (state->control_len < SYNC_CHUNK_HEADER_LEN) {
+        return;
+    }
+    uint32_t length = sync_get_u32(state->control + 16);
+    if (length == 0) {
+        announce_chunks(state, relative_path);
+        return;
+    }
+    Announced **link = find_announced(state, relative_path);
+    if (!link || *link != state->assembling) {
+        return;
+    }
+    FileWriter *file = &state->chunked;
+    if (state->chunk_writing && (hdr->flags & SYNC_FLAG_ZLIB)) {
+        // Inflated in one go: a chunk is at most SYNC_CHUNK_MAX bytes
+        char *out = malloc(length);
+        uLongf out_len = length;
+        if (!out || uncompress((Bytef *)out, &out_len, (const Bytef *)state->chunk_packed,
+                               state->chunk_packed_len) != Z_OK || out_len != length) {
+            file->failed = true;
+        } else {
+            sync_hash_update(&state->chunk_hash, out, length);
+            write_file_data(file, out, length);
+        }
+        free(out);
+    }
+    if (state->chunk_writing) {
+        uint8_t hash[SYNC_HASH_LEN];
+        sync_hash_final(&state->chunk_hash, hash);
+        sync_counter_add(&metrics.chunks_received, 1);
+        if (memcmp(hash, state->control + 20, SYNC_HASH_LEN) != 0) {
+            log_info("Chunk of %s at byte %llu does not match its hash\n", relative_path,
+                     (unsigned long long)sync_get_u64(state->control + 8));
+            sync_counter_add(&metrics.chunks_failed, 1);
+            file->failed = true;
+        }
+        state->chunk_writing = false;
+    }
+    if (!(hdr->flags & SYNC_FLAG_LAST)) {
+        return;
+    }
+
+    uint64_t start = (*link)->start;
+    state->assembling = NULL;
+    drop_announced(state, link, true);
+    flush_file_buffer(file);
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", state->sync_dir, relative_path);
+    if (file->failed || (uint64_t)file->offset != file->size ||
+        commit_temp_file(file->fd, file->tmp_path, full_path) < 0) {
+        discard_file_writer(file);
+        sync_counter_add(&metrics.transfers_incomplete, 1);
+        log_info("File transfer incomplete: %s\n", relative_path);
+        send_signature(state, relative_path, hdr->seq);
+        return;
+    }
+    close(file->fd);
+    file->fd = -1;
+    sync_counter_add(&metrics.files_received, 1);
+    log_debug("Received file in chunks: %s (%llu bytes from byte %llu)\n", relative_path,
+              (unsigned long long)file->size, (unsigned long long)start);
+}
+
+void apply_attr(SyncState *state, const char *full_path) {
+    if (state->control_len < 12) {
+        return;
+    }
+    uint64_t mtime_ns = sync_get_u64(state->control);
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime_ns / 1000000000ULL;
+    times[1].tv_nsec = mtime_ns % 1000000000ULL;
+    if (utimensat(AT_FDCWD, full_path, times, AT_SYMLINK_NOFOLLOW) < 0) {
+        perror("Failed to set file time");
+    }
+    chmod(full_path, sync_get_u32(state->control + 8) & 07777);
+}
+
+void apply_rename(SyncState *state, const char *relative_path) {
+    state->rename_to[state->rename_len] = '\0';
+    if (!sync_path_is_safe(state->rename_to)) {
+        fprintf(stderr, "Ignoring unsafe rename target from server: %s\n", state->rename_to);
+        return;
+    }
+    char old_full_path[PATH_MAX];
+    char new_full_path[PATH_MAX];
+    int old_len = snprintf(old_full_path, sizeof(old_full_path), "%s/%s", state->sync_dir, relative_path);
+    int new_len = snprintf(new_full_path, sizeof(new_full_path), "%s/%s", state->sync_dir, state->rename_to);
+    if (old_len < 0 || (size_t)old_len >= sizeof(old_full_path) || new_len < 0 ||
+        (size_t)new_len >= sizeof(new_full_path)) {
+        fprintf(stderr, "Ignoring rename with a path too long: %s -> %s\n", relative_path, state->rename_to);
+        return;
+    }
+    if (rename(old_full_path, new_full_path) == 0) {
+        stale_move(relative_path, state->rename_to);
+        log_debug("Moved: %s -> %s\n", old_full_path, new_full_path);
+    } else {
+        perror("Failed to move file");
+    }
+}
+
+// Delete a file or a directory with everything below it
+int remove_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return unlink(path);
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        remove_tree(child);
+    }
+    closedir(dir);
+    return rmdir(path);
+}
+
+// Manifest frames are small and numerous, so they are batched before sending
+static char manifest_buffer[BUFFER_SIZE];
+static size_t manifest_buffered = 0;
+
+static void manifest_flush(int sock) {
+    if (manifest_buffered) {
+        send_all(sock, manifest_buffer, manifest_buffered);
+        manifest_buffered = 0;
+    }
+}
+
+static void manifest_append(int sock, uint8_t opcode, const char *path, const void *payload, size_t payload_len) {
+    size_t path_len = path ? strlen(path) : 0;
+    size_t frame_len = SYNC_HEADER_LEN + path_len + payload_len;
+    if (manifest_buffered + frame_len > sizeof(manifest_buffer)) {
+        manifest_flush(sock);
+    }
+    SyncFrameHeader hdr = { opcode, 0, (uint16_t)path_len, payload_len, 0 };
+    sync_encode_header((uint8_t *)manifest_buffer + manifest_buffered, &hdr);
+    if (path_len) {
+        memcpy(manifest_buffer + manifest_buffered + SYNC_HEADER_LEN, path, path_len);
+    }
+    if (payload_len) {
+        memcpy(manifest_buffer + manifest_buffered + SYNC_HEADER_LEN + path_len, payload, payload_len);
+    }
+    manifest_buffered += frame_len;
+}
+
+// Files are hashed by the walker's threads at once, so the buffer is theirs
+static void hash_file_at(int dir_fd, const char *name, uint8_t out[SYNC_HASH_LEN]) {
+    char buffer[BUFFER_SIZE];
+    SyncHash h;
+    sync_hash_init(&h);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+            sync_hash_update(&h, buffer, got);
+        }
+        close(fd);
+    }
+    sync_hash_final(&h, out);
+}
+
+static void hash_local_file(const char *full_path, uint8_t out[SYNC_HASH_LEN]) {
+    hash_file_at(AT_FDCWD, full_path, out);
+}
+
+// Walks the mirror for the manifest, started with the first one
+static SyncWalker *manifest_walker = NULL;
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void manifest_visit(void *ctx, SyncWalkDir *dir) {
+    int sock = *(int *)ctx;
+    size_t suffix_len = strlen(TMP_SUFFIX);
+    for (size_t i = 0; i < dir->count; i++) {
+        SyncWalkEntry *entry = &dir->entries[i];
+        entry->descend = false;
+        // Leftovers of an interrupted transfer are ours, not part of the
+        // mirror; those offered to the server as PARTIAL are kept for now
+        if (entry->name_len > suffix_len && strcmp(entry->name + entry->name_len - suffix_len, TMP_SUFFIX) == 0) {
+            char target[PATH_MAX];
+            snprintf(target, sizeof(target), "%s%s%.*s", dir->path, dir->path[0] ? "/" : "",
+                     (int)(entry->name_len - suffix_len - 1), entry->name + 1);
+            if (entry->name[0] != '.' || !is_partial(target)) {
+                unlinkat(dir->fd, entry->name, 0);
+            }
+            continue;
+        }
+
+        uint8_t payload[SYNC_MANIFEST_ENTRY_LEN + SYNC_HASH_LEN];
+        size_t payload_len = SYNC_MANIFEST_ENTRY_LEN;
+        if (S_ISDIR(entry->st.st_mode)) {
+            payload[0] = SYNC_ENTRY_DIR;
+        } else if (S_ISREG(entry->st.st_mode)) {
+            payload[0] = SYNC_ENTRY_FILE;
+        } else {
+            continue;
+        }
+        char relative_path[PATH_MAX];
+        snprintf(relative_path, sizeof(relative_path), "%s%s%s", dir->path, dir->path[0] ? "/" : "", entry->name);
+        const struct stat *st = &entry->st;
+        sync_put_u64(payload + 1, S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0);
+        sync_put_u64(payload + 9, (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+        if (S_ISREG(st->st_mode) && manifest_hashes) {
+            hash_file_at(dir->fd, entry->name, payload + SYNC_MANIFEST_ENTRY_LEN);
+            payload_len += SYNC_HASH_LEN;
+        }
+        pthread_mutex_lock(&manifest_lock);
+        manifest_append(sock, SYNC_OP_MANIFEST_ENTRY, relative_path, payload, payload_len);
+        pthread_mutex_unlock(&manifest_lock);
+        entry->descend = S_ISDIR(st->st_mode);
+    }
+}
+
+static const SyncWalkOps manifest_walk_ops = { NULL, manifest_visit, SYNC_WALK_STAT };
+
+// Describe the local mirror to the server: one MANIFEST_ENTRY per file and
+// directory, then MANIFEST_END.
+void send_manifest(int sock, const char *sync_dir) {
+    if (!manifest_walker) {
+        manifest_walker = sync_walker_create(worker_count ? worker_count : sync_walk_default_threads());
+        if (!manifest_walker) {
+            perror("Cannot start tree walker");
+            exit(1);
+        }
+    }
+    pthread_mutex_lock(&send_lock);
+    if (!sync_walk_path(manifest_walker, sync_dir, &manifest_walk_ops, &sock, NULL)) {
+        perror("opendir failed");
+    }
+    manifest_append(sock, SYNC_OP_MANIFEST_END, NULL, NULL, 0);
+    manifest_flush(sock);
+    pthread_mutex_unlock(&send_lock);
+    log_info("Sent manifest of %s\n", sync_dir);
+}
+
+// Copies whose SIGNATURE was sent but whose reply has not been applied yet:
+// our position in the journal says they are current when they may not be.
+// The count is SIGNATUREs sent minus ATTRs received for the path.
+typedef struct StalePath {
+    struct StalePath *next;
+    int pending;
+    char path[];
+} StalePath;
+
+static StalePath *stale_paths[STALE_BUCKETS];
+static size_t stale_count = 0;
+// Sent as STALE; kept until the replay they were sent with has been applied
+static StalePath *stale_reported = NULL;
+static pthread_mutex_t stale_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Partial copies left in temp files by interrupted FILE transfers
+static char **partials = NULL;
+static size_t partial_count = 0;
+
+static bool path_within(const char *path, const char *dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+static void free_stale_list(StalePath *entry) {
+    while (entry) {
+        StalePath *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+static void stale_adjust(const char *relative_path, int delta) {
+    StalePath **link = &stale_paths[hash_path(relative_path, strlen(relative_path)) % STALE_BUCKETS];
+    pthread_mutex_lock(&stale_lock);
+    while (*link && strcmp((*link)->path, relative_path) != 0) {
+        link = &(*link)->next;
+    }
+    if (!*link && delta > 0) {
+        size_t len = strlen(relative_path);
+        StalePath *entry = malloc(sizeof(StalePath) + len + 1);
+        if (entry) {
+            entry->next = NULL;
+            entry->pending = 0;
+            memcpy(entry->path, relative_path, len + 1);
+            *link = entry;
+            stale_count++;
+        }
+    }
+    if (*link) {
+        (*link)->pending += delta;
+        if ((*link)->pending <= 0) {
+            StalePath *entry = *link;
+            *link = entry->next;
+            free(entry);
+            stale_count--;
+        }
+    }
+    pthread_mutex_unlock(&stale_lock);
+}
+
+void stale_add(const char *relative_path) {
+    stale_adjust(relative_path, 1);
+}
+
+void stale_done(const char *relative_path) {
+    stale_adjust(relative_path, -1);
+}
+
+// The path (or everything below it) was deleted, so there is nothing to update
+void stale_forget(const char *relative_path, bool subtree) {
+    size_t len = strlen(relative_path);
+    pthread_mutex_lock(&stale_lock);
+    for (size_t b = 0; b < STALE_BUCKETS && stale_count > 0; b++) {
+        if (!subtree) {
+            b = hash_path(relative_path, len) % STALE_BUCKETS;
+        }
+        StalePath **link = &stale_paths[b];
+        while (*link) {
+            StalePath *entry = *link;
+            if (subtree ? path_within(entry->path, relative_path, len) : strcmp(entry->path, relative_path) == 0) {
+                *link = entry->next;
+                free(entry);
+                stale_count--;
+            } else {
+                link = &entry->next;
+            }
+        }
+        if (!subtree) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stale_lock);
+}
+
+// Follow a file or directory rename
+void stale_move(const char *from, const char *to) {
+    size_t from_len = strlen(from);
+    StalePath *moved = NULL;
+    pthread_mutex_lock(&stale_lock);
+    for (size_t b = 0; b < STALE_BUCKETS && stale_count > 0; b++) {
+        StalePath **link = &stale_paths[b];
+        while (*link) {
+            StalePath *entry = *link;
+            if (path_within(entry->path, from, from_len)) {
+                *link = entry->next;
+                entry->next = moved;
+                moved = entry;
+                stale_count--;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&stale_lock);
+    while (moved) {
+        StalePath *entry = moved;
+        moved = entry->next;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", to, entry->path + from_len);
+        stale_adjust(path, entry->pending);
+        free(entry);
+    }
+}
+
+// A manifest diff brings every copy up to date
+void stale_clear(void) {
+    pthread_mutex_lock(&stale_lock);
+    for (size_t b = 0; b < STALE_BUCKETS; b++) {
+        free_stale_list(stale_paths[b]);
+        stale_paths[b] = NULL;
+    }
+    stale_count = 0;
+    free_stale_list(stale_reported);
+    stale_reported = NULL;
+    pthread_mutex_unlock(&stale_lock);
+}
+
+bool is_partial(const char *relative_path) {
+    for (size_t i = 0; i < partial_count; i++) {
+        if (strcmp(partials[i], relative_path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A partial copy being continued by chunks that may arrive after the replay
+// has completed; applied while the receive thread waits for the workers
+void claim_partial(const char *relative_path) {
+    for (size_t i = 0; i < partial_count; i++) {
+        if (strcmp(partials[i], relative_path) == 0) {
+            free(partials[i]);
+            partials[i] = partials[--partial_count];
+            return;
+        }
+    }
+}
+
+static void add_partial(const char *relative_path) {
+    if (is_partial(relative_path)) {
+        return;
+    }
+    char **grown = realloc(partials, (partial_count + 1) * sizeof(char *));
+    char *copy = grown ? strdup(relative_path) : NULL;
+    if (grown) {
+        partials = grown;
+    }
+    if (copy) {
+        partials[partial_count++] = copy;
+    }
+}
+
+// The connection dropped in the middle of a FILE: keep what was received so
+// the next connection only needs the rest. Called once the workers are done.
+void keep_partial(FileWriter *file) {
+    flush_file_buffer(file);
+    // The preallocated tail is not part of the copy
+    if ((!reconnect && !state_file) || file->failed || file->offset == 0 ||
+        ftruncate(file->fd, file->offset) < 0) {
+        discard_file_writer(file);
+        return;
+    }
+    close(file->fd);
+    file->fd = -1;
+    add_partial(file->path);
+    log_info("Keeping %llu bytes of %s to resume\n", (unsigned long long)file->offset, file->path);
+}
+
+// Offer the partial copies with a hash of each, so the server can check they
+// still match the start of its file
+void send_partials(int sock, const char *sync_dir) {
+    size_t kept = 0;
+    for (size_t i = 0; i < partial_count; i++) {
+        char tmp_path[PATH_MAX];
+        temp_path_for(sync_dir, partials[i], tmp_path, sizeof(tmp_path));
+        struct stat st;
+        if (lstat(tmp_path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            free(partials[i]);
+            continue;
+        }
+        uint8_t payload[SYNC_PARTIAL_LEN];
+        sync_put_u64(payload, (uint64_t)st.st_size);
+        hash_local_file(tmp_path, payload + 8);
+        pthread_mutex_lock(&send_lock);
+        send_frame_header(sock, SYNC_OP_PARTIAL, 0, partials[i], sizeof(payload), 0);
+        send_all(sock, payload, sizeof(payload));
+        pthread_mutex_unlock(&send_lock);
+        partials[kept++] = partials[i];
+    }
+    partial_count = kept;
+    if (partial_count) {
+        log_info("Offered %zu partial files to the server\n", partial_count);
+    }
+}
+
+// Ask the server to continue after the last change we applied, listing the
+// copies that may be older than that
+void send_resume(int sock) {
+    pthread_mutex_lock(&stale_lock);
+    for (size_t b = 0; b < STALE_BUCKETS; b++) {
+        while (stale_paths[b]) {
+            StalePath *entry = stale_paths[b];
+            stale_paths[b] = entry->next;
+            entry->next = stale_reported;
+            stale_reported = entry;
+        }
+    }
+    stale_count = 0;
+    size_t reported = 0;
+    pthread_mutex_lock(&send_lock);
+    for (StalePath *entry = stale_reported; entry; entry = entry->next) {
+        send_frame_header(sock, SYNC_OP_STALE, 0, entry->path, 0, 0);
+        reported++;
+    }
+    uint8_t payload[SYNC_RESUME_LEN];
+    sync_put_u64(payload, resume_point.journal_id);
+    sync_put_u64(payload + 8, resume_point.seq);
+    send_frame_header(sock, SYNC_OP_RESUME, 0, NULL, sizeof(payload), 0);
+    send_all(sock, payload, sizeof(payload));
+    pthread_mutex_unlock(&send_lock);
+    pthread_mutex_unlock(&stale_lock);
+    log_info("Resuming after change %llu (%zu files possibly out of date)\n",
+           (unsigned long long)resume_point.seq, reported);
+}
+
+// The manifest diff or replay has been applied: the server has dealt with the
+// stale paths, and partial copies it did not continue are of no further use
+void sync_completed(const char *sync_dir) {
+    pthread_mutex_lock(&stale_lock);
+    free_stale_list(stale_reported);
+    stale_reported = NULL;
+    pthread_mutex_unlock(&stale_lock);
+    for (size_t i = 0; i < partial_count; i++) {
+        char tmp_path[PATH_MAX];
+        temp_path_for(sync_dir, partials[i], tmp_path, sizeof(tmp_path));
+        unlink(tmp_path);
+        free(partials[i]);
+    }
+    partial_count = 0;
+}
+
+// State file layout: a version line, the resume point, then the stale paths
+// and partial copies, each path on its own line after its length:
+//
+//   sync-client-state 1
+//   resume <journal id> <seq> <valid> <ignore list hash>
+//   stale <pending> <length>
+//   <path>
+//   partial <length>
+//   <path>
+static void save_stale_list(FILE *file, const StalePath *entry) {
+    for (; entry; entry = entry->next) {
+        fprintf(file, "stale %d %zu\n%s\n", entry->pending, strlen(entry->path), entry->path);
+    }
+}
+
+// Written to a temp file and renamed over the old one, so a crash leaves
+// either state intact
+void save_state(void) {
+    if (!state_file) {
+        return;
+    }
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_file);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        perror("Failed to write state file");
+        return;
+    }
+    fprintf(file, "sync-client-state 1\nresume %llu %llu %d %llu\n",
+            (unsigned long long)resume_point.journal_id, (unsigned long long)resume_point.seq,
+            resume_point.valid, (unsigned long long)resume_point.ignore_hash);
+    pthread_mutex_lock(&stale_lock);
+    for (size_t b = 0; b < STALE_BUCKETS; b++) {
+        save_stale_list(file, stale_paths[b]);
+    }
+    save_stale_list(file, stale_reported);
+    pthread_mutex_unlock(&stale_lock);
+    for (size_t i = 0; i < partial_count; i++) {
+        fprintf(file, "partial %zu\n%s\n", strlen(partials[i]), partials[i]);
+    }
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, state_file) < 0) {
+        perror("Failed to write state file");
+        unlink(tmp_path);
+    }
+}
+
+void load_state(void) {
+    if (!state_file) {
+        return;
+    }
+    FILE *file = fopen(state_file, "r");
+    if (!file) {
+        if (errno != ENOENT) {
+            perror("Failed to read state file");
+        }
+        return;
+    }
+    int version;
+    int valid;
+    unsigned long long journal_id, seq, ignore_hash;
+    if (fscanf(file, "sync-client-state %d resume %llu %llu %d %llu",
+               &version, &journal_id, &seq, &valid, &ignore_hash) != 5 || version != 1) {
+        fprintf(stderr, "Ignoring unreadable state file %s\n", state_file);
+        fclose(file);
+        return;
+    }
+    resume_point.journal_id = journal_id;
+    resume_point.seq = seq;
+    resume_point.valid = valid;
+    resume_point.ignore_hash = ignore_hash;
+
+    char kind[16];
+    char path[PATH_MAX];
+    while (fscanf(file, " %15s", kind) == 1) {
+        int pending = 0;
+        size_t len;
+        if (strcmp(kind, "stale") == 0 && fscanf(file, "%d", &pending) != 1) {
+            break;
+        }
+        if (fscanf(file, "%zu", &len) != 1 || len >= sizeof(path) || fgetc(file) != '\n' ||
+            fread(path, 1, len, file) != len) {
+            break;
+        }
+        path[len] = '\0';
+        if (!sync_path_is_safe(path)) {
+            continue;
+        }
+        if (strcmp(kind, "stale") == 0) {
+            stale_adjust(path, pending);
+        } else if (strcmp(kind, "partial") == 0) {
+            add_partial(path);
+        }
+    }
+    fclose(file);
+    if (resume_point.valid) {
+        log_info("Loaded state: resuming after change %llu\n", seq);
+    }
+}
+
+static const char *const op_names[SYNC_OP_MAX] = {
+    [SYNC_OP_HELLO] = "hello",
+    [SYNC_OP_FILE] = "file",
+    [SYNC_OP_DELETE] = "delete",
+    [SYNC_OP_DIR_CREATE] = "dir_create",
+    [SYNC_OP_DIR_DELETE] = "dir_delete",
+    [SYNC_OP_RENAME] = "rename",
+    [SYNC_OP_SIG_REQUEST] = "sig_request",
+    [SYNC_OP_DELTA_BEGIN] = "delta_begin",
+    [SYNC_OP_DELTA_COPY] = "delta_copy",
+    [SYNC_OP_DELTA_DATA] = "delta_data",
+    [SYNC_OP_DELTA_END] = "delta_end",
+    [SYNC_OP_ATTR] = "attr",
+    [SYNC_OP_MANIFEST_REQUEST] = "manifest_request",
+    [SYNC_OP_FILE_DATA] = "file_data",
+    [SYNC_OP_CHECKPOINT] = "checkpoint",
+    [SYNC_OP_BUNDLE] = "bundle",
+    [SYNC_OP_APPEND] = "append",
+    [SYNC_OP_CHUNK] = "chunk",
+};
+
+static void write_stats(FILE *out) {
+    sync_metric_help(out, "sync_connected", "gauge", "Whether a connection to the server is up.");
+    sync_metric_value(out, "sync_connected", NULL, active_sock >= 0);
+    sync_metric_help(out, "sync_connections_total", "counter", "Connections made to the server.");
+    sync_metric_value(out, "sync_connections_total", NULL, sync_counter_get(&metrics.connections));
+    sync_metric_help(out, "sync_bytes_received_total", "counter", "Bytes read from the server.");
+    sync_metric_value(out, "sync_bytes_received_total", NULL, sync_counter_get(&metrics.bytes_received));
+    sync_metric_help(out, "sync_frames_received_total", "counter", "Frames received, by opcode.");
+    for (int op = 0; op < SYNC_OP_MAX; op++) {
+        if (op_names[op]) {
+            char labels[64];
+            snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[op]);
+            sync_metric_value(out, "sync_frames_received_total", labels, sync_counter_get(&metrics.frames[op]));
+        }
+    }
+    sync_metric_help(out, "sync_files_received_total", "counter", "Files received whole and renamed into place.");
+    sync_metric_value(out, "sync_files_received_total", NULL, sync_counter_get(&metrics.files_received));
+    sync_metric_help(out, "sync_transfers_incomplete_total", "counter", "Files whose transfer failed.");
+    sync_metric_value(out, "sync_transfers_incomplete_total", NULL, sync_counter_get(&metrics.transfers_incomplete));
+    sync_metric_help(out, "sync_deltas_applied_total", "counter", "Files updated from a delta.");
+    sync_metric_value(out, "sync_deltas_applied_total", NULL, sync_counter_get(&metrics.deltas_applied));
+    sync_metric_help(out, "sync_deltas_failed_total", "counter", "Deltas that failed verification.");
+    sync_metric_value(out, "sync_deltas_failed_total", NULL, sync_counter_get(&metrics.deltas_failed));
+    sync_metric_help(out, "sync_appends_applied_total", "counter", "Appends to followed files written in place.");
+    sync_metric_value(out, "sync_appends_applied_total", NULL, sync_counter_get(&metrics.appends_applied));
+    sync_metric_help(out, "sync_chunks_received_total", "counter", "CHUNK frames of large files received.");
+    sync_metric_value(out, "sync_chunks_received_total", NULL, sync_counter_get(&metrics.chunks_received));
+    sync_metric_help(out, "sync_chunks_failed_total", "counter", "Chunks that did not match their hash.");
+    sync_metric_value(out, "sync_chunks_failed_total", NULL, sync_counter_get(&metrics.chunks_failed));
+    sync_metric_help(out, "sync_apply_queue_steps", "gauge", "Received operations waiting for a worker.");
+    sync_metric_value(out, "sync_apply_queue_steps", NULL, sync_counter_get(&metrics.queued_steps));
+    sync_metric_help(out, "sync_apply_queue_bytes", "gauge", "Payload bytes waiting for a worker.");
+    sync_metric_value(out, "sync_apply_queue_bytes", NULL, sync_counter_get(&metrics.queued_bytes));
+    sync_metric_histogram(out, "sync_event_apply_latency_seconds",
+                          "Time from the server seeing the first event of a batch to the batch being applied.",
+                          &metrics.apply_latency);
+    sync_metric_histogram(out, "sync_origin_apply_latency_seconds",
+                          "Time from the origin server seeing the first event of a batch to the batch being applied, "
+                          "across relays.",
+                          &metrics.origin_latency);
+    sync_metric_help(out, "sync_upstream_relays", "gauge", "Relays between the origin server and this client.");
+    sync_metric_value(out, "sync_upstream_relays", NULL, sync_counter_get(&metrics.relays));
+}
+
+static void *stats_main(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    for (;;) {
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Stats accept failed");
+            return NULL;
+        }
+        char *text = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&text, &len);
+        if (out) {
+            write_stats(out);
+            fclose(out);
+            send_all(sock, text, len);
+            free(text);
+        }
+        close(sock);
+    }
+}
+
+// Serve a snapshot of the counters to every connection on path, from a
+// thread of its own so a slow reader never holds up syncing
+void start_stats_server(const char *path) {
+    int listener = sync_stats_listen(path, SOCK_CLOEXEC);
+    if (listener < 0) {
+        perror("Stats socket failed");
+        exit(1);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_main, (void *)(intptr_t)listener) != 0) {
+        perror("pthread_create failed");
+        exit(1);
     }
+    pthread_detach(thread);
 }
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sync_protocol.h"
+
+// Fuzz entry point for the frame decoder in sync_protocol.h.
+//
+// The input is decoded twice: all at once, and in pieces whose sizes are
+// taken from the input itself, the way recv() may split it. Both runs must
+// see the same frames, payload bytes and result. Paths are checked with
+// sync_path_is_safe() and BUNDLE payloads of up to FUZZ_PAYLOAD_MAX bytes
+// are walked with sync_bundle_get_entry(), as the client does.
+//
+//   clang -g -fsanitize=fuzzer,address,undefined -o syncfuzz sync_fuzz.c
+//   gcc -g -DSYNC_FUZZ_MAIN -fsanitize=address,undefined -o syncfuzz sync_fuzz.c
+//
+// The second build reads inputs from the files named on its command line
+// (or stdin), for AFL or to replay a crash.
+
+#define FUZZ_PAYLOAD_MAX (64 * 1024)
+
+typedef struct {
+    uint64_t frames;
+    uint64_t payload_bytes;
+    uint64_t safe_paths;
+    uint64_t bundle_entries;
+    uint64_t digest;                // of every header, path and payload byte seen
+    size_t payload_len;
+    char payload[FUZZ_PAYLOAD_MAX];
+} FuzzTrace;
+
+static void mix(FuzzTrace *t, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        t->digest = (t->digest ^ p[i]) * 0x100000001b3ULL;
+    }
+}
+
+static int fuzz_on_frame(void *ctx, const SyncFrameHeader *hdr, const char *path) {
+    FuzzTrace *t = ctx;
+    t->frames++;
+    mix(t, hdr, sizeof(*hdr));
+    mix(t, path, strlen(path));
+    if (path[0] && sync_path_is_safe(path)) {
+        t->safe_paths++;
+    }
+    t->payload_len = 0;
+    return 0;
+}
+
+static int fuzz_on_payload(void *ctx, const SyncFrameHeader *hdr, const char *data, size_t len) {
+    FuzzTrace *t = ctx;
+    (void)hdr;
+    t->payload_bytes += len;
+    mix(t, data, len);
+    if (t->payload_len + len <= sizeof(t->payload)) {
+        memcpy(t->payload + t->payload_len, data, len);
+        t->payload_len += len;
+    }
+    return 0;
+}
+
+static int fuzz_on_frame_end(void *ctx, const SyncFrameHeader *hdr, const char *path) {
+    FuzzTrace *t = ctx;
+    (void)path;
+    if (hdr->opcode == SYNC_OP_BUNDLE && hdr->payload_len == t->payload_len) {
+        size_t off = 0;
+        SyncBundleEntry e;
+        size_t n;
+        while (off < t->payload_len && (n = sync_bundle_get_entry(t->payload + off, t->payload_len - off, &e))) {
+            t->bundle_entries++;
+            mix(t, e.path, e.path_len);
+            off += n;
+        }
+    }
+    // A callback that aborts must stop the decoder in both runs alike
+    return hdr->opcode == SYNC_OP_MANIFEST_END && hdr->seq == 0xdead ? -1 : 0;
+}
+
+static const SyncDecoderOps fuzz_ops = { fuzz_on_frame, fuzz_on_payload, fuzz_on_frame_end };
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static FuzzTrace whole, split;
+    SyncDecoder dec;
+
+    memset(&whole, 0, offsetof(FuzzTrace, payload));
+    sync_decoder_init(&dec);
+    int whole_result = sync_decoder_feed(&dec, (const char *)data, size, &fuzz_ops, &whole);
+
+    // Piece sizes come from the input, one byte each, cycling
+    memset(&split, 0, offsetof(FuzzTrace, payload));
+    sync_decoder_init(&dec);
+    int split_result = 0;
+    size_t off = 0;
+    for (size_t i = 0; off < size && split_result == 0; i++) {
+        size_t piece = size ? (size_t)data[i % size] % 32 + 1 : 1;
+        if (piece > size - off) {
+            piece = size - off;
+        }
+        split_result = sync_decoder_feed(&dec, (const char *)data + off, piece, &fuzz_ops, &split);
+        off += piece;
+    }
+
+    if (whole_result != split_result || whole.frames != split.frames ||
+        whole.payload_bytes != split.payload_bytes || whole.safe_paths != split.safe_paths ||
+        whole.bundle_entries != split.bundle_entries || whole.digest != split.digest) {
+        fprintf(stderr, "Decoding in pieces differs from decoding at once\n");
+        abort();
+    }
+    return 0;
+}
+
+#ifdef SYNC_FUZZ_MAIN
+static int run_file(FILE *file, const char *name) {
+    size_t cap = 1 << 16, len = 0;
+    uint8_t *buf = malloc(cap);
+    size_t got;
+    while (buf && (got = fread(buf + len, 1, cap - len, file)) > 0) {
+        len += got;
+        if (len == cap) {
+            uint8_t *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if (!buf) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    LLVMFuzzerTestOneInput(buf, len);
+    printf("%s: %zu bytes\n", name, len);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return run_file(stdin, "stdin");
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (!file) {
+            perror(argv[i]);
+            return 1;
+        }
+        int rc = run_file(file, argv[i]);
+        fclose(file);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,192 @@
+#ifndef SYNC_HASH_H
+#define SYNC_HASH_H
+
+// Checksums shared by syncserver and syncclient.
+//
+// SyncHash is a streaming MurmurHash3 x64_128: a fast 128-bit content hash
+// used as the strong block hash in delta signatures and to verify files that
+// were rebuilt from a delta. It guards against corruption and stale data,
+// not against a malicious peer.
+//
+// sync_weak_* implement the rsync rolling checksum, which can be slid along a
+// file one byte at a time to find blocks the other side already has.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SYNC_HASH_LEN 16
+
+typedef struct {
+    uint64_t h1;
+    uint64_t h2;
+    uint8_t tail[16];
+    size_t tail_len;
+    uint64_t total;
+} SyncHash;
+
+static inline uint64_t sync_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t sync_fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t sync_load_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void sync_hash_init(SyncHash *h) {
+    h->h1 = 0;
+    h->h2 = 0;
+    h->tail_len = 0;
+    h->total = 0;
+}
+
+static inline void sync_hash_block(SyncHash *h, const uint8_t *block) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t k1 = sync_load_le64(block);
+    uint64_t k2 = sync_load_le64(block + 8);
+
+    k1 *= c1;
+    k1 = sync_rotl64(k1, 31);
+    k1 *= c2;
+    h->h1 ^= k1;
+    h->h1 = sync_rotl64(h->h1, 27);
+    h->h1 += h->h2;
+    h->h1 = h->h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = sync_rotl64(k2, 33);
+    k2 *= c1;
+    h->h2 ^= k2;
+    h->h2 = sync_rotl64(h->h2, 31);
+    h->h2 += h->h1;
+    h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+static inline void sync_hash_update(SyncHash *h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    h->total += len;
+    if (h->tail_len) {
+        size_t take = 16 - h->tail_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(h->tail + h->tail_len, p, take);
+        h->tail_len += take;
+        p += take;
+        len -= take;
+        if (h->tail_len < 16) {
+            return;
+        }
+        sync_hash_block(h, h->tail);
+        h->tail_len = 0;
+    }
+    while (len >= 16) {
+        sync_hash_block(h, p);
+        p += 16;
+        len -= 16;
+    }
+    memcpy(h->tail, p, len);
+    h->tail_len = len;
+}
+
+static inline void sync_hash_final(SyncHash *h, uint8_t out[SYNC_HASH_LEN]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    uint64_t h1 = h->h1;
+    uint64_t h2 = h->h2;
+
+    for (size_t i = h->tail_len; i > 8; i--) {
+        k2 = (k2 << 8) | h->tail[i - 1];
+    }
+    if (h->tail_len > 8) {
+        k2 *= c2;
+        k2 = sync_rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (size_t i = h->tail_len < 8 ? h->tail_len : 8; i > 0; i--) {
+        k1 = (k1 << 8) | h->tail[i - 1];
+    }
+    if (h->tail_len > 0) {
+        k1 *= c1;
+        k1 = sync_rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= h->total;
+    h2 ^= h->total;
+    h1 += h2;
+    h2 += h1;
+    h1 = sync_fmix64(h1);
+    h2 = sync_fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    for (int i = 7; i >= 0; i--) {
+        out[i] = h1;
+        out[8 + i] = h2;
+        h1 >>= 8;
+        h2 >>= 8;
+    }
+}
+
+static inline void sync_hash_buffer(const void *data, size_t len, uint8_t out[SYNC_HASH_LEN]) {
+    SyncHash h;
+    sync_hash_init(&h);
+    sync_hash_update(&h, data, len);
+    sync_hash_final(&h, out);
+}
+
+// Rolling checksum state for a window of n bytes
+typedef struct {
+    uint32_t a;
+    uint32_t b;
+    size_t n;
+} SyncWeak;
+
+static inline void sync_weak_init(SyncWeak *w, const uint8_t *data, size_t n) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a += data[i];
+        b += (uint32_t)(n - i) * data[i];
+    }
+    w->a = a & 0xffff;
+    w->b = b & 0xffff;
+    w->n = n;
+}
+
+// Slide the window one byte: out leaves at the front, in enters at the back
+static inline void sync_weak_roll(SyncWeak *w, uint8_t out, uint8_t in) {
+    w->a = (w->a - out + in) & 0xffff;
+    w->b = (w->b - (uint32_t)w->n * out + w->a) & 0xffff;
+}
+
+static inline uint32_t sync_weak_digest(const SyncWeak *w) {
+    return w->a | (w->b << 16);
+}
+
+static inline uint32_t sync_weak_sum(const uint8_t *data, size_t n) {
+    SyncWeak w;
+    sync_weak_init(&w, data, n);
+    return sync_weak_digest(&w);
+}
+
+#endif
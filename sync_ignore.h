@@ -0,0 +1,703 @@
+#ifndef SYNC_IGNORE_H
+#define SYNC_IGNORE_H
+
+// Compiled ignore rules. A client's ignore list is parsed once into an
+// IgnoreMatcher; rules are separated by commas or newlines:
+//
+//   mp4  .mp4  *.mp4   file extension, matched exactly ("mp4" does not match
+//                      "p4"); "tar.gz" matches "x.tar.gz"
+//   node_modules       a bare word is also a name: it matches a file or
+//                      directory called exactly that at any depth
+//   build/             directory with that name at any depth
+//   **/Thumbs.db       file or directory with that name at any depth
+//   *.tmp~  cache-*    glob matched against the name at any depth
+//   /out  docs/*.pdf   glob matched against the whole relative path; a rule
+//                      is anchored when it starts with or contains a '/'
+//   a/**/b             "**" matches any number of directories
+//   # comment          skipped, as are empty rules
+//
+// Globs support '*', '?', '[...]' classes ("[!...]" negated) and '\' escapes.
+// A trailing '/' restricts any rule to directories. Extensions only apply to
+// files. Everything below an ignored directory is ignored too. Negated rules
+// ("!pattern") are not supported.
+//
+// Extensions and plain names live in hash sets, so their cost does not grow
+// with the number of rules. Globs are compiled to token programs, one per
+// path segment, and indexed by their literal prefix ("tmp-" for "tmp-*.swp",
+// "src/gen/" for "src/gen/**/*.o"): one hashing pass over a name or path finds
+// the only globs that can match it. Globs that start with a wildcard are
+// bucketed by the last byte they can match instead.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+enum {
+    IGNORE_OP_CHAR,         // one literal byte
+    IGNORE_OP_ANY,          // '?'
+    IGNORE_OP_STAR,         // '*', never crosses a '/'
+    IGNORE_OP_CLASS         // '[...]'
+};
+
+typedef struct {
+    uint8_t op;
+    uint8_t ch;             // IGNORE_OP_CHAR
+    uint32_t cls;           // IGNORE_OP_CLASS: index into classes
+} IgnoreOp;
+
+typedef struct {
+    uint32_t first_op;
+    uint32_t op_count;
+    bool globstar;          // the segment is "**"
+} IgnoreSegment;
+
+typedef struct {
+    uint32_t first_seg;
+    uint32_t seg_count;
+    bool anchored;          // matched against the whole path, else the name
+    bool dir_only;
+    uint32_t next;          // next glob with the same literal prefix
+} IgnoreGlob;
+
+// Globs sharing one literal prefix
+typedef struct {
+    uint64_t hash;
+    uint32_t len;
+    bool anchored;
+    bool used;
+    uint32_t head;          // first glob, chained through IgnoreGlob.next
+} IgnorePrefix;
+
+#define IGNORE_NO_GLOB UINT32_MAX
+#define IGNORE_MAX_PREFIX 255
+
+// Open-addressing set of strings, looked up by (pointer, length)
+typedef struct {
+    char **slots;
+    size_t capacity;
+    size_t count;
+} IgnoreSet;
+
+#define IGNORE_WILD_BUCKET 256
+
+typedef struct {
+    IgnoreSet exts;
+    IgnoreSet names;        // files and directories
+    IgnoreSet dir_names;    // directories only
+    IgnoreGlob *globs;
+    size_t glob_count;
+    size_t glob_capacity;
+    IgnoreSegment *segs;
+    size_t seg_count;
+    size_t seg_capacity;
+    IgnoreOp *ops;
+    size_t op_count;
+    size_t op_capacity;
+    uint8_t (*classes)[32];
+    size_t class_count;
+    size_t class_capacity;
+    IgnorePrefix *prefixes; // open addressing by (anchored, len, hash)
+    size_t prefix_capacity;
+    uint32_t *prefix_lens[2]; // distinct prefix lengths in ascending order,
+    size_t prefix_len_count[2]; // for name globs [0] and anchored globs [1]
+    // Globs without a literal prefix, grouped by the last byte they match;
+    // those ending in a wildcard are in IGNORE_WILD_BUCKET and are tried for
+    // every name.
+    uint32_t bucket_start[IGNORE_WILD_BUCKET + 2];
+    uint32_t *bucket_globs;
+    bool dir_rules;         // some rule can match a directory
+    size_t rule_count;
+} IgnoreMatcher;
+
+// FNV-1a, in steps so prefixes of increasing length can share one pass
+#define IGNORE_HASH_INIT 1469598103934665603ULL
+
+static inline uint64_t ignore_hash_step(uint64_t h, unsigned char c) {
+    return (h ^ c) * 1099511628211ULL;
+}
+
+static inline uint64_t ignore_hash(const char *s, size_t len) {
+    uint64_t h = IGNORE_HASH_INIT;
+    for (size_t i = 0; i < len; i++) {
+        h = ignore_hash_step(h, (unsigned char)s[i]);
+    }
+    return h;
+}
+
+static inline char **ignore_set_slot(char **slots, size_t capacity, const char *s, size_t len) {
+    size_t mask = capacity - 1;
+    size_t i = ignore_hash(s, len) & mask;
+    while (slots[i] && !(strncmp(slots[i], s, len) == 0 && slots[i][len] == '\0')) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static inline bool ignore_set_contains(const IgnoreSet *set, const char *s, size_t len) {
+    return set->count && *ignore_set_slot(set->slots, set->capacity, s, len) != NULL;
+}
+
+static inline bool ignore_set_add(IgnoreSet *set, const char *s, size_t len) {
+    if ((set->count + 1) * 10 > set->capacity * 7) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        char **slots = calloc(capacity, sizeof(char *));
+        if (!slots) {
+            return false;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i]) {
+                *ignore_set_slot(slots, capacity, set->slots[i], strlen(set->slots[i])) = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+    char **slot = ignore_set_slot(set->slots, set->capacity, s, len);
+    if (*slot) {
+        return true;
+    }
+    *slot = malloc(len + 1);
+    if (!*slot) {
+        return false;
+    }
+    memcpy(*slot, s, len);
+    (*slot)[len] = '\0';
+    set->count++;
+    return true;
+}
+
+static inline void ignore_set_free(IgnoreSet *set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->slots[i]);
+    }
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// Make room for one more element of an array grown by doubling
+static inline bool ignore_reserve(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    void *grown = realloc(*array, new_capacity * size);
+    if (!grown) {
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static inline bool ignore_emit_op(IgnoreMatcher *m, uint8_t op, uint8_t ch, uint32_t cls) {
+    if (!ignore_reserve((void **)&m->ops, &m->op_capacity, m->op_count, sizeof(IgnoreOp))) {
+        return false;
+    }
+    IgnoreOp *o = &m->ops[m->op_count++];
+    o->op = op;
+    o->ch = ch;
+    o->cls = cls;
+    return true;
+}
+
+// Compile one '/'-free segment of a glob. Outside anchored globs "**" is
+// just another '*'.
+static inline bool ignore_compile_segment(IgnoreMatcher *m, const char *s, size_t len, bool anchored) {
+    if (!ignore_reserve((void **)&m->segs, &m->seg_capacity, m->seg_count, sizeof(IgnoreSegment))) {
+        return false;
+    }
+    IgnoreSegment *seg = &m->segs[m->seg_count++];
+    seg->first_op = m->op_count;
+    seg->globstar = anchored && len == 2 && s[0] == '*' && s[1] == '*';
+    if (seg->globstar) {
+        seg->op_count = 0;
+        return true;
+    }
+    for (size_t i = 0; i < len; i++) {
+        bool ok;
+        if (s[i] == '*') {
+            while (i + 1 < len && s[i + 1] == '*') {
+                i++;
+            }
+            ok = ignore_emit_op(m, IGNORE_OP_STAR, 0, 0);
+        } else if (s[i] == '?') {
+            ok = ignore_emit_op(m, IGNORE_OP_ANY, 0, 0);
+        } else if (s[i] == '\\' && i + 1 < len) {
+            i++;
+            ok = ignore_emit_op(m, IGNORE_OP_CHAR, (uint8_t)s[i], 0);
+        } else if (s[i] == '[' && memchr(s + i + 1, ']', len - i - 1)) {
+            if (!ignore_reserve((void **)&m->classes, &m->class_capacity, m->class_count, 32)) {
+                return false;
+            }
+            uint8_t *bits = m->classes[m->class_count];
+            memset(bits, 0, 32);
+            size_t j = i + 1;
+            bool negate = j < len && (s[j] == '!' || s[j] == '^');
+            if (negate) {
+                j++;
+            }
+            // A ']' right after the opening bracket is a member
+            size_t start = j;
+            while (j < len && (s[j] != ']' || j == start)) {
+                unsigned lo = (unsigned char)s[j];
+                unsigned hi = lo;
+                if (j + 2 < len && s[j + 1] == '-' && s[j + 2] != ']') {
+                    hi = (unsigned char)s[j + 2];
+                    j += 2;
+                }
+                for (unsigned c = lo; c <= hi; c++) {
+                    bits[c >> 3] |= 1 << (c & 7);
+                }
+                j++;
+            }
+            if (j >= len) {
+                // No closing bracket after all: a literal '['
+                ok = ignore_emit_op(m, IGNORE_OP_CHAR, '[', 0);
+            } else {
+                if (negate) {
+                    for (int k = 0; k < 32; k++) {
+                        bits[k] = ~bits[k];
+                    }
+                }
+                ok = ignore_emit_op(m, IGNORE_OP_CLASS, 0, m->class_count++);
+                i = j;
+            }
+        } else {
+            ok = ignore_emit_op(m, IGNORE_OP_CHAR, (uint8_t)s[i], 0);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    seg->op_count = m->op_count - seg->first_op;
+    return true;
+}
+
+static inline bool ignore_add_glob(IgnoreMatcher *m, const char *s, size_t len, bool anchored, bool dir_only) {
+    if (!ignore_reserve((void **)&m->globs, &m->glob_capacity, m->glob_count, sizeof(IgnoreGlob))) {
+        return false;
+    }
+    IgnoreGlob *g = &m->globs[m->glob_count];
+    g->first_seg = m->seg_count;
+    g->anchored = anchored;
+    g->dir_only = dir_only;
+    size_t i = 0;
+    while (i < len) {
+        const char *slash = memchr(s + i, '/', len - i);
+        size_t end = slash ? (size_t)(slash - s) : len;
+        if (end > i && !ignore_compile_segment(m, s + i, end - i, anchored)) {
+            return false;
+        }
+        i = end + 1;
+    }
+    g->seg_count = m->seg_count - g->first_seg;
+    m->glob_count++;
+    return true;
+}
+
+static inline bool ignore_has_wildcard(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool ignore_add_rule(IgnoreMatcher *m, const char *s, size_t len) {
+    while (len > 0 && (s[0] == ' ' || s[0] == '\t')) {
+        s++;
+        len--;
+    }
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r')) {
+        len--;
+    }
+    if (len == 0 || s[0] == '#') {
+        return true;
+    }
+
+    bool dir_only = false;
+    while (len > 0 && s[len - 1] == '/') {
+        dir_only = true;
+        len--;
+    }
+    bool anchored = false;
+    while (len > 0 && s[0] == '/') {
+        anchored = true;
+        s++;
+        len--;
+    }
+    // "**/x" with a single segment left is the same as an unanchored "x"
+    bool any_depth = false;
+    while (!anchored && len > 3 && memcmp(s, "**/", 3) == 0 && !memchr(s + 3, '/', len - 3)) {
+        any_depth = true;
+        s += 3;
+        len -= 3;
+    }
+    if (len == 0) {
+        return true;
+    }
+    if (memchr(s, '/', len)) {
+        anchored = true;
+    }
+    m->rule_count++;
+
+    if (!anchored && !dir_only) {
+        if (!any_depth && !ignore_has_wildcard(s, len)) {
+            m->dir_rules = true;
+            if (!ignore_set_add(&m->names, s, len)) {
+                return false;
+            }
+            while (len > 1 && s[0] == '.') {
+                s++;
+                len--;
+            }
+            return ignore_set_add(&m->exts, s, len);
+        }
+        if (len > 2 && s[0] == '*' && s[1] == '.' && !ignore_has_wildcard(s + 2, len - 2)) {
+            return ignore_set_add(&m->exts, s + 2, len - 2);
+        }
+    }
+    m->dir_rules = true;
+    if (!anchored && !ignore_has_wildcard(s, len)) {
+        return ignore_set_add(dir_only ? &m->dir_names : &m->names, s, len);
+    }
+    return ignore_add_glob(m, s, len, anchored, dir_only);
+}
+
+// Last byte a glob can match, or IGNORE_WILD_BUCKET if it ends in a wildcard
+static inline unsigned ignore_glob_bucket(const IgnoreMatcher *m, const IgnoreGlob *g) {
+    if (g->seg_count == 0) {
+        return IGNORE_WILD_BUCKET;
+    }
+    const IgnoreSegment *last = &m->segs[g->first_seg + g->seg_count - 1];
+    if (last->globstar || last->op_count == 0) {
+        return IGNORE_WILD_BUCKET;
+    }
+    const IgnoreOp *op = &m->ops[last->first_op + last->op_count - 1];
+    return op->op == IGNORE_OP_CHAR ? op->ch : IGNORE_WILD_BUCKET;
+}
+
+// The literal text every match of g starts with, up to the first wildcard:
+// from the name for name globs, from the whole path for anchored ones.
+static inline size_t ignore_glob_prefix(const IgnoreMatcher *m, const IgnoreGlob *g, char *out) {
+    size_t len = 0;
+    for (uint32_t k = 0; k < g->seg_count; k++) {
+        const IgnoreSegment *seg = &m->segs[g->first_seg + k];
+        if (seg->globstar) {
+            return len;
+        }
+        for (uint32_t o = 0; o < seg->op_count; o++) {
+            const IgnoreOp *op = &m->ops[seg->first_op + o];
+            if (op->op != IGNORE_OP_CHAR || len == IGNORE_MAX_PREFIX) {
+                return len;
+            }
+            out[len++] = op->ch;
+        }
+        if (k + 1 < g->seg_count) {
+            if (len == IGNORE_MAX_PREFIX) {
+                return len;
+            }
+            out[len++] = '/';
+        }
+    }
+    return len;
+}
+
+static inline IgnorePrefix *ignore_prefix_slot(IgnorePrefix *slots, size_t capacity, bool anchored,
+                                               size_t len, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t i = (hash ^ (len * 0x9e3779b97f4a7c15ULL) ^ anchored) & mask;
+    while (slots[i].used && !(slots[i].hash == hash && slots[i].len == len && slots[i].anchored == anchored)) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static inline bool ignore_add_prefix_len(IgnoreMatcher *m, bool anchored, uint32_t len) {
+    uint32_t *lens = m->prefix_lens[anchored];
+    size_t count = m->prefix_len_count[anchored];
+    size_t i = 0;
+    while (i < count && lens[i] < len) {
+        i++;
+    }
+    if (i < count && lens[i] == len) {
+        return true;
+    }
+    lens = realloc(lens, (count + 1) * sizeof(uint32_t));
+    if (!lens) {
+        return false;
+    }
+    memmove(lens + i + 1, lens + i, (count - i) * sizeof(uint32_t));
+    lens[i] = len;
+    m->prefix_lens[anchored] = lens;
+    m->prefix_len_count[anchored] = count + 1;
+    return true;
+}
+
+// Build the prefix index and the last-byte buckets for the remaining globs
+static inline bool ignore_index_globs(IgnoreMatcher *m) {
+    m->prefix_capacity = 16;
+    while (m->prefix_capacity < m->glob_count * 2) {
+        m->prefix_capacity *= 2;
+    }
+    m->prefixes = calloc(m->prefix_capacity, sizeof(IgnorePrefix));
+    m->bucket_globs = malloc((m->glob_count ? m->glob_count : 1) * sizeof(uint32_t));
+    if (!m->prefixes || !m->bucket_globs) {
+        return false;
+    }
+
+    char prefix[IGNORE_MAX_PREFIX];
+    for (size_t g = 0; g < m->glob_count; g++) {
+        IgnoreGlob *glob = &m->globs[g];
+        size_t len = ignore_glob_prefix(m, glob, prefix);
+        glob->next = IGNORE_NO_GLOB;
+        if (len == 0) {
+            m->bucket_start[ignore_glob_bucket(m, glob) + 1]++;
+            continue;
+        }
+        uint64_t hash = ignore_hash(prefix, len);
+        IgnorePrefix *slot = ignore_prefix_slot(m->prefixes, m->prefix_capacity, glob->anchored, len, hash);
+        if (!slot->used) {
+            slot->used = true;
+            slot->hash = hash;
+            slot->len = len;
+            slot->anchored = glob->anchored;
+            slot->head = IGNORE_NO_GLOB;
+            if (!ignore_add_prefix_len(m, glob->anchored, len)) {
+                return false;
+            }
+        }
+        glob->next = slot->head;
+        slot->head = g;
+    }
+
+    // Counting sort of the unprefixed globs into their buckets
+    for (int b = 0; b <= IGNORE_WILD_BUCKET; b++) {
+        m->bucket_start[b + 1] += m->bucket_start[b];
+    }
+    uint32_t fill[IGNORE_WILD_BUCKET + 1];
+    memcpy(fill, m->bucket_start, sizeof(fill));
+    for (size_t g = 0; g < m->glob_count; g++) {
+        if (ignore_glob_prefix(m, &m->globs[g], prefix) == 0) {
+            m->bucket_globs[fill[ignore_glob_bucket(m, &m->globs[g])]++] = g;
+        }
+    }
+    return true;
+}
+
+static inline void ignore_free(IgnoreMatcher *m) {
+    ignore_set_free(&m->exts);
+    ignore_set_free(&m->names);
+    ignore_set_free(&m->dir_names);
+    free(m->globs);
+    free(m->segs);
+    free(m->ops);
+    free(m->classes);
+    free(m->bucket_globs);
+    free(m->prefixes);
+    free(m->prefix_lens[0]);
+    free(m->prefix_lens[1]);
+    memset(m, 0, sizeof(*m));
+}
+
+// Parse a rule list. Returns the number of rules, or -1 if memory ran out
+// (the matcher is then empty).
+static inline long ignore_compile(IgnoreMatcher *m, const char *rules, size_t len) {
+    memset(m, 0, sizeof(*m));
+    size_t i = 0;
+    while (i < len) {
+        size_t end = i;
+        while (end < len && rules[end] != ',' && rules[end] != '\n') {
+            end++;
+        }
+        if (!ignore_add_rule(m, rules + i, end - i)) {
+            ignore_free(m);
+            return -1;
+        }
+        i = end + 1;
+    }
+
+    if (!ignore_index_globs(m)) {
+        ignore_free(m);
+        return -1;
+    }
+    return (long)m->rule_count;
+}
+
+static inline bool ignore_op_matches(const IgnoreMatcher *m, const IgnoreOp *op, unsigned char c) {
+    switch (op->op) {
+    case IGNORE_OP_CHAR:
+        return op->ch == c;
+    case IGNORE_OP_ANY:
+        return true;
+    default:
+        return (m->classes[op->cls][c >> 3] >> (c & 7)) & 1;
+    }
+}
+
+// Wildcard match of one segment against one path component. A later '*'
+// always supersedes the backtrack point of an earlier one, so this runs in
+// O(len * ops) at worst without recursion.
+static inline bool ignore_match_segment(const IgnoreMatcher *m, const IgnoreSegment *seg, const char *s, size_t len) {
+    const IgnoreOp *ops = m->ops + seg->first_op;
+    size_t n = seg->op_count;
+    size_t p = 0;
+    size_t i = 0;
+    size_t star_p = SIZE_MAX;
+    size_t star_i = 0;
+    while (i < len) {
+        if (p < n && ops[p].op == IGNORE_OP_STAR) {
+            star_p = ++p;
+            star_i = i;
+        } else if (p < n && ignore_op_matches(m, &ops[p], (unsigned char)s[i])) {
+            p++;
+            i++;
+        } else if (star_p != SIZE_MAX) {
+            p = star_p;
+            i = ++star_i;
+        } else {
+            return false;
+        }
+    }
+    while (p < n && ops[p].op == IGNORE_OP_STAR) {
+        p++;
+    }
+    return p == n;
+}
+
+static inline size_t ignore_component_end(const char *path, size_t len, size_t i) {
+    const char *slash = memchr(path + i, '/', len - i);
+    return slash ? (size_t)(slash - path) : len;
+}
+
+// Same algorithm one level up: segments against path components, with "**"
+// in the role of '*'.
+static inline bool ignore_match_glob(const IgnoreMatcher *m, const IgnoreGlob *g, const char *path, size_t len) {
+    const IgnoreSegment *segs = m->segs + g->first_seg;
+    size_t n = g->seg_count;
+    size_t p = 0;
+    size_t i = 0;
+    size_t star_p = SIZE_MAX;
+    size_t star_i = 0;
+    while (i < len) {
+        size_t end = ignore_component_end(path, len, i);
+        if (p < n && segs[p].globstar) {
+            star_p = ++p;
+            star_i = i;
+        } else if (p < n && ignore_match_segment(m, &segs[p], path + i, end - i)) {
+            p++;
+            i = end < len ? end + 1 : len;
+        } else if (star_p != SIZE_MAX) {
+            p = star_p;
+            size_t skip = ignore_component_end(path, len, star_i);
+            star_i = skip < len ? skip + 1 : len;
+            i = star_i;
+        } else {
+            return false;
+        }
+    }
+    while (p < n && segs[p].globstar) {
+        p++;
+    }
+    return p == n;
+}
+
+static inline bool ignore_try_glob(const IgnoreMatcher *m, const IgnoreGlob *g, const char *path, size_t len,
+                                   const char *name, size_t name_len, bool is_dir) {
+    if (g->dir_only && !is_dir) {
+        return false;
+    }
+    return g->anchored ? ignore_match_glob(m, g, path, len)
+                       : ignore_match_segment(m, &m->segs[g->first_seg], name, name_len);
+}
+
+// Try the globs whose literal prefix starts subject (the name, or the whole
+// path for anchored globs), hashing subject once for all prefix lengths.
+static inline bool ignore_match_prefixed(const IgnoreMatcher *m, bool anchored, const char *subject,
+                                         size_t subject_len, const char *path, size_t len,
+                                         const char *name, size_t name_len, bool is_dir) {
+    const uint32_t *lens = m->prefix_lens[anchored];
+    size_t count = m->prefix_len_count[anchored];
+    uint64_t hash = IGNORE_HASH_INIT;
+    size_t hashed = 0;
+    for (size_t k = 0; k < count && lens[k] <= subject_len; k++) {
+        while (hashed < lens[k]) {
+            hash = ignore_hash_step(hash, (unsigned char)subject[hashed++]);
+        }
+        const IgnorePrefix *slot = ignore_prefix_slot(m->prefixes, m->prefix_capacity, anchored, lens[k], hash);
+        if (!slot->used) {
+            continue;
+        }
+        for (uint32_t g = slot->head; g != IGNORE_NO_GLOB; g = m->globs[g].next) {
+            if (ignore_try_glob(m, &m->globs[g], path, len, name, name_len, is_dir)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Does a rule match the last component of path? Its ancestors are not looked
+// at; scans that only descend into directories that passed use this directly.
+static inline bool ignore_match_entry(const IgnoreMatcher *m, const char *path, size_t len, bool is_dir) {
+    if (len == 0) {
+        return false;
+    }
+    size_t name_off = len;
+    while (name_off > 0 && path[name_off - 1] != '/') {
+        name_off--;
+    }
+    const char *name = path + name_off;
+    size_t name_len = len - name_off;
+
+    if (!is_dir && m->exts.count) {
+        // Every suffix after a '.', so "tar.gz" and "gz" both apply to x.tar.gz
+        for (size_t k = 0; k < name_len; k++) {
+            if (name[k] == '.' && ignore_set_contains(&m->exts, name + k + 1, name_len - k - 1)) {
+                return true;
+            }
+        }
+    }
+    if (!m->dir_rules) {
+        return false;
+    }
+    if (ignore_set_contains(&m->names, name, name_len)) {
+        return true;
+    }
+    if (is_dir && ignore_set_contains(&m->dir_names, name, name_len)) {
+        return true;
+    }
+    if (ignore_match_prefixed(m, false, name, name_len, path, len, name, name_len, is_dir) ||
+        ignore_match_prefixed(m, true, path, len, path, len, name, name_len, is_dir)) {
+        return true;
+    }
+    unsigned buckets[2] = { (unsigned char)name[name_len - 1], IGNORE_WILD_BUCKET };
+    for (int b = 0; b < 2; b++) {
+        for (uint32_t k = m->bucket_start[buckets[b]]; k < m->bucket_start[buckets[b] + 1]; k++) {
+            if (ignore_try_glob(m, &m->globs[m->bucket_globs[k]], path, len, name, name_len, is_dir)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Is the relative path ignored, either itself or through one of its
+// parent directories?
+static inline bool ignore_match(const IgnoreMatcher *m, const char *path, bool is_dir) {
+    size_t len = strlen(path);
+    if (m->dir_rules) {
+        for (size_t i = 0; i < len; i++) {
+            if (path[i] == '/' && ignore_match_entry(m, path, i, true)) {
+                return true;
+            }
+        }
+    }
+    return ignore_match_entry(m, path, len, is_dir);
+}
+
+#endif
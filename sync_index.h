@@ -0,0 +1,524 @@
+#ifndef SYNC_INDEX_H
+#define SYNC_INDEX_H
+
+// Persistent index of the server's tree: one node per file or directory with
+// its inode, size, mtime, mode, the sequence number of its last change and,
+// once it has been needed, its content hash.
+//
+// In memory the index is a tree. Each node stores only its own name and
+// hangs off its parent, so renaming a directory moves one node however large
+// the subtree is. A hash table keyed by (parent, name) finds a node from a
+// path one component at a time.
+//
+// On disk it is a header followed by one record per node in depth-first
+// order, each record giving its depth instead of its path:
+//
+//   IndexFileHeader
+//   IndexRecord, name padded to 8 bytes    (repeated count times)
+//
+// The file is mmap'd and read front to back at startup, and rewritten to a
+// temp file and renamed over the old one when saved. It is tied to the
+// directory it was built for by device and inode number.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sync_protocol.h"
+#include "sync_hash.h"
+
+#define INDEX_MAGIC "SYNCIDX1"
+#define INDEX_MAX_DEPTH 4096
+
+typedef struct IndexNode {
+    struct IndexNode *parent;
+    struct IndexNode *first_child;
+    struct IndexNode *next_sibling;
+    struct IndexNode *prev_sibling;
+    struct IndexNode *hash_next;    // chain in TreeIndex.buckets
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t seq;                   // sequence number of the last change
+    uint32_t mode;
+    uint8_t type;                   // SYNC_ENTRY_*
+    bool has_hash;
+    bool seen;                      // scratch mark for reconciling
+    uint8_t hash[SYNC_HASH_LEN];
+    size_t name_len;
+    char *name;
+} IndexNode;
+
+typedef struct {
+    IndexNode *root;                // the sync directory itself, name ""
+    IndexNode **buckets;            // chained by (parent, name)
+    size_t capacity;
+    size_t count;                   // nodes below the root
+    bool dirty;                     // changed since it was loaded or saved
+} TreeIndex;
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t next_seq;              // the server's sequence counter when saved
+    uint64_t root_dev;
+    uint64_t root_ino;
+    uint64_t root_mtime_ns;
+    uint64_t records_len;           // bytes of records after the header
+} IndexFileHeader;
+
+typedef struct {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t seq;
+    uint8_t hash[SYNC_HASH_LEN];
+    uint32_t mode;
+    uint32_t depth;                 // 0 for entries directly in the sync directory
+    uint16_t name_len;
+    uint8_t type;
+    uint8_t has_hash;
+    uint32_t reserved;
+} IndexRecord;
+
+static inline size_t index_bucket(const TreeIndex *idx, const IndexNode *parent, const char *name, size_t len) {
+    // FNV-1a of the name, mixed with the parent's address
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t)(uintptr_t)parent * 0x9e3779b97f4a7c15ULL;
+    return (h ^ (h >> 29)) & (idx->capacity - 1);
+}
+
+static inline IndexNode *index_new_node(const char *name, size_t len, uint8_t type) {
+    IndexNode *node = calloc(1, sizeof(IndexNode));
+    char *copy = malloc(len + 1);
+    if (!node || !copy) {
+        free(node);
+        free(copy);
+        return NULL;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    node->name = copy;
+    node->name_len = len;
+    node->type = type;
+    return node;
+}
+
+static inline bool index_init(TreeIndex *idx) {
+    memset(idx, 0, sizeof(*idx));
+    idx->capacity = 1024;
+    idx->buckets = calloc(idx->capacity, sizeof(IndexNode *));
+    idx->root = index_new_node("", 0, SYNC_ENTRY_DIR);
+    return idx->buckets && idx->root;
+}
+
+static inline IndexNode *index_child(const TreeIndex *idx, const IndexNode *parent, const char *name, size_t len) {
+    IndexNode *node = idx->buckets[index_bucket(idx, parent, name, len)];
+    while (node && !(node->parent == parent && node->name_len == len && memcmp(node->name, name, len) == 0)) {
+        node = node->hash_next;
+    }
+    return node;
+}
+
+// Find the node for a relative path ("" is the root)
+static inline IndexNode *index_lookup(const TreeIndex *idx, const char *path) {
+    IndexNode *node = idx->root;
+    while (node && *path) {
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        node = index_child(idx, node, path, len);
+        path += len + (slash ? 1 : 0);
+    }
+    return node;
+}
+
+static inline void index_hash_insert(TreeIndex *idx, IndexNode *node) {
+    size_t b = index_bucket(idx, node->parent, node->name, node->name_len);
+    node->hash_next = idx->buckets[b];
+    idx->buckets[b] = node;
+}
+
+static inline void index_hash_remove(TreeIndex *idx, IndexNode *node) {
+    IndexNode **p = &idx->buckets[index_bucket(idx, node->parent, node->name, node->name_len)];
+    while (*p && *p != node) {
+        p = &(*p)->hash_next;
+    }
+    if (*p) {
+        *p = node->hash_next;
+    }
+}
+
+static inline bool index_grow(TreeIndex *idx) {
+    size_t old_capacity = idx->capacity;
+    IndexNode **old = idx->buckets;
+    IndexNode **buckets = calloc(old_capacity * 2, sizeof(IndexNode *));
+    if (!buckets) {
+        return false;
+    }
+    idx->buckets = buckets;
+    idx->capacity = old_capacity * 2;
+    for (size_t i = 0; i < old_capacity; i++) {
+        IndexNode *node = old[i];
+        while (node) {
+            IndexNode *next = node->hash_next;
+            index_hash_insert(idx, node);
+            node = next;
+        }
+    }
+    free(old);
+    return true;
+}
+
+static inline void index_link(IndexNode *parent, IndexNode *node) {
+    node->parent = parent;
+    node->prev_sibling = NULL;
+    node->next_sibling = parent->first_child;
+    if (parent->first_child) {
+        parent->first_child->prev_sibling = node;
+    }
+    parent->first_child = node;
+}
+
+static inline void index_unlink(IndexNode *node) {
+    if (node->prev_sibling) {
+        node->prev_sibling->next_sibling = node->next_sibling;
+    } else if (node->parent) {
+        node->parent->first_child = node->next_sibling;
+    }
+    if (node->next_sibling) {
+        node->next_sibling->prev_sibling = node->prev_sibling;
+    }
+    node->next_sibling = NULL;
+    node->prev_sibling = NULL;
+}
+
+// Return the child called name, adding it with the given type if missing
+static inline IndexNode *index_add_child(TreeIndex *idx, IndexNode *parent, const char *name, size_t len, uint8_t type) {
+    IndexNode *node = index_child(idx, parent, name, len);
+    if (node) {
+        return node;
+    }
+    if (idx->count + 1 > idx->capacity && !index_grow(idx)) {
+        return NULL;
+    }
+    node = index_new_node(name, len, type);
+    if (!node) {
+        return NULL;
+    }
+    index_link(parent, node);
+    index_hash_insert(idx, node);
+    idx->count++;
+    idx->dirty = true;
+    return node;
+}
+
+// Find or add the node for path, adding missing parents as directories
+static inline IndexNode *index_add_path(TreeIndex *idx, const char *path, uint8_t type) {
+    IndexNode *node = idx->root;
+    while (node && *path) {
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        node = index_add_child(idx, node, path, len, slash ? SYNC_ENTRY_DIR : type);
+        path += len + (slash ? 1 : 0);
+    }
+    return node;
+}
+
+// Remove node and everything below it
+static inline void index_remove(TreeIndex *idx, IndexNode *node) {
+    if (node == idx->root) {
+        return;
+    }
+    index_hash_remove(idx, node);
+    index_unlink(node);
+    // Free the subtree bottom up; each child is unhashed while its parent,
+    // part of its key, is still alive
+    IndexNode *cur = node;
+    for (;;) {
+        if (cur->first_child) {
+            cur = cur->first_child;
+            continue;
+        }
+        IndexNode *parent = cur->parent;
+        if (cur != node) {
+            index_hash_remove(idx, cur);
+            parent->first_child = cur->next_sibling;
+            if (cur->next_sibling) {
+                cur->next_sibling->prev_sibling = NULL;
+            }
+        }
+        free(cur->name);
+        free(cur);
+        idx->count--;
+        if (cur == node) {
+            break;
+        }
+        cur = parent;
+    }
+    idx->dirty = true;
+}
+
+// Move node to new_parent under a new name, replacing anything already there
+static inline bool index_move(TreeIndex *idx, IndexNode *node, IndexNode *new_parent, const char *name, size_t len) {
+    for (IndexNode *p = new_parent; p; p = p->parent) {
+        if (p == node) {
+            return false;           // into its own subtree
+        }
+    }
+    IndexNode *existing = index_child(idx, new_parent, name, len);
+    if (existing == node) {
+        return true;
+    }
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        return false;
+    }
+    if (existing) {
+        index_remove(idx, existing);
+    }
+    index_hash_remove(idx, node);
+    index_unlink(node);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    free(node->name);
+    node->name = copy;
+    node->name_len = len;
+    index_link(new_parent, node);
+    index_hash_insert(idx, node);
+    idx->dirty = true;
+    return true;
+}
+
+// Relative path of node; returns its length, or -1 if it does not fit
+static inline long index_path(const IndexNode *node, char *out, size_t out_len) {
+    size_t len = 0;
+    for (const IndexNode *p = node; p && p->parent; p = p->parent) {
+        len += p->name_len + (p->parent->parent ? 1 : 0);
+    }
+    if (len + 1 > out_len) {
+        return -1;
+    }
+    out[len] = '\0';
+    size_t end = len;
+    for (const IndexNode *p = node; p && p->parent; p = p->parent) {
+        end -= p->name_len;
+        memcpy(out + end, p->name, p->name_len);
+        if (p->parent->parent) {
+            out[--end] = '/';
+        }
+    }
+    return (long)len;
+}
+
+// Next node in depth-first order below top, or NULL when done. *depth tracks
+// the depth of the returned node relative to top's children.
+static inline IndexNode *index_next(const IndexNode *top, IndexNode *node, uint32_t *depth, bool descend) {
+    if (descend && node->first_child) {
+        (*depth)++;
+        return node->first_child;
+    }
+    while (node != top) {
+        if (node->next_sibling) {
+            return node->next_sibling;
+        }
+        node = node->parent;
+        if (node == top) {
+            break;
+        }
+        (*depth)--;
+    }
+    return NULL;
+}
+
+static inline IndexNode *index_first(const IndexNode *top, uint32_t *depth) {
+    *depth = 0;
+    return top->first_child;
+}
+
+static inline void index_free(TreeIndex *idx) {
+    if (idx->root) {
+        while (idx->root->first_child) {
+            index_remove(idx, idx->root->first_child);
+        }
+        free(idx->root->name);
+        free(idx->root);
+    }
+    free(idx->buckets);
+    memset(idx, 0, sizeof(*idx));
+}
+
+static inline uint64_t index_mtime_ns(const struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+// Update node from a fresh lstat. Returns true if the file's contents may
+// have changed, which also drops its cached hash.
+static inline bool index_set_stat(TreeIndex *idx, IndexNode *node, const struct stat *st) {
+    bool changed = node->ino != (uint64_t)st->st_ino || node->size != (uint64_t)st->st_size ||
+                   node->mtime_ns != index_mtime_ns(st);
+    if (changed || node->mode != (uint32_t)st->st_mode) {
+        idx->dirty = true;
+    }
+    node->ino = st->st_ino;
+    node->size = st->st_size;
+    node->mtime_ns = index_mtime_ns(st);
+    node->mode = st->st_mode;
+    node->type = S_ISDIR(st->st_mode) ? SYNC_ENTRY_DIR : SYNC_ENTRY_FILE;
+    if (changed) {
+        node->has_hash = false;
+    }
+    return changed;
+}
+
+static inline size_t index_record_len(size_t name_len) {
+    return sizeof(IndexRecord) + ((name_len + 7) & ~(size_t)7);
+}
+
+// Load an index saved for the directory described by root_st. Returns false
+// (leaving idx empty) if the file is missing, damaged or for another tree.
+static inline bool index_load(TreeIndex *idx, const char *path, const struct stat *root_st, uint64_t *next_seq) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(IndexFileHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t file_len = st.st_size;
+    const uint8_t *map = mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    madvise((void *)map, file_len, MADV_SEQUENTIAL);
+
+    const IndexFileHeader *hdr = (const IndexFileHeader *)map;
+    bool ok = memcmp(hdr->magic, INDEX_MAGIC, 8) == 0 && hdr->root_dev == (uint64_t)root_st->st_dev &&
+              hdr->root_ino == (uint64_t)root_st->st_ino &&
+              hdr->records_len == file_len - sizeof(IndexFileHeader);
+
+    // Directories on the path from the root to the current record
+    IndexNode **stack = ok ? malloc(INDEX_MAX_DEPTH * sizeof(IndexNode *)) : NULL;
+    ok = ok && stack;
+    uint32_t stack_len = 1;
+    if (ok) {
+        stack[0] = idx->root;
+        idx->root->ino = hdr->root_ino;
+        idx->root->mtime_ns = hdr->root_mtime_ns;
+        idx->root->mode = root_st->st_mode;
+    }
+    size_t off = sizeof(IndexFileHeader);
+    for (uint64_t i = 0; ok && i < hdr->count; i++) {
+        if (file_len - off < sizeof(IndexRecord)) {
+            ok = false;
+            break;
+        }
+        const IndexRecord *rec = (const IndexRecord *)(map + off);
+        const char *name = (const char *)(rec + 1);
+        if (rec->name_len == 0 || rec->depth >= stack_len || file_len - off < index_record_len(rec->name_len) ||
+            memchr(name, '/', rec->name_len) || memchr(name, '\0', rec->name_len)) {
+            ok = false;
+            break;
+        }
+        IndexNode *node = index_add_child(idx, stack[rec->depth], name, rec->name_len, rec->type);
+        if (!node) {
+            ok = false;
+            break;
+        }
+        node->ino = rec->ino;
+        node->size = rec->size;
+        node->mtime_ns = rec->mtime_ns;
+        node->seq = rec->seq;
+        node->mode = rec->mode;
+        node->has_hash = rec->has_hash;
+        memcpy(node->hash, rec->hash, SYNC_HASH_LEN);
+        stack_len = rec->depth + 1;
+        if (node->type == SYNC_ENTRY_DIR && stack_len < INDEX_MAX_DEPTH) {
+            stack[stack_len++] = node;
+        }
+        off += index_record_len(rec->name_len);
+    }
+    if (ok) {
+        *next_seq = hdr->next_seq;
+    }
+    free(stack);
+    munmap((void *)map, file_len);
+    if (!ok) {
+        while (idx->root->first_child) {
+            index_remove(idx, idx->root->first_child);
+        }
+    }
+    idx->dirty = false;
+    return ok;
+}
+
+// Write the index to path atomically. Returns false on error.
+static inline bool index_save(TreeIndex *idx, const char *path, const struct stat *root_st, uint64_t next_seq) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        return false;
+    }
+    static char buffer[1024 * 1024];
+    setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+
+    IndexFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, 8);
+    hdr.count = 0;
+    hdr.next_seq = next_seq;
+    hdr.root_dev = root_st->st_dev;
+    hdr.root_ino = root_st->st_ino;
+    hdr.root_mtime_ns = idx->root->mtime_ns;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+
+    static const char padding[8];
+    uint64_t records_len = 0;
+    uint32_t depth;
+    for (IndexNode *node = index_first(idx->root, &depth); ok && node;
+         node = index_next(idx->root, node, &depth, depth + 1 < INDEX_MAX_DEPTH)) {
+        IndexRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.ino = node->ino;
+        rec.size = node->size;
+        rec.mtime_ns = node->mtime_ns;
+        rec.seq = node->seq;
+        memcpy(rec.hash, node->hash, SYNC_HASH_LEN);
+        rec.mode = node->mode;
+        rec.depth = depth;
+        rec.name_len = node->name_len;
+        rec.type = node->type;
+        rec.has_hash = node->has_hash;
+        size_t pad = index_record_len(node->name_len) - sizeof(rec) - node->name_len;
+        ok = fwrite(&rec, sizeof(rec), 1, out) == 1 && fwrite(node->name, 1, node->name_len, out) == node->name_len &&
+             fwrite(padding, 1, pad, out) == pad;
+        records_len += index_record_len(node->name_len);
+        hdr.count++;
+    }
+    hdr.records_len = records_len;
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, out) == 1 && fflush(out) == 0 &&
+         fsync(fileno(out)) == 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    idx->dirty = false;
+    return true;
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef SYNC_METRICS_H
+#define SYNC_METRICS_H
+
+// Counters, latency histograms and the log level, shared by syncserver and
+// syncclient.
+//
+// Counters are plain uint64_t bumped with relaxed atomic adds: any thread can
+// update them without a lock, and a reader sees a recent value of each, with
+// no ordering between them. Histograms count observations in power-of-two
+// buckets of microseconds (<= 1, <= 2, <= 4, ...), so recording one is a
+// count of leading zeros and three adds.
+//
+// Both programs serve a snapshot on a Unix socket given with -m: every
+// connection gets the current values in the Prometheus text exposition format
+// and is closed, so `socat - UNIX-CONNECT:path` or `nc -U path` reads it.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SYNC_HIST_BUCKETS 32        // the last one also holds anything above 2^30 us
+
+typedef struct {
+    uint64_t buckets[SYNC_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;                   // microseconds
+} SyncHistogram;
+
+static inline void sync_counter_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void sync_counter_sub(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_sub(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t sync_counter_get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void sync_hist_observe(SyncHistogram *h, uint64_t us) {
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (i >= SYNC_HIST_BUCKETS) {
+        i = SYNC_HIST_BUCKETS - 1;
+    }
+    sync_counter_add(&h->buckets[i], 1);
+    sync_counter_add(&h->count, 1);
+    sync_counter_add(&h->sum, us);
+}
+
+static inline void sync_metric_help(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static inline void sync_metric_value(FILE *out, const char *name, const char *labels, uint64_t value) {
+    fprintf(out, "%s%s%s%s %llu\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+            (unsigned long long)value);
+}
+
+// Cumulative buckets in seconds, as Prometheus expects
+static inline void sync_metric_histogram(FILE *out, const char *name, const char *help, const SyncHistogram *h) {
+    sync_metric_help(out, name, "histogram", help);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < SYNC_HIST_BUCKETS - 1; i++) {
+        cumulative += sync_counter_get(&h->buckets[i]);
+        fprintf(out, "%s_bucket{le=\"%.6f\"} %llu\n", name, (double)(1ULL << i) / 1e6,
+                (unsigned long long)cumulative);
+    }
+    uint64_t count = sync_counter_get(&h->count);
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+    fprintf(out, "%s_sum %.6f\n", name, sync_counter_get(&h->sum) / 1e6);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+// Bind a listening Unix socket at path, replacing a stale one. Returns -1
+// with errno set on failure.
+static inline int sync_stats_listen(const char *path, int flags) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+// Log levels. Errors always go to stderr; -l picks how much goes to stdout,
+// and SIGUSR1 / SIGUSR2 switch per-event logging on and off while running.
+enum {
+    SYNC_LOG_QUIET,                 // nothing but errors
+    SYNC_LOG_INFO,                  // connections, summaries (default)
+    SYNC_LOG_DEBUG                  // every event, file and operation
+};
+
+static volatile sig_atomic_t sync_log_level = SYNC_LOG_INFO;
+static int sync_log_configured = SYNC_LOG_INFO;
+
+#define log_info(...) do { if (sync_log_level >= SYNC_LOG_INFO) printf(__VA_ARGS__); } while (0)
+#define log_debug(...) do { if (sync_log_level >= SYNC_LOG_DEBUG) printf(__VA_ARGS__); } while (0)
+
+static inline int sync_parse_log_level(const char *name) {
+    if (strcmp(name, "quiet") == 0) {
+        return SYNC_LOG_QUIET;
+    }
+    if (strcmp(name, "info") == 0) {
+        return SYNC_LOG_INFO;
+    }
+    if (strcmp(name, "debug") == 0) {
+        return SYNC_LOG_DEBUG;
+    }
+    return -1;
+}
+
+static void sync_log_signal(int sig) {
+    sync_log_level = sig == SIGUSR1 ? SYNC_LOG_DEBUG : sync_log_configured;
+}
+
+static inline void sync_log_init(int level) {
+    sync_log_configured = level;
+    sync_log_level = level;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sync_log_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+#endif
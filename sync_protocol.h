@@ -0,0 +1,442 @@
+#ifndef SYNC_PROTOCOL_H
+#define SYNC_PROTOCOL_H
+
+// Wire protocol shared by syncserver and syncclient.
+//
+// Every message is a frame made of a fixed 20-byte header, the relative path
+// (path_len bytes, not NUL terminated) and payload_len bytes of payload:
+//
+//   offset  size  field
+//   0       1     opcode       (SYNC_OP_*)
+//   1       1     flags        (SYNC_FLAG_*)
+//   2       2     path_len     big endian
+//   4       8     payload_len  big endian
+//   12      8     seq          big endian, assigned by the sender
+//
+// Frames can be pipelined freely: the receiver runs SyncDecoder over the raw
+// byte stream, so it does not matter how TCP splits or coalesces them.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#define SYNC_HEADER_LEN 20
+#define SYNC_MAX_PATH (PATH_MAX - 1)
+
+enum {
+    SYNC_OP_HELLO = 1,      // client -> server, payload: ignore list
+                            // server -> client, payload: u64 journal id
+    SYNC_OP_FILE,           // payload: file contents
+    SYNC_OP_DELETE,
+    SYNC_OP_DIR_CREATE,
+    SYNC_OP_DIR_DELETE,
+    SYNC_OP_RENAME,         // path: old path, payload: new path
+    SYNC_OP_SIG_REQUEST,    // server -> client: send signatures of your copy of path
+    SYNC_OP_SIGNATURE,      // client -> server, payload: u32 block size + entries
+    SYNC_OP_DELTA_BEGIN,    // payload: u64 final size, u32 block size
+    SYNC_OP_DELTA_COPY,     // no path, payload: u64 first block, u32 block count
+    SYNC_OP_DELTA_DATA,     // no path, payload: literal bytes
+    SYNC_OP_DELTA_END,      // payload: SYNC_HASH_LEN hash of the rebuilt file
+    SYNC_OP_ATTR,           // payload: u64 mtime in ns, u32 mode
+    SYNC_OP_MANIFEST_REQUEST, // server -> client: send a fresh manifest
+    SYNC_OP_MANIFEST_ENTRY, // client -> server, payload: see below
+    SYNC_OP_MANIFEST_END,   // client -> server: manifest complete
+    SYNC_OP_FILE_DATA,      // no path, payload: next piece of a compressed FILE
+    SYNC_OP_CHECKPOINT,     // server -> client, no path: see below
+    SYNC_OP_RESUME,         // client -> server, payload: u64 journal id, u64 seq
+    SYNC_OP_STALE,          // client -> server: my copy of path may be out of date
+    SYNC_OP_PARTIAL,        // client -> server, payload: u64 length, prefix hash
+    SYNC_OP_BUNDLE,         // server -> client, no path, payload: see below
+    SYNC_OP_APPEND,         // server -> client, payload: u64 offset + bytes
+    SYNC_OP_CHUNK,          // server -> client, payload: see below
+    SYNC_OP_MAX
+};
+
+// Frame flags
+#define SYNC_FLAG_ZLIB 0x01     // HELLO: compression offered (client) or accepted
+                                // (server). FILE: contents follow as FILE_DATA
+#define SYNC_FLAG_LAST 0x02     // FILE_DATA: last piece of the file
+#define SYNC_FLAG_RESUME 0x04   // FILE: continues the client's partial copy
+#define SYNC_FLAG_BUNDLE 0x08   // HELLO: bundles offered (client) or accepted (server)
+#define SYNC_FLAG_APPEND 0x10   // HELLO: appends offered (client) or accepted (server)
+#define SYNC_FLAG_CHUNKS 0x20   // HELLO: chunked transfers offered (client) or accepted
+
+// Compressed transfer. A client that offers SYNC_FLAG_ZLIB in its HELLO gets a
+// HELLO with the same flag back if the server agrees. From then on the server
+// may send a FILE with SYNC_FLAG_ZLIB whose payload is only the u64 file size;
+// the contents follow as one zlib stream split over FILE_DATA frames of at
+// most SYNC_ZLIB_CHUNK bytes, the last of which carries SYNC_FLAG_LAST.
+// Nothing else is sent between them. Files that do not compress are still
+// sent as plain FILE frames.
+#define SYNC_ZLIB_CHUNK (64 * 1024)
+
+// Initial synchronisation. Right after HELLO (and whenever the server sends
+// MANIFEST_REQUEST) the client describes its copy of the tree with one
+// MANIFEST_ENTRY per file or directory:
+//
+//   u8 type (SYNC_ENTRY_*), u64 size, u64 mtime in ns, optional 16-byte hash
+//
+// followed by MANIFEST_END. The server diffs that against its own tree and
+// sends only missing, changed and deleted entries; files sent this way are
+// followed by ATTR so their mtime matches the server's next time round.
+#define SYNC_ENTRY_FILE 0
+#define SYNC_ENTRY_DIR 1
+#define SYNC_MANIFEST_ENTRY_LEN 17
+
+// Delta transfer of a modified file:
+//
+//   server                              client
+//   SIG_REQUEST path          ->
+//                             <-        SIGNATURE path (block size, then one
+//                                       u32 weak + 16-byte strong hash per
+//                                       full block of its current copy)
+//   DELTA_BEGIN path          ->
+//   DELTA_COPY / DELTA_DATA   ->        rebuild into a temp file
+//   DELTA_END path            ->        verify hash, rename into place
+//
+// A SIGNATURE with no blocks (client has no usable copy, or the rebuilt file
+// failed verification) makes the server send a plain FILE instead.
+#define SYNC_SIG_ENTRY_LEN 20
+
+// Reconnecting. The server's HELLO carries a u64 journal id; every change
+// frame carries the sequence number of the change it belongs to, and a
+// change is complete once a frame of a later change or a CHECKPOINT with
+// seq >= it has arrived. Frames with a lower seq (delta replies, manifest
+// diffs) do not count. A client that remembers the journal id and the last
+// complete change sends, right after its HELLO:
+//
+//   PARTIAL path  (any number) a temp file holding the first u64 length bytes
+//                 of path from an interrupted FILE, with the hash of those bytes
+//   STALE path    (any number) a SIGNATURE was sent for path and the reply
+//                 never arrived
+//   RESUME        journal id and seq
+//
+// If the server still has every change after seq it sends what the client
+// missed followed by a CHECKPOINT, otherwise a MANIFEST_REQUEST. PARTIAL is
+// also accepted before a manifest. A FILE with SYNC_FLAG_RESUME carries only
+// the bytes after the client's partial copy (compressed or not); the client
+// appends them to its temp file; if it cannot, it answers with a SIGNATURE
+// without blocks for path, which brings a complete FILE.
+#define SYNC_JOURNAL_ID_LEN 8
+#define SYNC_RESUME_LEN 16
+#define SYNC_PARTIAL_LEN (8 + 16)
+
+// A CHECKPOINT sent after a batch of live changes may carry a u64 payload:
+// the wall clock time (ns since the epoch) at which the server saw the first
+// event of the batch. The client compares it with the time it finished
+// applying the batch to measure end-to-end latency; older clients ignore it.
+#define SYNC_CHECKPOINT_LEN 8
+
+// Relays. A client started with -R serves its mirror to further clients with
+// a syncserver of its own, passing it on a pipe, for every stamped batch it
+// has applied, the stamp of the origin server and how many relays the batch
+// came through (a RELAY_RECORD: u64 origin stamp, u8 relays). The stamp may
+// then be followed by the origin's stamp and the number of relays between
+// the origin and this server, so each hop and the whole path can be timed.
+// A relay leaves both out of a batch it cannot trace back to its upstream.
+#define SYNC_CHECKPOINT_ORIGIN_LEN (8 + 8 + 1)
+#define SYNC_RELAY_RECORD_LEN (8 + 1)
+
+// Clients receive into ".name.sync-tmp" next to the final path. A server
+// never sends such files, so a relay's mirror is served without them.
+#define SYNC_TEMP_SUFFIX ".sync-tmp"
+
+static inline int sync_is_temp_name(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    size_t len = strlen(name);
+    size_t suffix_len = sizeof(SYNC_TEMP_SUFFIX) - 1;
+    return name[0] == '.' && len > suffix_len && memcmp(name + len - suffix_len, SYNC_TEMP_SUFFIX, suffix_len) == 0;
+}
+
+// Small-file bundles. A client that offers SYNC_FLAG_BUNDLE in its HELLO and
+// gets it back may be sent small files and new directories packed into BUNDLE
+// frames, each payload a run of entries:
+//
+//   u8 type (SYNC_ENTRY_*), u16 path length, u64 seq, u64 size,
+//   u64 mtime in ns, u32 mode, path, size bytes of contents
+//
+// An entry stands for the FILE and ATTR, or the DIR_CREATE, it replaces and
+// belongs to change seq; entries are applied in order as if they had arrived
+// as frames. A directory entry has no contents and its mtime and mode are 0.
+// With SYNC_FLAG_ZLIB the payload is a u64 length followed by the entries
+// deflated as one zlib stream of that length.
+#define SYNC_BUNDLE_ENTRY_LEN 31
+#define SYNC_BUNDLE_MAX (16 * 1024 * 1024)  // largest payload a client accepts
+
+// Followed files. A client that offers SYNC_FLAG_APPEND in its HELLO and gets
+// it back may be sent what was appended to a file it has as an APPEND: a u64
+// offset, then the bytes to write there, in place, followed by ATTR. The
+// offset is at most the size the server last sent, so the client may already
+// have some of the bytes. A client whose copy is shorter than the offset
+// answers with a SIGNATURE for path, which brings a delta.
+#define SYNC_APPEND_HEADER_LEN 8
+
+// Chunked transfer. A client that offers SYNC_FLAG_CHUNKS in its HELLO and
+// gets it back may be sent a large file as CHUNK frames, whose payload is
+//
+//   u64 file size, u64 offset, u32 length, 16-byte hash of the chunk, bytes
+//
+// In place of the FILE the server sends an empty CHUNK (length 0) carrying the
+// change's seq and the offset the contents start at, which is non-zero only
+// when they continue the client's partial copy. The chunks themselves follow
+// in order but only when nothing else is waiting, so other frames (for other
+// paths) come between them; the last carries SYNC_FLAG_LAST and is followed
+// by ATTR. With SYNC_FLAG_ZLIB the bytes of a chunk are deflated on their own;
+// length and hash are those of the inflated bytes. Any other frame for path,
+// for a directory above it or a MANIFEST_REQUEST ends the transfer, and a
+// client that cannot verify a chunk answers with a SIGNATURE without blocks
+// for path once the last one has arrived.
+#define SYNC_CHUNK_HEADER_LEN (8 + 8 + 4 + 16)
+#define SYNC_CHUNK_MAX (4 * 1024 * 1024)  // largest chunk a client accepts
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t path_len;
+    uint64_t payload_len;
+    uint64_t seq;
+} SyncFrameHeader;
+
+static inline void sync_put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void sync_put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 3; i >= 0; i--) {
+        p[i] = v;
+        v >>= 8;
+    }
+}
+
+static inline void sync_put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = v;
+        v >>= 8;
+    }
+}
+
+static inline uint16_t sync_get_u16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t sync_get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline uint64_t sync_get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void sync_encode_header(uint8_t *out, const SyncFrameHeader *hdr) {
+    out[0] = hdr->opcode;
+    out[1] = hdr->flags;
+    sync_put_u16(out + 2, hdr->path_len);
+    sync_put_u64(out + 4, hdr->payload_len);
+    sync_put_u64(out + 12, hdr->seq);
+}
+
+static inline void sync_decode_header(const uint8_t *in, SyncFrameHeader *hdr) {
+    hdr->opcode = in[0];
+    hdr->flags = in[1];
+    hdr->path_len = sync_get_u16(in + 2);
+    hdr->payload_len = sync_get_u64(in + 4);
+    hdr->seq = sync_get_u64(in + 12);
+}
+
+typedef struct {
+    uint8_t type;
+    uint16_t path_len;
+    uint64_t seq;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t mode;
+    const char *path;               // not NUL terminated
+    const char *data;
+} SyncBundleEntry;
+
+// Write the fixed part of a bundle entry; path and contents follow it
+static inline void sync_bundle_put_entry(uint8_t *out, const SyncBundleEntry *e) {
+    out[0] = e->type;
+    sync_put_u16(out + 1, e->path_len);
+    sync_put_u64(out + 3, e->seq);
+    sync_put_u64(out + 11, e->size);
+    sync_put_u64(out + 19, e->mtime_ns);
+    sync_put_u32(out + 27, e->mode);
+}
+
+// Parse the bundle entry at p. Returns its total length, or 0 if it is cut
+// short or malformed.
+static inline size_t sync_bundle_get_entry(const char *p, size_t len, SyncBundleEntry *e) {
+    if (len < SYNC_BUNDLE_ENTRY_LEN) {
+        return 0;
+    }
+    const uint8_t *in = (const uint8_t *)p;
+    e->type = in[0];
+    e->path_len = sync_get_u16(in + 1);
+    e->seq = sync_get_u64(in + 3);
+    e->size = sync_get_u64(in + 11);
+    e->mtime_ns = sync_get_u64(in + 19);
+    e->mode = sync_get_u32(in + 27);
+    size_t rest = len - SYNC_BUNDLE_ENTRY_LEN;
+    if (e->path_len == 0 || e->path_len > SYNC_MAX_PATH || e->path_len > rest ||
+        e->size > rest - e->path_len) {
+        return 0;
+    }
+    e->path = p + SYNC_BUNDLE_ENTRY_LEN;
+    e->data = e->path + e->path_len;
+    if (memchr(e->path, '\0', e->path_len)) {
+        return 0;
+    }
+    return SYNC_BUNDLE_ENTRY_LEN + e->path_len + e->size;
+}
+
+// A relative path received from the network is only applied if it cannot
+// escape the sync directory: not absolute, no "." or ".." components.
+static inline int sync_path_is_safe(const char *path) {
+    if (path[0] == '/' || path[0] == '\0') {
+        return 0;
+    }
+    const char *p = path;
+    while (*p) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return 0;
+        }
+        if (!end) {
+            break;
+        }
+        p = end + 1;
+    }
+    return 1;
+}
+
+// Incremental frame decoder. Bytes are fed in whatever chunks recv() returns;
+// the callbacks fire as soon as each part of a frame is complete. Payloads are
+// streamed through on_payload without being buffered, so frame size is not
+// bounded by memory. A callback returning non-zero aborts decoding.
+typedef struct {
+    int (*on_frame)(void *ctx, const SyncFrameHeader *hdr, const char *path);
+    int (*on_payload)(void *ctx, const SyncFrameHeader *hdr, const char *data, size_t len);
+    int (*on_frame_end)(void *ctx, const SyncFrameHeader *hdr, const char *path);
+} SyncDecoderOps;
+
+enum {
+    SYNC_DEC_HEADER,
+    SYNC_DEC_PATH,
+    SYNC_DEC_PAYLOAD
+};
+
+typedef struct {
+    int state;
+    size_t have;                    // bytes collected for the current part
+    uint8_t header_buf[SYNC_HEADER_LEN];
+    SyncFrameHeader hdr;
+    uint64_t payload_left;
+    char path[SYNC_MAX_PATH + 1];
+} SyncDecoder;
+
+static inline void sync_decoder_init(SyncDecoder *dec) {
+    dec->state = SYNC_DEC_HEADER;
+    dec->have = 0;
+    dec->payload_left = 0;
+    dec->path[0] = '\0';
+}
+
+static inline int sync_decoder_frame_ready(SyncDecoder *dec, const SyncDecoderOps *ops, void *ctx) {
+    if (ops->on_frame && ops->on_frame(ctx, &dec->hdr, dec->path) != 0) {
+        return -1;
+    }
+    if (dec->payload_left == 0) {
+        if (ops->on_frame_end && ops->on_frame_end(ctx, &dec->hdr, dec->path) != 0) {
+            return -1;
+        }
+        dec->state = SYNC_DEC_HEADER;
+    } else {
+        dec->state = SYNC_DEC_PAYLOAD;
+    }
+    dec->have = 0;
+    return 0;
+}
+
+// Returns 0 when all of data was consumed, -1 on a malformed stream or when a
+// callback aborted. The decoder must not be fed again after an error.
+static inline int sync_decoder_feed(SyncDecoder *dec, const char *data, size_t len,
+                                    const SyncDecoderOps *ops, void *ctx) {
+    while (len > 0) {
+        if (dec->state == SYNC_DEC_HEADER) {
+            size_t take = SYNC_HEADER_LEN - dec->have;
+            if (take > len) {
+                take = len;
+            }
+            memcpy(dec->header_buf + dec->have, data, take);
+            dec->have += take;
+            data += take;
+            len -= take;
+            if (dec->have < SYNC_HEADER_LEN) {
+                break;
+            }
+            sync_decode_header(dec->header_buf, &dec->hdr);
+            if (dec->hdr.opcode == 0 || dec->hdr.opcode >= SYNC_OP_MAX ||
+                dec->hdr.path_len > SYNC_MAX_PATH) {
+                return -1;
+            }
+            dec->payload_left = dec->hdr.payload_len;
+            dec->path[0] = '\0';
+            dec->have = 0;
+            if (dec->hdr.path_len > 0) {
+                dec->state = SYNC_DEC_PATH;
+            } else if (sync_decoder_frame_ready(dec, ops, ctx) != 0) {
+                return -1;
+            }
+        } else if (dec->state == SYNC_DEC_PATH) {
+            size_t take = dec->hdr.path_len - dec->have;
+            if (take > len) {
+                take = len;
+            }
+            memcpy(dec->path + dec->have, data, take);
+            dec->have += take;
+            data += take;
+            len -= take;
+            if (dec->have < dec->hdr.path_len) {
+                break;
+            }
+            dec->path[dec->have] = '\0';
+            if (memchr(dec->path, '\0', dec->hdr.path_len)) {
+                return -1;
+            }
+            if (sync_decoder_frame_ready(dec, ops, ctx) != 0) {
+                return -1;
+            }
+        } else {
+            size_t take = dec->payload_left < len ? (size_t)dec->payload_left : len;
+            if (ops->on_payload && ops->on_payload(ctx, &dec->hdr, data, take) != 0) {
+                return -1;
+            }
+            dec->payload_left -= take;
+            data += take;
+            len -= take;
+            if (dec->payload_left == 0) {
+                if (ops->on_frame_end && ops->on_frame_end(ctx, &dec->hdr, dec->path) != 0) {
+                    return -1;
+                }
+                dec->state = SYNC_DEC_HEADER;
+                dec->have = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+#endif
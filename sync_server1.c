@@ -1,64 +1,655 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/inotify.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "sync_protocol.h"
+#include "sync_hash.h"
+#include "sync_ignore.h"
+#include "sync_index.h"
+#include "sync_metrics.h"
+#include "sync_walk.h"
 
 #define EVENT_SIZE  (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + 16))
-#define MAX_CLIENTS 10
-#define MAX_WATCHES 1024
+#define MAX_EPOLL_EVENTS 64
+#define SEND_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_QUEUE_HIGH_WATER (64UL * 1024 * 1024)
+#define MAX_IGNORE_LIST_LEN (64 * 1024)
+#define MAX_SIGNATURE_LEN (64 * 1024 * 1024)
+#define INLINE_LITERAL_MAX (64 * 1024)
+#define DELTA_MAX_BLOCK_SIZE (1024 * 1024)
+#define DELTA_READ_SIZE (256 * 1024)
+#define DEFAULT_COALESCE_MS 50
+#define DEFAULT_COMPRESS_LEVEL 1
+#define COMPRESS_MIN_SIZE 4096
+#define COMPRESS_SAMPLE_SIZE (16 * 1024)
+#define COALESCE_MAX_PENDING 65536
+#define INOTIFY_MAX_READS 64            // per wakeup, so clients are served in between
+#define INDEX_SAVE_INTERVAL_MS (60 * 1000)
+#define DEFAULT_JOURNAL_BYTES (16UL * 1024 * 1024)
+#define DEFAULT_MEMORY_BUDGET (512UL * 1024 * 1024)
+#define MTIME_SLACK_NS (1000ULL * 1000 * 1000)   // file times lag the clock by a tick or so
+#define SHARED_STREAM_WINDOW (16 * 1024 * 1024)
+#define DEFAULT_BUNDLE_BYTES (1024 * 1024)
+#define BUNDLE_FILE_MAX (64 * 1024)
+#define BUNDLE_MAX_ENTRIES 4096
+#define FOLLOW_TAIL_BYTES 4096
+#define DEFAULT_CHUNKED_MIN (16UL * 1024 * 1024)
+#define TRANSFER_CHUNK_SIZE (1024 * 1024)
+#define CHUNK_HASH_SLOTS 256
 
-// Structure to store client info
+// Deflate state of a FILE payload that is sent compressed. The stream is
+// produced one FILE_DATA frame at a time as the socket drains, so memory per
+// transfer stays at one input and one output chunk.
+typedef struct {
+    z_stream zs;
+    uint64_t seq;
+    bool done;
+    uint8_t in[SYNC_ZLIB_CHUNK];
+} Compressor;
+
+// One FILE_DATA frame of a compressed stream that several clients read
+typedef struct SharedChunk {
+    struct SharedChunk *next;
+    int refs;               // readers on this chunk, plus one from the chunk before it
+    bool last;
+    off_t in_bytes;         // file bytes it was deflated from
+    size_t len;
+    char data[];            // frame header and compressed bytes
+} SharedChunk;
+
+// A file sent to every client by the same change. It is stat'ed, sampled
+// and opened once, and compressed once: the first client to need a frame
+// deflates it and the others send the same bytes when their sockets drain.
+// A client more than SHARED_STREAM_WINDOW ahead of the slowest one takes a
+// copy of the deflate state and carries on alone, so memory stays bounded
+// and nobody waits for a slow mirror.
+typedef struct {
+    int refs;               // queued items, plus the change being sent
+    char *path;
+    struct stat st;
+    int fd;                 // -1 until first read
+    bool open_failed;
+    int compressible;       // -1 until sampled
+    uint64_t seq;
+    Compressor *z;          // NULL until the first frame is made
+    off_t z_off;            // file bytes fed to z
+    SharedChunk *first;     // held while some reader has not started
+    int unstarted;
+    SharedChunk *tail;
+    size_t retained;        // bytes in chunks still referenced
+} SharedFile;
+
+// Small files and new directories queued for one BUNDLE frame. Only their
+// paths are kept while it waits; the files are read and the frame is built
+// when it reaches the head of the queue, like a file item is opened then.
 typedef struct {
+    char *names;            // per entry: u8 type, u64 seq, u16 length, path, NUL
+    size_t names_len;
+    size_t names_cap;
+    unsigned count;
+    size_t estimate;        // payload bytes expected, counted in queued_bytes
+} Bundle;
+
+// One pending write on a client socket. Either an owned buffer (data != NULL)
+// or a byte range of a file (is_file) that is streamed on demand. File items
+// are opened by path only when they reach the head of the queue, so a long
+// queue does not pin one descriptor per file.
+typedef struct OutItem {
+    struct OutItem *next;
+    char *data;
+    size_t len;
+    size_t off;
+    bool is_file;
+    int file_fd;            // -1 until opened
+    char *file_path;
+    off_t file_off;
+    off_t file_end;
+    bool joined_next;       // next item is part of the same message
+    bool no_sendfile;       // kernel refused sendfile for this fd; use pread+send
+    Compressor *z;          // file range is sent as compressed FILE_DATA frames
+    SharedFile *shared;     // file_fd belongs to it and file_path is unused
+    bool share_stream;      // frames come from shared's chunks; data is not owned
+    SharedChunk *chunk;     // shared frame being sent, NULL before the first
+    Bundle *bundle;         // data is built from it at the head of the queue
+} OutItem;
+
+// A large file going to one client as CHUNK frames. Transfers wait on their
+// own list and the next chunk is read only when the client's queue is empty,
+// so whatever else happens meanwhile is sent between two chunks instead of
+// behind the whole file. Their bytes are not counted in queued_bytes.
+typedef struct Transfer {
+    struct Transfer *next;
+    char *path;             // relative path
+    char *file_path;
+    int fd;                 // -1 until the first chunk is read
+    off_t offset;           // next chunk starts here
+    struct stat st;         // as announced; size bounds the transfer
+    uint64_t seq;
+    bool compress;
+} Transfer;
+
+// Structure to store client info
+typedef struct Client {
     int socket;
     struct sockaddr_in address;
-    char *ignore_list;
+    char *ignore_list;      // HELLO payload while it is being received
+    size_t ignore_len;
+    IgnoreMatcher ignore;   // compiled from ignore_list once HELLO is complete
+    SyncDecoder decoder;    // frames sent by the client
+    uint8_t control[64];    // payload of small control frames
+    size_t control_len;
+    struct Manifest *manifest; // client's tree while its manifest is arriving
+    bool live;              // manifest diff done; receives individual events
+    uint8_t *signature;     // SIGNATURE payload being received
+    size_t signature_len;
+    bool handshake_done;
+    bool closing;
+    bool want_write;
+    bool needs_rescan;      // queue overflowed; ask for a new manifest once drained
+    bool rescanning;        // generating a manifest diff
+    bool replying;          // queueing the delta the client asked for
+    size_t queued_bytes;    // bytes still to be written from out_head..out_tail
+    size_t held_bytes;      // of which in memory rather than in files, see memory_held
+    bool compress;          // client accepted SYNC_FLAG_ZLIB
+    bool bundle;            // client accepted SYNC_FLAG_BUNDLE
+    bool append;            // client accepted SYNC_FLAG_APPEND
+    bool chunks;            // client accepted SYNC_FLAG_CHUNKS
+    uint64_t zlib_in;       // file bytes fed to the compressor
+    uint64_t zlib_out;      // compressed bytes produced
+    unsigned long files_compressed;
+    unsigned long files_uncompressible;
+    double compress_cpu;    // seconds of CPU spent sampling and compressing
+    struct Manifest *partials; // PARTIAL copies the client can resume from
+    struct Manifest *stale; // STALE paths reported before RESUME
+    struct Manifest *owed;  // paths to send again once renamed, see owe_contents()
+    size_t owed_count;
+    uint64_t checkpoint;    // last CHECKPOINT queued
+    uint64_t bytes_sent;
+    int index;              // position in clients[]
+    struct Client *next_closed;
+    OutItem *out_head;
+    OutItem *out_tail;
+    Transfer *transfers;    // large files still to be sent in chunks, oldest first
+    Transfer *transfers_tail;
 } Client;
 
+// One file or directory from a client's manifest
+typedef struct {
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint8_t type;
+    bool has_hash;
+    bool seen;              // matched by the server's tree during the diff
+    uint8_t hash[SYNC_HASH_LEN];
+    char path[];
+} ManifestEntry;
+
+// Open-addressing hash table of ManifestEntry keyed by path
+typedef struct Manifest {
+    ManifestEntry **slots;
+    size_t capacity;
+    size_t count;
+} Manifest;
+
+// A watched directory. Each entry is indexed twice: by wd to dispatch
+// events and by path to handle renames and removals of whole subtrees.
 typedef struct {
     int wd;
-    char path[PATH_MAX];
-} WatchDescriptorMap;
+    uint64_t path_hash;
+    char *path;
+} WatchEntry;
 
-WatchDescriptorMap watch_map[MAX_WATCHES];
-int watch_count = 0;
+// Two open-addressing tables (linear probing, backward-shift deletion) that
+// share one capacity and grow together; no limit on the number of watches.
+typedef struct {
+    WatchEntry **by_wd;
+    WatchEntry **by_path;
+    size_t capacity;
+    size_t count;
+} WatchTable;
+
+WatchTable watches;
+
+// Rename seen as IN_MOVED_FROM, waiting for its IN_MOVED_TO
+uint32_t pending_move_cookie = 0;
+bool pending_move_is_dir = false;
+char pending_move_path[PATH_MAX];
+
+// Net effect of the events seen for one path since the last flush, relative
+// to what clients were sent before. Kept in a hash table by path and in a
+// list in the order the changes have to be applied.
+typedef struct Change {
+    struct Change *prev;
+    struct Change *next;
+    uint64_t path_hash;
+    char *origin;           // client-side path of an object renamed to path
+    bool existed;           // clients may have something at path
+    bool exists;            // something is at path now
+    bool fresh;             // what is at path now is unknown to clients
+    bool dirty;             // contents changed since the clients' copy
+    bool moved_away;        // clients' object at path is renamed by another change
+    bool removed_dir;       // a directory at path was deleted or moved out
+    bool is_dir;
+    bool walk;              // fresh directory: send its contents as they are
+    bool appended;          // followed file written to; see follow_check()
+    char path[];
+} Change;
+
+typedef struct {
+    Change **slots;
+    size_t capacity;
+    size_t count;
+    Change *head;
+    Change *tail;
+    uint64_t deadline_ns;   // flush time, 0 while nothing is pending
+    uint64_t opened_ns;     // monotonic time of the first pending event
+    uint64_t first_event_ns; // wall clock time of the first pending event
+    unsigned long events;   // watcher events folded in since the last flush
+} Coalescer;
+
+Coalescer coalescer;
+unsigned long coalesce_window_ms = DEFAULT_COALESCE_MS;
+unsigned long events_suppressed = 0;   // total events that never reached a client
+
+// A change as it was sent to clients. The most recent ones are kept so a
+// client that reconnects is sent only what it missed.
+typedef struct {
+    uint64_t seq;
+    size_t size;            // bytes charged to the journal
+    bool known;             // clients may have had something at path before
+    bool exists;
+    bool fresh;
+    bool dirty;
+    bool removed_dir;
+    bool is_dir;
+    bool walk;
+    char *origin;           // renamed from, NULL if not a rename
+    char path[];
+} JournalEntry;
+
+// Ring buffer of entries in seq order, bounded by the memory they take
+typedef struct {
+    JournalEntry **entries;
+    size_t capacity;        // power of two
+    size_t first;
+    size_t count;
+    size_t bytes;
+    uint64_t floor;         // changes up to this seq can no longer be replayed
+    uint64_t id;            // tells a client whether its seq is from this journal
+} Journal;
+
+Journal journal;
+size_t journal_limit = DEFAULT_JOURNAL_BYTES;
 
+// Set while a batch of changes is queued; flush_client() then leaves the
+// sockets alone until the whole batch is in every queue.
+bool batching = false;
 
-Client clients[MAX_CLIENTS];
+// Connected clients, grown on demand. The only limit on the number of mirrors
+// is max_clients from the command line and the process fd limit. Clients
+// closed during an epoll batch keep their slot, marked closing, until
+// reap_clients() so loops over clients[] are never disturbed by a close.
+Client **clients = NULL;
 int client_count = 0;
-pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+int client_capacity = 0;
+Client *closed_clients = NULL;   // closed this epoll batch, freed by reap_clients()
+int closed_count = 0;            // of them, still in clients[]
+
+// A client whose queue grows past this many bytes stops receiving individual
+// events and is resynchronised from a fresh manifest once its socket catches up.
+size_t queue_high_water = DEFAULT_QUEUE_HIGH_WATER;
+
+// Frames queued to all clients may hold this much memory (-M). Past it the
+// server stops reading inotify and client requests until the queues are
+// down to three quarters of it; events the kernel drops meanwhile are
+// recovered by the overflow rescan.
+size_t memory_budget = DEFAULT_MEMORY_BUDGET;
+size_t memory_held = 0;
+bool throttled = false;
+
+// The kernel dropped events (IN_Q_OVERFLOW); the tree is rescanned once the
+// queue is drained. Every event before inotify_drained_ns (wall clock, when
+// the queue was last read empty) was delivered, so only what was modified
+// since then can have been missed, and only changes after
+// inotify_drained_seq were sent from a tree that may have moved on.
+bool inotify_overflowed = false;
+uint64_t inotify_drained_ns = 0;
+uint64_t inotify_drained_seq = 0;
+const char *sync_root;
+
+// Number of read/write/sendfile calls issued for file payloads, reported by
+// the transfer benchmark (-B).
+unsigned long transfer_syscalls = 0;
+
+// Opens of files being sent and bytes read from them into userspace,
+// reported by the fan-out benchmark (-F)
+unsigned long file_opens = 0;
+uint64_t file_bytes_read = 0;
+
+// Clients sent the same file by one change share a SharedFile; the fan-out
+// benchmark turns this off to compare
+bool share_fanout = true;
+
+// Counters served on the stats socket (-m). Only the reactor thread updates
+// them, so plain increments are enough.
+typedef struct {
+    uint64_t events_received;       // inotify events read
+    uint64_t changes_sent;          // coalesced changes queued to clients
+    uint64_t batches;               // coalescer flushes
+    uint64_t bytes_sent;            // to clients that have disconnected
+    uint64_t clients_accepted;
+    uint64_t rescans;               // clients downgraded to a manifest diff
+    uint64_t replays;               // reconnects resumed from the journal
+    uint64_t overflows;             // inotify queue overflows recovered by a rescan
+    uint64_t throttles;             // times memory_budget paused the inputs
+    uint64_t bundles;               // BUNDLE frames built
+    uint64_t bundled_files;         // files sent in them
+    uint64_t appends;               // APPEND frames queued
+    uint64_t append_bytes;          // file bytes in them
+    uint64_t follow_rewrites;       // followed files resent as they were not appended to
+    uint64_t transfers;             // files sent in chunks
+    uint64_t chunks;                // CHUNK frames with contents queued
+    uint64_t transfers_cancelled;   // chunked transfers overtaken by a later change
+    SyncHistogram batch_delay;      // first event of a batch to its flush
+} ServerMetrics;
+
+ServerMetrics metrics;
+const char *stats_path = NULL;
+int stats_fd = -1;
+
+// zlib level for clients that ask for compression; 0 turns it off (-z)
+int compress_level = DEFAULT_COMPRESS_LEVEL;
+
+// Files up to BUNDLE_FILE_MAX bytes and new directories go to clients that
+// accept bundles in BUNDLE frames of up to this many payload bytes; 0 sends
+// each on its own (-b). A bundle at the tail of a queue takes more entries
+// until it holds this much or BUNDLE_MAX_ENTRIES, a frame of another kind is
+// queued behind it or the socket takes it, which is at the latest when the
+// batch of the coalescing window has been queued.
+size_t bundle_limit = DEFAULT_BUNDLE_BYTES;
+
+// Files of at least this many bytes go to clients that accept chunked
+// transfers as CHUNK frames of TRANSFER_CHUNK_SIZE, sent only while nothing
+// else is queued for the client; 0 sends every file whole (-L)
+size_t chunked_min = DEFAULT_CHUNKED_MIN;
+
+// Files matching these rules (-T) are followed as they grow: watches also
+// report IN_MODIFY, and clients that accept appends are sent only the bytes
+// added since they were last sent the file. Writes to them are sent at most
+// follow_window_ms (-t, default the coalescing window) after the first one,
+// or sooner with other changes.
+IgnoreMatcher follow_rules;
+bool following = false;
+long follow_window_ms = -1;
+uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE;
+
+// The size of each followed file as clients were last sent it, and the hash
+// of the FOLLOW_TAIL_BYTES before that point. A file that has shrunk or no
+// longer has those bytes was rewritten, and is sent as a delta instead.
+Manifest *followed = NULL;
+
+// Sequence number stamped on every change frame, shared by all clients
+uint64_t next_seq = 1;
+
+// Persistent index of the sync directory (-x); without one the tree is
+// walked at startup and for every manifest diff
+const char *index_file = NULL;
+TreeIndex tree_index;
+struct stat root_stat;
+uint64_t index_saved_ns = 0;
+
+// Threads walking the tree (-j, 0 for one per CPU). The event loop waits for
+// a walk to finish, so the walk's callbacks only have each other to guard
+// against; they take walk_lock around the server's structures.
+int walk_threads = 0;
+SyncWalker *walker;
+pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by SIGINT/SIGTERM so the index is saved before exiting
+volatile sig_atomic_t stop_requested = 0;
+
+// When serving a relay's mirror (-u, passed by syncclient -R): the pipe on
+// which the relay reports the origin of each upstream batch it has applied,
+// and the earliest such origin not yet handed on. A batch is traced back to
+// it if the report came after the batch's first event, which the relay's
+// writes caused; a report older than that batch had no events of its own.
+int upstream_fd = -1;
+uint64_t upstream_origin_ns = 0;
+uint8_t upstream_relays = 0;
+uint64_t upstream_seen_ns = 0;
+
 int fd;
-int wd[MAX_WATCHES];
+int server_fd;
+int epoll_fd;
 
-void *handle_client(void *arg);
-void *watch_directory(void *arg);
+void accept_clients(int max_clients);
+void handle_client(Client *client);
+void close_client(Client *client);
+void reap_clients(void);
+void flush_client(Client *client);
+void handle_inotify_events(const char *sync_dir);
+void update_throttle(void);
+void recover_overflow(const char *sync_dir);
+static uint64_t realtime_ns(void);
+static uint64_t stat_mtime_ns(const struct stat *st);
+static int build_bundle(Client *client, OutItem *item);
+static OutItem *make_file_item(const char *filepath, off_t start, off_t end);
+static bool enqueue_file_frame(Client *client, OutItem *header, OutItem *item);
+void serve_stats(void);
+void read_upstream(void);
 void add_watch_recursive(const char *dir_path);
-void send_file(int client_socket, const char *filepath, const char *relative_path);
-bool is_ignored(Client *client, const char *filename);
-void send_directory_structure(int client_socket, const char *base_dir, const char *relative_path) ;
+WatchEntry *watch_find_wd(WatchTable *t, int wd);
+WatchEntry *watch_find_path(WatchTable *t, const char *path);
+void watch_insert(WatchTable *t, int wd, const char *path);
+void watch_remove(WatchTable *t, WatchEntry *entry);
+void watch_rename_subtree(WatchTable *t, const char *old_path, const char *new_path);
+void watch_remove_subtree(WatchTable *t, const char *path);
+int run_watch_benchmark(long count);
+void send_file(Client *client, const char *filepath, const char *relative_path, uint64_t seq);
+bool send_delta(Client *client, const char *relative_path, const uint8_t *signature, size_t signature_len, uint64_t seq);
+void send_attr(Client *client, const char *relative_path, const struct stat *st, uint64_t seq);
+void send_append(Client *client, const char *filepath, const char *relative_path, off_t from,
+                 const struct stat *st, uint64_t seq);
+void send_dir_create(Client *client, const char *relative_path, uint64_t seq);
+void send_frame(Client *client, uint8_t opcode, const char *path, const void *payload, size_t payload_len, uint64_t seq);
+void send_hello(Client *client);
+bool is_ignored(Client *client, const char *relative_path, bool is_dir);
+void send_manifest_diff(Client *client);
+void owe_contents(Client *client, const char *relative_path);
+void drop_transfers(Client *client);
+void cancel_transfers(Client *client, const char *path);
+void contents_sent(Client *client, const char *relative_path);
+void request_signature(Client *client, const char *relative_path, uint64_t seq);
+bool send_owed(Client *client, const char *old_path, const char *new_path, bool is_dir, uint64_t seq);
+void coalesce_flush(const char *remap_from, const char *remap_to);
+int coalesce_timeout_ms(void);
+Manifest *manifest_create(void);
+void manifest_free(Manifest *m);
+ManifestEntry *manifest_find(Manifest *m, const char *path);
+ManifestEntry *manifest_add(Manifest *m, const char *path);
+void manifest_remove(Manifest *m, const char *path);
+int run_transfer_benchmark(const char *path);
+int run_fanout_benchmark(const char *path);
+int run_ignore_benchmark(long rule_count);
+int run_walk_benchmark(const char *path);
+void load_tree_index(void);
+void save_tree_index(void);
+int index_timeout_ms(void);
+void journal_init(void);
+bool replay_journal(Client *client, uint64_t seq);
+
+static int set_nonblocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-q queue_high_water_bytes] [-c coalesce_ms] [-z zlib_level] [-b bundle_bytes]\n"
+           "          [-x index_file] [-J journal_bytes] [-M memory_budget_bytes] [-j walk_threads]\n"
+           "          [-T follow_rules] [-t follow_ms] [-m stats_socket] [-l quiet|info|debug]\n"
+           "          [-L chunked_min_bytes] [-u upstream_fd]\n"
+           "          <sync_dir> <port> <max_clients>\n", prog);
+    printf("       %s -B <file>   (benchmark file transfer paths and exit)\n", prog);
+    printf("       %s -F <file>   (benchmark sending a file to many clients and exit)\n", prog);
+    printf("       %s -W <count>  (benchmark watch lookups with count directories and exit)\n", prog);
+    printf("       %s -I <rules>  (benchmark the ignore matcher with that many rules and exit)\n", prog);
+    printf("       %s -D <dir>    (benchmark walking a directory tree and exit)\n", prog);
+    exit(1);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <sync_dir> <port> <max_clients>\n", argv[0]);
-        exit(1);
+    int opt;
+    int log_level = SYNC_LOG_INFO;
+    while ((opt = getopt(argc, argv, "q:c:z:b:x:J:M:j:T:t:L:m:l:u:B:F:W:I:D:")) != -1) {
+        switch (opt) {
+        case 'B':
+            return run_transfer_benchmark(optarg);
+        case 'F':
+            return run_fanout_benchmark(optarg);
+        case 'W':
+            return run_watch_benchmark(atol(optarg));
+        case 'I':
+            return run_ignore_benchmark(atol(optarg));
+        case 'D':
+            return run_walk_benchmark(optarg);
+        case 'q':
+            queue_high_water = strtoull(optarg, NULL, 10);
+            if (queue_high_water == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            coalesce_window_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            compress_level = atoi(optarg);
+            if (compress_level < 0 || compress_level > 9) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            // An entry may run BUNDLE_FILE_MAX past the limit
+            bundle_limit = strtoull(optarg, NULL, 10);
+            if (bundle_limit > SYNC_BUNDLE_MAX / 2) {
+                usage(argv[0]);
+            }
+            break;
+        case 'x':
+            index_file = optarg;
+            break;
+        case 'J':
+            journal_limit = strtoull(optarg, NULL, 10);
+            break;
+        case 'M':
+            memory_budget = strtoull(optarg, NULL, 10);
+            if (memory_budget == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'j':
+            walk_threads = atoi(optarg);
+            if (walk_threads < 1 || walk_threads > SYNC_WALK_MAX_THREADS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'T':
+            if (ignore_compile(&follow_rules, optarg, strlen(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+            following = true;
+            break;
+        case 't':
+            follow_window_ms = strtol(optarg, NULL, 10);
+            if (follow_window_ms < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            chunked_min = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            stats_path = optarg;
+            break;
+        case 'l':
+            log_level = sync_parse_log_level(optarg);
+            if (log_level < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'u':
+            upstream_fd = atoi(optarg);
+            if (upstream_fd < 0 || set_nonblocking(upstream_fd) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+    }
+    if (follow_window_ms < 0) {
+        follow_window_ms = coalesce_window_ms;
+    }
+    if (following) {
+        watch_mask |= IN_MODIFY;
+        followed = manifest_create();
     }
     
-    char *sync_dir = argv[1];
-    int port = atoi(argv[2]);
-    int max_clients = atoi(argv[3]);
+    char *sync_dir = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    int max_clients = atoi(argv[optind + 2]);
+    sync_root = sync_dir;
 
-    int server_fd, new_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = request_stop;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    sync_log_init(log_level);
+    raise_fd_limit();
 
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
@@ -66,6 +657,9 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
@@ -75,317 +669,4870 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (listen(server_fd, max_clients) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
         exit(1);
     }
+    set_nonblocking(server_fd);
 
-    printf("Server listening on port %d, watching directory: %s\n", port, sync_dir);
+    walker = sync_walker_create(walk_threads ? walk_threads : sync_walk_default_threads());
+    if (!walker) {
+        perror("Cannot start tree walker");
+        exit(1);
+    }
 
-    pthread_t watch_thread;
-    pthread_create(&watch_thread, NULL, watch_directory, sync_dir);
-    
-    while (1) {
-        new_socket = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
-        if (new_socket < 0) {
-            perror("Accept failed");
-            continue;
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init failed");
+        exit(1);
+    }
+    // Nothing before the watches are set up can be missed
+    inotify_drained_ns = realtime_ns();
+    if (index_file) {
+        load_tree_index();
+    } else {
+        add_watch_recursive(sync_dir);
+    }
+    journal_init();
+    inotify_drained_seq = next_seq - 1;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create failed");
+        exit(1);
+    }
+
+    // The listening sockets and the inotify fd are tagged with the address of
+    // their global so they can be told apart from Client pointers.
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (stats_path) {
+        stats_fd = sync_stats_listen(stats_path, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (stats_fd < 0) {
+            perror("Stats socket failed");
+            exit(1);
         }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &stats_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stats_fd, &ev);
+    }
+    if (upstream_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &upstream_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upstream_fd, &ev);
+    }
 
-        pthread_mutex_lock(&client_mutex);
-        if (client_count >= max_clients) {
-            printf("Max clients reached, rejecting connection\n");
-            close(new_socket);
-        } else {
-            // Check for free client slot
-            for(int i=0;i<MAX_CLIENTS;i++){
-                if(clients[i].socket == -1 || clients[i].socket == 0){
-                    clients[i].socket = new_socket;
-                    clients[i].address = client_addr;
-                    pthread_t client_thread;
-                    pthread_create(&client_thread, NULL, handle_client, &clients[i]);
-                    break;
+    log_info("Server listening on port %d, watching directory: %s\n", port, sync_dir);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (!stop_requested) {
+        // While throttled the coalescer keeps its changes until the queues drain
+        int timeout = throttled ? -1 : coalesce_timeout_ms();
+        int save_timeout = index_timeout_ms();
+        if (save_timeout >= 0 && (timeout < 0 || save_timeout < timeout)) {
+            timeout = save_timeout;
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &server_fd) {
+                accept_clients(max_clients);
+            } else if (tag == &fd) {
+                handle_inotify_events(sync_dir);
+            } else if (tag == &stats_fd) {
+                serve_stats();
+            } else if (tag == &upstream_fd) {
+                read_upstream();
+            } else {
+                Client *client = (Client *)tag;
+                if (client->closing) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                    close_client(client);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    handle_client(client);
+                }
+                if ((events[i].events & EPOLLOUT) && !client->closing) {
+                    flush_client(client);
                 }
             }
-            client_count++;
         }
-        pthread_mutex_unlock(&client_mutex);
+        if (!throttled && coalescer.deadline_ns && coalesce_timeout_ms() == 0) {
+            coalesce_flush(NULL, NULL);
+        }
+        if (index_timeout_ms() == 0) {
+            save_tree_index();
+        }
+        // Clients are only freed once no event in this batch can refer to them
+        reap_clients();
+        update_throttle();
+    }
+
+    if (index_file) {
+        coalesce_flush(NULL, NULL);
+        save_tree_index();
     }
-    
     close(server_fd);
+    if (stats_fd >= 0) {
+        close(stats_fd);
+        unlink(stats_path);
+    }
     return 0;
 }
 
-void *handle_client(void *arg) {
-    Client *client = (Client *)arg;
-    char buffer[256];
+static void update_client_events(Client *client) {
+    struct epoll_event ev;
+    ev.events = (throttled ? 0 : EPOLLIN) | EPOLLRDHUP;
+    if (client->want_write) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &ev);
+}
 
-    int bytes_received = recv(client->socket, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received <= 0) {
-        perror("Failed to receive ignore list");
-        close(client->socket);
-        client->socket = -1;
-        return NULL;
+// Stop reading inotify and client requests while the queues hold more than
+// memory_budget, and resume once they are down to three quarters of it
+void update_throttle(void) {
+    bool over = memory_held > (throttled ? memory_budget / 4 * 3 : memory_budget);
+    if (over == throttled) {
+        return;
     }
-    client->ignore_list = (char *)malloc(bytes_received + 1);
-    if (!client->ignore_list) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    throttled = over;
+    if (throttled) {
+        metrics.throttles++;
+        log_info("Queued frames hold %zu bytes, over the memory budget: pausing events and requests\n",
+                 memory_held);
+    } else {
+        log_info("Queues drained to %zu bytes, resuming events and requests\n", memory_held);
     }
-
-    buffer[bytes_received] = '\0';
-    strncpy(client->ignore_list, buffer, bytes_received + 1);
-    printf("Client connected with ignore list: %s\n", client->ignore_list);
-
-    // pthread_mutex_lock(&client_mutex);
-    // send_directory_structure(client->socket, watch_map[0].path, "");
-    // pthread_mutex_unlock(&client_mutex);
-
-    while (1) {
-        sleep(1);
-        char check_connection[10];
-        int bytes_received = recv(client->socket, check_connection, sizeof(check_connection) - 1, MSG_DONTWAIT);
-        if (bytes_received == 0) {
-            // Print IP address of disconnected client
-            char ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client->address.sin_addr, ip, INET_ADDRSTRLEN);
-            printf("Client disconnected: %s\n", ip);
-            close(client->socket);
-            //Free memory allocated for ignore list
-            free(client->ignore_list);
-            client->socket = -1;
-            client_count--;
-            break;
+    struct epoll_event ev;
+    ev.events = throttled ? 0 : EPOLLIN;
+    ev.data.ptr = &fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    for (int i = 0; i < client_count; i++) {
+        if (!clients[i]->closing) {
+            update_client_events(clients[i]);
         }
     }
-    return NULL;
 }
 
-void send_directory_structure(int client_socket, const char *base_dir, const char *relative_path) {
-    DIR *dir = opendir(base_dir);
-    if (!dir) {
-        perror("opendir failed");
-        return;
-    }
+void accept_clients(int max_clients) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int new_socket = accept4(server_fd, (struct sockaddr *)&client_addr, &addr_len,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            return;
+        }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        if (max_clients > 0 && client_count - closed_count >= max_clients) {
+            log_info("Max clients reached, rejecting connection\n");
+            close(new_socket);
             continue;
         }
 
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, entry->d_name);
-
-        char new_relative_path[PATH_MAX];
-        snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s", relative_path, entry->d_name);
-
-        if (entry->d_type == DT_DIR) {
-            // Send directory creation message
-            char message[512];
-            snprintf(message, sizeof(message), "DIR_CREATE %s\n", new_relative_path);
-            send(client_socket, message, strlen(message), 0);
-
-            // Recursively process subdirectories
-            send_directory_structure(client_socket, full_path, new_relative_path);
-        } else if (entry->d_type == DT_REG) {
-            // Send file metadata and content and check if its ignored
-            if (is_ignored(clients, entry->d_name)) {
+        if (client_count == client_capacity) {
+            int new_capacity = client_capacity ? client_capacity * 2 : 16;
+            Client **grown = realloc(clients, new_capacity * sizeof(Client *));
+            if (!grown) {
+                perror("Memory allocation failed");
+                close(new_socket);
                 continue;
             }
-            send_file(client_socket, full_path, new_relative_path);
+            clients = grown;
+            client_capacity = new_capacity;
+        }
+
+        Client *client = calloc(1, sizeof(Client));
+        if (!client) {
+            perror("Memory allocation failed");
+            close(new_socket);
+            continue;
+        }
+        client->socket = new_socket;
+        client->address = client_addr;
+        sync_decoder_init(&client->decoder);
+        client->index = client_count;
+        clients[client_count++] = client;
+
+        struct epoll_event ev;
+        ev.events = (throttled ? 0 : EPOLLIN) | EPOLLRDHUP;
+        ev.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close_client(client);
         }
+        metrics.clients_accepted++;
     }
-    closedir(dir);
 }
 
+static void write_stats(FILE *out) {
+    sync_metric_help(out, "sync_clients", "gauge", "Connected clients.");
+    sync_metric_value(out, "sync_clients", NULL, client_count - closed_count);
+    sync_metric_help(out, "sync_clients_accepted_total", "counter", "Client connections accepted.");
+    sync_metric_value(out, "sync_clients_accepted_total", NULL, metrics.clients_accepted);
+    sync_metric_help(out, "sync_watches", "gauge", "Directories watched with inotify.");
+    sync_metric_value(out, "sync_watches", NULL, watches.count);
+    sync_metric_help(out, "sync_events_received_total", "counter", "Inotify events read.");
+    sync_metric_value(out, "sync_events_received_total", NULL, metrics.events_received);
+    sync_metric_help(out, "sync_events_suppressed_total", "counter",
+                     "Events folded into another change by the coalescer.");
+    sync_metric_value(out, "sync_events_suppressed_total", NULL, events_suppressed);
+    sync_metric_help(out, "sync_changes_sent_total", "counter", "Coalesced changes queued to clients.");
+    sync_metric_value(out, "sync_changes_sent_total", NULL, metrics.changes_sent);
+    sync_metric_help(out, "sync_pending_changes", "gauge", "Changes waiting for the coalescing window.");
+    sync_metric_value(out, "sync_pending_changes", NULL, coalescer.count);
+    sync_metric_help(out, "sync_batches_total", "counter", "Batches of changes flushed to clients.");
+    sync_metric_value(out, "sync_batches_total", NULL, metrics.batches);
+    sync_metric_histogram(out, "sync_batch_delay_seconds",
+                          "Time from the first event of a batch until it is queued to clients.",
+                          &metrics.batch_delay);
+    sync_metric_help(out, "sync_last_seq", "gauge", "Sequence number of the latest change.");
+    sync_metric_value(out, "sync_last_seq", NULL, next_seq - 1);
+    sync_metric_help(out, "sync_journal_changes", "gauge", "Changes kept for clients that reconnect.");
+    sync_metric_value(out, "sync_journal_changes", NULL, journal.count);
+    sync_metric_help(out, "sync_rescans_total", "counter", "Clients resynchronised after overflowing their queue.");
+    sync_metric_value(out, "sync_rescans_total", NULL, metrics.rescans);
+    sync_metric_help(out, "sync_replays_total", "counter", "Reconnected clients sent only what they missed.");
+    sync_metric_value(out, "sync_replays_total", NULL, metrics.replays);
+    sync_metric_help(out, "sync_inotify_overflows_total", "counter", "Inotify queue overflows recovered by a rescan.");
+    sync_metric_value(out, "sync_inotify_overflows_total", NULL, metrics.overflows);
+    sync_metric_help(out, "sync_memory_held_bytes", "gauge", "Memory held by frames queued to clients.");
+    sync_metric_value(out, "sync_memory_held_bytes", NULL, memory_held);
+    sync_metric_help(out, "sync_throttles_total", "counter", "Times the memory budget paused reading events and requests.");
+    sync_metric_value(out, "sync_throttles_total", NULL, metrics.throttles);
+    sync_metric_help(out, "sync_bundles_total", "counter", "BUNDLE frames of small files and directories sent.");
+    sync_metric_value(out, "sync_bundles_total", NULL, metrics.bundles);
+    sync_metric_help(out, "sync_bundled_files_total", "counter", "Files sent in BUNDLE frames.");
+    sync_metric_value(out, "sync_bundled_files_total", NULL, metrics.bundled_files);
+    sync_metric_help(out, "sync_appends_total", "counter", "APPEND frames of bytes added to followed files.");
+    sync_metric_value(out, "sync_appends_total", NULL, metrics.appends);
+    sync_metric_help(out, "sync_append_bytes_total", "counter", "File bytes sent in APPEND frames.");
+    sync_metric_value(out, "sync_append_bytes_total", NULL, metrics.append_bytes);
+    sync_metric_help(out, "sync_follow_rewrites_total", "counter",
+                     "Followed files sent as a delta because they were not only appended to.");
+    sync_metric_value(out, "sync_follow_rewrites_total", NULL, metrics.follow_rewrites);
+    sync_metric_help(out, "sync_transfers_total", "counter", "Large files sent in chunks.");
+    sync_metric_value(out, "sync_transfers_total", NULL, metrics.transfers);
+    sync_metric_help(out, "sync_chunks_total", "counter", "CHUNK frames of large files sent.");
+    sync_metric_value(out, "sync_chunks_total", NULL, metrics.chunks);
+    sync_metric_help(out, "sync_transfers_cancelled_total", "counter",
+                     "Chunked transfers stopped by a later change to the file.");
+    sync_metric_value(out, "sync_transfers_cancelled_total", NULL, metrics.transfers_cancelled);
+    sync_metric_help(out, "sync_file_opens_total", "counter", "Opens of files being sent.");
+    sync_metric_value(out, "sync_file_opens_total", NULL, file_opens);
+    sync_metric_help(out, "sync_file_read_bytes_total", "counter", "File bytes read into userspace to be sent.");
+    sync_metric_value(out, "sync_file_read_bytes_total", NULL, file_bytes_read);
+    uint64_t bytes_sent = metrics.bytes_sent;
+    for (int j = 0; j < client_count; j++) {
+        if (!clients[j]->closing) {
+            bytes_sent += clients[j]->bytes_sent;
+        }
+    }
+    sync_metric_help(out, "sync_bytes_sent_total", "counter", "Bytes written to all clients.");
+    sync_metric_value(out, "sync_bytes_sent_total", NULL, bytes_sent);
 
-bool is_ignored(Client *client, const char *filename) {
-    //Check if the extension is in the ignore list
-    char *ext = strrchr(filename, '.');
-    if (ext) {
-        ext++;
-        if (strstr(client->ignore_list, ext) != NULL) {
-            return true;
+    // Per client, labelled with its address
+    char (*labels)[64] = client_count ? calloc(client_count, sizeof(*labels)) : NULL;
+    if (client_count && !labels) {
+        return;
+    }
+    for (int j = 0; j < client_count; j++) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clients[j]->address.sin_addr, ip, INET_ADDRSTRLEN);
+        snprintf(labels[j], sizeof(labels[j]), "client=\"%s:%d\"", ip, ntohs(clients[j]->address.sin_port));
+    }
+    sync_metric_help(out, "sync_client_bytes_sent_total", "counter", "Bytes written to the client.");
+    for (int j = 0; j < client_count; j++) {
+        sync_metric_value(out, "sync_client_bytes_sent_total", labels[j], clients[j]->bytes_sent);
+    }
+    sync_metric_help(out, "sync_client_queue_bytes", "gauge", "Bytes queued for the client.");
+    for (int j = 0; j < client_count; j++) {
+        sync_metric_value(out, "sync_client_queue_bytes", labels[j], clients[j]->queued_bytes);
+    }
+    sync_metric_help(out, "sync_client_queue_items", "gauge", "Messages and file ranges queued for the client.");
+    for (int j = 0; j < client_count; j++) {
+        uint64_t items = 0;
+        for (OutItem *item = clients[j]->out_head; item; item = item->next) {
+            items++;
         }
+        sync_metric_value(out, "sync_client_queue_items", labels[j], items);
     }
-    return false;
+    free(labels);
 }
 
-void *watch_directory(void *arg) {
-    char *sync_dir = (char *)arg;
-    fd = inotify_init();
-    if (fd < 0) {
-        perror("inotify_init failed");
-        return NULL;
+// Answer every pending connection on the stats socket with a snapshot. The
+// reader is local and the snapshot small, so it is written in one go with a
+// short timeout rather than queued like client data.
+void serve_stats(void) {
+    for (;;) {
+        int sock = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Stats accept failed");
+            }
+            return;
+        }
+        char *text = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&text, &len);
+        if (out) {
+            write_stats(out);
+            fclose(out);
+            struct timeval timeout = { 0, 100 * 1000 };
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            size_t off = 0;
+            while (off < len) {
+                ssize_t sent = send(sock, text + off, len - off, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    break;
+                }
+                off += sent;
+            }
+            free(text);
+        }
+        close(sock);
     }
+}
 
-    add_watch_recursive(sync_dir);
-
-    char buffer[EVENT_BUF_LEN];
-    while (1) {
-        int length = read(fd, buffer, EVENT_BUF_LEN);
-        if (length < 0) {
-            perror("read failed");
-            continue;
+static int client_on_frame(void *ctx, const SyncFrameHeader *hdr, const char *path) {
+    Client *client = ctx;
+    (void)path;
+    client->control_len = 0;
+    if (hdr->opcode == SYNC_OP_MANIFEST_ENTRY || hdr->opcode == SYNC_OP_MANIFEST_END) {
+        if (!client->handshake_done || !client->manifest) {
+            fprintf(stderr, "Unexpected manifest from client\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (hdr->opcode == SYNC_OP_SIGNATURE) {
+        if (!client->handshake_done || hdr->payload_len > MAX_SIGNATURE_LEN) {
+            fprintf(stderr, "Rejecting signature of %llu bytes\n", (unsigned long long)hdr->payload_len);
+            return -1;
+        }
+        free(client->signature);
+        client->signature = malloc(hdr->payload_len ? hdr->payload_len : 1);
+        if (!client->signature) {
+            perror("Memory allocation failed");
+            return -1;
         }
+        client->signature_len = 0;
+        return 0;
+    }
+    if (hdr->opcode == SYNC_OP_RESUME || hdr->opcode == SYNC_OP_STALE || hdr->opcode == SYNC_OP_PARTIAL) {
+        // Only valid between HELLO and the manifest or RESUME
+        if (!client->handshake_done || !client->manifest || client->live) {
+            fprintf(stderr, "Unexpected resume request from client\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (hdr->opcode != SYNC_OP_HELLO) {
+        // Nothing else is expected from clients; skip it
+        return 0;
+    }
+    if (client->handshake_done || hdr->payload_len > MAX_IGNORE_LIST_LEN) {
+        fprintf(stderr, "Unexpected HELLO from client\n");
+        return -1;
+    }
+    client->compress = (hdr->flags & SYNC_FLAG_ZLIB) && compress_level > 0;
+    client->bundle = (hdr->flags & SYNC_FLAG_BUNDLE) && bundle_limit > 0;
+    client->append = (hdr->flags & SYNC_FLAG_APPEND) && following;
+    client->chunks = (hdr->flags & SYNC_FLAG_CHUNKS) && chunked_min > 0;
+    client->ignore_list = (char *)malloc(hdr->payload_len + 1);
+    if (!client->ignore_list) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    client->ignore_len = 0;
+    return 0;
+}
 
-        int i = 0;
-        while (i < length) {
-            struct inotify_event *event = (struct inotify_event *)&buffer[i];
-            if (event->len) {
-                char watched_path[PATH_MAX] = {0};
+static int client_on_payload(void *ctx, const SyncFrameHeader *hdr, const char *data, size_t len) {
+    Client *client = ctx;
+    if (hdr->opcode == SYNC_OP_HELLO) {
+        memcpy(client->ignore_list + client->ignore_len, data, len);
+        client->ignore_len += len;
+    } else if (hdr->opcode == SYNC_OP_SIGNATURE) {
+        memcpy(client->signature + client->signature_len, data, len);
+        client->signature_len += len;
+    } else if (client->control_len + len <= sizeof(client->control)) {
+        memcpy(client->control + client->control_len, data, len);
+        client->control_len += len;
+    }
+    return 0;
+}
 
-                for (int j = 0; j < watch_count; j++) {
-                    if (watch_map[j].wd == event->wd) {
-                        strncpy(watched_path, watch_map[j].path, PATH_MAX);
-                        break;
-                    }
-                }
+static int client_on_frame_end(void *ctx, const SyncFrameHeader *hdr, const char *path) {
+    Client *client = ctx;
+    if (hdr->opcode == SYNC_OP_HELLO) {
+        client->handshake_done = true;
+        long rules = ignore_compile(&client->ignore, client->ignore_list, client->ignore_len);
+        if (rules < 0) {
+            perror("Failed to compile ignore list");
+            return -1;
+        }
+        free(client->ignore_list);
+        client->ignore_list = NULL;
+        log_info("Client connected with %ld ignore rules%s\n", rules,
+               client->compress ? " (compressed transfers)" : "");
+        send_hello(client);
 
-                if (watched_path[0] == '\0') {
-                    fprintf(stderr, "Could not find watched path for wd: %d\n", event->wd);
-                    continue;
-                }
+        // The client follows HELLO with its manifest or a RESUME; events are
+        // held back until the diff or the replay has been queued.
+        client->manifest = manifest_create();
+    } else if (hdr->opcode == SYNC_OP_STALE || hdr->opcode == SYNC_OP_PARTIAL) {
+        if (!sync_path_is_safe(path)) {
+            return 0;
+        }
+        Manifest **set = hdr->opcode == SYNC_OP_STALE ? &client->stale : &client->partials;
+        if (!*set) {
+            *set = manifest_create();
+        }
+        ManifestEntry *entry = manifest_add(*set, path);
+        if (!entry) {
+            return -1;
+        }
+        if (hdr->opcode == SYNC_OP_PARTIAL && client->control_len >= SYNC_PARTIAL_LEN) {
+            entry->size = sync_get_u64(client->control);
+            memcpy(entry->hash, client->control + 8, SYNC_HASH_LEN);
+            entry->has_hash = true;
+        }
+    } else if (hdr->opcode == SYNC_OP_RESUME) {
+        if (client->control_len < SYNC_RESUME_LEN) {
+            return -1;
+        }
+        uint64_t id = sync_get_u64(client->control);
+        uint64_t seq = sync_get_u64(client->control + 8);
+        // Changes still being coalesced are sent to everyone once the
+        // replay is queued, like after a manifest diff
+        coalesce_flush(NULL, NULL);
+        if (id == journal.id && replay_journal(client, seq)) {
+            manifest_free(client->manifest);
+            client->manifest = NULL;
+            client->live = true;
+        } else {
+            log_info("Client cannot resume after change %llu, asking for a manifest\n", (unsigned long long)seq);
+            send_frame(client, SYNC_OP_MANIFEST_REQUEST, NULL, NULL, 0, 0);
+        }
+        manifest_free(client->stale);
+        client->stale = NULL;
+    } else if (hdr->opcode == SYNC_OP_MANIFEST_ENTRY) {
+        if (client->control_len < SYNC_MANIFEST_ENTRY_LEN || !sync_path_is_safe(path)) {
+            return 0;
+        }
+        ManifestEntry *entry = manifest_add(client->manifest, path);
+        if (!entry) {
+            return -1;
+        }
+        entry->type = client->control[0];
+        entry->size = sync_get_u64(client->control + 1);
+        entry->mtime_ns = sync_get_u64(client->control + 9);
+        if (client->control_len >= SYNC_MANIFEST_ENTRY_LEN + SYNC_HASH_LEN) {
+            entry->has_hash = true;
+            memcpy(entry->hash, client->control + SYNC_MANIFEST_ENTRY_LEN, SYNC_HASH_LEN);
+        }
+    } else if (hdr->opcode == SYNC_OP_MANIFEST_END) {
+        // Changes still being coalesced predate the diff; send them to the
+        // other clients first so this one does not get them twice.
+        coalesce_flush(NULL, NULL);
+        send_manifest_diff(client);
+        manifest_free(client->manifest);
+        client->manifest = NULL;
+        client->live = true;
+    } else if (hdr->opcode == SYNC_OP_SIGNATURE) {
+        client->replying = true;
+        // If the file has moved on, the rename still to come sends it
+        if (!sync_path_is_safe(path) || send_delta(client, path, client->signature, client->signature_len, hdr->seq)) {
+            contents_sent(client, path);
+        }
+        client->replying = false;
+        free(client->signature);
+        client->signature = NULL;
+        client->signature_len = 0;
+    }
+    return 0;
+}
 
-                char event_path[PATH_MAX];
-                snprintf(event_path, sizeof(event_path), "%s/%s", watched_path, event->name);
+static const SyncDecoderOps client_decoder_ops = {
+    client_on_frame,
+    client_on_payload,
+    client_on_frame_end,
+};
 
-                // Compute relative path
-                const char *relative_path = event_path + strlen(sync_dir) + 1;
+void handle_client(Client *client) {
+    char buffer[4096];
 
-                char message[512];
-                if(event->mask & IN_CREATE){
-                    if(event->mask & IN_ISDIR){
-                        add_watch_recursive(event_path);
-                        snprintf(message, sizeof(message), "DIR_CREATE %s\n", relative_path);
-                        printf("DIR_CREATE %s\n", relative_path);
-                    } else {
-                        printf("CREATE %s\n", relative_path);
-                    }
-                }  else if (event->mask & IN_DELETE) {
-                    if (event->mask & IN_ISDIR) {
-                        snprintf(message, sizeof(message), "DIR_DELETE %s\n", relative_path);
-                        printf("DIR_DELETE %s\n", relative_path);
-                    } else {
-                        snprintf(message, sizeof(message), "DELETE %s\n", relative_path);
-                        printf("DELETE %s\n", relative_path);
-                    }
-                } else if (event->mask & IN_MOVED_FROM) {
-                    snprintf(message, sizeof(message), "MOVED_FROM %s\n", relative_path);
-                    printf("MOVED_FROM %s\n", relative_path);
-                } else if (event->mask & IN_MOVED_TO) {
-                    snprintf(message, sizeof(message), "MOVED_TO %s\n", relative_path);
-                    printf("MOVED_TO %s\n", relative_path);
-                }
-
-                pthread_mutex_lock(&client_mutex);
-                for (int j = 0; j < client_count; j++) {
-                    if (event->mask & IN_CREATE) {    
-                        if (event->mask & IN_ISDIR) {
-                            send(clients[j].socket, message, strlen(message), 0);
-                        } else {
-                            //Check if the file is in the ignore list
-                            if (is_ignored(&clients[j], event->name)) {
-                                continue;
-                            }
-                            send_file(clients[j].socket, event_path, relative_path);
-                        }
-                    } else if (event->mask & IN_DELETE) {
-                        if(is_ignored(&clients[j], event->name)){
-                            continue;
-                        }
-                        send(clients[j].socket, message, strlen(message), 0);
-                    } else if (event->mask & IN_MOVED_FROM) {
-                        //Check if the file is in the ignore list
-                        if (is_ignored(&clients[j], event->name)) {
-                            continue;
-                        }
-                        send(clients[j].socket, message, strlen(message), 0);
-                    } else if (event->mask & IN_MOVED_TO) {
-                        //Check if the file is in the ignore list
-                        if (is_ignored(&clients[j], event->name)) {
-                            continue;
-                        }
-                        send(clients[j].socket, message, strlen(message), 0);
-                    } 
-                }
-                pthread_mutex_unlock(&client_mutex);
+    // The first frame from a client is a HELLO carrying its ignore list
+    while (!client->closing) {
+        int bytes_received = recv(client->socket, buffer, sizeof(buffer), 0);
+        if (bytes_received > 0) {
+            if (sync_decoder_feed(&client->decoder, buffer, bytes_received,
+                                  &client_decoder_ops, client) != 0) {
+                fprintf(stderr, "Malformed frame from client\n");
+                close_client(client);
             }
-            i += EVENT_SIZE + event->len;
+            continue;
+        }
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_received < 0 && errno == EINTR) {
+            continue;
         }
+        if (!client->handshake_done) {
+            perror("Failed to receive ignore list");
+        }
+        close_client(client);
+        return;
     }
-    return NULL;
 }
 
-void send_file(int client_socket, const char *filepath, const char *relative_path) {
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        perror("Failed to open file");
+void close_client(Client *client) {
+    if (client->closing) {
         return;
     }
+    // Print IP address of disconnected client
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->address.sin_addr, ip, INET_ADDRSTRLEN);
+    log_info("Client disconnected: %s\n", ip);
+    if (client->compress) {
+        log_info("  compression: %lu files compressed, %lu sent as is, %llu -> %llu bytes (ratio %.2f), %.3f s CPU\n",
+               client->files_compressed, client->files_uncompressible,
+               (unsigned long long)client->zlib_in, (unsigned long long)client->zlib_out,
+               client->zlib_out ? (double)client->zlib_in / client->zlib_out : 0.0, client->compress_cpu);
+    }
 
-    // Send CREATE command
-    char message[512];
-    // snprintf(message, sizeof(message), "CREATE %s\n", relative_path);
-    // send(client_socket, message, strlen(message), 0);
-    //format: FILE <relative_path> <file_size>
-    
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+    close(client->socket);
+    client->closing = true;
+    metrics.bytes_sent += client->bytes_sent;
 
-    // Send file size
-    fseek(fp, 0, SEEK_END);
-    long filesize = ftell(fp);
-    printf("Sending file %s, size: %ld bytes\n", relative_path, filesize);
-    rewind(fp);
-    snprintf(message, sizeof(message), "FILE %s %ld", relative_path, filesize);
-    send(client_socket, message, strlen(message), 0);
+    // Fan-out skips it from now on; its slot and memory are kept until the
+    // current epoll batch is done
+    client->next_closed = closed_clients;
+    closed_clients = client;
+    closed_count++;
+}
 
-    // Send file content
-    char buffer[1024];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+static SharedFile *shared_file_create(const char *filepath, uint64_t seq) {
+    SharedFile *sf = calloc(1, sizeof(SharedFile));
+    if (!sf) {
+        return NULL;
     }
-
-    fclose(fp);
+    sf->path = strdup(filepath);
+    if (!sf->path || stat(filepath, &sf->st) < 0) {
+        free(sf->path);
+        free(sf);
+        return NULL;
+    }
+    sf->refs = 1;
+    sf->fd = -1;
+    sf->compressible = -1;
+    sf->seq = seq;
+    return sf;
 }
 
-
-
-
-void add_watch_recursive(const char *dir_path) {
-    int watch_descriptor = inotify_add_watch(fd, dir_path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
-    if (watch_descriptor < 0) {
-        perror("inotify_add_watch failed");
+static void shared_file_release(SharedFile *sf) {
+    if (!sf || --sf->refs > 0) {
         return;
     }
+    // Every reader is gone, and with them every chunk
+    if (sf->fd >= 0) {
+        close(sf->fd);
+    }
+    if (sf->z) {
+        deflateEnd(&sf->z->zs);
+        free(sf->z);
+    }
+    free(sf->path);
+    free(sf);
+}
+
+// Opened by the first reader and kept until the last one is done
+static int shared_file_fd(SharedFile *sf) {
+    if (sf->fd < 0 && !sf->open_failed) {
+        sf->fd = open(sf->path, O_RDONLY | O_CLOEXEC);
+        sf->open_failed = sf->fd < 0;
+        file_opens++;
+    }
+    return sf->fd;
+}
+
+static void chunk_release(SharedFile *sf, SharedChunk *chunk) {
+    while (chunk && --chunk->refs == 0) {
+        SharedChunk *next = chunk->next;
+        if (sf->tail == chunk) {
+            sf->tail = NULL;
+        }
+        sf->retained -= chunk->len;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// Readers that have not sent a frame yet need the first chunk kept
+static void shared_reader_started(SharedFile *sf) {
+    if (--sf->unstarted == 0 && sf->first) {
+        chunk_release(sf, sf->first);
+        sf->first = NULL;
+    }
+}
+
+// While emit_change() sends a change to every client, the file it refers to;
+// the first send_file() for it creates the SharedFile the others reuse
+static const char *fanout_path = NULL;
+static SharedFile *fanout = NULL;
+
+static SharedFile *fanout_file(const char *filepath, uint64_t seq) {
+    if (!share_fanout || !fanout_path || strcmp(fanout_path, filepath) != 0) {
+        return NULL;
+    }
+    if (!fanout) {
+        fanout = shared_file_create(filepath, seq);
+    }
+    return fanout;
+}
+
+static void fanout_end(void) {
+    shared_file_release(fanout);
+    fanout = NULL;
+    fanout_path = NULL;
+}
+
+static size_t item_remaining(const OutItem *item) {
+    if (item->bundle) {
+        return item->bundle->estimate;
+    }
+    if (item->is_file) {
+        return item->file_end - item->file_off;
+    }
+    return item->len - item->off;
+}
+
+// Memory an item holds while queued: its frame, unless the payload is read
+// from a file as the socket drains
+static size_t item_held(const OutItem *item) {
+    return item->is_file ? 0 : item->len;
+}
+
+// Items leaving a client's queue no longer count against memory_budget
+static void release_items(Client *client, OutItem *item) {
+    for (; item; item = item->next) {
+        client->held_bytes -= item_held(item);
+        memory_held -= item_held(item);
+    }
+}
+
+static void free_items(OutItem *item) {
+    while (item) {
+        OutItem *next = item->next;
+        if (item->shared) {
+            if (item->share_stream && item->chunk) {
+                chunk_release(item->shared, item->chunk);
+            } else if (item->share_stream) {
+                shared_reader_started(item->shared);
+            }
+            shared_file_release(item->shared);
+        } else if (item->file_fd >= 0) {
+            close(item->file_fd);
+        }
+        if (item->z) {
+            deflateEnd(&item->z->zs);
+            free(item->z);
+        }
+        if (item->bundle) {
+            free(item->bundle->names);
+            free(item->bundle);
+        }
+        free(item->file_path);
+        if (!item->share_stream) {
+            free(item->data);
+        }
+        free(item);
+        item = next;
+    }
+}
+
+void reap_clients(void) {
+    while (closed_clients) {
+        Client *client = closed_clients;
+        closed_clients = client->next_closed;
+        int last = client_count - 1;
+        clients[client->index] = clients[last];
+        clients[client->index]->index = client->index;
+        client_count--;
+        closed_count--;
+        memory_held -= client->held_bytes;
+        free_items(client->out_head);
+        drop_transfers(client);
+        free(client->signature);
+        manifest_free(client->manifest);
+        manifest_free(client->partials);
+        manifest_free(client->stale);
+        manifest_free(client->owed);
+        //Free memory allocated for ignore list
+        free(client->ignore_list);
+        ignore_free(&client->ignore);
+        free(client);
+    }
+}
+
+// Drop everything queued for a client that has fallen too far behind. The
+// item at the head may already be partly on the wire, so it is kept to leave
+// the stream well formed; the rest is replaced by a manifest diff once it drains.
+static void downgrade_client(Client *client, const char *reason) {
+    OutItem *keep = client->out_head;
+    if (keep && ((keep->is_file && keep->file_off == 0) || (!keep->is_file && keep->off == 0))) {
+        keep = NULL;
+    }
+    if (keep) {
+        // Keep the rest of a message whose first part is already on the wire
+        OutItem *last = keep;
+        client->queued_bytes = item_remaining(last);
+        while (last->joined_next && last->next) {
+            last = last->next;
+            client->queued_bytes += item_remaining(last);
+        }
+        release_items(client, last->next);
+        free_items(last->next);
+        last->next = NULL;
+        client->out_tail = last;
+    } else {
+        release_items(client, client->out_head);
+        free_items(client->out_head);
+        client->out_head = NULL;
+        client->out_tail = NULL;
+        client->queued_bytes = 0;
+    }
+    drop_transfers(client);
+    client->needs_rescan = true;
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->address.sin_addr, ip, INET_ADDRSTRLEN);
+    log_info("Client %s %s, scheduling full rescan\n", ip, reason);
+    metrics.rescans++;
+}
+
+// A rescan may legitimately queue the whole tree, and a rescan would only
+// ask for the same delta again; the mark only applies to incremental events.
+static bool over_high_water(Client *client, uint64_t adding) {
+    return !client->rescanning && !client->replying && client->queued_bytes + adding > queue_high_water;
+}
+
+static void check_high_water(Client *client) {
+    if (over_high_water(client, 0)) {
+        downgrade_client(client, "exceeded queue high-water mark");
+    }
+}
+
+// Returns false when the item was not queued because the client is waiting
+// for a rescan, or is made to wait for one because the item would take its
+// queue past the high-water mark; ownership of the item stays with the
+// caller in that case. Items queued before it may be gone as well.
+static bool enqueue_item(Client *client, OutItem *item) {
+    if (client->needs_rescan && !client->rescanning) {
+        return false;
+    }
+    if (over_high_water(client, item_remaining(item))) {
+        downgrade_client(client, "exceeded queue high-water mark");
+        return false;
+    }
+    item->next = NULL;
+    if (client->out_tail) {
+        client->out_tail->next = item;
+    } else {
+        client->out_head = item;
+    }
+    client->out_tail = item;
+    client->queued_bytes += item_remaining(item);
+    client->held_bytes += item_held(item);
+    memory_held += item_held(item);
+    return true;
+}
+
+// The client's state is unknown after its backlog was dropped: ask it for a
+// manifest and hold events back until the diff against it is queued.
+static void rescan_client(Client *client) {
+    client->needs_rescan = false;
+    client->live = false;
+    manifest_free(client->manifest);
+    client->manifest = manifest_create();
+    send_frame(client, SYNC_OP_MANIFEST_REQUEST, NULL, NULL, 0, 0);
+}
+
+static OutItem *make_frame_item(uint8_t opcode, uint8_t flags, const char *path, const void *payload,
+                                size_t payload_len, uint64_t seq, uint64_t announced_payload) {
+    size_t path_len = path ? strlen(path) : 0;
+    if (path_len > SYNC_MAX_PATH) {
+        fprintf(stderr, "Path too long for frame: %s\n", path);
+        return NULL;
+    }
+    OutItem *item = calloc(1, sizeof(OutItem));
+    if (!item) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    item->len = SYNC_HEADER_LEN + path_len + payload_len;
+    item->data = malloc(item->len);
+    if (!item->data) {
+        perror("Memory allocation failed");
+        free(item);
+        return NULL;
+    }
+    SyncFrameHeader hdr = { opcode, flags, (uint16_t)path_len, announced_payload, seq };
+    sync_encode_header((uint8_t *)item->data, &hdr);
+    if (path_len) {
+        memcpy(item->data + SYNC_HEADER_LEN, path, path_len);
+    }
+    if (payload_len) {
+        memcpy(item->data + SYNC_HEADER_LEN + path_len, payload, payload_len);
+    }
+    item->file_fd = -1;
+    return item;
+}
+
+void send_frame(Client *client, uint8_t opcode, const char *path, const void *payload, size_t payload_len, uint64_t seq) {
+    OutItem *item = make_frame_item(opcode, 0, path, payload, payload_len, seq, payload_len);
+    if (!item) {
+        return;
+    }
+    if (!enqueue_item(client, item)) {
+        free(item->data);
+        free(item);
+        return;
+    }
+    flush_client(client);
+}
+
+// Answer the client's HELLO with the journal id, accepting the compression
+// and bundles it offered if we agree
+void send_hello(Client *client) {
+    uint8_t payload[SYNC_JOURNAL_ID_LEN];
+    sync_put_u64(payload, journal.id);
+    uint8_t flags = (client->compress ? SYNC_FLAG_ZLIB : 0) | (client->bundle ? SYNC_FLAG_BUNDLE : 0) |
+                    (client->append ? SYNC_FLAG_APPEND : 0) | (client->chunks ? SYNC_FLAG_CHUNKS : 0);
+    OutItem *item = make_frame_item(SYNC_OP_HELLO, flags, NULL, payload, sizeof(payload), 0, sizeof(payload));
+    if (!item) {
+        return;
+    }
+    if (!enqueue_item(client, item)) {
+        free_items(item);
+        return;
+    }
+    flush_client(client);
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Deflate the next FILE_DATA frame of z into out (SYNC_HEADER_LEN +
+// SYNC_ZLIB_CHUNK bytes), reading file_fd from *offset up to end as far as
+// needed. Returns the frame length, or -1 if zlib failed.
+static ssize_t deflate_frame(Compressor *z, int file_fd, off_t *offset, off_t end, char *out) {
+    z->zs.next_out = (Bytef *)out + SYNC_HEADER_LEN;
+    z->zs.avail_out = SYNC_ZLIB_CHUNK;
+    while (z->zs.avail_out > 0 && !z->done) {
+        if (z->zs.avail_in == 0 && *offset < end) {
+            size_t want = end - *offset;
+            if (want > SYNC_ZLIB_CHUNK) {
+                want = SYNC_ZLIB_CHUNK;
+            }
+            ssize_t n = file_fd >= 0 ? pread(file_fd, z->in, want, *offset) : 0;
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            transfer_syscalls++;
+            if (n <= 0) {
+                // Shrunk or deleted since it was queued: keep the announced size
+                memset(z->in, 0, want);
+                n = want;
+            } else {
+                file_bytes_read += n;
+            }
+            *offset += n;
+            z->zs.next_in = z->in;
+            z->zs.avail_in = n;
+        }
+        int ret = deflate(&z->zs, *offset < end ? Z_NO_FLUSH : Z_FINISH);
+        if (ret == Z_STREAM_END) {
+            z->done = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "deflate failed: %d\n", ret);
+            return -1;
+        }
+    }
+    size_t produced = SYNC_ZLIB_CHUNK - z->zs.avail_out;
+    SyncFrameHeader hdr = { SYNC_OP_FILE_DATA, z->done ? SYNC_FLAG_LAST : 0, 0, produced, z->seq };
+    sync_encode_header((uint8_t *)out, &hdr);
+    return SYNC_HEADER_LEN + produced;
+}
+
+// Fill item->data with the next FILE_DATA frame of a compressed transfer.
+// Returns -1 if zlib failed.
+static int compress_next_frame(Client *client, OutItem *item) {
+    double start = cpu_seconds();
+    off_t before = item->file_off;
+    ssize_t len = deflate_frame(item->z, item->file_fd, &item->file_off, item->file_end, item->data);
+    if (len < 0) {
+        return -1;
+    }
+    client->queued_bytes -= item->file_off - before;
+    client->zlib_in += item->file_off - before;
+    client->zlib_out += len - SYNC_HEADER_LEN;
+    client->compress_cpu += cpu_seconds() - start;
+    item->len = len;
+    item->off = 0;
+    return 0;
+}
+
+// Deflate the next frame of a shared stream and append it. The caller is the
+// reader at the end of the stream and pays the CPU for everyone.
+static SharedChunk *shared_make_chunk(Client *client, SharedFile *sf) {
+    double start = cpu_seconds();
+    if (!sf->z) {
+        sf->z = calloc(1, sizeof(Compressor));
+        if (!sf->z || deflateInit(&sf->z->zs, compress_level) != Z_OK) {
+            fprintf(stderr, "Failed to set up compression for %s\n", sf->path);
+            free(sf->z);
+            sf->z = NULL;
+            return NULL;
+        }
+        sf->z->seq = sf->seq;
+    }
+    SharedChunk *chunk = malloc(sizeof(SharedChunk) + SYNC_HEADER_LEN + SYNC_ZLIB_CHUNK);
+    if (!chunk) {
+        return NULL;
+    }
+    off_t before = sf->z_off;
+    ssize_t len = deflate_frame(sf->z, shared_file_fd(sf), &sf->z_off, sf->st.st_size, chunk->data);
+    if (len < 0) {
+        free(chunk);
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->refs = 1;        // from the chunk before it, or held as sf->first
+    chunk->last = sf->z->done;
+    chunk->in_bytes = sf->z_off - before;
+    chunk->len = len;
+    if (sf->tail) {
+        sf->tail->next = chunk;
+    } else {
+        sf->first = chunk;
+    }
+    sf->tail = chunk;
+    sf->retained += len;
+    client->compress_cpu += cpu_seconds() - start;
+    return chunk;
+}
+
+// The reader at the end of a shared stream is too far ahead of the slowest
+// one: give it its own copy of the deflate state.
+static bool shared_detach(OutItem *item) {
+    SharedFile *sf = item->shared;
+    Compressor *z = malloc(sizeof(Compressor));
+    char *data = malloc(SYNC_HEADER_LEN + SYNC_ZLIB_CHUNK);
+    if (!z || !data || deflateCopy(&z->zs, &sf->z->zs) != Z_OK) {
+        free(z);
+        free(data);
+        return false;
+    }
+    memcpy(z->in, sf->z->in, sizeof(z->in));
+    if (sf->z->zs.avail_in > 0) {
+        z->zs.next_in = z->in + (sf->z->zs.next_in - sf->z->in);
+    }
+    z->seq = sf->z->seq;
+    z->done = sf->z->done;
+    chunk_release(sf, item->chunk);
+    item->chunk = NULL;
+    item->share_stream = false;
+    item->z = z;
+    item->data = data;
+    item->len = 0;
+    item->off = 0;
+    return true;
+}
+
+// Move a shared-stream item on to its next frame, making it if nobody has.
+// Returns -1 if zlib failed.
+static int shared_next_frame(Client *client, OutItem *item) {
+    SharedFile *sf = item->shared;
+    if (!item->chunk && !sf->first && sf->z) {
+        // The stream has moved past its start: compress this copy alone
+        Compressor *z = calloc(1, sizeof(Compressor));
+        char *data = malloc(SYNC_HEADER_LEN + SYNC_ZLIB_CHUNK);
+        if (!z || !data || deflateInit(&z->zs, compress_level) != Z_OK) {
+            free(z);
+            free(data);
+            return -1;
+        }
+        z->seq = sf->seq;
+        shared_reader_started(sf);
+        item->share_stream = false;
+        item->z = z;
+        item->data = data;
+        return compress_next_frame(client, item);
+    }
+    SharedChunk *next = item->chunk ? item->chunk->next : sf->first;
+    if (!next) {
+        if (item->chunk && sf->retained + SYNC_HEADER_LEN + SYNC_ZLIB_CHUNK > SHARED_STREAM_WINDOW &&
+            shared_detach(item)) {
+            return compress_next_frame(client, item);
+        }
+        next = shared_make_chunk(client, sf);
+        if (!next) {
+            return -1;
+        }
+    }
+    next->refs++;
+    if (item->chunk) {
+        chunk_release(sf, item->chunk);
+    } else {
+        shared_reader_started(sf);
+    }
+    item->chunk = next;
+    item->data = next->data;
+    item->len = next->len;
+    item->off = 0;
+    item->file_off += next->in_bytes;
+    client->queued_bytes -= next->in_bytes;
+    client->zlib_in += next->in_bytes;
+    client->zlib_out += next->len - SYNC_HEADER_LEN;
+    return 0;
+}
+
+// Send up to count bytes of file_fd starting at *offset, advancing *offset.
+// Uses sendfile(2) so the data goes from the page cache to the socket without
+// a userspace copy; falls back to pread+send when the kernel cannot splice
+// this fd pair. Returns the number of bytes sent or -1 with errno set.
+static ssize_t send_file_range(int sock, int file_fd, off_t *offset, size_t count, bool *no_sendfile) {
+    static char chunk[SEND_CHUNK_SIZE];
+
+    if (!*no_sendfile) {
+        transfer_syscalls++;
+        ssize_t sent = sendfile(sock, file_fd, offset, count);
+        if (sent > 0) {
+            return sent;
+        }
+        if (sent < 0 && errno != EINVAL && errno != ENOSYS && errno != EOVERFLOW) {
+            return -1;
+        }
+        // sent == 0 means the file shrank under us; the buffered path below
+        // pads the announced length. Anything else: no zero-copy for this fd.
+        if (sent < 0) {
+            *no_sendfile = true;
+        }
+    }
+
+    size_t want = count < sizeof(chunk) ? count : sizeof(chunk);
+    transfer_syscalls++;
+    ssize_t got = pread(file_fd, chunk, want, *offset);
+    if (got <= 0) {
+        // File shrank after the size was announced; pad so the
+        // stream stays aligned with the header we already sent.
+        memset(chunk, 0, want);
+        got = want;
+    } else {
+        file_bytes_read += got;
+    }
+    transfer_syscalls++;
+    ssize_t sent = send(sock, chunk, got, MSG_NOSIGNAL);
+    if (sent > 0) {
+        *offset += sent;
+    }
+    return sent;
+}
+
+static OutItem *make_attr_item(const char *relative_path, const struct stat *st, uint64_t seq) {
+    uint8_t payload[12];
+    sync_put_u64(payload, stat_mtime_ns(st));
+    sync_put_u32(payload + 8, st->st_mode & 07777);
+    return make_frame_item(SYNC_OP_ATTR, 0, relative_path, payload, sizeof(payload), seq, sizeof(payload));
+}
+
+static void free_transfer(Transfer *t) {
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+    free(t->path);
+    free(t->file_path);
+    free(t);
+}
+
+static void pop_transfer(Client *client) {
+    Transfer *t = client->transfers;
+    client->transfers = t->next;
+    if (!client->transfers) {
+        client->transfers_tail = NULL;
+    }
+    free_transfer(t);
+}
+
+void drop_transfers(Client *client) {
+    while (client->transfers) {
+        pop_transfer(client);
+    }
+}
+
+// Stop the transfers of path and of everything under it: a change to them is
+// being sent, and the client drops what it has assembled when it sees it.
+// They stay owed, see queue_transfer().
+void cancel_transfers(Client *client, const char *path) {
+    size_t len = strlen(path);
+    Transfer **link = &client->transfers;
+    client->transfers_tail = NULL;
+    while (*link) {
+        Transfer *t = *link;
+        if (strncmp(t->path, path, len) == 0 && (t->path[len] == '\0' || t->path[len] == '/')) {
+            log_debug("Cancelled chunked transfer of %s at byte %lld\n", t->path, (long long)t->offset);
+            metrics.transfers_cancelled++;
+            *link = t->next;
+            free_transfer(t);
+        } else {
+            client->transfers_tail = t;
+            link = &t->next;
+        }
+    }
+}
+
+// Hashes of chunks sent lately, so a file going to several clients is read
+// and hashed once rather than once per client. Keyed by the file as it was
+// announced; a client that gets other bytes asks for the file again.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    uint64_t mtime_ns;
+    off_t offset;
+    size_t len;
+    uint8_t hash[SYNC_HASH_LEN];
+} ChunkHash;
+
+static ChunkHash chunk_hashes[CHUNK_HASH_SLOTS];
+
+static ChunkHash *chunk_hash_slot(const Transfer *t) {
+    uint64_t key = ((uint64_t)t->st.st_ino * 31 + (uint64_t)t->offset / TRANSFER_CHUNK_SIZE) * 0x9e3779b97f4a7c15ULL;
+    return &chunk_hashes[(key >> 32) % CHUNK_HASH_SLOTS];
+}
+
+static bool chunk_hash_matches(const ChunkHash *h, const Transfer *t, size_t len) {
+    return h->len == len && h->offset == t->offset && h->ino == t->st.st_ino && h->dev == t->st.st_dev &&
+           h->mtime_ns == stat_mtime_ns(&t->st);
+}
+
+// Read and hash the next len bytes of a transfer into chunk. Returns false if
+// the file can no longer be read as announced.
+static bool read_chunk(Transfer *t, uint8_t *chunk, size_t len, uint8_t hash[SYNC_HASH_LEN]) {
+    if (t->fd < 0) {
+        t->fd = open(t->file_path, O_RDONLY | O_CLOEXEC);
+        file_opens++;
+    }
+    transfer_syscalls++;
+    ssize_t got = t->fd < 0 ? -1 : pread(t->fd, chunk, len, t->offset);
+    if (got != (ssize_t)len) {
+        return false;
+    }
+    file_bytes_read += got;
+    sync_hash_buffer(chunk, len, hash);
+    ChunkHash *h = chunk_hash_slot(t);
+    h->dev = t->st.st_dev;
+    h->ino = t->st.st_ino;
+    h->mtime_ns = stat_mtime_ns(&t->st);
+    h->offset = t->offset;
+    h->len = len;
+    memcpy(h->hash, hash, SYNC_HASH_LEN);
+    return true;
+}
+
+// Queue the next chunk of the client's oldest transfer, and after the last
+// one the file's ATTR. Uncompressed chunks are sent from the file like FILE
+// payloads once they are hashed. A file that can no longer be read as
+// announced ends its transfer: the change that shrank or removed it has not
+// been sent yet and will be. Chunks stay well under the high-water mark (-q)
+// so a lone chunk never counts as a backlog. Returns -1 if out of memory.
+static int queue_chunk(Client *client) {
+    static uint8_t chunk[TRANSFER_CHUNK_SIZE];
+    static uint8_t payload[SYNC_CHUNK_HEADER_LEN + TRANSFER_CHUNK_SIZE + TRANSFER_CHUNK_SIZE / 100 + 64];
+    Transfer *t = client->transfers;
+    size_t chunk_size = queue_high_water / 2 < TRANSFER_CHUNK_SIZE ? queue_high_water / 2 + 1 : TRANSFER_CHUNK_SIZE;
+    size_t want = t->st.st_size - t->offset < (off_t)chunk_size ? (size_t)(t->st.st_size - t->offset) : chunk_size;
+    ChunkHash *cached = chunk_hash_slot(t);
+    uint8_t hash[SYNC_HASH_LEN];
+    if (!t->compress && chunk_hash_matches(cached, t, want)) {
+        memcpy(hash, cached->hash, SYNC_HASH_LEN);
+    } else if (!read_chunk(t, chunk, want, hash)) {
+        log_debug("Chunked transfer of %s ended early at byte %lld\n", t->path, (long long)t->offset);
+        pop_transfer(client);
+        return 0;
+    }
+
+    uint8_t flags = t->offset + (off_t)want == t->st.st_size ? SYNC_FLAG_LAST : 0;
+    size_t len = want;
+    if (t->compress) {
+        double start = cpu_seconds();
+        uLongf packed_len = sizeof(payload) - SYNC_CHUNK_HEADER_LEN;
+        if (compress2(payload + SYNC_CHUNK_HEADER_LEN, &packed_len, chunk, want, compress_level) == Z_OK &&
+            packed_len < want) {
+            flags |= SYNC_FLAG_ZLIB;
+            len = packed_len;
+        } else {
+            memcpy(payload + SYNC_CHUNK_HEADER_LEN, chunk, want);
+        }
+        client->zlib_in += want;
+        client->zlib_out += len;
+        client->compress_cpu += cpu_seconds() - start;
+    }
+    sync_put_u64(payload, t->st.st_size);
+    sync_put_u64(payload + 8, t->offset);
+    sync_put_u32(payload + 16, want);
+    memcpy(payload + 20, hash, SYNC_HASH_LEN);
+
+    OutItem *attr = NULL;
+    if ((flags & SYNC_FLAG_LAST) && !(attr = make_attr_item(t->path, &t->st, t->seq))) {
+        return -1;
+    }
+    OutItem *item;
+    bool queued;
+    if (t->compress) {
+        item = make_frame_item(SYNC_OP_CHUNK, flags, t->path, payload, SYNC_CHUNK_HEADER_LEN + len, t->seq,
+                               SYNC_CHUNK_HEADER_LEN + len);
+        queued = item && enqueue_item(client, item);
+        if (item && !queued) {
+            free_items(item);
+        }
+    } else {
+        OutItem *header = make_frame_item(SYNC_OP_CHUNK, flags, t->path, payload, SYNC_CHUNK_HEADER_LEN, t->seq,
+                                          SYNC_CHUNK_HEADER_LEN + len);
+        item = make_file_item(t->file_path, t->offset, t->offset + want);
+        queued = enqueue_file_frame(client, header, item);
+    }
+    if (!queued) {
+        // Downgrading the client dropped its transfers along with its queue
+        free_items(attr);
+        drop_transfers(client);
+        return 0;
+    }
+    metrics.chunks++;
+    t->offset += want;
+    if (attr) {
+        item->joined_next = true;
+        if (!enqueue_item(client, attr)) {
+            free_items(attr);
+            return 0;
+        }
+        contents_sent(client, t->path);
+        pop_transfer(client);
+    }
+    return 0;
+}
+
+// Write as much of the client's queue as the socket accepts without blocking.
+// Whatever is left is picked up again on EPOLLOUT.
+void flush_client(Client *client) {
+    // Items queued while a rescan or a batch is being generated are flushed
+    // by the outer call once it returns.
+    if (client->rescanning || batching) {
+        return;
+    }
+
+    while (!client->closing) {
+        if (!client->out_head) {
+            if (client->needs_rescan) {
+                rescan_client(client);
+            } else if (client->transfers && queue_chunk(client) < 0) {
+                close_client(client);
+                return;
+            }
+            if (!client->out_head) {
+                break;
+            }
+        }
+        OutItem *item = client->out_head;
+        ssize_t sent;
+
+        if (item->is_file) {
+            if (item->file_fd < 0 && item->file_off < item->file_end) {
+                if (item->shared) {
+                    item->file_fd = shared_file_fd(item->shared);
+                } else {
+                    item->file_fd = open(item->file_path, O_RDONLY | O_CLOEXEC);
+                    file_opens++;
+                }
+                if (item->file_fd < 0) {
+                    // Deleted since it was queued; the fallback pads the
+                    // announced length and the DELETE follows.
+                    item->no_sendfile = true;
+                }
+            }
+            if (item->z || item->share_stream) {
+                // Compressed bytes are not counted in queued_bytes; the file
+                // bytes are, as they are read.
+                bool done = item->share_stream ? item->chunk && item->chunk->last : item->z->done;
+                if (item->off == item->len && !done &&
+                    (item->share_stream ? shared_next_frame(client, item) : compress_next_frame(client, item)) < 0) {
+                    close_client(client);
+                    return;
+                }
+                if (item->off < item->len) {
+                    sent = send(client->socket, item->data + item->off, item->len - item->off, MSG_NOSIGNAL);
+                    if (sent > 0) {
+                        item->off += sent;
+                        client->bytes_sent += sent;
+                    }
+                    if (sent >= 0) {
+                        continue;
+                    }
+                } else {
+                    sent = 0;
+                }
+            } else if (item->file_off >= item->file_end) {
+                sent = 0;
+            } else {
+                sent = send_file_range(client->socket, item->file_fd, &item->file_off,
+                                       item->file_end - item->file_off, &item->no_sendfile);
+                if (sent > 0) {
+                    client->queued_bytes -= sent;
+                    client->bytes_sent += sent;
+                }
+            }
+            if (sent >= 0 && item->file_off < item->file_end) {
+                continue;
+            }
+        } else {
+            if (item->bundle && build_bundle(client, item) < 0) {
+                close_client(client);
+                return;
+            }
+            sent = send(client->socket, item->data + item->off, item->len - item->off, MSG_NOSIGNAL);
+            if (sent > 0) {
+                item->off += sent;
+                client->queued_bytes -= sent;
+                client->bytes_sent += sent;
+            }
+            if (sent >= 0 && item->off < item->len) {
+                continue;
+            }
+        }
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!client->want_write) {
+                    client->want_write = true;
+                    update_client_events(client);
+                }
+                return;
+            }
+            perror("send failed");
+            close_client(client);
+            return;
+        }
+
+        client->out_head = item->next;
+        if (!client->out_head) {
+            client->out_tail = NULL;
+        }
+        item->next = NULL;
+        release_items(client, item);
+        free_items(item);
+    }
+
+    if (client->want_write && !client->closing) {
+        client->want_write = false;
+        update_client_events(client);
+    }
+}
+
+static uint64_t hash_path(const char *path) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+Manifest *manifest_create(void) {
+    Manifest *m = calloc(1, sizeof(Manifest));
+    if (!m) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    m->capacity = 1024;
+    m->slots = calloc(m->capacity, sizeof(ManifestEntry *));
+    if (!m->slots) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    return m;
+}
+
+void manifest_free(Manifest *m) {
+    if (!m) {
+        return;
+    }
+    for (size_t i = 0; i < m->capacity; i++) {
+        free(m->slots[i]);
+    }
+    free(m->slots);
+    free(m);
+}
+
+static ManifestEntry **manifest_slot(Manifest *m, const char *path) {
+    size_t i = hash_path(path) & (m->capacity - 1);
+    while (m->slots[i] && strcmp(m->slots[i]->path, path) != 0) {
+        i = (i + 1) & (m->capacity - 1);
+    }
+    return &m->slots[i];
+}
+
+ManifestEntry *manifest_find(Manifest *m, const char *path) {
+    return *manifest_slot(m, path);
+}
+
+// Insert path (or return the existing entry), growing the table at 70% load
+ManifestEntry *manifest_add(Manifest *m, const char *path) {
+    if ((m->count + 1) * 10 > m->capacity * 7) {
+        ManifestEntry **old = m->slots;
+        size_t old_capacity = m->capacity;
+        m->capacity *= 2;
+        m->slots = calloc(m->capacity, sizeof(ManifestEntry *));
+        if (!m->slots) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i]) {
+                *manifest_slot(m, old[i]->path) = old[i];
+            }
+        }
+        free(old);
+    }
+    ManifestEntry **slot = manifest_slot(m, path);
+    if (!*slot) {
+        size_t len = strlen(path);
+        *slot = calloc(1, sizeof(ManifestEntry) + len + 1);
+        if (!*slot) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        memcpy((*slot)->path, path, len + 1);
+        m->count++;
+    }
+    return *slot;
+}
+
+// Remove path, moving later entries of its probe run back into the hole
+void manifest_remove(Manifest *m, const char *path) {
+    ManifestEntry **slot = manifest_slot(m, path);
+    if (!*slot) {
+        return;
+    }
+    free(*slot);
+    m->count--;
+    size_t mask = m->capacity - 1;
+    size_t hole = slot - m->slots;
+    m->slots[hole] = NULL;
+    for (size_t j = (hole + 1) & mask; m->slots[j]; j = (j + 1) & mask) {
+        size_t home = hash_path(m->slots[j]->path) & mask;
+        // Move the entry back unless its home lies cyclically in (hole, j]
+        bool stays = hole <= j ? (home > hole && home <= j) : (home > hole || home <= j);
+        if (!stays) {
+            m->slots[hole] = m->slots[j];
+            m->slots[j] = NULL;
+            hole = j;
+        }
+    }
+}
+
+static uint64_t stat_mtime_ns(const struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+static bool hash_file(const char *filepath, uint8_t out[SYNC_HASH_LEN]) {
+    static char buffer[SEND_CHUNK_SIZE];
+    int file_fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        return false;
+    }
+    SyncHash h;
+    sync_hash_init(&h);
+    ssize_t got;
+    while ((got = read(file_fd, buffer, sizeof(buffer))) > 0) {
+        sync_hash_update(&h, buffer, got);
+    }
+    close(file_fd);
+    sync_hash_final(&h, out);
+    return got == 0;
+}
+
+// Hash of the first len bytes of a file; false if it has fewer
+static bool hash_file_prefix(const char *filepath, uint64_t len, uint8_t out[SYNC_HASH_LEN]) {
+    static char buffer[SEND_CHUNK_SIZE];
+    int file_fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        return false;
+    }
+    SyncHash h;
+    sync_hash_init(&h);
+    while (len > 0) {
+        ssize_t got = read(file_fd, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+        if (got <= 0) {
+            break;
+        }
+        sync_hash_update(&h, buffer, got);
+        len -= got;
+    }
+    close(file_fd);
+    sync_hash_final(&h, out);
+    return len == 0;
+}
+
+typedef struct {
+    unsigned long sent;
+    unsigned long deltas;
+    unsigned long touched;
+    unsigned long deleted;
+    unsigned long unchanged;
+} DiffStats;
+
+// Whether the client still has an unused PARTIAL copy of relative_path
+static bool has_partial(Client *client, const char *relative_path) {
+    ManifestEntry *entry = client->partials ? manifest_find(client->partials, relative_path) : NULL;
+    return entry && !entry->seen;
+}
+
+// Paths whose current contents the client is still owed: a SIG_REQUEST is
+// open, or the file was gone when it was to be sent. Events are read after
+// the fact, so either may be because it was renamed on disk by a change not
+// sent yet; when that rename is sent, send_owed() follows it with the file.
+void owe_contents(Client *client, const char *relative_path) {
+    if (!client->owed) {
+        client->owed = manifest_create();
+    }
+    ManifestEntry *entry = manifest_add(client->owed, relative_path);
+    if (entry && !entry->seen) {
+        entry->seen = true;
+        client->owed_count++;
+    }
+}
+
+void contents_sent(Client *client, const char *relative_path) {
+    ManifestEntry *entry = client->owed ? manifest_find(client->owed, relative_path) : NULL;
+    if (!entry || !entry->seen) {
+        return;
+    }
+    entry->seen = false;
+    if (--client->owed_count == 0) {
+        manifest_free(client->owed);
+        client->owed = NULL;
+    }
+}
+
+void request_signature(Client *client, const char *relative_path, uint64_t seq) {
+    send_frame(client, SYNC_OP_SIG_REQUEST, relative_path, NULL, 0, seq);
+    owe_contents(client, relative_path);
+}
+
+// old_path (a file, or a directory and all under it) was just renamed for
+// this client. Send whatever was owed under it whole, by its new name, as
+// the client's copy is missing or out of date. Returns whether any was owed.
+bool send_owed(Client *client, const char *old_path, const char *new_path, bool is_dir, uint64_t seq) {
+    if (!client->owed) {
+        return false;
+    }
+    char disk_path[PATH_MAX];
+    if (!is_dir) {
+        ManifestEntry *entry = manifest_find(client->owed, old_path);
+        if (!entry || !entry->seen) {
+            return false;
+        }
+        contents_sent(client, old_path);
+        snprintf(disk_path, sizeof(disk_path), "%s/%s", sync_root, new_path);
+        send_file(client, disk_path, new_path, seq);
+        return true;
+    }
+
+    // Sending may owe more, so take the paths out of the table first
+    size_t old_len = strlen(old_path);
+    size_t count = 0;
+    char **paths = malloc(client->owed_count * sizeof(char *));
+    if (!paths) {
+        perror("Memory allocation failed");
+        return false;
+    }
+    for (size_t i = 0; i < client->owed->capacity; i++) {
+        ManifestEntry *entry = client->owed->slots[i];
+        if (!entry || !entry->seen || strncmp(entry->path, old_path, old_len) != 0 ||
+            entry->path[old_len] != '/') {
+            continue;
+        }
+        char relative_path[PATH_MAX];
+        snprintf(relative_path, sizeof(relative_path), "%s%s", new_path, entry->path + old_len);
+        paths[count] = strdup(relative_path);
+        if (paths[count]) {
+            count++;
+        }
+        entry->seen = false;
+        client->owed_count--;
+    }
+    if (client->owed_count == 0) {
+        manifest_free(client->owed);
+        client->owed = NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (snprintf(disk_path, sizeof(disk_path), "%s/%s", sync_root, paths[i]) < (int)sizeof(disk_path) &&
+            !is_ignored(client, paths[i], false)) {
+            send_file(client, disk_path, paths[i], seq);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    return count > 0;
+}
+
+// Content hash of a file for comparing with the client's, taken from the
+// index when it has one for the current version
+static bool entry_hash(const char *full_path, IndexNode *node, uint8_t out[SYNC_HASH_LEN]) {
+    if (node && node->has_hash) {
+        memcpy(out, node->hash, SYNC_HASH_LEN);
+        return true;
+    }
+    if (!hash_file(full_path, out)) {
+        return false;
+    }
+    if (node) {
+        memcpy(node->hash, out, SYNC_HASH_LEN);
+        node->has_hash = true;
+        tree_index.dirty = true;
+    }
+    return true;
+}
+
+// Compare one entry of the server's tree with the client's manifest and queue
+// what the client needs. Returns true if the caller should descend into it.
+static bool diff_entry(Client *client, Manifest *m, DiffStats *stats, const char *full_path,
+                       const char *relative_path, const struct stat *st, IndexNode *node) {
+    ManifestEntry *theirs = manifest_find(m, relative_path);
+
+    // Parents were checked on the way down, so only this entry's own name
+    // matters. An ignored directory is skipped with everything below it.
+    bool ignored = ignore_match_entry(&client->ignore, relative_path, strlen(relative_path),
+                                      S_ISDIR(st->st_mode));
+    if (ignored && S_ISDIR(st->st_mode)) {
+        return false;
+    }
+
+    if (S_ISDIR(st->st_mode)) {
+        if (theirs) {
+            theirs->seen = true;
+        }
+        if (!theirs || theirs->type != SYNC_ENTRY_DIR) {
+            if (theirs) {
+                send_frame(client, SYNC_OP_DELETE, relative_path, NULL, 0, 0);
+            }
+            send_dir_create(client, relative_path, 0);
+        }
+        return true;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        return false;
+    }
+    if (ignored) {
+        if (theirs) {
+            theirs->seen = true;
+        }
+        return false;
+    }
+    if (!theirs) {
+        send_file(client, full_path, relative_path, 0);
+        stats->sent++;
+        return false;
+    }
+    theirs->seen = true;
+    if (theirs->type != SYNC_ENTRY_FILE) {
+        send_frame(client, SYNC_OP_DIR_DELETE, relative_path, NULL, 0, 0);
+        send_file(client, full_path, relative_path, 0);
+        stats->sent++;
+    } else if (theirs->size == (uint64_t)st->st_size && theirs->mtime_ns == stat_mtime_ns(st)) {
+        stats->unchanged++;
+    } else {
+        uint8_t ours[SYNC_HASH_LEN];
+        if (theirs->has_hash && theirs->size == (uint64_t)st->st_size &&
+            entry_hash(full_path, node, ours) && memcmp(ours, theirs->hash, SYNC_HASH_LEN) == 0) {
+            // Same content, only the timestamp differs
+            send_attr(client, relative_path, st, 0);
+            stats->touched++;
+        } else if (has_partial(client, relative_path)) {
+            // Most of the new version is already on the client
+            send_file(client, full_path, relative_path, 0);
+            stats->sent++;
+        } else {
+            // Let the delta exchange move only the changed blocks
+            request_signature(client, relative_path, 0);
+            stats->deltas++;
+        }
+    }
+    return false;
+}
+
+// base/path/name for an entry met in a walk, leaving out empty parts.
+// Returns false if it does not fit.
+static bool walk_path(char *out, size_t size, const char *base, const char *path, const char *name) {
+    const char *parts[3] = { base, path, name };
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < 3; i++) {
+        if (!parts[i] || !parts[i][0]) {
+            continue;
+        }
+        int n = snprintf(out + len, size - len, "%s%s", len ? "/" : "", parts[i]);
+        if (n < 0 || (size_t)n >= size - len) {
+            return false;
+        }
+        len += n;
+    }
+    return true;
+}
+
+typedef struct {
+    Client *client;
+    Manifest *m;
+    DiffStats *stats;
+    const char *base_dir;
+    const char *relative_path;
+} DiffWalk;
+
+// Entries are stat'ed in parallel, but queued to the client one directory
+// at a time; a directory is always queued before what is in it.
+static void diff_visit(void *ctx, SyncWalkDir *dir) {
+    DiffWalk *walk = ctx;
+    char full_path[PATH_MAX];
+    char relative_path[PATH_MAX];
+    pthread_mutex_lock(&walk_lock);
+    for (size_t i = 0; i < dir->count; i++) {
+        SyncWalkEntry *entry = &dir->entries[i];
+        entry->descend = walk_path(full_path, sizeof(full_path), walk->base_dir, dir->path, entry->name) &&
+                         walk_path(relative_path, sizeof(relative_path), walk->relative_path, dir->path, entry->name) &&
+                         diff_entry(walk->client, walk->m, walk->stats, full_path, relative_path, &entry->st, NULL);
+    }
+    pthread_mutex_unlock(&walk_lock);
+}
+
+static const SyncWalkOps diff_walk_ops = { NULL, diff_visit, SYNC_WALK_STAT };
+
+static void diff_directory(Client *client, Manifest *m, DiffStats *stats, const char *base_dir, const char *relative_path) {
+    DiffWalk walk = { client, m, stats, base_dir, relative_path };
+    if (!sync_walk_path(walker, base_dir, &diff_walk_ops, &walk, NULL)) {
+        perror("opendir failed");
+    }
+}
+
+// Same as diff_directory(), but from the index: no directory is read and no
+// file is stat'ed, and content hashes are computed at most once per version.
+static void diff_index(Client *client, Manifest *m, DiffStats *stats, IndexNode *dir, const char *relative_path) {
+    for (IndexNode *node = dir->first_child; node; node = node->next_sibling) {
+        char new_relative_path[PATH_MAX];
+        char full_path[PATH_MAX];
+        if (!walk_path(new_relative_path, sizeof(new_relative_path), relative_path, NULL, node->name) ||
+            !walk_path(full_path, sizeof(full_path), sync_root, NULL, new_relative_path)) {
+            log_info("Path too long, not sent: %s/%s\n", relative_path, node->name);
+            continue;
+        }
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = node->mode;
+        st.st_ino = node->ino;
+        st.st_size = node->size;
+        st.st_mtim.tv_sec = node->mtime_ns / 1000000000ULL;
+        st.st_mtim.tv_nsec = node->mtime_ns % 1000000000ULL;
+        if (diff_entry(client, m, stats, full_path, new_relative_path, &st, node)) {
+            diff_index(client, m, stats, node, new_relative_path);
+        }
+    }
+}
+
+static void send_checkpoint(Client *client, bool force, uint64_t event_ns, uint64_t origin_ns, uint8_t relays);
+
+static int compare_paths_reverse(const void *a, const void *b) {
+    return strcmp((*(ManifestEntry *const *)b)->path, (*(ManifestEntry *const *)a)->path);
+}
+
+// Bring a client from the state described by its manifest to the server's
+// current tree: queue what is missing or changed, then delete what the
+// server no longer has.
+void send_manifest_diff(Client *client) {
+    Manifest *m = client->manifest;
+    DiffStats stats = { 0, 0, 0, 0, 0 };
+
+    // A diff for a fresh mirror can be as large as the tree itself, so the
+    // high-water mark does not apply while it is being queued.
+    client->rescanning = true;
+    if (index_file) {
+        diff_index(client, m, &stats, tree_index.root, "");
+    } else {
+        diff_directory(client, m, &stats, sync_root, "");
+    }
+
+    // Entries the server no longer has. Reverse order puts children before
+    // their parent directory.
+    ManifestEntry **stale = malloc((m->count ? m->count : 1) * sizeof(ManifestEntry *));
+    size_t stale_count = 0;
+    for (size_t i = 0; stale && i < m->capacity; i++) {
+        ManifestEntry *entry = m->slots[i];
+        if (!entry || entry->seen) {
+            continue;
+        }
+        if (is_ignored(client, entry->path, entry->type == SYNC_ENTRY_DIR)) {
+            continue;
+        }
+        stale[stale_count++] = entry;
+    }
+    if (stale) {
+        qsort(stale, stale_count, sizeof(ManifestEntry *), compare_paths_reverse);
+        for (size_t i = 0; i < stale_count; i++) {
+            uint8_t opcode = stale[i]->type == SYNC_ENTRY_DIR ? SYNC_OP_DIR_DELETE : SYNC_OP_DELETE;
+            send_frame(client, opcode, stale[i]->path, NULL, 0, 0);
+        }
+        stats.deleted = stale_count;
+        free(stale);
+    }
+    send_checkpoint(client, true, 0, 0, 0);
+    client->rescanning = false;
+
+    log_info("Manifest diff: %zu client entries, %lu files sent, %lu deltas, %lu attribute updates, %lu deletes, %lu unchanged\n",
+           m->count, stats.sent, stats.deltas, stats.touched, stats.deleted, stats.unchanged);
+    flush_client(client);
+}
+
+
+bool is_ignored(Client *client, const char *relative_path, bool is_dir) {
+    return sync_is_temp_name(relative_path) || ignore_match(&client->ignore, relative_path, is_dir);
+}
+
+// Event coalescing. Editors and build tools produce bursts such as create,
+// write, rename, delete; rather than forwarding each event, the net effect
+// per path is collected for up to coalesce_window_ms after the first one and
+// then queued to every client in one batch. A file that is created and
+// deleted within the window never reaches a client, and a chain of renames
+// becomes a single RENAME.
+
+static bool path_in_subtree(const char *path, const char *root, size_t root_len);
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// For CHECKPOINT stamps, which the client compares with its own clock
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Milliseconds until pending changes are due, -1 if there are none
+int coalesce_timeout_ms(void) {
+    if (!coalescer.deadline_ns) {
+        return -1;
+    }
+    uint64_t now = monotonic_ns();
+    if (now >= coalescer.deadline_ns) {
+        return 0;
+    }
+    return (int)((coalescer.deadline_ns - now + 999999) / 1000000);
+}
+
+static Change **change_slot(const char *path, uint64_t hash) {
+    size_t mask = coalescer.capacity - 1;
+    size_t i = hash & mask;
+    while (coalescer.slots[i] &&
+           (coalescer.slots[i]->path_hash != hash || strcmp(coalescer.slots[i]->path, path) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &coalescer.slots[i];
+}
+
+static bool change_grow(void) {
+    size_t old_capacity = coalescer.capacity;
+    Change **old_slots = coalescer.slots;
+    size_t capacity = old_capacity ? old_capacity * 2 : 256;
+    Change **slots = calloc(capacity, sizeof(Change *));
+    if (!slots) {
+        perror("Memory allocation failed");
+        return false;
+    }
+    coalescer.slots = slots;
+    coalescer.capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i]) {
+            *change_slot(old_slots[i]->path, old_slots[i]->path_hash) = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return true;
+}
+
+static Change *change_find(const char *path) {
+    if (!coalescer.count) {
+        return NULL;
+    }
+    return *change_slot(path, hash_path(path));
+}
+
+// Move a change to the end of the apply order
+static void change_touch(Change *c) {
+    if (coalescer.tail == c) {
+        return;
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        coalescer.head = c->next;
+    }
+    c->next->prev = c->prev;
+    c->prev = coalescer.tail;
+    c->next = NULL;
+    coalescer.tail->next = c;
+    coalescer.tail = c;
+}
+
+// The change for path, created if needed. A path seen for the first time is
+// assumed to hold whatever clients were last sent for it.
+static Change *change_get(const char *path) {
+    Change *c = change_find(path);
+    if (c) {
+        return c;
+    }
+    if ((coalescer.count + 1) * 10 > coalescer.capacity * 7 && !change_grow()) {
+        return NULL;
+    }
+    size_t len = strlen(path);
+    c = calloc(1, sizeof(Change) + len + 1);
+    if (!c) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    memcpy(c->path, path, len + 1);
+    c->path_hash = hash_path(path);
+    c->existed = true;
+    c->exists = true;
+    *change_slot(c->path, c->path_hash) = c;
+    coalescer.count++;
+
+    c->prev = coalescer.tail;
+    if (coalescer.tail) {
+        coalescer.tail->next = c;
+    } else {
+        coalescer.head = c;
+    }
+    coalescer.tail = c;
+    return c;
+}
+
+// Pending changes are due window_ms after this event, or earlier if an
+// event before it asked for that
+static void coalesce_due(unsigned long window_ms) {
+    uint64_t now = monotonic_ns();
+    uint64_t deadline = now + (uint64_t)window_ms * 1000000;
+    if (!coalescer.deadline_ns) {
+        coalescer.opened_ns = now;
+        coalescer.first_event_ns = realtime_ns();
+    } else if (coalescer.deadline_ns <= deadline) {
+        return;
+    }
+    coalescer.deadline_ns = deadline;
+}
+
+// The object clients know as c->origin no longer exists anywhere, so the
+// change at that path has to delete it after all.
+static void change_drop_origin(Change *c) {
+    if (!c->origin) {
+        return;
+    }
+    Change *source = change_find(c->origin);
+    if (source) {
+        source->moved_away = false;
+    }
+    free(c->origin);
+    c->origin = NULL;
+}
+
+static void coalesce_create(const char *path, bool is_dir, bool walk) {
+    coalescer.events++;
+    Change *c = change_find(path);
+    if (!c) {
+        c = change_get(path);
+        if (!c) {
+            return;
+        }
+        c->existed = false;
+    }
+    change_drop_origin(c);
+    c->exists = true;
+    c->fresh = true;
+    c->dirty = false;
+    c->is_dir = is_dir;
+    c->walk = walk;
+    c->appended = false;
+    change_touch(c);
+    coalesce_due(coalesce_window_ms);
+}
+
+static void coalesce_modify(const char *path) {
+    coalescer.events++;
+    Change *c = change_get(path);
+    if (!c) {
+        return;
+    }
+    c->dirty = true;
+    change_touch(c);
+    coalesce_due(coalesce_window_ms);
+}
+
+// A followed file was written to. Unless more happens to it, clients are
+// sent what was appended (see follow_check()).
+static void coalesce_append(const char *path) {
+    coalescer.events++;
+    Change *c = change_get(path);
+    if (!c) {
+        return;
+    }
+    c->appended = true;
+    change_touch(c);
+    coalesce_due(follow_window_ms);
+}
+
+static void coalesce_delete(const char *path, bool is_dir) {
+    coalescer.events++;
+    Change *c = change_get(path);
+    if (!c) {
+        return;
+    }
+    change_drop_origin(c);
+    c->exists = false;
+    c->fresh = false;
+    c->dirty = false;
+    c->walk = false;
+    c->appended = false;
+    if (is_dir) {
+        c->removed_dir = true;
+    }
+    change_touch(c);
+    coalesce_due(coalesce_window_ms);
+}
+
+// A file renamed within the sync tree. What clients see depends on where the
+// object came from: one they know is renamed from its original path, one
+// created within the window is simply sent at its new path.
+static void coalesce_move(const char *old_path, const char *new_path) {
+    coalescer.events += 2;
+    Change *from = change_get(old_path);
+    Change *to = from ? change_get(new_path) : NULL;
+    coalesce_due(coalesce_window_ms);
+    if (!to) {
+        return;
+    }
+    change_drop_origin(to);
+    to->exists = true;
+    to->is_dir = from->is_dir;
+    to->dirty = from->dirty;
+    to->fresh = from->fresh;
+    to->walk = from->walk;
+    to->appended = from->appended;
+    if (!from->fresh) {
+        char *origin = from->origin ? from->origin : strdup(old_path);
+        from->origin = NULL;
+        if (origin && strcmp(origin, new_path) == 0) {
+            // Renamed back to where clients have it
+            free(origin);
+        } else if (origin) {
+            Change *source = change_find(origin);
+            if (source) {
+                source->moved_away = true;
+            }
+            to->origin = origin;
+        }
+    }
+    from->exists = false;
+    from->fresh = false;
+    from->dirty = false;
+    from->walk = false;
+    from->appended = false;
+    change_touch(to);
+}
+
+// Keep the index in step with what clients are told: the same renames,
+// deletes and creates, with sizes and times from the file itself.
+// Entries added, removed or renamed in a directory change its mtime; record
+// the new one so the next startup does not have to read the directory again.
+static void index_refresh_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char parent_path[PATH_MAX];
+    snprintf(parent_path, sizeof(parent_path), "%.*s", slash ? (int)(slash - path) : 0, path);
+    IndexNode *parent = index_lookup(&tree_index, parent_path);
+    char disk_path[PATH_MAX];
+    struct stat st;
+    if (parent && parent->type == SYNC_ENTRY_DIR &&
+        walk_path(disk_path, sizeof(disk_path), sync_root, NULL, parent_path) && lstat(disk_path, &st) == 0 &&
+        S_ISDIR(st.st_mode)) {
+        index_set_stat(&tree_index, parent, &st);
+    }
+}
+
+static void index_move_path(const char *old_path, const char *new_path, uint64_t seq) {
+    IndexNode *node = index_file ? index_lookup(&tree_index, old_path) : NULL;
+    if (!node) {
+        return;
+    }
+    const char *slash = strrchr(new_path, '/');
+    IndexNode *parent = tree_index.root;
+    if (slash) {
+        char parent_path[PATH_MAX];
+        snprintf(parent_path, sizeof(parent_path), "%.*s", (int)(slash - new_path), new_path);
+        parent = index_add_path(&tree_index, parent_path, SYNC_ENTRY_DIR);
+    }
+    const char *name = slash ? slash + 1 : new_path;
+    if (parent && index_move(&tree_index, node, parent, name, strlen(name))) {
+        node->seq = seq;
+    }
+    index_refresh_parent(old_path);
+    index_refresh_parent(new_path);
+}
+
+static void index_scan(IndexNode *dir, const char *dir_path, bool watch);
+
+static void index_apply_change(const Change *c, const char *disk_path, uint64_t seq) {
+    if (!index_file) {
+        return;
+    }
+    if (c->origin) {
+        index_move_path(c->origin, c->path, seq);
+    }
+    IndexNode *node = index_lookup(&tree_index, c->path);
+    struct stat st;
+    if (!c->exists || lstat(disk_path, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+        if (node) {
+            index_remove(&tree_index, node);
+        }
+        index_refresh_parent(c->path);
+        return;
+    }
+    uint8_t type = S_ISDIR(st.st_mode) ? SYNC_ENTRY_DIR : SYNC_ENTRY_FILE;
+    if (node && node->type != type) {
+        index_remove(&tree_index, node);
+        node = NULL;
+    }
+    if (!node) {
+        node = index_add_path(&tree_index, c->path, type);
+        if (!node) {
+            return;
+        }
+    }
+    index_set_stat(&tree_index, node, &st);
+    node->seq = seq;
+    if (c->walk) {
+        // New, or moved in from outside: its contents produced no events.
+        // Watched again in case it moved before the event's watch was added.
+        index_scan(node, disk_path, true);
+    }
+    index_refresh_parent(c->path);
+}
+
+void journal_init(void) {
+    if (getrandom(&journal.id, sizeof(journal.id), 0) != sizeof(journal.id)) {
+        journal.id = monotonic_ns() ^ ((uint64_t)getpid() << 32);
+    }
+    if (journal.id == 0) {
+        journal.id = 1;
+    }
+    // Nothing before this run can be replayed, even if the index kept
+    // the sequence numbers going
+    journal.floor = next_seq - 1;
+}
+
+static JournalEntry *journal_at(size_t i) {
+    return journal.entries[(journal.first + i) & (journal.capacity - 1)];
+}
+
+static void journal_drop_first(void) {
+    JournalEntry *entry = journal_at(0);
+    journal.floor = entry->seq;
+    journal.bytes -= entry->size;
+    journal.first = (journal.first + 1) & (journal.capacity - 1);
+    journal.count--;
+    free(entry);
+}
+
+// Record change seq; the caller fills in what happened. Returns NULL if it
+// could not be kept, in which case nothing up to seq can be replayed.
+static JournalEntry *journal_append(uint64_t seq, const char *path, const char *origin) {
+    size_t path_len = strlen(path) + 1;
+    size_t origin_len = origin ? strlen(origin) + 1 : 0;
+    size_t size = sizeof(JournalEntry) + path_len + origin_len;
+    while (journal.count > 0 && journal.bytes + size > journal_limit) {
+        journal_drop_first();
+    }
+    JournalEntry *entry = NULL;
+    if (journal_limit > 0 && journal.count == journal.capacity) {
+        size_t capacity = journal.capacity ? journal.capacity * 2 : 1024;
+        JournalEntry **entries = malloc(capacity * sizeof(JournalEntry *));
+        if (entries) {
+            for (size_t i = 0; i < journal.count; i++) {
+                entries[i] = journal_at(i);
+            }
+            free(journal.entries);
+            journal.entries = entries;
+            journal.capacity = capacity;
+            journal.first = 0;
+        }
+    }
+    if (journal_limit > 0 && journal.count < journal.capacity) {
+        entry = calloc(1, size);
+    }
+    if (!entry) {
+        while (journal.count > 0) {
+            journal_drop_first();
+        }
+        journal.floor = seq;
+        return NULL;
+    }
+    entry->seq = seq;
+    entry->size = size;
+    memcpy(entry->path, path, path_len);
+    if (origin) {
+        entry->origin = entry->path + path_len;
+        memcpy(entry->origin, origin, origin_len);
+    }
+    journal.entries[(journal.first + journal.count) & (journal.capacity - 1)] = entry;
+    journal.count++;
+    journal.bytes += size;
+    return entry;
+}
+
+// Tell a client that every change so far has been queued for it. Forced at
+// the end of a manifest diff or replay, which bring it up to date. After a
+// batch of live changes it carries the time of the batch's first event, and
+// the origin's if known.
+static void send_checkpoint(Client *client, bool force, uint64_t event_ns, uint64_t origin_ns, uint8_t relays) {
+    uint64_t seq = next_seq - 1;
+    if (client->closing || (client->needs_rescan && !client->rescanning) ||
+        (!force && (!client->live || seq <= client->checkpoint))) {
+        return;
+    }
+    client->checkpoint = seq;
+    uint8_t payload[SYNC_CHECKPOINT_ORIGIN_LEN];
+    sync_put_u64(payload, event_ns);
+    sync_put_u64(payload + 8, origin_ns);
+    payload[16] = relays;
+    size_t len = !event_ns ? 0 : origin_ns ? SYNC_CHECKPOINT_ORIGIN_LEN : SYNC_CHECKPOINT_LEN;
+    send_frame(client, SYNC_OP_CHECKPOINT, NULL, payload, len, seq);
+}
+
+// Where the batch whose first event was at event_ns started. Without an
+// upstream that is here; a relay only knows if its client has reported
+// applying an upstream batch since.
+static uint64_t batch_origin(uint64_t event_ns, uint8_t *relays) {
+    *relays = 0;
+    if (upstream_fd < 0) {
+        return event_ns;
+    }
+    uint64_t origin_ns = upstream_seen_ns >= event_ns ? upstream_origin_ns : 0;
+    if (origin_ns) {
+        *relays = upstream_relays < UINT8_MAX ? upstream_relays + 1 : UINT8_MAX;
+    }
+    upstream_origin_ns = 0;
+    return origin_ns;
+}
+
+// Origins reported by the relay's client, see upstream_fd. Its end closing
+// means the relay is going away.
+void read_upstream(void) {
+    uint8_t records[64 * SYNC_RELAY_RECORD_LEN];
+    for (;;) {
+        ssize_t n = read(upstream_fd, records, sizeof(records));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            log_info("Upstream relay client exited\n");
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, upstream_fd, NULL);
+            stop_requested = 1;
+            return;
+        }
+        if (n < 0) {
+            return;
+        }
+        // Records are written whole, well under PIPE_BUF
+        for (ssize_t off = 0; off + SYNC_RELAY_RECORD_LEN <= n; off += SYNC_RELAY_RECORD_LEN) {
+            uint64_t origin_ns = sync_get_u64(records + off);
+            if (!upstream_origin_ns || origin_ns < upstream_origin_ns) {
+                upstream_origin_ns = origin_ns;
+                upstream_relays = records[off + 8];
+            }
+        }
+        upstream_seen_ns = realtime_ns();
+    }
+}
+
+static bool is_followed(const char *path) {
+    return following && ignore_match(&follow_rules, path, false);
+}
+
+// Hash of the FOLLOW_TAIL_BYTES of a file before end
+static bool follow_tail_hash(const char *filepath, uint64_t end, uint8_t out[SYNC_HASH_LEN]) {
+    static char buffer[FOLLOW_TAIL_BYTES];
+    size_t len = end < FOLLOW_TAIL_BYTES ? end : FOLLOW_TAIL_BYTES;
+    int file_fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        return false;
+    }
+    ssize_t got = pread(file_fd, buffer, len, end - len);
+    close(file_fd);
+    if (got != (ssize_t)len) {
+        return false;
+    }
+    sync_hash_buffer(buffer, len, out);
+    return true;
+}
+
+// Where the bytes appended to a followed file since clients were sent it
+// start, with st its size now. -1 if it was truncated or rewritten, or was
+// not sent while followed in this run.
+static off_t follow_check(const char *relative_path, const char *disk_path, struct stat *st) {
+    ManifestEntry *e = manifest_find(followed, relative_path);
+    if (!e || !e->has_hash || lstat(disk_path, st) < 0 || !S_ISREG(st->st_mode)) {
+        return -1;
+    }
+    uint8_t hash[SYNC_HASH_LEN];
+    if ((uint64_t)st->st_size < e->size || !follow_tail_hash(disk_path, e->size, hash) ||
+        memcmp(hash, e->hash, SYNC_HASH_LEN) != 0) {
+        metrics.follow_rewrites++;
+        return -1;
+    }
+    return e->size;
+}
+
+// Clients are about to be sent c. Remember how much of a followed file that
+// is: size, or if unknown its size now, as what is read later can only be
+// longer unless it is rewritten.
+static void follow_update(const Change *c, const char *disk_path, off_t size) {
+    if (c->origin) {
+        manifest_remove(followed, c->origin);
+    }
+    struct stat st;
+    if (size < 0 && c->exists && lstat(disk_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = st.st_size;
+    }
+    if (size < 0 || !is_followed(c->path)) {
+        manifest_remove(followed, c->path);
+        return;
+    }
+    ManifestEntry *e = manifest_add(followed, c->path);
+    if (e) {
+        e->size = size;
+        e->has_hash = follow_tail_hash(disk_path, size, e->hash);
+    }
+}
+
+// Queue one change to every live client. Paths under remap_from are read
+// from remap_to on disk: the directory was renamed after these changes and
+// the rename is sent right after them.
+static bool emit_change(Change *c, Manifest *none, const char *remap_from, const char *remap_to) {
+    bool known = c->existed && !c->moved_away;
+    if (!c->exists && !known) {
+        return false;
+    }
+    if (c->exists && !c->fresh && !c->origin && !c->dirty && !c->appended) {
+        return false;
+    }
+
+    char disk_path[PATH_MAX];
+    size_t remap_len = remap_from ? strlen(remap_from) : 0;
+    bool remapped = remap_from && path_in_subtree(c->path, remap_from, remap_len);
+    if (remapped) {
+        snprintf(disk_path, sizeof(disk_path), "%s/%s%s", sync_root, remap_to, c->path + remap_len);
+    } else {
+        snprintf(disk_path, sizeof(disk_path), "%s/%s", sync_root, c->path);
+    }
+    // Only appended to, or else sent as a delta
+    struct stat follow_st;
+    off_t append_from = -1;
+    if (c->appended && c->exists && !c->fresh) {
+        append_from = c->origin || c->dirty ? -1 : follow_check(c->path, disk_path, &follow_st);
+        if (append_from < 0) {
+            c->dirty = true;
+        } else if (append_from == follow_st.st_size) {
+            return false;
+        }
+    }
+    if (!c->exists) {
+        log_debug("%s %s\n", c->removed_dir ? "DIR_DELETE" : "DELETE", c->path);
+    } else if (c->fresh) {
+        log_debug("%s %s\n", c->is_dir ? "DIR_CREATE" : "CREATE", c->path);
+    } else if (c->origin) {
+        log_debug("RENAME %s -> %s%s\n", c->origin, c->path, c->dirty ? " (modified)" : "");
+    } else if (append_from >= 0) {
+        log_debug("APPEND %s (%lld bytes at %lld)\n", c->path, (long long)(follow_st.st_size - append_from),
+                  (long long)append_from);
+    } else {
+        log_debug("MODIFY %s\n", c->path);
+    }
+
+    uint64_t seq = next_seq++;
+    index_apply_change(c, disk_path, seq);
+    JournalEntry *entry = journal_append(seq, c->path, c->origin);
+    if (entry) {
+        entry->known = known;
+        entry->exists = c->exists;
+        entry->fresh = c->fresh;
+        entry->dirty = c->dirty || append_from >= 0;
+        entry->removed_dir = c->removed_dir;
+        entry->is_dir = c->is_dir;
+        entry->walk = c->walk;
+    }
+    if (followed && !c->is_dir) {
+        follow_update(c, disk_path, append_from >= 0 ? follow_st.st_size : -1);
+    }
+    // Every client sent this file shares one open, read and compression of it
+    if (c->exists && !c->is_dir) {
+        fanout_path = disk_path;
+    }
+    for (int j = 0; j < client_count; j++) {
+        Client *client = clients[j];
+        if (!client->live || client->closing) {
+            continue;
+        }
+        bool ignored = is_ignored(client, c->path, c->exists ? c->is_dir : c->removed_dir);
+        if (client->transfers) {
+            // Whatever is still to be sent of them in chunks is out of date
+            cancel_transfers(client, c->path);
+            if (c->origin) {
+                cancel_transfers(client, c->origin);
+            }
+        }
+
+        if (!c->exists) {
+            if (!ignored) {
+                send_frame(client, c->removed_dir ? SYNC_OP_DIR_DELETE : SYNC_OP_DELETE, c->path, NULL, 0, seq);
+            }
+            continue;
+        }
+        if (c->fresh) {
+            // Something of another type may be in the way
+            if (known && c->removed_dir && !is_ignored(client, c->path, true)) {
+                send_frame(client, SYNC_OP_DIR_DELETE, c->path, NULL, 0, seq);
+            } else if (known && c->is_dir && !ignored) {
+                send_frame(client, SYNC_OP_DELETE, c->path, NULL, 0, seq);
+            }
+            if (ignored) {
+                continue;
+            }
+            if (c->is_dir) {
+                send_dir_create(client, c->path, seq);
+                if (c->walk) {
+                    DiffStats stats = { 0, 0, 0, 0, 0 };
+                    diff_directory(client, none, &stats, disk_path, c->path);
+                }
+            } else {
+                send_file(client, disk_path, c->path, seq);
+            }
+            continue;
+        }
+        if (c->origin) {
+            bool was_ignored = is_ignored(client, c->origin, c->is_dir);
+            if (was_ignored && ignored) {
+                continue;
+            }
+            if (ignored) {
+                send_frame(client, SYNC_OP_DELETE, c->origin, NULL, 0, seq);
+                continue;
+            }
+            if (was_ignored) {
+                send_file(client, disk_path, c->path, seq);
+                continue;
+            }
+            send_frame(client, SYNC_OP_RENAME, c->origin, c->path, strlen(c->path), seq);
+            if (send_owed(client, c->origin, c->path, c->is_dir, seq) && !c->is_dir) {
+                continue;
+            }
+        }
+        if ((c->dirty || append_from >= 0) && !ignored) {
+            // A delta would be requested by a path that is about to change
+            if (append_from >= 0 && client->append) {
+                send_append(client, disk_path, c->path, append_from, &follow_st, seq);
+            } else if (remapped) {
+                send_file(client, disk_path, c->path, seq);
+            } else {
+                request_signature(client, c->path, seq);
+            }
+        }
+    }
+    fanout_end();
+    return true;
+}
+
+// Whether path is below a directory whose contents were sent whole earlier
+// in this batch
+static bool under_walked(Manifest *walked, const char *path) {
+    char parent[PATH_MAX];
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        memcpy(parent, path, slash - path);
+        parent[slash - path] = '\0';
+        if (manifest_find(walked, parent)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Queue everything pending to the clients, in the order it happened
+void coalesce_flush(const char *remap_from, const char *remap_to) {
+    if (!coalescer.head) {
+        coalescer.deadline_ns = 0;
+        return;
+    }
+    Manifest *none = manifest_create();
+    unsigned long changes = 0;
+
+    batching = true;
+    uint64_t event_ns = coalescer.first_event_ns;
+    uint8_t relays;
+    uint64_t origin_ns = batch_origin(event_ns, &relays);
+    uint64_t opened_ns = coalescer.opened_ns;
+    Manifest *walked = NULL;
+    Change *c = coalescer.head;
+    while (c) {
+        Change *next = c->next;
+        if (c->fresh && walked && under_walked(walked, c->path)) {
+            // Sent with its directory, as it is now
+        } else if (none && emit_change(c, none, remap_from, remap_to)) {
+            changes++;
+            if (c->walk && c->exists && (walked || (walked = manifest_create()))) {
+                manifest_add(walked, c->path);
+            }
+        }
+        free(c->origin);
+        free(c);
+        c = next;
+    }
+    for (int j = 0; j < client_count; j++) {
+        send_checkpoint(clients[j], false, event_ns, origin_ns, relays);
+    }
+    batching = false;
+    manifest_free(none);
+    manifest_free(walked);
+    sync_hist_observe(&metrics.batch_delay, (monotonic_ns() - opened_ns) / 1000);
+    metrics.batches++;
+    metrics.changes_sent += changes;
+
+    memset(coalescer.slots, 0, coalescer.capacity * sizeof(Change *));
+    coalescer.count = 0;
+    coalescer.head = NULL;
+    coalescer.tail = NULL;
+    coalescer.deadline_ns = 0;
+    coalescer.first_event_ns = 0;
+
+    unsigned long suppressed = coalescer.events > changes ? coalescer.events - changes : 0;
+    events_suppressed += suppressed;
+    log_debug("Coalesced %lu events into %lu changes (%lu suppressed, %lu total)\n",
+           coalescer.events, changes, suppressed, events_suppressed);
+    coalescer.events = 0;
+
+    for (int j = 0; j < client_count; j++) {
+        if (!clients[j]->closing) {
+            flush_client(clients[j]);
+        }
+    }
+}
+
+// A directory renamed within the tree. This is a barrier: pending changes
+// under the old name are sent first, then the rename itself.
+static void coalesce_rename_dir(const char *old_path, const char *new_path) {
+    coalesce_flush(old_path, new_path);
+    log_debug("RENAME %s -> %s\n", old_path, new_path);
+    uint64_t seq = next_seq++;
+    index_move_path(old_path, new_path, seq);
+    JournalEntry *entry = journal_append(seq, new_path, old_path);
+    if (entry) {
+        entry->known = true;
+        entry->exists = true;
+        entry->is_dir = true;
+    }
+    Manifest *none = NULL;
+    for (int j = 0; j < client_count; j++) {
+        Client *client = clients[j];
+        if (!client->live || client->closing) {
+            continue;
+        }
+        bool was_ignored = is_ignored(client, old_path, true);
+        bool ignored = is_ignored(client, new_path, true);
+        if (client->transfers) {
+            cancel_transfers(client, old_path);
+            cancel_transfers(client, new_path);
+        }
+        if (was_ignored && ignored) {
+            continue;
+        }
+        if (ignored) {
+            send_frame(client, SYNC_OP_DIR_DELETE, old_path, NULL, 0, seq);
+        } else if (was_ignored) {
+            // The client never had it: send the directory as if it were new
+            if (!none) {
+                none = manifest_create();
+            }
+            if (none) {
+                char disk_path[PATH_MAX];
+                DiffStats stats = { 0, 0, 0, 0, 0 };
+                snprintf(disk_path, sizeof(disk_path), "%s/%s", sync_root, new_path);
+                send_dir_create(client, new_path, seq);
+                if (!client->closing) {
+                    diff_directory(client, none, &stats, disk_path, new_path);
+                }
+            }
+        } else {
+            send_frame(client, SYNC_OP_RENAME, old_path, new_path, strlen(new_path), seq);
+            if (!client->closing) {
+                send_owed(client, old_path, new_path, true, seq);
+            }
+        }
+    }
+    manifest_free(none);
+    metrics.changes_sent++;
+    uint64_t event_ns = realtime_ns();
+    uint8_t relays;
+    uint64_t origin_ns = batch_origin(event_ns, &relays);
+    for (int j = 0; j < client_count; j++) {
+        send_checkpoint(clients[j], false, event_ns, origin_ns, relays);
+    }
+}
+
+// What a replay still has to send once all renames and deletes are queued,
+// kept in a Manifest under the path the entry has by then. `type` says what
+// to send and `seen` marks entries that were later deleted or moved away.
+enum {
+    REPLAY_MODIFIED,        // the client has an older copy: delta
+    REPLAY_FRESH,           // the client has no copy: whole file
+    REPLAY_WALK             // directory from outside the tree: all its contents
+};
+
+static void replay_set(Manifest *pending, const char *path, uint8_t type) {
+    ManifestEntry *entry = manifest_add(pending, path);
+    if (!entry) {
+        return;
+    }
+    if (entry->seen || type != REPLAY_MODIFIED || entry->type != REPLAY_FRESH) {
+        entry->type = type;
+    }
+    entry->seen = false;
+}
+
+static void replay_drop(Manifest *pending, const char *path, bool subtree) {
+    ManifestEntry *entry = manifest_find(pending, path);
+    if (entry) {
+        entry->seen = true;
+    }
+    size_t len = strlen(path);
+    for (size_t i = 0; subtree && i < pending->capacity; i++) {
+        entry = pending->slots[i];
+        if (entry && path_in_subtree(entry->path, path, len)) {
+            entry->seen = true;
+        }
+    }
+}
+
+static void replay_move(Manifest *pending, const char *from, const char *to, bool subtree) {
+    replay_drop(pending, to, subtree);
+    size_t from_len = strlen(from);
+    size_t moved = 0;
+    ManifestEntry **list = malloc((pending->count ? pending->count : 1) * sizeof(ManifestEntry *));
+    for (size_t i = 0; list && i < pending->capacity; i++) {
+        ManifestEntry *entry = pending->slots[i];
+        if (entry && !entry->seen && (subtree ? path_in_subtree(entry->path, from, from_len)
+                                              : strcmp(entry->path, from) == 0)) {
+            entry->seen = true;
+            list[moved++] = entry;
+        }
+    }
+    for (size_t i = 0; i < moved; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", to, list[i]->path + from_len);
+        replay_set(pending, path, list[i]->type);
+    }
+    free(list);
+}
+
+// One journal entry for one client, following emit_change(). All frames
+// carry seq 0: the client only counts the replay once its CHECKPOINT arrives.
+static void replay_entry(Client *client, Manifest *pending, const JournalEntry *e) {
+    bool ignored = is_ignored(client, e->path, e->exists ? e->is_dir : e->removed_dir);
+    if (!e->exists) {
+        if (!ignored) {
+            send_frame(client, e->removed_dir ? SYNC_OP_DIR_DELETE : SYNC_OP_DELETE, e->path, NULL, 0, 0);
+        }
+        replay_drop(pending, e->path, e->removed_dir);
+        return;
+    }
+    if (e->fresh) {
+        if (e->known && e->removed_dir && !is_ignored(client, e->path, true)) {
+            send_frame(client, SYNC_OP_DIR_DELETE, e->path, NULL, 0, 0);
+        } else if (e->known && e->is_dir && !ignored) {
+            send_frame(client, SYNC_OP_DELETE, e->path, NULL, 0, 0);
+        }
+        replay_drop(pending, e->path, e->known && e->removed_dir);
+        if (ignored) {
+            return;
+        }
+        if (e->is_dir) {
+            send_dir_create(client, e->path, 0);
+            if (e->walk) {
+                replay_set(pending, e->path, REPLAY_WALK);
+            }
+        } else {
+            replay_set(pending, e->path, REPLAY_FRESH);
+        }
+        return;
+    }
+    if (e->origin) {
+        bool was_ignored = is_ignored(client, e->origin, e->is_dir);
+        if (was_ignored && ignored) {
+            return;
+        }
+        if (ignored) {
+            send_frame(client, e->is_dir ? SYNC_OP_DIR_DELETE : SYNC_OP_DELETE, e->origin, NULL, 0, 0);
+            replay_drop(pending, e->origin, e->is_dir);
+            return;
+        }
+        if (was_ignored) {
+            replay_drop(pending, e->path, e->is_dir);
+            if (e->is_dir) {
+                send_dir_create(client, e->path, 0);
+            }
+            replay_set(pending, e->path, e->is_dir ? REPLAY_WALK : REPLAY_FRESH);
+            return;
+        }
+        ManifestEntry *source = manifest_find(pending, e->origin);
+        if (e->is_dir || !source || source->seen || source->type != REPLAY_FRESH) {
+            send_frame(client, SYNC_OP_RENAME, e->origin, e->path, strlen(e->path), 0);
+        }
+        replay_move(pending, e->origin, e->path, e->is_dir);
+        if (!e->is_dir) {
+            // If the client had applied part of this replay before, the
+            // rename may have moved a newer file over this one: check it
+            replay_set(pending, e->path, REPLAY_MODIFIED);
+        }
+    }
+    if (e->dirty && !ignored) {
+        replay_set(pending, e->path, REPLAY_MODIFIED);
+    }
+}
+
+// Queue for a reconnecting client every change after seq, or return false if
+// the journal no longer has all of them. Renames and deletes are replayed in
+// order; contents are sent at the end from the current tree, under the name
+// each file ended up with, so a file changed many times is sent once.
+bool replay_journal(Client *client, uint64_t seq) {
+    if (seq < journal.floor || seq >= next_seq) {
+        return false;
+    }
+    size_t lo = 0;
+    size_t hi = journal.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (journal_at(mid)->seq <= seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Paths whose delta the client never received are checked like modified ones
+    Manifest *pending = client->stale ? client->stale : manifest_create();
+    client->stale = NULL;
+    client->rescanning = true;
+    for (size_t i = lo; i < journal.count; i++) {
+        replay_entry(client, pending, journal_at(i));
+    }
+
+    // Whole directories first, so files below them have somewhere to go
+    DiffStats stats = { 0, 0, 0, 0, 0 };
+    Manifest *none = NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < pending->capacity; i++) {
+            ManifestEntry *entry = pending->slots[i];
+            if (!entry || entry->seen || (entry->type == REPLAY_WALK) != (pass == 0) ||
+                is_ignored(client, entry->path, entry->type == REPLAY_WALK)) {
+                continue;
+            }
+            char disk_path[PATH_MAX];
+            snprintf(disk_path, sizeof(disk_path), "%s/%s", sync_root, entry->path);
+            struct stat st;
+            if (lstat(disk_path, &st) < 0) {
+                continue;
+            }
+            if (entry->type == REPLAY_WALK) {
+                if (!none) {
+                    none = manifest_create();
+                }
+                if (S_ISDIR(st.st_mode)) {
+                    diff_directory(client, none, &stats, disk_path, entry->path);
+                }
+            } else if (S_ISREG(st.st_mode)) {
+                if (entry->type == REPLAY_FRESH || has_partial(client, entry->path)) {
+                    send_file(client, disk_path, entry->path, 0);
+                    stats.sent++;
+                } else {
+                    request_signature(client, entry->path, 0);
+                    stats.deltas++;
+                }
+            }
+        }
+    }
+    manifest_free(none);
+    manifest_free(pending);
+    send_checkpoint(client, true, 0, 0, 0);
+    client->rescanning = false;
+
+    metrics.replays++;
+    log_info("Resumed client after change %llu: %zu changes replayed, %lu files sent, %lu deltas\n",
+           (unsigned long long)seq, journal.count - lo, stats.sent, stats.deltas);
+    flush_client(client);
+    return true;
+}
+
+// The IN_MOVED_FROM held back was not followed by its IN_MOVED_TO: the entry
+// left the sync tree.
+static void finish_pending_move(const char *sync_dir) {
+    if (pending_move_is_dir) {
+        watch_remove_subtree(&watches, pending_move_path);
+    }
+    coalesce_delete(pending_move_path + strlen(sync_dir) + 1, pending_move_is_dir);
+    pending_move_cookie = 0;
+}
+
+// Drain queued inotify events into the coalescer. Called from the reactor
+// whenever the inotify fd is readable; the changes reach clients when the
+// window expires. At most INOTIFY_MAX_READS buffers are read per call, and
+// none once forced flushes have taken the queues past the memory budget:
+// the rest stays in the kernel until the reactor comes back.
+void handle_inotify_events(const char *sync_dir) {
+    char buffer[EVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (int reads = 0;; reads++) {
+        if (memory_held > memory_budget) {
+            update_throttle();
+            return;
+        }
+        if (reads == INOTIFY_MAX_READS) {
+            return;
+        }
+        uint64_t read_ns = realtime_ns();
+        int length = read(fd, buffer, EVENT_BUF_LEN);
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("read failed");
+            } else if (!inotify_overflowed) {
+                inotify_drained_ns = read_ns;
+                inotify_drained_seq = next_seq - 1;
+            }
+            if (pending_move_cookie) {
+                finish_pending_move(sync_dir);
+            }
+            if (inotify_overflowed) {
+                recover_overflow(sync_dir);
+            }
+            return;
+        }
+
+        int i = 0;
+        while (i < length) {
+            struct inotify_event *event = (struct inotify_event *)&buffer[i];
+            i += EVENT_SIZE + event->len;
+            metrics.events_received++;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // The kernel's queue filled up and dropped events; the events
+                // after this one are still good
+                inotify_overflowed = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // The kernel dropped this watch (directory deleted or moved away)
+                WatchEntry *gone = watch_find_wd(&watches, event->wd);
+                if (gone) {
+                    watch_remove(&watches, gone);
+                }
+                continue;
+            }
+            if (!event->len) {
+                continue;
+            }
+
+            WatchEntry *watch = watch_find_wd(&watches, event->wd);
+            if (!watch) {
+                fprintf(stderr, "Could not find watched path for wd: %d\n", event->wd);
+                continue;
+            }
+
+            char event_path[PATH_MAX];
+            snprintf(event_path, sizeof(event_path), "%s/%s", watch->path, event->name);
+
+            // Compute relative path
+            const char *relative_path = event_path + strlen(sync_dir) + 1;
+            bool is_dir = event->mask & IN_ISDIR;
+
+            if (pending_move_cookie &&
+                !((event->mask & IN_MOVED_TO) && event->cookie == pending_move_cookie)) {
+                finish_pending_move(sync_dir);
+            }
+
+            if (event->mask & IN_MOVED_FROM) {
+                // Held back until we know whether the matching IN_MOVED_TO follows
+                pending_move_cookie = event->cookie;
+                pending_move_is_dir = is_dir;
+                snprintf(pending_move_path, sizeof(pending_move_path), "%s", event_path);
+                continue;
+            }
+
+            if (event->mask & IN_MOVED_TO) {
+                if (pending_move_cookie) {
+                    const char *old_relative = pending_move_path + strlen(sync_dir) + 1;
+                    if (is_dir) {
+                        // Renamed inside the tree: the kernel watches stay, only our paths change
+                        watch_rename_subtree(&watches, pending_move_path, event_path);
+                        coalesce_rename_dir(old_relative, relative_path);
+                    } else {
+                        coalesce_move(old_relative, relative_path);
+                    }
+                    pending_move_cookie = 0;
+                } else {
+                    // Moved in from outside the sync tree
+                    if (is_dir) {
+                        add_watch_recursive(event_path);
+                    }
+                    coalesce_create(relative_path, is_dir, is_dir);
+                }
+            } else if (event->mask & IN_CREATE) {
+                // What was created in a new directory before its watch was
+                // added has no events, so it is sent with the directory
+                if (is_dir) {
+                    add_watch_recursive(event_path);
+                }
+                coalesce_create(relative_path, is_dir, is_dir);
+            } else if ((event->mask & (IN_MODIFY | IN_CLOSE_WRITE)) && !is_dir && is_followed(relative_path)) {
+                coalesce_append(relative_path);
+            } else if ((event->mask & IN_CLOSE_WRITE) && !is_dir) {
+                coalesce_modify(relative_path);
+            } else if (event->mask & IN_DELETE) {
+                coalesce_delete(relative_path, is_dir);
+            }
+
+            // Bound memory during very large bursts
+            if (coalescer.count >= COALESCE_MAX_PENDING) {
+                coalesce_flush(NULL, NULL);
+            }
+        }
+    }
+}
+
+static OutItem *make_file_item(const char *filepath, off_t start, off_t end) {
+    OutItem *item = calloc(1, sizeof(OutItem));
+    if (!item) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    item->file_path = strdup(filepath);
+    if (!item->file_path) {
+        perror("Memory allocation failed");
+        free(item);
+        return NULL;
+    }
+    item->is_file = true;
+    item->file_fd = -1;
+    item->file_off = start;
+    item->file_end = end;
+    return item;
+}
+
+// An item sending the whole of a shared file, compressed if stream is set
+static OutItem *make_shared_item(SharedFile *sf, bool stream) {
+    OutItem *item = calloc(1, sizeof(OutItem));
+    if (!item) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    item->is_file = true;
+    item->file_fd = -1;
+    item->file_end = sf->st.st_size;
+    item->shared = sf;
+    sf->refs++;
+    if (stream) {
+        item->share_stream = true;
+        sf->unstarted++;
+    }
+    return item;
+}
+
+// Queue a frame header together with the file range that forms its payload.
+// Takes ownership of both items; returns false if nothing was queued or the
+// client was downgraded while queueing.
+static bool enqueue_file_frame(Client *client, OutItem *header, OutItem *item) {
+    if (!header || !item) {
+        free_items(header);
+        free_items(item);
+        return false;
+    }
+    header->joined_next = true;
+    if (!enqueue_item(client, header)) {
+        free_items(header);
+        free_items(item);
+        return false;
+    }
+    if (!enqueue_item(client, item)) {
+        // The payload would have taken the client over its high-water mark;
+        // the header was dropped with the rest of the queue.
+        free_items(item);
+        return false;
+    }
+    return !client->needs_rescan;
+}
+
+// Queue a small file (size as of now) or a new directory in the BUNDLE at the
+// tail of the client's queue, starting a new one if there is none or it is
+// full. Returns false like enqueue_item() if nothing was queued.
+static bool bundle_add(Client *client, uint8_t type, const char *relative_path, off_t size, uint64_t seq) {
+    size_t path_len = strlen(relative_path);
+    if (path_len > SYNC_MAX_PATH) {
+        return false;
+    }
+    size_t entry = SYNC_BUNDLE_ENTRY_LEN + path_len + size;
+    OutItem *item = client->out_tail;
+    Bundle *b = item ? item->bundle : NULL;
+    if (!b || b->count >= BUNDLE_MAX_ENTRIES || b->estimate + entry > bundle_limit) {
+        item = calloc(1, sizeof(OutItem));
+        b = calloc(1, sizeof(Bundle));
+        if (!item || !b) {
+            perror("Memory allocation failed");
+            free(item);
+            free(b);
+            return false;
+        }
+        item->file_fd = -1;
+        item->bundle = b;
+        if (!enqueue_item(client, item)) {
+            free_items(item);
+            return false;
+        }
+    }
+    if (b->names_len + 12 + path_len > b->names_cap) {
+        size_t cap = b->names_cap ? b->names_cap * 2 : 4096;
+        while (cap < b->names_len + 12 + path_len) {
+            cap *= 2;
+        }
+        char *names = realloc(b->names, cap);
+        if (!names) {
+            perror("Memory allocation failed");
+            return false;
+        }
+        b->names = names;
+        b->names_cap = cap;
+    }
+    uint8_t *p = (uint8_t *)b->names + b->names_len;
+    p[0] = type;
+    sync_put_u64(p + 1, seq);
+    sync_put_u16(p + 9, path_len);
+    memcpy(p + 11, relative_path, path_len + 1);
+    b->names_len += 12 + path_len;
+    b->count++;
+    b->estimate += entry;
+    client->queued_bytes += entry;
+    check_high_water(client);
+    return true;
+}
+
+// Read the files of a bundle that has reached the head of the queue and turn
+// it into a BUNDLE frame. Files deleted, renamed, replaced or grown past
+// BUNDLE_FILE_MAX since they were queued are left out: the events that did
+// it bring their own change. Returns -1 if memory ran out.
+static int build_bundle(Client *client, OutItem *item) {
+    Bundle *b = item->bundle;
+    size_t cap = SYNC_HEADER_LEN + b->estimate;
+    size_t len = SYNC_HEADER_LEN;
+    char *buf = malloc(cap);
+    if (!buf) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    uint64_t first_seq = 0;
+    unsigned long files = 0;
+    for (size_t pos = 0; pos < b->names_len;) {
+        const uint8_t *p = (const uint8_t *)b->names + pos;
+        SyncBundleEntry e = { p[0], sync_get_u16(p + 9), sync_get_u64(p + 1), 0, 0, 0, (const char *)p + 11, NULL };
+        if (pos == 0) {
+            first_seq = e.seq;
+        }
+        pos += 12 + e.path_len;
+        int file_fd = -1;
+        struct stat st;
+        if (e.type == SYNC_ENTRY_FILE) {
+            char filepath[PATH_MAX];
+            snprintf(filepath, sizeof(filepath), "%s/%s", sync_root, e.path);
+            file_fd = open(filepath, O_RDONLY | O_CLOEXEC);
+            file_opens++;
+            if (file_fd < 0) {
+                if (errno == ENOENT) {
+                    // Renamed on disk by a change not sent yet, as in send_file()
+                    owe_contents(client, e.path);
+                }
+                continue;
+            }
+            if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > BUNDLE_FILE_MAX ||
+                len + SYNC_BUNDLE_ENTRY_LEN + e.path_len + st.st_size > SYNC_HEADER_LEN + SYNC_BUNDLE_MAX) {
+                close(file_fd);
+                continue;
+            }
+            e.size = st.st_size;
+            e.mtime_ns = stat_mtime_ns(&st);
+            e.mode = st.st_mode & 07777;
+        }
+        size_t need = len + SYNC_BUNDLE_ENTRY_LEN + e.path_len + e.size;
+        if (need > cap) {
+            // Grown since it was queued
+            char *grown = realloc(buf, need * 2);
+            if (!grown) {
+                perror("Memory allocation failed");
+                if (file_fd >= 0) {
+                    close(file_fd);
+                }
+                free(buf);
+                return -1;
+            }
+            buf = grown;
+            cap = need * 2;
+        }
+        char *data = buf + len + SYNC_BUNDLE_ENTRY_LEN + e.path_len;
+        if (file_fd >= 0) {
+            size_t got = 0;
+            while (got < e.size) {
+                ssize_t n = pread(file_fd, data + got, e.size - got, got);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                transfer_syscalls++;
+                if (n <= 0) {
+                    break;
+                }
+                got += n;
+            }
+            close(file_fd);
+            file_bytes_read += got;
+            e.size = got;
+            files++;
+        }
+        sync_bundle_put_entry((uint8_t *)buf + len, &e);
+        memcpy(buf + len + SYNC_BUNDLE_ENTRY_LEN, e.path, e.path_len);
+        len += SYNC_BUNDLE_ENTRY_LEN + e.path_len + e.size;
+    }
+
+    uint8_t flags = 0;
+    size_t payload_len = len - SYNC_HEADER_LEN;
+    if (client->compress && payload_len >= COMPRESS_MIN_SIZE) {
+        // Small files rarely compress on their own, but many of them together
+        // do. A sample from the middle tells whether the rest is worth it.
+        double start = cpu_seconds();
+        static uint8_t sample[COMPRESS_SAMPLE_SIZE + COMPRESS_SAMPLE_SIZE / 100 + 64];
+        uLong sample_len = payload_len < COMPRESS_SAMPLE_SIZE ? payload_len : COMPRESS_SAMPLE_SIZE;
+        uLongf packed_len = sizeof(sample);
+        bool worth = compress2(sample, &packed_len, (const Bytef *)buf + SYNC_HEADER_LEN + (payload_len - sample_len) / 2,
+                               sample_len, compress_level) == Z_OK && packed_len * 10 < sample_len * 9;
+        packed_len = compressBound(payload_len);
+        char *packed = worth ? malloc(SYNC_HEADER_LEN + 8 + packed_len) : NULL;
+        if (packed && compress2((Bytef *)packed + SYNC_HEADER_LEN + 8, &packed_len,
+                                (const Bytef *)buf + SYNC_HEADER_LEN, payload_len, compress_level) == Z_OK &&
+            (8 + packed_len) * 10 < payload_len * 9) {
+            sync_put_u64((uint8_t *)packed + SYNC_HEADER_LEN, payload_len);
+            client->zlib_in += payload_len;
+            client->zlib_out += 8 + packed_len;
+            free(buf);
+            buf = packed;
+            payload_len = 8 + packed_len;
+            len = SYNC_HEADER_LEN + payload_len;
+            flags = SYNC_FLAG_ZLIB;
+        } else {
+            free(packed);
+        }
+        client->compress_cpu += cpu_seconds() - start;
+    }
+    SyncFrameHeader hdr = { SYNC_OP_BUNDLE, flags, 0, payload_len, first_seq };
+    sync_encode_header((uint8_t *)buf, &hdr);
+
+    // From here on it is an ordinary frame
+    client->queued_bytes = client->queued_bytes - b->estimate + len;
+    client->held_bytes += len;
+    memory_held += len;
+    free(b->names);
+    free(b);
+    item->bundle = NULL;
+    item->data = buf;
+    item->len = len;
+    item->off = 0;
+    metrics.bundles++;
+    metrics.bundled_files += files;
+    return 0;
+}
+
+// Tell the client the mtime and mode of a file it has just received, so an
+// unchanged file can be recognised from its manifest entry on reconnect.
+void send_attr(Client *client, const char *relative_path, const struct stat *st, uint64_t seq) {
+    OutItem *item = make_attr_item(relative_path, st, seq);
+    if (!item) {
+        return;
+    }
+    if (!enqueue_item(client, item)) {
+        free_items(item);
+        return;
+    }
+    flush_client(client);
+}
+
+// Queue the bytes appended to a followed file from offset from, which the
+// client writes in place, and the file's new time
+void send_append(Client *client, const char *filepath, const char *relative_path, off_t from,
+                 const struct stat *st, uint64_t seq) {
+    uint8_t offset[SYNC_APPEND_HEADER_LEN];
+    sync_put_u64(offset, from);
+    OutItem *header = make_frame_item(SYNC_OP_APPEND, 0, relative_path, offset, sizeof(offset), seq,
+                                      sizeof(offset) + st->st_size - from);
+    if (!enqueue_file_frame(client, header, make_file_item(filepath, from, st->st_size))) {
+        return;
+    }
+    metrics.appends++;
+    metrics.append_bytes += st->st_size - from;
+    send_attr(client, relative_path, st, seq);
+}
+
+void send_dir_create(Client *client, const char *relative_path, uint64_t seq) {
+    if (client->bundle && bundle_add(client, SYNC_ENTRY_DIR, relative_path, 0, seq)) {
+        flush_client(client);
+        return;
+    }
+    send_frame(client, SYNC_OP_DIR_CREATE, relative_path, NULL, 0, seq);
+}
+
+// Decide from a few samples whether a file is worth compressing. Media and
+// archives are already compressed; deflating them only burns CPU.
+static bool worth_compressing(Client *client, const char *filepath, off_t size) {
+    if (size < COMPRESS_MIN_SIZE) {
+        return false;
+    }
+    int file_fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    file_opens++;
+    if (file_fd < 0) {
+        return false;
+    }
+    double start = cpu_seconds();
+    static uint8_t sample[COMPRESS_SAMPLE_SIZE];
+    static uint8_t packed[COMPRESS_SAMPLE_SIZE + COMPRESS_SAMPLE_SIZE / 100 + 64];
+    off_t offsets[3] = { 0, size / 2, size - COMPRESS_SAMPLE_SIZE };
+    uLong in_total = 0;
+    uLong out_total = 0;
+    for (int i = 0; i < 3; i++) {
+        off_t off = offsets[i] < 0 ? 0 : offsets[i];
+        ssize_t n = pread(file_fd, sample, sizeof(sample), off);
+        if (n <= 0) {
+            break;
+        }
+        file_bytes_read += n;
+        uLongf packed_len = sizeof(packed);
+        if (compress2(packed, &packed_len, sample, n, compress_level) != Z_OK) {
+            packed_len = n;
+        }
+        in_total += n;
+        out_total += packed_len;
+        if (size <= COMPRESS_SAMPLE_SIZE) {
+            break;
+        }
+    }
+    close(file_fd);
+    client->compress_cpu += cpu_seconds() - start;
+    // Require at least a 10% saving
+    return in_total > 0 && out_total * 10 < in_total * 9;
+}
+
+// Queue FILE with SYNC_FLAG_ZLIB and an item that deflates the file from
+// start on into FILE_DATA frames as the socket drains.
+static bool enqueue_compressed_file(Client *client, const char *filepath, const char *relative_path,
+                                    off_t start, off_t size, uint64_t seq) {
+    uint8_t payload[8];
+    sync_put_u64(payload, size - start);
+    OutItem *header = make_frame_item(SYNC_OP_FILE, SYNC_FLAG_ZLIB | (start ? SYNC_FLAG_RESUME : 0), relative_path,
+                                      payload, sizeof(payload), seq, sizeof(payload));
+    OutItem *item = make_file_item(filepath, start, size);
+    if (item) {
+        item->z = calloc(1, sizeof(Compressor));
+        item->data = malloc(SYNC_HEADER_LEN + SYNC_ZLIB_CHUNK);
+        if (!item->z || !item->data || deflateInit(&item->z->zs, compress_level) != Z_OK) {
+            fprintf(stderr, "Failed to set up compression for %s\n", relative_path);
+            free(item->z);
+            item->z = NULL;
+            free_items(item);
+            item = NULL;
+        } else {
+            item->z->seq = seq;
+        }
+    }
+    return enqueue_file_frame(client, header, item);
+}
+
+// Send a large file from start on in chunks: an empty CHUNK goes out now, in
+// the order of its change, and queue_chunk() reads the rest while the queue
+// is otherwise empty. The client is owed the file until the last chunk is
+// queued, so a rename before then sends it again by its new name.
+static void queue_transfer(Client *client, const char *filepath, const char *relative_path, off_t start,
+                           const struct stat *st, bool compress, uint64_t seq) {
+    uint8_t payload[SYNC_CHUNK_HEADER_LEN];
+    memset(payload, 0, sizeof(payload));
+    sync_put_u64(payload, st->st_size);
+    sync_put_u64(payload + 8, start);
+    OutItem *item = make_frame_item(SYNC_OP_CHUNK, 0, relative_path, payload, sizeof(payload), seq, sizeof(payload));
+    Transfer *t = calloc(1, sizeof(Transfer));
+    if (t) {
+        t->fd = -1;
+        t->path = strdup(relative_path);
+        t->file_path = strdup(filepath);
+    }
+    if (!item || !t || !t->path || !t->file_path) {
+        perror("Memory allocation failed");
+        free_items(item);
+        if (t) {
+            free_transfer(t);
+        }
+        return;
+    }
+    if (!enqueue_item(client, item)) {
+        free_items(item);
+        free_transfer(t);
+        return;
+    }
+    t->offset = start;
+    t->st = *st;
+    t->seq = seq;
+    t->compress = compress;
+    if (client->transfers_tail) {
+        client->transfers_tail->next = t;
+    } else {
+        client->transfers = t;
+    }
+    client->transfers_tail = t;
+    owe_contents(client, relative_path);
+    metrics.transfers++;
+    flush_client(client);
+}
+
+// Where a FILE can start: after the client's PARTIAL copy of the path if it
+// has one that is still a prefix of the file, otherwise 0. A partial copy is
+// only offered once.
+static off_t resume_offset(Client *client, const char *filepath, const char *relative_path, off_t size) {
+    ManifestEntry *partial = client->partials ? manifest_find(client->partials, relative_path) : NULL;
+    if (!partial || partial->seen) {
+        return 0;
+    }
+    partial->seen = true;
+    uint8_t hash[SYNC_HASH_LEN];
+    if (!partial->has_hash || partial->size == 0 || partial->size > (uint64_t)size ||
+        !hash_file_prefix(filepath, partial->size, hash) || memcmp(hash, partial->hash, SYNC_HASH_LEN) != 0) {
+        return 0;
+    }
+    return partial->size;
+}
+
+void send_file(Client *client, const char *filepath, const char *relative_path, uint64_t seq) {
+    SharedFile *shared = fanout_file(filepath, seq);
+    struct stat st;
+    if (shared) {
+        st = shared->st;
+    } else if (stat(filepath, &st) < 0) {
+        if (errno == ENOENT) {
+            // Deleted or renamed since; a later change says which
+            owe_contents(client, relative_path);
+        } else {
+            perror("Failed to stat file");
+        }
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return;
+    }
+    contents_sent(client, relative_path);
+
+    long filesize = (long)st.st_size;
+    off_t start = resume_offset(client, filepath, relative_path, st.st_size);
+    if (start) {
+        // Nobody else continues from there
+        shared = NULL;
+        log_debug("Resuming file %s at byte %lld of %ld\n", relative_path, (long long)start, filesize);
+    } else {
+        log_debug("Sending file %s, size: %ld bytes\n", relative_path, filesize);
+    }
+
+    // Read when the bundle is sent, and its entry carries what ATTR would.
+    // Flushed here as send_attr() would, for files sent outside a batch.
+    if (!start && client->bundle && st.st_size <= BUNDLE_FILE_MAX &&
+        bundle_add(client, SYNC_ENTRY_FILE, relative_path, st.st_size, seq)) {
+        flush_client(client);
+        return;
+    }
+
+    if (client->chunks && st.st_size - start >= (off_t)chunked_min) {
+        bool compress = false;
+        if (client->compress) {
+            if (shared && shared->compressible < 0) {
+                shared->compressible = worth_compressing(client, filepath, st.st_size);
+            }
+            compress = shared ? shared->compressible : worth_compressing(client, filepath, st.st_size);
+            if (compress) {
+                client->files_compressed++;
+            } else {
+                client->files_uncompressible++;
+            }
+        }
+        queue_transfer(client, filepath, relative_path, start, &st, compress, seq);
+        return;
+    }
+
+    if (client->compress) {
+        bool worth;
+        if (shared) {
+            if (shared->compressible < 0) {
+                shared->compressible = worth_compressing(client, filepath, st.st_size);
+            }
+            worth = shared->compressible;
+        } else {
+            worth = worth_compressing(client, filepath, st.st_size);
+        }
+        if (worth) {
+            client->files_compressed++;
+            if (shared) {
+                uint8_t payload[8];
+                sync_put_u64(payload, st.st_size);
+                OutItem *header = make_frame_item(SYNC_OP_FILE, SYNC_FLAG_ZLIB, relative_path,
+                                                  payload, sizeof(payload), seq, sizeof(payload));
+                if (!enqueue_file_frame(client, header, make_shared_item(shared, true))) {
+                    return;
+                }
+            } else if (!enqueue_compressed_file(client, filepath, relative_path, start, st.st_size, seq)) {
+                return;
+            }
+            send_attr(client, relative_path, &st, seq);
+            return;
+        }
+        client->files_uncompressible++;
+    }
+
+    // The frame header and the file range are queued together so they reach
+    // the socket back to back; file content is read only when the socket has room.
+    OutItem *header = make_frame_item(SYNC_OP_FILE, start ? SYNC_FLAG_RESUME : 0, relative_path, NULL, 0, seq,
+                                      st.st_size - start);
+    OutItem *item = shared ? make_shared_item(shared, false) : make_file_item(filepath, start, st.st_size);
+    if (!enqueue_file_frame(client, header, item)) {
+        return;
+    }
+    send_attr(client, relative_path, &st, seq);
+}
+
+// Queue a literal range of the file for a DELTA_DATA frame. Short ranges are
+// copied from data, the window's bytes at start; long ones are streamed from
+// the file like FILE payloads so a heavily rewritten file does not have to
+// fit in memory.
+static bool queue_delta_literal(Client *client, const char *filepath, const uint8_t *data, off_t start, off_t end, uint64_t seq) {
+    size_t len = end - start;
+    if (len <= INLINE_LITERAL_MAX) {
+        OutItem *item = make_frame_item(SYNC_OP_DELTA_DATA, 0, NULL, data, len, seq, len);
+        if (!item || !enqueue_item(client, item)) {
+            free_items(item);
+            return false;
+        }
+        return true;
+    }
+
+    OutItem *header = make_frame_item(SYNC_OP_DELTA_DATA, 0, NULL, NULL, 0, seq, len);
+    return enqueue_file_frame(client, header, make_file_item(filepath, start, end));
+}
+
+static bool queue_delta_copy(Client *client, uint64_t first_block, uint32_t count, uint64_t seq) {
+    uint8_t payload[12];
+    sync_put_u64(payload, first_block);
+    sync_put_u32(payload + 8, count);
+    OutItem *item = make_frame_item(SYNC_OP_DELTA_COPY, 0, NULL, payload, sizeof(payload), seq, sizeof(payload));
+    if (!item || !enqueue_item(client, item)) {
+        free_items(item);
+        return false;
+    }
+    return true;
+}
+
+// The part of the file send_delta() is looking at: buf holds len bytes read
+// from offset off. Everything read is hashed on the way in, in order, for
+// the DELTA_END frame.
+typedef struct {
+    int fd;
+    off_t size;
+    off_t off;
+    size_t len;
+    size_t cap;
+    uint8_t *buf;
+    SyncHash hash;
+} DeltaWindow;
+
+// Make the window reach need, dropping bytes before keep_from. Returns false
+// if the file ends early, which means it changed under us.
+static bool delta_window_fill(DeltaWindow *w, off_t need, off_t keep_from) {
+    if (w->off + (off_t)w->len >= need) {
+        return true;
+    }
+    if (keep_from > w->off) {
+        size_t drop = keep_from - w->off;
+        memmove(w->buf, w->buf + drop, w->len - drop);
+        w->len -= drop;
+        w->off = keep_from;
+    }
+    off_t target = w->off + (off_t)w->cap < w->size ? w->off + (off_t)w->cap : w->size;
+    while (w->off + (off_t)w->len < target) {
+        ssize_t n = pread(w->fd, w->buf + w->len, target - w->off - w->len, w->off + w->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        transfer_syscalls++;
+        if (n <= 0) {
+            break;
+        }
+        sync_hash_update(&w->hash, w->buf + w->len, n);
+        file_bytes_read += n;
+        w->len += n;
+    }
+    return w->off + (off_t)w->len >= need;
+}
+
+// Answer a client's SIGNATURE for relative_path with a delta against its
+// copy: blocks the client already has are sent as DELTA_COPY references and
+// everything else as DELTA_DATA literals (rsync algorithm). The file is read
+// through a DeltaWindow rather than mapped, so one truncated meanwhile ends
+// the delta early instead of faulting. Returns false if the file is no
+// longer there.
+bool send_delta(Client *client, const char *relative_path, const uint8_t *signature, size_t signature_len, uint64_t seq) {
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/%s", sync_root, relative_path);
+
+    if (is_ignored(client, relative_path, false)) {
+        return true;
+    }
+
+    uint32_t block_size = signature_len >= 4 ? sync_get_u32(signature) : 0;
+    size_t block_count = signature_len >= 4 ? (signature_len - 4) / SYNC_SIG_ENTRY_LEN : 0;
+
+    int file_fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        // Gone again; a DELETE or MOVED_FROM is already on its way
+        return false;
+    }
+    struct stat st;
+    if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(file_fd);
+        return true;
+    }
+    if (block_size == 0 || block_count == 0 || st.st_size < block_size) {
+        close(file_fd);
+        send_file(client, filepath, relative_path, seq);
+        return true;
+    }
+
+    // Blocks larger than any the client picks are not worth a window
+    if (block_size > DELTA_MAX_BLOCK_SIZE) {
+        close(file_fd);
+        send_file(client, filepath, relative_path, seq);
+        return true;
+    }
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Room for an inline literal, the block being matched and the byte
+    // after it, and then some so refills are not one block at a time
+    DeltaWindow w = { .fd = file_fd, .size = st.st_size };
+    w.cap = INLINE_LITERAL_MAX + 2 * (size_t)block_size + DELTA_READ_SIZE;
+    w.buf = malloc(w.cap);
+    sync_hash_init(&w.hash);
+
+    // Open-addressed table with one slot per distinct weak checksum, whose
+    // blocks are chained in file order. Blocks equal to one already chained
+    // are left out, so a file of many identical blocks (zero-filled images,
+    // preallocated databases) costs one slot and one chain entry to look up.
+    size_t table_size = 1;
+    while (table_size < block_count * 2) {
+        table_size <<= 1;
+    }
+    uint32_t *table = calloc(table_size, sizeof(uint32_t));
+    uint32_t *chain = calloc(block_count, sizeof(uint32_t));
+    if (!table || !chain || !w.buf) {
+        perror("Memory allocation failed");
+        free(table);
+        free(chain);
+        free(w.buf);
+        close(file_fd);
+        return true;
+    }
+    const uint8_t *entries = signature + 4;
+    for (size_t b = 0; b < block_count; b++) {
+        const uint8_t *entry = entries + b * SYNC_SIG_ENTRY_LEN;
+        uint32_t weak = sync_get_u32(entry);
+        size_t slot = (weak * 2654435761u) & (table_size - 1);
+        while (table[slot] && sync_get_u32(entries + (table[slot] - 1) * SYNC_SIG_ENTRY_LEN) != weak) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        uint32_t *link = &table[slot];
+        while (*link && memcmp(entries + (*link - 1) * SYNC_SIG_ENTRY_LEN + 4, entry + 4, SYNC_HASH_LEN) != 0) {
+            link = &chain[*link - 1];
+        }
+        if (!*link) {
+            *link = b + 1;
+        }
+    }
+
+    uint8_t payload[12];
+    sync_put_u64(payload, st.st_size);
+    sync_put_u32(payload + 8, block_size);
+    send_frame(client, SYNC_OP_DELTA_BEGIN, relative_path, payload, sizeof(payload), seq);
+
+    bool ok = !client->closing;
+    bool changed = false;
+    off_t size = st.st_size;
+    off_t pos = 0;
+    off_t literal_start = 0;
+    uint64_t copy_first = 0;
+    uint32_t copy_count = 0;
+    size_t literal_bytes = 0;
+    SyncWeak weak;
+    bool rolling = false;
+
+    while (ok && pos + block_size <= size) {
+        // Keep the pending literal while it is short enough to send inline
+        off_t keep_from = pos - literal_start <= INLINE_LITERAL_MAX ? literal_start : pos;
+        off_t need = pos + block_size < size ? pos + block_size + 1 : size;
+        if (!delta_window_fill(&w, need, keep_from)) {
+            changed = true;
+            break;
+        }
+        const uint8_t *block = w.buf + (pos - w.off);
+        if (!rolling) {
+            sync_weak_init(&weak, block, block_size);
+            rolling = true;
+        }
+
+        uint32_t digest = sync_weak_digest(&weak);
+        size_t slot = (digest * 2654435761u) & (table_size - 1);
+        while (table[slot] && sync_get_u32(entries + (table[slot] - 1) * SYNC_SIG_ENTRY_LEN) != digest) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        long match = -1;
+        if (table[slot]) {
+            uint8_t strong[SYNC_HASH_LEN];
+            sync_hash_buffer(block, block_size, strong);
+            // The block after the last one copied keeps the run going, even
+            // if it was left out of the chain as a duplicate
+            uint64_t next = copy_first + copy_count;
+            if (copy_count && next < block_count && literal_start == pos &&
+                sync_get_u32(entries + next * SYNC_SIG_ENTRY_LEN) == digest &&
+                memcmp(entries + next * SYNC_SIG_ENTRY_LEN + 4, strong, SYNC_HASH_LEN) == 0) {
+                match = next;
+            }
+            for (uint32_t b = table[slot]; match < 0 && b; b = chain[b - 1]) {
+                if (memcmp(entries + (b - 1) * SYNC_SIG_ENTRY_LEN + 4, strong, SYNC_HASH_LEN) == 0) {
+                    match = b - 1;
+                }
+            }
+        }
+
+        if (match >= 0) {
+            if (pos > literal_start) {
+                if (copy_count) {
+                    ok = queue_delta_copy(client, copy_first, copy_count, seq);
+                    copy_count = 0;
+                }
+                ok = ok && queue_delta_literal(client, filepath, w.buf + (literal_start - w.off),
+                                               literal_start, pos, seq);
+                literal_bytes += pos - literal_start;
+            }
+            if (copy_count && copy_first + copy_count == (uint64_t)match) {
+                copy_count++;
+            } else {
+                if (copy_count) {
+                    ok = ok && queue_delta_copy(client, copy_first, copy_count, seq);
+                }
+                copy_first = match;
+                copy_count = 1;
+            }
+            pos += block_size;
+            literal_start = pos;
+            rolling = false;
+        } else {
+            if (pos + block_size < size) {
+                sync_weak_roll(&weak, block[0], block[block_size]);
+            }
+            pos++;
+        }
+    }
+    if (ok && !changed) {
+        // The tail, and the rest of the file for the whole-file hash
+        off_t keep_from = size - literal_start <= INLINE_LITERAL_MAX ? literal_start : size;
+        changed = !delta_window_fill(&w, size, keep_from);
+    }
+    if (ok && !changed && copy_count) {
+        ok = queue_delta_copy(client, copy_first, copy_count, seq);
+    }
+    if (ok && !changed && size > literal_start) {
+        ok = queue_delta_literal(client, filepath, w.buf + (literal_start - w.off), literal_start, size, seq);
+        literal_bytes += size - literal_start;
+    }
+    if (ok && changed) {
+        // Shorter than it was a moment ago. A hash the client cannot match
+        // makes it ask for the whole file, which by then has settled.
+        uint8_t hash[SYNC_HASH_LEN] = { 0 };
+        send_frame(client, SYNC_OP_DELTA_END, relative_path, hash, sizeof(hash), seq);
+        log_debug("Delta for %s abandoned: file shrank while reading\n", relative_path);
+    } else if (ok) {
+        uint8_t hash[SYNC_HASH_LEN];
+        sync_hash_final(&w.hash, hash);
+        send_frame(client, SYNC_OP_DELTA_END, relative_path, hash, sizeof(hash), seq);
+        send_attr(client, relative_path, &st, seq);
+        log_debug("Delta for %s: %zu of %ld bytes literal\n", relative_path, literal_bytes, (long)size);
+    }
+
+    free(table);
+    free(chain);
+    free(w.buf);
+    close(file_fd);
+    flush_client(client);
+    return true;
+}
+
+static size_t wd_home(int wd, size_t capacity) {
+    return ((uint32_t)wd * 2654435761u) & (capacity - 1);
+}
+
+static size_t watch_wd_slot(WatchTable *t, int wd) {
+    size_t i = wd_home(wd, t->capacity);
+    while (t->by_wd[i] && t->by_wd[i]->wd != wd) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return i;
+}
+
+static size_t watch_path_slot(WatchTable *t, const char *path, uint64_t hash) {
+    size_t i = hash & (t->capacity - 1);
+    while (t->by_path[i] && (t->by_path[i]->path_hash != hash || strcmp(t->by_path[i]->path, path) != 0)) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return i;
+}
+
+static void watch_grow(WatchTable *t) {
+    WatchEntry **old = t->by_wd;
+    size_t old_capacity = t->capacity;
+    t->capacity = old_capacity ? old_capacity * 2 : 1024;
+    t->by_wd = calloc(t->capacity, sizeof(WatchEntry *));
+    free(t->by_path);
+    t->by_path = calloc(t->capacity, sizeof(WatchEntry *));
+    if (!t->by_wd || !t->by_path) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i]) {
+            t->by_wd[watch_wd_slot(t, old[i]->wd)] = old[i];
+            t->by_path[watch_path_slot(t, old[i]->path, old[i]->path_hash)] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+static void watch_unlink_slot(WatchEntry **slots, size_t capacity, size_t hole, bool by_wd) {
+    size_t mask = capacity - 1;
+    slots[hole] = NULL;
+    size_t j = hole;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!slots[j]) {
+            return;
+        }
+        size_t home = by_wd ? wd_home(slots[j]->wd, capacity) : (slots[j]->path_hash & mask);
+        // Move the entry back unless its home lies cyclically in (hole, j]
+        bool stays = hole <= j ? (home > hole && home <= j) : (home > hole || home <= j);
+        if (!stays) {
+            slots[hole] = slots[j];
+            slots[j] = NULL;
+            hole = j;
+        }
+    }
+}
+
+WatchEntry *watch_find_wd(WatchTable *t, int wd) {
+    if (!t->capacity) {
+        return NULL;
+    }
+    return t->by_wd[watch_wd_slot(t, wd)];
+}
+
+WatchEntry *watch_find_path(WatchTable *t, const char *path) {
+    if (!t->capacity) {
+        return NULL;
+    }
+    return t->by_path[watch_path_slot(t, path, hash_path(path))];
+}
+
+// Link entry under path. The entry must not be linked by path already. A
+// watch still filed under path is stale, e.g. a directory renamed onto one
+// whose IN_IGNORED has not arrived yet after an overflow: it is removed, so
+// the path leads to one entry and removing either later unlinks its own slot.
+static void watch_set_path(WatchTable *t, WatchEntry *entry, const char *path) {
+    char *copy = strdup(path);
+    if (!copy) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    free(entry->path);
+    entry->path = copy;
+    entry->path_hash = hash_path(path);
+    WatchEntry *stale = t->by_path[watch_path_slot(t, entry->path, entry->path_hash)];
+    if (stale) {
+        log_debug("Dropping stale watch %d on %s\n", stale->wd, stale->path);
+        if (t == &watches) {
+            inotify_rm_watch(fd, stale->wd);
+        }
+        watch_remove(t, stale);
+    }
+    t->by_path[watch_path_slot(t, entry->path, entry->path_hash)] = entry;
+}
+
+// Add a watch, or update the path of an existing wd (inotify_add_watch on an
+// already watched directory returns the same descriptor)
+void watch_insert(WatchTable *t, int wd, const char *path) {
+    WatchEntry *entry = watch_find_wd(t, wd);
+    if (entry) {
+        if (strcmp(entry->path, path) != 0) {
+            watch_unlink_slot(t->by_path, t->capacity, watch_path_slot(t, entry->path, entry->path_hash), false);
+            watch_set_path(t, entry, path);
+        }
+        return;
+    }
+    if ((t->count + 1) * 10 > t->capacity * 7) {
+        watch_grow(t);
+    }
+    entry = calloc(1, sizeof(WatchEntry));
+    if (!entry) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    entry->wd = wd;
+    t->by_wd[watch_wd_slot(t, wd)] = entry;
+    watch_set_path(t, entry, path);
+    t->count++;
+}
 
-    // Store the watch descriptor mapping
-    if (watch_count < MAX_WATCHES) {
-        watch_map[watch_count].wd = watch_descriptor;
-        strncpy(watch_map[watch_count].path, dir_path, PATH_MAX);
-        watch_count++;
+void watch_remove(WatchTable *t, WatchEntry *entry) {
+    watch_unlink_slot(t->by_wd, t->capacity, watch_wd_slot(t, entry->wd), true);
+    watch_unlink_slot(t->by_path, t->capacity, watch_path_slot(t, entry->path, entry->path_hash), false);
+    t->count--;
+    free(entry->path);
+    free(entry);
+}
+
+static bool path_in_subtree(const char *path, const char *root, size_t root_len) {
+    return strncmp(path, root, root_len) == 0 && (path[root_len] == '\0' || path[root_len] == '/');
+}
+
+// Collect every watch at or below root. Renames and removals of whole
+// subtrees are rare, so a scan over the table is fine here.
+static WatchEntry **watch_collect_subtree(WatchTable *t, const char *root, size_t *found) {
+    size_t root_len = strlen(root);
+    size_t n = 0;
+    WatchEntry **list = malloc((t->count ? t->count : 1) * sizeof(WatchEntry *));
+    if (!list) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
     }
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (t->by_wd[i] && path_in_subtree(t->by_wd[i]->path, root, root_len)) {
+            list[n++] = t->by_wd[i];
+        }
+    }
+    *found = n;
+    return list;
+}
 
-    // Recursively add watches to subdirectories
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
+void watch_rename_subtree(WatchTable *t, const char *old_path, const char *new_path) {
+    size_t n;
+    size_t old_len = strlen(old_path);
+    WatchEntry **list = watch_collect_subtree(t, old_path, &n);
+    for (size_t i = 0; i < n; i++) {
+        watch_unlink_slot(t->by_path, t->capacity, watch_path_slot(t, list[i]->path, list[i]->path_hash), false);
+    }
+    for (size_t i = 0; i < n; i++) {
+        char renamed[PATH_MAX];
+        snprintf(renamed, sizeof(renamed), "%s%s", new_path, list[i]->path + old_len);
+        watch_set_path(t, list[i], renamed);
+    }
+    free(list);
+}
+
+void watch_remove_subtree(WatchTable *t, const char *path) {
+    size_t n;
+    WatchEntry **list = watch_collect_subtree(t, path, &n);
+    for (size_t i = 0; i < n; i++) {
+        if (t == &watches) {
+            inotify_rm_watch(fd, list[i]->wd);
+        }
+        watch_remove(t, list[i]);
+    }
+    free(list);
+}
+
+static bool add_watch(const char *dir_path) {
+    int watch_descriptor = inotify_add_watch(fd, dir_path, watch_mask);
+    if (watch_descriptor < 0) {
+        perror("inotify_add_watch failed");
+        return false;
+    }
+
+    // Store the watch descriptor mapping
+    pthread_mutex_lock(&walk_lock);
+    watch_insert(&watches, watch_descriptor, dir_path);
+    pthread_mutex_unlock(&walk_lock);
+    return true;
+}
+
+// Watch each directory before it is read, so whatever is created in it
+// afterwards produces an event
+static bool watch_enter(void *ctx, SyncWalkDir *dir) {
+    char dir_path[PATH_MAX];
+    return walk_path(dir_path, sizeof(dir_path), ctx, dir->path, NULL) && add_watch(dir_path);
+}
+
+static const SyncWalkOps watch_walk_ops = { watch_enter, NULL, 0 };
+
+void add_watch_recursive(const char *dir_path) {
+    if (!sync_walk_path(walker, dir_path, &watch_walk_ops, (void *)dir_path, NULL)) {
         perror("opendir failed");
-        return;
     }
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR) {
+typedef struct {
+    unsigned long added;
+    unsigned long changed;
+    unsigned long removed;
+    unsigned long listed;       // directories read with readdir
+    unsigned long skipped;      // directories whose listing came from the index
+} ReconcileStats;
+
+ReconcileStats reconcile_stats;
+
+typedef struct {
+    const char *dir_path;
+    bool watch;
+} IndexWalk;
+
+static bool index_enter(void *ctx, SyncWalkDir *dir) {
+    IndexWalk *walk = ctx;
+    return !walk->watch || watch_enter((void *)walk->dir_path, dir);
+}
+
+static void index_visit(void *ctx, SyncWalkDir *dir) {
+    (void)ctx;
+    IndexNode *parent = dir->data;
+    pthread_mutex_lock(&walk_lock);
+    reconcile_stats.listed++;
+    for (size_t i = 0; i < dir->count; i++) {
+        SyncWalkEntry *entry = &dir->entries[i];
+        if (!(S_ISREG(entry->st.st_mode) || S_ISDIR(entry->st.st_mode))) {
+            continue;
+        }
+        IndexNode *node = index_add_child(&tree_index, parent, entry->name, entry->name_len,
+                                          S_ISDIR(entry->st.st_mode) ? SYNC_ENTRY_DIR : SYNC_ENTRY_FILE);
+        if (!node) {
+            entry->descend = false;
+            continue;
+        }
+        index_set_stat(&tree_index, node, &entry->st);
+        node->seq = next_seq;
+        reconcile_stats.added++;
+        entry->data = node;
+    }
+    pthread_mutex_unlock(&walk_lock);
+}
+
+static const SyncWalkOps index_walk_ops = { index_enter, index_visit, SYNC_WALK_STAT };
+
+// Add everything below dir_path to the index, watching dir_path and every
+// directory in it if asked. Used for a first start and for directories that
+// are new since the index was saved.
+static void index_scan(IndexNode *dir, const char *dir_path, bool watch) {
+    IndexWalk walk = { dir_path, watch };
+    sync_walk_path(walker, dir_path, &index_walk_ops, &walk, dir);
+}
+
+// Bring a loaded index up to date with a directory whose own lstat is st.
+// Every entry is lstat'ed, but a directory is only read if its mtime or
+// inode changed, i.e. if entries were added, removed or renamed in it.
+static void index_reconcile(IndexNode *dir, const char *dir_path, const struct stat *st) {
+    add_watch(dir_path);
+    bool listing_changed = dir->ino != (uint64_t)st->st_ino || dir->mtime_ns != stat_mtime_ns(st);
+    index_set_stat(&tree_index, dir, st);
+
+    for (IndexNode *child = dir->first_child; child; child = child->next_sibling) {
+        child->seen = false;
+    }
+    if (listing_changed) {
+        // New entries are scanned in full here and marked seen so the loop
+        // below leaves them alone
+        DIR *d = opendir(dir_path);
+        reconcile_stats.listed++;
+        struct dirent *entry;
+        while (d && (entry = readdir(d)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                index_child(&tree_index, dir, entry->d_name, strlen(entry->d_name))) {
+                continue;
+            }
+            struct stat child_st;
+            if (fstatat(dirfd(d), entry->d_name, &child_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                !(S_ISREG(child_st.st_mode) || S_ISDIR(child_st.st_mode))) {
+                continue;
+            }
+            IndexNode *node = index_add_child(&tree_index, dir, entry->d_name, strlen(entry->d_name),
+                                              S_ISDIR(child_st.st_mode) ? SYNC_ENTRY_DIR : SYNC_ENTRY_FILE);
+            if (!node) {
+                continue;
+            }
+            index_set_stat(&tree_index, node, &child_st);
+            node->seq = next_seq++;
+            node->seen = true;
+            reconcile_stats.added++;
+            if (S_ISDIR(child_st.st_mode)) {
+                char sub_dir_path[PATH_MAX];
+                snprintf(sub_dir_path, sizeof(sub_dir_path), "%s/%s", dir_path, entry->d_name);
+                index_scan(node, sub_dir_path, true);
+            }
+        }
+        if (d) {
+            closedir(d);
+        }
+    } else {
+        reconcile_stats.skipped++;
+    }
+
+    // Entries are stat'ed relative to the directory to save a path walk each
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    IndexNode *child = dir->first_child;
+    while (child) {
+        IndexNode *next = child->next_sibling;
+        if (child->seen) {
+            child = next;
+            continue;
+        }
+        char child_path[PATH_MAX];
+        snprintf(child_path, sizeof(child_path), "%s/%s", dir_path, child->name);
+        struct stat child_st;
+        bool is_dir = child->type == SYNC_ENTRY_DIR;
+        bool exists = (dir_fd >= 0 ? fstatat(dir_fd, child->name, &child_st, AT_SYMLINK_NOFOLLOW)
+                                   : lstat(child_path, &child_st)) == 0;
+        if (!exists || (is_dir ? !S_ISDIR(child_st.st_mode) : !S_ISREG(child_st.st_mode))) {
+            index_remove(&tree_index, child);
+            reconcile_stats.removed++;
+            if (exists && (S_ISREG(child_st.st_mode) || S_ISDIR(child_st.st_mode))) {
+                // Replaced by the other type: add it back as what it is now
+                const char *name = child_path + strlen(dir_path) + 1;
+                IndexNode *node = index_add_child(&tree_index, dir, name, strlen(name),
+                                                  S_ISDIR(child_st.st_mode) ? SYNC_ENTRY_DIR : SYNC_ENTRY_FILE);
+                if (node) {
+                    index_set_stat(&tree_index, node, &child_st);
+                    node->seq = next_seq++;
+                    reconcile_stats.added++;
+                    if (S_ISDIR(child_st.st_mode)) {
+                        index_scan(node, child_path, true);
+                    }
+                }
+            }
+        } else if (is_dir) {
+            index_reconcile(child, child_path, &child_st);
+        } else if (index_set_stat(&tree_index, child, &child_st)) {
+            child->seq = next_seq++;
+            reconcile_stats.changed++;
+        }
+        child = next;
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+}
+
+// After an inotify overflow: compare a directory with the index, which holds
+// what clients were last sent, and feed every difference to the coalescer as
+// the event that would have reported it. The index records times as they
+// were when a change was sent, which may already include changes whose
+// events were lost, so anything modified since the events were last all
+// read counts as changed too. Other directories are not read; every other
+// entry costs one stat. The index itself is left to the coalescer to update.
+static bool overflow_suspect(const IndexNode *node, const struct stat *st, uint64_t since_ns) {
+    return node->ino != (uint64_t)st->st_ino || node->mtime_ns != stat_mtime_ns(st) ||
+           stat_mtime_ns(st) >= since_ns;
+}
+
+static void overflow_reconcile(IndexNode *dir, const char *dir_path, const char *relative_path,
+                               const struct stat *st, uint64_t since_ns) {
+    char child_path[PATH_MAX];
+    char child_relative[PATH_MAX];
+    if (overflow_suspect(dir, st, since_ns)) {
+        DIR *d = opendir(dir_path);
+        reconcile_stats.listed++;
+        struct dirent *entry;
+        while (d && (entry = readdir(d)) != NULL) {
             if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
                 continue;
             }
+            struct stat child_st;
+            if (index_child(&tree_index, dir, entry->d_name, strlen(entry->d_name)) ||
+                fstatat(dirfd(d), entry->d_name, &child_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                !(S_ISREG(child_st.st_mode) || S_ISDIR(child_st.st_mode)) ||
+                !walk_path(child_path, sizeof(child_path), dir_path, NULL, entry->d_name) ||
+                !walk_path(child_relative, sizeof(child_relative), relative_path, NULL, entry->d_name)) {
+                continue;
+            }
+            bool is_dir = S_ISDIR(child_st.st_mode);
+            if (is_dir) {
+                add_watch_recursive(child_path);
+            }
+            coalesce_create(child_relative, is_dir, is_dir);
+            reconcile_stats.added++;
+        }
+        if (d) {
+            closedir(d);
+        }
+    } else {
+        reconcile_stats.skipped++;
+    }
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (IndexNode *child = dir->first_child; child; child = child->next_sibling) {
+        if (!walk_path(child_path, sizeof(child_path), dir_path, NULL, child->name) ||
+            !walk_path(child_relative, sizeof(child_relative), relative_path, NULL, child->name)) {
+            continue;
+        }
+        struct stat child_st;
+        bool is_dir = child->type == SYNC_ENTRY_DIR;
+        bool exists = dir_fd >= 0 && fstatat(dir_fd, child->name, &child_st, AT_SYMLINK_NOFOLLOW) == 0;
+        // A directory with another inode was replaced, and is not watched
+        if (!exists || (is_dir ? !S_ISDIR(child_st.st_mode) || child->ino != (uint64_t)child_st.st_ino
+                               : !S_ISREG(child_st.st_mode))) {
+            if (is_dir) {
+                watch_remove_subtree(&watches, child_path);
+            }
+            coalesce_delete(child_relative, is_dir);
+            reconcile_stats.removed++;
+            if (exists && (S_ISREG(child_st.st_mode) || S_ISDIR(child_st.st_mode))) {
+                if (S_ISDIR(child_st.st_mode)) {
+                    add_watch_recursive(child_path);
+                }
+                coalesce_create(child_relative, S_ISDIR(child_st.st_mode), S_ISDIR(child_st.st_mode));
+                reconcile_stats.added++;
+            }
+        } else if (is_dir) {
+            overflow_reconcile(child, child_path, child_relative, &child_st, since_ns);
+        } else if (child->size != (uint64_t)child_st.st_size || overflow_suspect(child, &child_st, since_ns)) {
+            coalesce_modify(child_relative);
+            reconcile_stats.changed++;
+        }
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+}
+
+// Drop watches whose directory is gone or has been replaced; their
+// IN_IGNORED may have been among the events the kernel dropped. A directory
+// renamed within the tree loses its watch too and gets a new one when the
+// tree is walked again.
+static void watch_prune(void) {
+    size_t n;
+    WatchEntry **list = watch_collect_subtree(&watches, sync_root, &n);
+    for (size_t i = 0; i < n; i++) {
+        int wd = inotify_add_watch(fd, list[i]->path, watch_mask | IN_ONLYDIR | IN_DONT_FOLLOW);
+        if (wd != list[i]->wd) {
+            inotify_rm_watch(fd, list[i]->wd);
+            watch_remove(&watches, list[i]);
+        }
+    }
+    free(list);
+}
+
+// A change sent since the queue was last drained may have created something
+// that was already gone, and is not in the index either: delete it again.
+// Returns false if the journal no longer reaches back that far.
+static bool overflow_recheck_journal(void) {
+    if (journal.floor > inotify_drained_seq) {
+        return false;
+    }
+    for (size_t i = journal.count; i > 0 && journal_at(i - 1)->seq > inotify_drained_seq; i--) {
+        const JournalEntry *e = journal_at(i - 1);
+        char disk_path[PATH_MAX];
+        snprintf(disk_path, sizeof(disk_path), "%s/%s", sync_root, e->path);
+        struct stat st;
+        if (e->exists && !change_find(e->path) && !index_lookup(&tree_index, e->path) && lstat(disk_path, &st) < 0) {
+            coalesce_delete(e->path, e->is_dir);
+            reconcile_stats.removed++;
+        }
+    }
+    return true;
+}
+
+// The kernel dropped events, so below any directory the watches and what
+// clients were sent may be out of date. With an index the tree is reconciled
+// against it and the differences go out as ordinary changes. Without one
+// every directory is watched again and each client is resynchronised from a
+// new manifest; the journal cannot be trusted either, so clients that
+// reconnect get a manifest diff too.
+void recover_overflow(const char *sync_dir) {
+    inotify_overflowed = false;
+    metrics.overflows++;
+    uint64_t start = monotonic_ns();
+    // Whatever the coalescer holds was reported; clients and the index
+    // should have it before the tree is compared
+    coalesce_flush(NULL, NULL);
+    if (index_file) {
+        memset(&reconcile_stats, 0, sizeof(reconcile_stats));
+        struct stat st;
+        if (lstat(sync_dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+            uint64_t since_ns = inotify_drained_ns > MTIME_SLACK_NS ? inotify_drained_ns - MTIME_SLACK_NS : 0;
+            overflow_reconcile(tree_index.root, sync_dir, "", &st, since_ns);
+        }
+        bool rechecked = overflow_recheck_journal();
+        log_info("Inotify queue overflowed: rescanned in %.1f ms, %lu added, %lu changed, %lu removed, "
+                 "%lu directories read, %lu unchanged directories skipped\n",
+                 (monotonic_ns() - start) / 1e6, reconcile_stats.added, reconcile_stats.changed,
+                 reconcile_stats.removed, reconcile_stats.listed, reconcile_stats.skipped);
+        if (rechecked) {
+            return;
+        }
+    } else {
+        watch_prune();
+        add_watch_recursive(sync_dir);
+    }
+    journal.floor = next_seq - 1;
+    int resynced = 0;
+    for (int i = 0; i < client_count; i++) {
+        Client *client = clients[i];
+        if (client->live && !client->closing && !client->needs_rescan) {
+            downgrade_client(client, "missed changes in an inotify overflow");
+            flush_client(client);
+            resynced++;
+        }
+    }
+    log_info("Inotify queue overflowed: %zu directories watched in %.1f ms, %d clients resynchronised\n",
+             watches.count, (monotonic_ns() - start) / 1e6, resynced);
+}
+
+// Start from the saved index if there is one, otherwise build it; either way
+// every directory ends up watched.
+void load_tree_index(void) {
+    if (lstat(sync_root, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode)) {
+        perror("Cannot stat sync directory");
+        exit(1);
+    }
+    if (!index_init(&tree_index)) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    uint64_t start = monotonic_ns();
+    bool loaded = index_load(&tree_index, index_file, &root_stat, &next_seq);
+    uint64_t loaded_ns = monotonic_ns();
+    if (loaded) {
+        index_reconcile(tree_index.root, sync_root, &root_stat);
+    } else {
+        index_set_stat(&tree_index, tree_index.root, &root_stat);
+        index_scan(tree_index.root, sync_root, true);
+        tree_index.dirty = true;
+    }
+    if (loaded) {
+        log_info("Index %s: loaded in %.1f ms, reconciled in %.1f ms: %zu entries, %lu added, %lu changed, "
+               "%lu removed, %lu directories read, %lu unchanged directories skipped\n",
+               index_file, (loaded_ns - start) / 1e6, (monotonic_ns() - loaded_ns) / 1e6, tree_index.count,
+               reconcile_stats.added, reconcile_stats.changed, reconcile_stats.removed, reconcile_stats.listed,
+               reconcile_stats.skipped);
+    } else {
+        log_info("Index %s: built in %.1f ms: %zu entries, %lu directories read\n",
+               index_file, (monotonic_ns() - start) / 1e6, tree_index.count, reconcile_stats.listed);
+    }
+    save_tree_index();
+}
+
+void save_tree_index(void) {
+    index_saved_ns = monotonic_ns();
+    if (!index_file || !tree_index.dirty) {
+        return;
+    }
+    if (!index_save(&tree_index, index_file, &root_stat, next_seq)) {
+        perror("Failed to save index");
+    }
+}
+
+// Milliseconds until unsaved index changes are due to be written, -1 if none
+int index_timeout_ms(void) {
+    if (!index_file || !tree_index.dirty) {
+        return -1;
+    }
+    uint64_t due = index_saved_ns + INDEX_SAVE_INTERVAL_MS * 1000000ULL;
+    uint64_t now = monotonic_ns();
+    return now >= due ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+// Transfer benchmark: pushes one file over a loopback TCP connection using
+// the original 1 KB fread+send loop, the buffered fallback and the sendfile
+// path, and reports throughput and syscalls per MB for each.
+static void *drain_socket(void *arg) {
+    int sock = *(int *)arg;
+    static char sink[256 * 1024];
+    while (recv(sock, sink, sizeof(sink), 0) > 0) {
+    }
+    return NULL;
+}
+
+static int bench_connect(int *sender, int *receiver) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 1) < 0 || getsockname(listener, (struct sockaddr *)&addr, &len) < 0) {
+        perror("benchmark socket setup failed");
+        return -1;
+    }
+    *sender = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*sender, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("benchmark connect failed");
+        return -1;
+    }
+    *receiver = accept(listener, NULL, NULL);
+    close(listener);
+    return *receiver < 0 ? -1 : 0;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int run_transfer_benchmark(const char *path) {
+    static const char *names[] = { "legacy-fread-1k", "buffered-64k", "sendfile" };
+
+    int file_fd = open(path, O_RDONLY);
+    struct stat st;
+    if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+        perror("Failed to open benchmark file");
+        return 1;
+    }
+    printf("Benchmarking %s (%ld bytes)\n", path, (long)st.st_size);
+
+    for (int mode = 0; mode < 3; mode++) {
+        int sender, receiver;
+        if (bench_connect(&sender, &receiver) < 0) {
+            return 1;
+        }
+        pthread_t drain_thread;
+        pthread_create(&drain_thread, NULL, drain_socket, &receiver);
+
+        transfer_syscalls = 0;
+        double start = now_seconds();
+        if (mode == 0) {
+            FILE *fp = fdopen(dup(file_fd), "rb");
+            char buffer[1024];
+            size_t bytes_read;
+            while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+                send(sender, buffer, bytes_read, 0);
+                transfer_syscalls++;
+            }
+            // fread issues one read(2) per stdio buffer
+            transfer_syscalls += (st.st_size + BUFSIZ - 1) / BUFSIZ;
+            fclose(fp);
+        } else {
+            bool no_sendfile = (mode == 1);
+            off_t offset = 0;
+            while (offset < st.st_size) {
+                if (send_file_range(sender, file_fd, &offset, st.st_size - offset, &no_sendfile) < 0) {
+                    perror("benchmark send failed");
+                    break;
+                }
+            }
+        }
+        shutdown(sender, SHUT_WR);
+        pthread_join(drain_thread, NULL);
+        double elapsed = now_seconds() - start;
+        close(sender);
+        close(receiver);
+
+        double mb = st.st_size / (1024.0 * 1024.0);
+        printf("%-16s %10.1f MB/s %10.2f syscalls/MB\n", names[mode],
+               elapsed > 0 ? mb / elapsed : 0.0, mb > 0 ? transfer_syscalls / mb : 0.0);
+    }
+    close(file_fd);
+    return 0;
+}
+
+// Fan-out benchmark: queues one file for 1 to 64 loopback clients the way
+// emit_change() does, with a read per client and with the shared file, plain
+// and compressed, then drains them round robin like the event loop. Reports
+// the server thread's CPU time, file opens and bytes read into userspace.
+static double thread_cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int run_fanout_benchmark(const char *path) {
+    static const int counts[] = { 1, 4, 16, 64 };
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        perror("Failed to open benchmark file");
+        return 1;
+    }
+    printf("Fan-out of %s (%ld bytes)\n", path, (long)st.st_size);
+    printf("%-8s %-10s %7s %10s %7s %10s\n", "payload", "reads", "clients", "cpu ms", "opens", "MB read");
+
+    for (int compress = 0; compress < 2; compress++) {
+        for (int shared = 0; shared < 2; shared++) {
+            for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+                int n = counts[c];
+                Client *bench[64];
+                int receivers[64];
+                pthread_t threads[64];
+                struct pollfd pfds[64];
+                for (int i = 0; i < n; i++) {
+                    bench[i] = calloc(1, sizeof(Client));
+                    if (!bench[i] || bench_connect(&bench[i]->socket, &receivers[i]) < 0) {
+                        return 1;
+                    }
+                    set_nonblocking(bench[i]->socket);
+                    bench[i]->live = true;
+                    bench[i]->compress = compress;
+                    pthread_create(&threads[i], NULL, drain_socket, &receivers[i]);
+                }
+
+                // Keep the per-file log lines out of the results
+                fflush(stdout);
+                int saved_stdout = dup(STDOUT_FILENO);
+                int devnull = open("/dev/null", O_WRONLY);
+                dup2(devnull, STDOUT_FILENO);
+
+                share_fanout = shared;
+                file_opens = 0;
+                file_bytes_read = 0;
+                double start = thread_cpu_seconds();
+                batching = true;
+                fanout_path = path;
+                for (int i = 0; i < n; i++) {
+                    send_file(bench[i], path, "bench", 1);
+                }
+                fanout_end();
+                batching = false;
+                for (;;) {
+                    int waiting = 0;
+                    for (int i = 0; i < n; i++) {
+                        flush_client(bench[i]);
+                        if (bench[i]->out_head) {
+                            pfds[waiting].fd = bench[i]->socket;
+                            pfds[waiting].events = POLLOUT;
+                            waiting++;
+                        }
+                    }
+                    if (waiting == 0) {
+                        break;
+                    }
+                    poll(pfds, waiting, 100);
+                }
+                double cpu = thread_cpu_seconds() - start;
+
+                fflush(stdout);
+                dup2(saved_stdout, STDOUT_FILENO);
+                close(saved_stdout);
+                close(devnull);
+                for (int i = 0; i < n; i++) {
+                    shutdown(bench[i]->socket, SHUT_WR);
+                    pthread_join(threads[i], NULL);
+                    close(bench[i]->socket);
+                    close(receivers[i]);
+                    free(bench[i]);
+                }
+                printf("%-8s %-10s %7d %10.1f %7lu %10.1f\n", compress ? "zlib" : "plain",
+                       shared ? "shared" : "per-client", n, cpu * 1000, file_opens,
+                       file_bytes_read / (1024.0 * 1024.0));
+            }
+        }
+    }
+    share_fanout = true;
+    return 0;
+}
+
+// Watch table benchmark: dispatches events against count synthetic watched
+// directories with the hash table and with the linear scan it replaced, then
+// times renaming a subtree.
+int run_watch_benchmark(long count) {
+    if (count <= 0) {
+        fprintf(stderr, "Watch count must be positive\n");
+        return 1;
+    }
+    WatchTable table = { NULL, NULL, 0, 0 };
+    int *linear_wd = malloc(count * sizeof(int));
+    char **linear_path = malloc(count * sizeof(char *));
+    if (!linear_wd || !linear_path) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    double start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/bench/tree/d%03ld/d%06ld", i % 1000, i);
+        watch_insert(&table, (int)i + 1, path);
+        linear_wd[i] = (int)i + 1;
+        linear_path[i] = table.by_wd[watch_wd_slot(&table, (int)i + 1)]->path;
+    }
+    double insert_time = now_seconds() - start;
+
+    long lookups = 1000000;
+    unsigned int seed = 12345;
+    unsigned long found = 0;
+    start = now_seconds();
+    for (long i = 0; i < lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        WatchEntry *entry = watch_find_wd(&table, (int)(seed % count) + 1);
+        found += entry != NULL;
+    }
+    double hash_time = now_seconds() - start;
+
+    // The old watch_map scan, on a smaller sample since it is O(n) per event
+    long linear_lookups = lookups / 100 > 0 ? lookups / 100 : 1;
+    start = now_seconds();
+    for (long i = 0; i < linear_lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        int wd = (int)(seed % count) + 1;
+        for (long j = 0; j < count; j++) {
+            if (linear_wd[j] == wd) {
+                found += linear_path[j] != NULL;
+                break;
+            }
+        }
+    }
+    double linear_time = now_seconds() - start;
+
+    start = now_seconds();
+    watch_rename_subtree(&table, "/bench/tree/d007", "/bench/tree/renamed");
+    double rename_time = now_seconds() - start;
+    bool renamed_ok = watch_find_path(&table, "/bench/tree/renamed/d000007") != NULL &&
+                      watch_find_path(&table, "/bench/tree/d007/d000007") == NULL;
+
+    printf("watched directories: %ld (found %lu)\n", count, found);
+    printf("insert:          %10.1f ns/watch\n", insert_time * 1e9 / count);
+    printf("hash dispatch:   %10.1f ns/event\n", hash_time * 1e9 / lookups);
+    printf("linear dispatch: %10.1f ns/event\n", linear_time * 1e9 / linear_lookups);
+    printf("subtree rename:  %10.3f ms (%s)\n", rename_time * 1e3, renamed_ok ? "ok" : "FAILED");
+
+    free(linear_wd);
+    free(linear_path);
+    return renamed_ok ? 0 : 1;
+}
+
+// The strstr() check is_ignored() used to do: extension anywhere in the list
+static bool legacy_is_ignored(const char *ignore_list, const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    return ext && strstr(ignore_list, ext + 1) != NULL;
+}
+
+// Ignore matcher benchmark (-I): rule_count rules of every kind against a
+// few million paths, plus the old strstr() check on the extension rules.
+// Rules with paths they must and must not ignore, checked before timing
+static const struct {
+    const char *rules;
+    const char *path;
+    bool is_dir;
+    bool ignored;
+} ignore_checks[] = {
+    { "mp4", "a/x.mp4", false, true },
+    { ".mp4", "a/x.mp4", false, true },
+    { "mp4", "a/x.p4", false, false },
+    { "tar.gz", "x.tar.gz", false, true },
+    { "node_modules", "node_modules", true, true },
+    { "node_modules", "a/node_modules/x.js", false, true },
+    { "core", "core", false, true },
+    { "core", "x.core", false, true },
+    { "core", "score", false, false },
+    { "app.log", "app.log", false, true },
+    { "app.log", "logs/app.log", false, true },
+    { "app.log", "x.app.log", false, true },
+    { "app.log", "myapp.log", false, false },
+    { "build/", "build", false, false },
+    { "build/", "a/build/x.o", false, true },
+    { "/out", "a/out", true, false },
+    { "/out", "out/x", false, true },
+    { "src/**/*.o", "src/a/b/x.o", false, true },
+    { "*.sw?", "a/.x.swp", false, true },
+};
+
+int run_ignore_benchmark(long rule_count) {
+    if (rule_count <= 0) {
+        fprintf(stderr, "Rule count must be positive\n");
+        return 1;
+    }
+    size_t check_count = sizeof(ignore_checks) / sizeof(ignore_checks[0]);
+    size_t checks_failed = 0;
+    for (size_t i = 0; i < check_count; i++) {
+        IgnoreMatcher check;
+        if (ignore_compile(&check, ignore_checks[i].rules, strlen(ignore_checks[i].rules)) < 0) {
+            perror("Failed to compile rules");
+            return 1;
+        }
+        if (ignore_match(&check, ignore_checks[i].path, ignore_checks[i].is_dir) != ignore_checks[i].ignored) {
+            fprintf(stderr, "Rule '%s' %s %s\n", ignore_checks[i].rules,
+                    ignore_checks[i].ignored ? "does not ignore" : "ignores", ignore_checks[i].path);
+            checks_failed++;
+        }
+        ignore_free(&check);
+    }
+    printf("rule checks: %zu of %zu %s\n", check_count - checks_failed, check_count,
+           checks_failed ? "FAILED" : "ok");
+    if (checks_failed) {
+        return 1;
+    }
+    char *rules = malloc(rule_count * 32 + 1);
+    char *exts = malloc(rule_count * 16 + 1);
+    long pool = 100000;
+    char **paths = calloc(pool, sizeof(char *));
+    if (!rules || !exts || !paths) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    // A quarter each of extensions, name globs, directory names and
+    // anchored globs with "**"
+    size_t len = 0;
+    size_t ext_len = 0;
+    for (long i = 0; i < rule_count; i++) {
+        switch (i % 4) {
+        case 0:
+            len += sprintf(rules + len, "e%ld,", i);
+            ext_len += sprintf(exts + ext_len, "e%ld,", i);
+            break;
+        case 1:
+            len += sprintf(rules + len, "tmp%ld-*.swp\n", i);
+            break;
+        case 2:
+            len += sprintf(rules + len, "build%ld/\n", i);
+            break;
+        default:
+            len += sprintf(rules + len, "src/gen%ld/**/*.o\n", i);
+            break;
+        }
+    }
+    exts[ext_len] = '\0';
+
+    IgnoreMatcher matcher;
+    IgnoreMatcher ext_matcher;
+    double start = now_seconds();
+    long compiled = ignore_compile(&matcher, rules, len);
+    double compile_time = now_seconds() - start;
+    if (compiled < 0 || ignore_compile(&ext_matcher, exts, ext_len) < 0) {
+        perror("Failed to compile rules");
+        return 1;
+    }
+
+    unsigned int seed = 12345;
+    for (long i = 0; i < pool; i++) {
+        char path[PATH_MAX];
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 8;
+        long rule = (long)(r % rule_count);
+        switch (r % 8) {
+        case 0:
+            snprintf(path, sizeof(path), "src/mod%u/file%u.e%ld", r % 97, r, rule - rule % 4);
+            break;
+        case 1:
+            snprintf(path, sizeof(path), "src/mod%u/file%u.c", r % 97, r);
+            break;
+        case 2:
+            snprintf(path, sizeof(path), "src/mod%u/tmp%ld-%u.swp", r % 97, rule, r);
+            break;
+        case 3:
+            snprintf(path, sizeof(path), "build%ld/obj/x%u.o", rule, r);
+            break;
+        case 4:
+            snprintf(path, sizeof(path), "src/gen%ld/a/b/x%u.o", rule, r);
+            break;
+        case 5:
+            snprintf(path, sizeof(path), "docs/page%u.html", r);
+            break;
+        case 6:
+            snprintf(path, sizeof(path), "deep/a/b/c/d/e/f%u.txt", r);
+            break;
+        default:
+            snprintf(path, sizeof(path), "src/mod%u/file%u.%ld", r % 97, r, rule);
+            break;
+        }
+        paths[i] = strdup(path);
+        if (!paths[i]) {
+            perror("Memory allocation failed");
+            return 1;
+        }
+    }
+
+    long lookups = 4000000;
+    unsigned long hits = 0;
+    start = now_seconds();
+    for (long i = 0; i < lookups; i++) {
+        hits += ignore_match(&matcher, paths[i % pool], false);
+    }
+    double match_time = now_seconds() - start;
+
+    // The old check is linear in the length of the list; fewer lookups
+    long legacy_lookups = lookups / 10;
+    unsigned long legacy_hits = 0;
+    start = now_seconds();
+    for (long i = 0; i < legacy_lookups; i++) {
+        const char *name = strrchr(paths[i % pool], '/');
+        legacy_hits += legacy_is_ignored(exts, name ? name + 1 : paths[i % pool]);
+    }
+    double legacy_time = now_seconds() - start;
+
+    unsigned long false_matches = 0;
+    for (long i = 0; i < pool; i++) {
+        const char *name = strrchr(paths[i], '/');
+        if (legacy_is_ignored(exts, name ? name + 1 : paths[i]) && !ignore_match(&ext_matcher, paths[i], false)) {
+            false_matches++;
+        }
+    }
+
+    printf("rules: %ld (%zu extensions, %zu names, %zu globs), compiled in %.2f ms\n",
+           compiled, matcher.exts.count, matcher.names.count + matcher.dir_names.count,
+           matcher.glob_count, compile_time * 1e3);
+    printf("compiled matcher: %10.1f ns/path, %lu of %ld paths ignored\n",
+           match_time * 1e9 / lookups, hits, lookups);
+    printf("strstr on extensions only: %10.1f ns/path, %lu of %ld paths ignored\n",
+           legacy_time * 1e9 / legacy_lookups, legacy_hits, legacy_lookups);
+    printf("strstr false matches: %lu of %ld distinct paths\n", false_matches, pool);
+
+    for (long i = 0; i < pool; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(rules);
+    free(exts);
+    ignore_free(&matcher);
+    ignore_free(&ext_matcher);
+    return 0;
+}
 
-            char sub_dir_path[PATH_MAX];
-            snprintf(sub_dir_path, sizeof(sub_dir_path), "%s/%s", dir_path, entry->d_name);
-            add_watch_recursive(sub_dir_path);
+// Walk benchmark: reads a tree the way the server used to (recursive
+// opendir/readdir with an lstat per entry) and with the walker at 1, 2, 4,
+// ... threads, stat'ing every entry. A first pass warms the dentry and
+// inode caches, so on a local disk this compares CPU and syscall cost; on a
+// network filesystem run it twice to see the cold numbers.
+static void readdir_walk(const char *dir_path, unsigned long *dirs, unsigned long *entries) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    (*dirs)++;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        (*entries)++;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            readdir_walk(path, dirs, entries);
         }
     }
     closedir(dir);
 }
+
+static const SyncWalkOps bench_walk_ops = { NULL, NULL, SYNC_WALK_STAT };
+
+int run_walk_benchmark(const char *path) {
+    unsigned long dirs = 0;
+    unsigned long entries = 0;
+    readdir_walk(path, &dirs, &entries);
+    if (dirs == 0) {
+        perror("opendir failed");
+        return 1;
+    }
+    dirs = entries = 0;
+    double start = now_seconds();
+    readdir_walk(path, &dirs, &entries);
+    double elapsed = now_seconds() - start;
+    printf("tree: %lu directories, %lu entries\n", dirs, entries);
+    printf("%-20s %10.1f ms %12.0f entries/s\n", "readdir + lstat", elapsed * 1e3, entries / elapsed);
+
+    int max_threads = sync_walk_default_threads();
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        SyncWalker *bench = sync_walker_create(threads);
+        if (!bench) {
+            perror("Cannot start tree walker");
+            return 1;
+        }
+        start = now_seconds();
+        sync_walk_path(bench, path, &bench_walk_ops, NULL, NULL);
+        elapsed = now_seconds() - start;
+        char label[32];
+        snprintf(label, sizeof(label), "walker, %d thread%s", threads, threads == 1 ? "" : "s");
+        printf("%-20s %10.1f ms %12.0f entries/s  (%llu directories, %llu stolen, %llu DT_UNKNOWN)\n",
+               label, elapsed * 1e3, bench->entries / elapsed, (unsigned long long)bench->dirs,
+               (unsigned long long)bench->steals, (unsigned long long)bench->unknown);
+        sync_walker_free(bench);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    return 0;
+}